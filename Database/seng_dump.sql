@@ -36,7 +36,7 @@ SET character_set_client = utf8;
   `cid` int(11),
   `name` varchar(45),
   `descr` tinytext,
-  `price` float,
+  `price` decimal(10,2),
   `availability` tinyint(4),
   `deleted` tinyint(1)
 ) ENGINE=MyISAM */;
@@ -55,7 +55,7 @@ SET character_set_client = utf8;
   `cid` int(11),
   `name` varchar(45),
   `descr` tinytext,
-  `price` float,
+  `price` decimal(10,2),
   `availability` tinyint(4),
   `deleted` tinyint(1),
   `category` varchar(45)
@@ -115,6 +115,20 @@ INSERT INTO `configurations` VALUES (1,3),(1,5),(1,6),(2,2),(2,5),(2,6),(2,8),(2
 /*!40000 ALTER TABLE `configurations` ENABLE KEYS */;
 UNLOCK TABLES;
 
+--
+-- Table structure for table `deferred_writes`
+--
+
+DROP TABLE IF EXISTS `deferred_writes`;
+/*!40101 SET @saved_cs_client     = @@character_set_client */;
+/*!40101 SET character_set_client = utf8 */;
+CREATE TABLE `deferred_writes` (
+  `writer` varchar(128) NOT NULL,
+  `last_seq` bigint(20) NOT NULL,
+  PRIMARY KEY (`writer`)
+) ENGINE=InnoDB DEFAULT CHARSET=latin1;
+/*!40101 SET character_set_client = @saved_cs_client */;
+
 --
 -- Temporary table structure for view `handled_orders`
 --
@@ -131,7 +145,7 @@ SET character_set_client = utf8;
   `category` varchar(45),
   `product` varchar(45),
   `qty` int(11),
-  `order_total` float
+  `order_total` decimal(10,2)
 ) ENGINE=MyISAM */;
 SET character_set_client = @saved_cs_client;
 
@@ -200,7 +214,7 @@ CREATE TABLE `orders` (
   `oid` int(11) NOT NULL AUTO_INCREMENT,
   `uid` int(11) NOT NULL,
   `date` datetime NOT NULL,
-  `total` float DEFAULT '0',
+  `total` decimal(10,2) DEFAULT '0',
   PRIMARY KEY (`oid`),
   KEY `users` (`uid`),
   CONSTRAINT `users` FOREIGN KEY (`uid`) REFERENCES `users` (`uid`) ON DELETE NO ACTION ON UPDATE NO ACTION
@@ -217,6 +231,21 @@ INSERT INTO `orders` VALUES (1,1,'2010-01-20 18:31:24',800),(2,2,'2009-12-20 18:
 /*!40000 ALTER TABLE `orders` ENABLE KEYS */;
 UNLOCK TABLES;
 
+--
+-- Table structure for table `product_tombstones`
+--
+
+DROP TABLE IF EXISTS `product_tombstones`;
+/*!40101 SET @saved_cs_client     = @@character_set_client */;
+/*!40101 SET character_set_client = utf8 */;
+CREATE TABLE `product_tombstones` (
+  `pid` int(11) NOT NULL,
+  `change_seq` bigint(20) NOT NULL,
+  PRIMARY KEY (`pid`),
+  KEY `change_seq` (`change_seq`)
+) ENGINE=InnoDB DEFAULT CHARSET=latin1;
+/*!40101 SET character_set_client = @saved_cs_client */;
+
 --
 -- Table structure for table `products`
 --
@@ -229,12 +258,15 @@ CREATE TABLE `products` (
   `cid` int(11) NOT NULL,
   `name` varchar(45) NOT NULL,
   `descr` tinytext,
-  `price` float DEFAULT '0',
+  `price` decimal(10,2) DEFAULT '0',
   `availability` tinyint(4) DEFAULT '0',
   `deleted` tinyint(1) DEFAULT '0',
+  `version` int(11) NOT NULL DEFAULT '0',
+  `change_seq` bigint(20) NOT NULL DEFAULT '0',
   PRIMARY KEY (`pid`),
   UNIQUE KEY `prd_name` (`name`),
   KEY `category` (`cid`),
+  KEY `change_seq` (`change_seq`),
   CONSTRAINT `category` FOREIGN KEY (`cid`) REFERENCES `categories` (`cid`) ON DELETE NO ACTION ON UPDATE NO ACTION
 ) ENGINE=InnoDB AUTO_INCREMENT=28 DEFAULT CHARSET=latin1;
 /*!40101 SET character_set_client = @saved_cs_client */;
@@ -245,9 +277,79 @@ CREATE TABLE `products` (
 
 LOCK TABLES `products` WRITE;
 /*!40000 ALTER TABLE `products` DISABLE KEYS */;
-INSERT INTO `products` VALUES (1,1,'Apple MacBook Pro','Monitor 15 inches + HDD 250Gb solid state',2150,10,0),(2,1,'Apple iMac 24','Desktop monitor 24 inches + HDD 640Gb',1200,2,1),(3,2,'External monitor Acer','Width 32 inches',800,1,0),(4,2,'Monitor LCD Full HD','Resolution 1080p',1230,23,0),(5,3,'Italian keyboard','102 keys',15,1,0),(6,3,'Bluetooth keyboard',NULL,45,10,0),(7,4,'Wireless card 811.2e','Compatible with Windows and Macos',123,0,0),(8,4,'TV Card','Transform your computer in a portable TV',243,10,0),(9,4,'NETGEAR WG511 Wireless-G','PC Card Network adapter',30,5,0),(10,5,'HD esterno 1.5Tb','Supporto USB1 & 2',160,10,1),(11,6,'PACKARD BELL iMax mini','HD 160GB - RAM 1GB',249,11,0),(12,6,'FUJITSU-SIEMENS Amilo Li 3740','HD 160GB - RAM 1GB',249,11,0),(13,6,'HP Pavilion Elite m9441.it','Intel Atom 230 (1.60GHz, 512KB L2, 533MHz FSB)',369,1,0),(14,7,'LOGITECH LS11','Speaker system 2.0 for Pc',19.9,3,0),(15,7,'HERCULES XPS 2.0 Lounge','Speaker system 2.0 - 10W',34.9,7,0),(19,28,'ipp','luto',3.5,0,0),(20,28,'no','ue',3.2,0,0),(22,7,'pp','qq',0,0,0),(24,7,'ppp1234','2',123,0,0),(26,28,'Extra range III','Extra range wifi extension (G)',175.2,10,0),(27,4,'USB to PCCARD converter','USB 2.0 compatible converter',25,10,0);
+INSERT INTO `products` VALUES (1,1,'Apple MacBook Pro','Monitor 15 inches + HDD 250Gb solid state',2150,10,0,0,0),(2,1,'Apple iMac 24','Desktop monitor 24 inches + HDD 640Gb',1200,2,1,0,0),(3,2,'External monitor Acer','Width 32 inches',800,1,0,0,0),(4,2,'Monitor LCD Full HD','Resolution 1080p',1230,23,0,0,0),(5,3,'Italian keyboard','102 keys',15,1,0,0,0),(6,3,'Bluetooth keyboard',NULL,45,10,0,0,0),(7,4,'Wireless card 811.2e','Compatible with Windows and Macos',123,0,0,0,0),(8,4,'TV Card','Transform your computer in a portable TV',243,10,0,0,0),(9,4,'NETGEAR WG511 Wireless-G','PC Card Network adapter',30,5,0,0,0),(10,5,'HD esterno 1.5Tb','Supporto USB1 & 2',160,10,1,0,0),(11,6,'PACKARD BELL iMax mini','HD 160GB - RAM 1GB',249,11,0,0,0),(12,6,'FUJITSU-SIEMENS Amilo Li 3740','HD 160GB - RAM 1GB',249,11,0,0,0),(13,6,'HP Pavilion Elite m9441.it','Intel Atom 230 (1.60GHz, 512KB L2, 533MHz FSB)',369,1,0,0,0),(14,7,'LOGITECH LS11','Speaker system 2.0 for Pc',19.9,3,0,0,0),(15,7,'HERCULES XPS 2.0 Lounge','Speaker system 2.0 - 10W',34.9,7,0,0,0),(19,28,'ipp','luto',3.5,0,0,0,0),(20,28,'no','ue',3.2,0,0,0,0),(22,7,'pp','qq',0,0,0,0,0),(24,7,'ppp1234','2',123,0,0,0,0),(26,28,'Extra range III','Extra range wifi extension (G)',175.2,10,0,0,0),(27,4,'USB to PCCARD converter','USB 2.0 compatible converter',25,10,0,0,0);
 /*!40000 ALTER TABLE `products` ENABLE KEYS */;
 UNLOCK TABLES;
+/*!50003 SET @saved_cs_client      = @@character_set_client */ ;
+/*!50003 SET @saved_cs_results     = @@character_set_results */ ;
+/*!50003 SET @saved_col_connection = @@collation_connection */ ;
+/*!50003 SET character_set_client  = utf8 */ ;
+/*!50003 SET character_set_results = utf8 */ ;
+/*!50003 SET collation_connection  = utf8_general_ci */ ;
+/*!50003 SET @saved_sql_mode       = @@sql_mode */ ;
+/*!50003 SET sql_mode              = 'STRICT_TRANS_TABLES,STRICT_ALL_TABLES,NO_ZERO_IN_DATE,NO_ZERO_DATE,ERROR_FOR_DIVISION_BY_ZERO,TRADITIONAL,NO_AUTO_CREATE_USER' */ ;
+DELIMITER ;;
+/*!50003 CREATE*/ /*!50017 DEFINER=`root`@`localhost`*/ /*!50003 TRIGGER `products_bi` BEFORE INSERT ON `products` FOR EACH ROW BEGIN
+
+UPDATE sequences SET next_hi = next_hi + 1 WHERE name = 'products_changes';
+SET NEW.change_seq = (SELECT next_hi FROM sequences 
+                                     WHERE name = 'products_changes');
+DELETE FROM product_tombstones WHERE pid = NEW.pid;
+
+END */;;
+/*!50003 CREATE*/ /*!50017 DEFINER=`root`@`localhost`*/ /*!50003 TRIGGER `products_bu` BEFORE UPDATE ON `products` FOR EACH ROW BEGIN
+
+-- stock changes alone (orders, write-backs) don't lock the sequence:
+-- readers take the live stock from the inventory
+IF NOT (NEW.pid <=> OLD.pid AND NEW.cid <=> OLD.cid AND 
+        NEW.name <=> OLD.name AND NEW.descr <=> OLD.descr AND 
+        NEW.price <=> OLD.price AND NEW.deleted <=> OLD.deleted AND 
+        NEW.version <=> OLD.version) THEN
+  UPDATE sequences SET next_hi = next_hi + 1 
+                                 WHERE name = 'products_changes';
+  SET NEW.change_seq = (SELECT next_hi FROM sequences 
+                                       WHERE name = 'products_changes');
+END IF;
+
+END */;;
+/*!50003 CREATE*/ /*!50017 DEFINER=`root`@`localhost`*/ /*!50003 TRIGGER `products_ad` AFTER DELETE ON `products` FOR EACH ROW BEGIN
+
+UPDATE sequences SET next_hi = next_hi + 1 WHERE name = 'products_changes';
+REPLACE INTO product_tombstones 
+        SELECT OLD.pid, next_hi FROM sequences 
+                                WHERE name = 'products_changes';
+
+END */;;
+DELIMITER ;
+/*!50003 SET sql_mode              = @saved_sql_mode */ ;
+/*!50003 SET character_set_client  = @saved_cs_client */ ;
+/*!50003 SET character_set_results = @saved_cs_results */ ;
+/*!50003 SET collation_connection  = @saved_col_connection */ ;
+
+--
+-- Table structure for table `sequences`
+--
+
+DROP TABLE IF EXISTS `sequences`;
+/*!40101 SET @saved_cs_client     = @@character_set_client */;
+/*!40101 SET character_set_client = utf8 */;
+CREATE TABLE `sequences` (
+  `name` varchar(45) NOT NULL,
+  `next_hi` int(11) NOT NULL DEFAULT '0',
+  `block_size` int(11) NOT NULL DEFAULT '20',
+  PRIMARY KEY (`name`)
+) ENGINE=InnoDB DEFAULT CHARSET=latin1;
+/*!40101 SET character_set_client = @saved_cs_client */;
+
+--
+-- Dumping data for table `sequences`
+--
+
+LOCK TABLES `sequences` WRITE;
+/*!40000 ALTER TABLE `sequences` DISABLE KEYS */;
+INSERT INTO `sequences` VALUES ('orders',2,20),('products_changes',1,1);
+/*!40000 ALTER TABLE `sequences` ENABLE KEYS */;
+UNLOCK TABLES;
 
 --
 -- Table structure for table `users`
@@ -265,6 +367,7 @@ CREATE TABLE `users` (
   `address` varchar(45) NOT NULL,
   `city` varchar(15) NOT NULL,
   `admin` int(11) NOT NULL DEFAULT '0',
+  `version` int(11) NOT NULL DEFAULT '0',
   PRIMARY KEY (`uid`),
   UNIQUE KEY `credentials` (`login`)
 ) ENGINE=InnoDB AUTO_INCREMENT=31 DEFAULT CHARSET=latin1;
@@ -276,13 +379,45 @@ CREATE TABLE `users` (
 
 LOCK TABLES `users` WRITE;
 /*!40000 ALTER TABLE `users` DISABLE KEYS */;
-INSERT INTO `users` VALUES (1,'Ferruccio','Vitale','unixo','secret','via del Sagittario, 17F','Rome',1),(2,'Alessandro','Aldini','aaldini','secret','via Saffi, 42','Urbino',0),(3,'Erika','Pigliapoco','md','*LK*','via Saffi, 42','Urbino',0),(4,'Alessandro','Bogliolo','boglio','*LK*','via Saffi, 42','Urbino',0),(18,'Edoardo','BontÃ ','eddy','secret','via Saffi, 42','Urbino',0),(29,'Elena Silvana','Vitale','elena','secret','via Daqualche Parte 11','Rome',0);
+INSERT INTO `users` VALUES (1,'Ferruccio','Vitale','unixo','secret','via del Sagittario, 17F','Rome',1,0),(2,'Alessandro','Aldini','aaldini','secret','via Saffi, 42','Urbino',0,0),(3,'Erika','Pigliapoco','md','*LK*','via Saffi, 42','Urbino',0,0),(4,'Alessandro','Bogliolo','boglio','*LK*','via Saffi, 42','Urbino',0,0),(18,'Edoardo','BontÃ ','eddy','secret','via Saffi, 42','Urbino',0,0),(29,'Elena Silvana','Vitale','elena','secret','via Daqualche Parte 11','Rome',0,0);
 /*!40000 ALTER TABLE `users` ENABLE KEYS */;
 UNLOCK TABLES;
 
 --
 -- Dumping routines for database 'seng'
 --
+/*!50003 DROP PROCEDURE IF EXISTS `next_id_block` */;
+/*!50003 SET @saved_cs_client      = @@character_set_client */ ;
+/*!50003 SET @saved_cs_results     = @@character_set_results */ ;
+/*!50003 SET @saved_col_connection = @@collation_connection */ ;
+/*!50003 SET character_set_client  = utf8 */ ;
+/*!50003 SET character_set_results = utf8 */ ;
+/*!50003 SET collation_connection  = utf8_general_ci */ ;
+/*!50003 SET @saved_sql_mode       = @@sql_mode */ ;
+/*!50003 SET sql_mode              = 'STRICT_TRANS_TABLES,STRICT_ALL_TABLES,NO_ZERO_IN_DATE,NO_ZERO_DATE,ERROR_FOR_DIVISION_BY_ZERO,TRADITIONAL,NO_AUTO_CREATE_USER' */ ;
+DELIMITER ;;
+/*!50003 CREATE*/ /*!50020 DEFINER=`root`@`localhost`*/ /*!50003 PROCEDURE `next_id_block`(IN p_name VARCHAR(45))
+BEGIN
+
+DECLARE v_hi     INT;
+DECLARE v_size   INT;
+
+START TRANSACTION;
+
+SELECT next_hi, block_size INTO v_hi, v_size FROM sequences 
+                           WHERE name = p_name FOR UPDATE;
+UPDATE sequences SET next_hi = next_hi + 1 WHERE name = p_name;
+
+COMMIT;
+
+SELECT v_hi AS hi, v_size AS block_size;
+
+END */;;
+DELIMITER ;
+/*!50003 SET sql_mode              = @saved_sql_mode */ ;
+/*!50003 SET character_set_client  = @saved_cs_client */ ;
+/*!50003 SET character_set_results = @saved_cs_results */ ;
+/*!50003 SET collation_connection  = @saved_col_connection */ ;
 /*!50003 DROP PROCEDURE IF EXISTS `offers_by_product` */;
 /*!50003 SET @saved_cs_client      = @@character_set_client */ ;
 /*!50003 SET @saved_cs_results     = @@character_set_results */ ;
@@ -355,6 +490,93 @@ END IF;
 
 COMMIT;
 
+END */;;
+DELIMITER ;
+/*!50003 SET sql_mode              = @saved_sql_mode */ ;
+/*!50003 SET character_set_client  = @saved_cs_client */ ;
+/*!50003 SET character_set_results = @saved_cs_results */ ;
+/*!50003 SET collation_connection  = @saved_col_connection */ ;
+/*!50003 DROP PROCEDURE IF EXISTS `place_order` */;
+/*!50003 SET @saved_cs_client      = @@character_set_client */ ;
+/*!50003 SET @saved_cs_results     = @@character_set_results */ ;
+/*!50003 SET @saved_col_connection = @@collation_connection */ ;
+/*!50003 SET character_set_client  = utf8 */ ;
+/*!50003 SET character_set_results = utf8 */ ;
+/*!50003 SET collation_connection  = utf8_general_ci */ ;
+/*!50003 SET @saved_sql_mode       = @@sql_mode */ ;
+/*!50003 SET sql_mode              = 'STRICT_TRANS_TABLES,STRICT_ALL_TABLES,NO_ZERO_IN_DATE,NO_ZERO_DATE,ERROR_FOR_DIVISION_BY_ZERO,TRADITIONAL,NO_AUTO_CREATE_USER' */ ;
+DELIMITER ;;
+/*!50003 CREATE*/ /*!50020 DEFINER=`root`@`localhost`*/ /*!50003 PROCEDURE `place_order`(IN p_oid INT, IN p_uid INT, IN p_lines TEXT)
+proc: BEGIN
+
+DECLARE v_oid       INT default 0;
+DECLARE v_date      DATETIME;
+DECLARE v_total     DECIMAL(10,2) default 0;
+DECLARE v_lines     TEXT;
+DECLARE v_line      VARCHAR(64);
+DECLARE v_pid       INT;
+DECLARE v_qty       INT;
+DECLARE v_stock     INT;
+DECLARE v_price     DECIMAL(10,2);
+DECLARE v_expected  DECIMAL(10,2);
+DECLARE v_failed    INT default 0;
+
+DECLARE EXIT HANDLER FOR SQLEXCEPTION
+BEGIN
+  ROLLBACK;
+  SELECT 0 AS oid, NULL AS date, 0 AS total, -1 AS pid, NULL AS price;
+END;
+
+-- IDs come from next_id_block(): an AUTO_INCREMENT one could fall in a
+-- block reserved by somebody else
+IF p_oid IS NULL OR p_oid <= 0 THEN
+  SELECT 0 AS oid, NULL AS date, 0 AS total, -1 AS pid, NULL AS price;
+  LEAVE proc;
+END IF;
+
+START TRANSACTION;
+
+SET v_date = NOW();
+INSERT INTO orders (oid, uid, date, total) VALUES (p_oid, p_uid, v_date, 0);
+SET v_oid = p_oid;
+
+SET v_lines = p_lines;
+lines: WHILE LENGTH(v_lines) > 0 DO
+            SET v_line  = SUBSTRING_INDEX(v_lines, ',', 1);
+            SET v_lines = SUBSTRING(v_lines, LENGTH(v_line) + 2);
+            SET v_pid   = CAST(SUBSTRING_INDEX(v_line, ':', 1) AS UNSIGNED);
+            SET v_qty   = CAST(SUBSTRING_INDEX(SUBSTRING_INDEX(v_line, ':', 2),
+                                               ':', -1) AS UNSIGNED);
+            SET v_expected = CAST(SUBSTRING_INDEX(v_line, ':', -1) 
+                                  AS DECIMAL(10,2));
+
+            SET v_stock = NULL, v_price = NULL;
+            SELECT availability, price INTO v_stock, v_price FROM products 
+                                 WHERE pid = v_pid AND deleted = 0 FOR UPDATE;
+
+            IF v_stock IS NULL OR v_qty <= 0 OR v_stock < v_qty OR
+               v_price <> v_expected THEN
+              SET v_failed = v_pid;
+              LEAVE lines;
+            END IF;
+
+            UPDATE products SET availability = availability - v_qty 
+                            WHERE pid = v_pid;
+            INSERT INTO order_details VALUES (v_oid, v_pid, v_qty);
+            SET v_total = v_total + v_price * v_qty;
+       END WHILE lines;
+
+IF v_failed <> 0 THEN
+  ROLLBACK;
+  SELECT 0 AS oid, NULL AS date, 0 AS total, v_failed AS pid, 
+         v_price AS price;
+ELSE
+  UPDATE orders SET total = v_total WHERE oid = v_oid;
+  COMMIT;
+  SELECT v_oid AS oid, v_date AS date, v_total AS total, 0 AS pid, 
+         NULL AS price;
+END IF;
+
 END */;;
 DELIMITER ;
 /*!50003 SET sql_mode              = @saved_sql_mode */ ;
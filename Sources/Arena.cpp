@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#include "Arena.h"
+#include "common.h"
+#include <cstdlib>
+
+/** Bytes taken by the header of a block, keeping its data aligned */
+#define ARENA_HEADER \
+    ((sizeof(Block) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+/**
+   @brief Default constructor: allocations start in the inline buffer
+ */
+Arena::Arena()
+{
+    _next = _inline;
+    _end = _inline + ARENA_INLINE_SIZE;
+    _blocks = NULL;
+    _blockSize = ARENA_BLOCK_SIZE;
+    _cleanups = NULL;
+    _used = 0;
+    _objects = 0;
+}
+
+/**
+   @brief Default destructor: destroys all the objects of the arena
+ */
+Arena::~Arena()
+{
+    release();
+}
+
+/**
+   @brief Continue in a new block, large enough for aSize bytes
+
+   @param[in]    aSize   The size of the allocation, already aligned
+   @return    The memory allocated
+ */
+void *Arena::grow(size_t aSize)
+{
+    size_t size = (aSize > _blockSize) ? aSize : _blockSize;
+    Block *b = (Block *) malloc(ARENA_HEADER + size);
+
+    if (!b)
+        throw std::bad_alloc();
+
+    b->next = _blocks;
+    b->size = size;
+    _blocks = b;
+    if (_blockSize < ARENA_MAX_BLOCK)
+        _blockSize *= 2;
+
+    _next = (char *) b + ARENA_HEADER + aSize;
+    _end = (char *) b + ARENA_HEADER + size;
+    LOG(3, "New arena block of %d bytes\n", (int) size);
+
+    return (char *) b + ARENA_HEADER;
+}
+
+/**
+   @brief Run the destructor of an object on release
+
+   @param[in]    anObject    The object, allocated from the arena
+   @param[in]    aDestroy    Function destroying it
+ */
+void Arena::track(void *anObject, void (*aDestroy)(void *))
+{
+    Cleanup *c = (Cleanup *) allocate(sizeof(Cleanup));
+
+    c->next = _cleanups;
+    c->object = anObject;
+    c->destroy = aDestroy;
+    _cleanups = c;
+}
+
+/**
+   @brief Destroy every object and give back the memory
+
+   Objects are destroyed in reverse order of creation, so a container
+   created before its elements is destroyed after them. The arena can
+   be used again afterwards.
+ */
+void Arena::release()
+{
+    // destructors may still use memory of the arena
+    while (_cleanups) {
+        Cleanup *c = _cleanups;
+        _cleanups = c->next;
+        c->destroy(c->object);
+    }
+
+    while (_blocks) {
+        Block *b = _blocks;
+        _blocks = b->next;
+        free(b);
+    }
+
+    LOG(3, "Arena released: %d objects, %d bytes\n", (int) _objects,
+        (int) _used);
+    _next = _inline;
+    _end = _inline + ARENA_INLINE_SIZE;
+    _blockSize = ARENA_BLOCK_SIZE;
+    _used = 0;
+    _objects = 0;
+}
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <cstddef>
+#include <new>
+#include <tr1/type_traits>
+
+/** Bytes embedded in the arena itself */
+#define ARENA_INLINE_SIZE   2048
+/** Size of the first block taken from the heap, doubled for each next */
+#define ARENA_BLOCK_SIZE    8192
+/** Largest block size reached by doubling */
+#define ARENA_MAX_BLOCK     (256 * 1024)
+/** Alignment of every allocation */
+#define ARENA_ALIGN         16
+
+/**
+   @brief Monotonic allocator for the objects of one request
+
+   An arena hands out memory by bumping a pointer inside a block:
+   nothing is freed one by one, everything goes away at once when the
+   arena is released or destroyed. The first ARENA_INLINE_SIZE bytes
+   live inside the arena object, so an operation creating a few small
+   objects (usually a stack-allocated arena) doesn't touch the heap at
+   all; larger ones chain blocks of growing size.
+
+   Objects built with create() get their destructor run on release,
+   in reverse order of creation (types with a trivial destructor are
+   not tracked). They must not be deleted, nor outlive the arena.
+
+   @code
+   Arena arena;
+   vector<User *> & v = anAdmin->userList(arena);
+   ...
+   // v and its users are destroyed with arena
+   @endcode
+
+   An arena is not thread-safe: use one per request.
+ */
+class Arena
+{
+private:
+    /** A block taken from the heap, followed by its data */
+    struct Block {
+        Block *next;
+        size_t size;
+    };
+
+    /** A destructor to run on release */
+    struct Cleanup {
+        Cleanup *next;
+        void *object;
+        void (*destroy)(void *);
+    };
+
+    union {
+        char _inline[ARENA_INLINE_SIZE];
+        long double _alignDouble;
+        void *_alignPointer;
+    };
+    char *_next;
+    char *_end;
+    Block *_blocks;
+    size_t _blockSize;
+    Cleanup *_cleanups;
+
+    size_t _used;
+    size_t _objects;
+
+    void *grow(size_t aSize);
+    void track(void *anObject, void (*aDestroy)(void *));
+
+    template <class T> static void destroy(void *anObject) {
+        static_cast<T *>(anObject)->~T();
+    }
+
+    /** Track the object, unless its destructor does nothing */
+    template <class T> T *tracked(T *anObject) {
+        if (!std::tr1::has_trivial_destructor<T>::value)
+            track(anObject, &destroy<T>);
+        _objects++;
+        return anObject;
+    }
+
+    Arena(const Arena &);
+    Arena & operator=(const Arena &);
+
+public:
+    Arena();
+    ~Arena();
+
+    /**
+       @brief Returns aSize bytes, aligned to ARENA_ALIGN
+     */
+    void *allocate(size_t aSize) {
+        aSize = (aSize + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+        _used += aSize;
+        if ((size_t) (_end - _next) < aSize)
+            return grow(aSize);
+
+        void *p = _next;
+        _next += aSize;
+        return p;
+    }
+
+    template <class T> T *create() {
+        return tracked(new (allocate(sizeof(T))) T());
+    }
+    template <class T, class A1> T *create(const A1 & a1) {
+        return tracked(new (allocate(sizeof(T))) T(a1));
+    }
+    template <class T, class A1, class A2>
+    T *create(const A1 & a1, const A2 & a2) {
+        return tracked(new (allocate(sizeof(T))) T(a1, a2));
+    }
+
+    void release();
+
+    /** Bytes handed out since the last release */
+    size_t used() const { return _used; }
+    /** Objects created since the last release */
+    size_t objects() const { return _objects; }
+};
+
+#endif /* __ARENA_H__ */
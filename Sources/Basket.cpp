@@ -7,22 +7,34 @@
 
 #include "Basket.h"
 #include "Product.h"
+#include "Inventory.h"
+#include <algorithm>
+
+/**
+   @brief Orders lines by product ID, for lower_bound()
+ */
+static bool lineBefore(const Basket::Line & aLine, int aPid)
+{
+    return aLine.pid < aPid;
+}
 
 /**
    @brief Default constructor
  */
-Basket::Basket()
+Basket::Basket() : _count(0)
 {
     LOG_CTOR();
-    _tot = 0.0;
 }
 
 /**
    @brief Default destructor
+ 
+   Products still in the basket go back to stock.
  */
 Basket::~Basket()
 {
     LOG_DTOR();
+    empty();
 }
 
 /**
@@ -30,7 +42,7 @@ Basket::~Basket()
  
    Add a product to the basket. It's possibile to specify how many 
    pieces of the same product.
-   A check against product availability is done before adding it 
+   Requested pieces are reserved in the inventory before adding them 
    to the basket.
  
    @param[in]    p An instance to ProductProxy
@@ -40,15 +52,12 @@ Basket::~Basket()
  */
 bool Basket::addProduct(ProductProxy *p, int aQty)
 {
-    if (aQty > p->getAvailability())
-        return false;
-    
-    _tot += p->getPrice();
-    
     int aPid = p->uniqueID();
-    _realAddProduct(aPid, aQty);
+    Lines::iterator it = _find(aPid);
+    if (it != _lines.end())
+        return _reserve(*it, aQty);
     
-    return true;
+    return _addProduct(aPid, p->getName(), p->getPrice(), aQty);
 }
 
 /**
@@ -56,8 +65,8 @@ bool Basket::addProduct(ProductProxy *p, int aQty)
  
    Add a product to the basket. It's possibile to specify how 
    many pieces of the same product.
-   A check against product availability is done before adding 
-   it to the basket.
+   Requested pieces are reserved in the inventory before adding 
+   them to the basket.
  
    @param[in]    p An instance to Product
    @param[in]    aQty How many pieces of the same product 
@@ -66,105 +75,218 @@ bool Basket::addProduct(ProductProxy *p, int aQty)
  */
 bool Basket::addProduct(Product *p, int aQty)
 {
-    if (aQty > p->getAvailability())
-        return false;
+    int aPid = p->intForKey(p->primaryKey());
+    Lines::iterator it = _find(aPid);
+    if (it != _lines.end())
+        return _reserve(*it, aQty);
     
-    _tot += p->getPrice();
+    return _addProduct(aPid, p->valueForKey(KEY_PRD_NAME), p->getPrice(), 
+                       aQty);
+}
+
+/**
+   @brief Returns the line of a product, end of lines if not found
+ */
+Basket::Lines::iterator Basket::_find(int pid)
+{
+    Lines::iterator it = lower_bound(_lines.begin(), _lines.end(), pid, 
+                                     lineBefore);
     
-    int aPid = p->intForKey(p->primaryKey());
-    _realAddProduct(aPid, aQty);
+    return (it != _lines.end() && (*it).pid == pid) ? it : _lines.end();
+}
+
+/**
+   @brief Add a new line to the basket
+ 
+   This function must not be used directly, but only called by
+   addProduct() - that's why it's private. The line is inserted in 
+   order only once its pieces have been reserved.
+ 
+   @param[in]    pid       Product ID to add
+   @param[in]    aName     Name of the product
+   @param[in]    aPrice    Current unit price of the product
+   @param[in]    qty       Requested quantity
+   @return    True if enough pieces were available
+ */
+bool Basket::_addProduct(int pid, const string & aName, const Money & aPrice, 
+                         int qty)
+{
+    Line aLine(pid);
+    aLine.name = aName;
+    aLine.price = aPrice;
+    if (!_reserve(aLine, qty))
+        return false;
+    
+    _lines.insert(lower_bound(_lines.begin(), _lines.end(), pid, 
+                              lineBefore), aLine);
     
     return true;
 }
 
 /**
-   @brief Real add product
+   @brief Reserve more pieces of a line
  
-   This function must not be used directly, but only called by
-   addProduct() - that's why it's private. It adds the chosen 
-   product and requested quantity to the map, by first looking 
-   for an equal entry: in this case only quantity is increased.
+   If the line is already reserved, its reservation is extended, 
+   otherwise a new reservation is made. Once reserved, the pieces are 
+   added to the line, to the item count and, at the price of the 
+   line, to the total.
  
-   @param[in]    pid    Product ID to add
-   @param[in]    qty    Requested quantity
+   @param[in]    aLine  The line
+   @param[in]    qty    Additional pieces to reserve
+   @return    True if enough pieces were available
+   @see Inventory::reserve(), Inventory::adjust()
  */
-void Basket::_realAddProduct(int pid, int qty)
+bool Basket::_reserve(Line & aLine, int qty)
 {
-    int aValue = qty;
+    if (qty <= 0)
+        return false;
     
-    map<int,int>::iterator it = find(pid);
-    if (it != end())
-        aValue += (*it).second;
-    insert(pair<int, int>(pid, aValue));        
+    Inventory &inv = Inventory::instance();
+    int total = aLine.qty + qty;
+    
+    if (!aLine.reservation || !inv.adjust(aLine.reservation, total)) {
+        // still reserved: the additional pieces aren't available
+        if (aLine.reservation && inv.isValid(aLine.reservation))
+            return false;
+        
+        // no reservation yet (or it expired): reserve the whole quantity
+        unsigned long rid= inv.reserve(aLine.pid, total);
+        if (rid == 0)
+            return false;
+        aLine.reservation = rid;
+    }
+    
+    aLine.qty = total;
+    _count += qty;
+    _total += aLine.price * qty;
+    
+    return true;
 }
 
 /**
    @brief Empty the basket
+ 
+   All reserved pieces go back to stock.
  */
 void Basket::empty()
 {
-    _tot = 0.0;
-    clear();
+    Inventory &inv = Inventory::instance();
+    
+    for (Lines::const_iterator it = _lines.begin(); it != _lines.end(); it++)
+        if ((*it).reservation)
+            inv.release((*it).reservation);
+    
+    _lines.clear();
+    _total = Money();
+    _count = 0;
 }
 
 /**
-   @brief Remove a product from the basket
+   @brief Make sure all products in the basket are still reserved
  
-   The function looks for the given product and decreases 
-   the quantity: if this value goes down below or equal to 
-   zero, the product is removed; otherwise only quantity is 
-   decreased.
+   Reservations which expired in the meanwhile are made again, if 
+   enough pieces are still available. Call this method just before 
+   placing an order.
  
-   @param[in]    p    Pointer to Product to be removed
-   @param[in]    aQty    Requested quantity to remove
+   @return    True if all products are reserved
  */
-void Basket::removeProduct(Product *p, int aQty)
+bool Basket::renewReservations()
 {
-    int aPid = p->intForKey(p->primaryKey());
-    map<int,int>::iterator it = find(aPid);
-    if (it != end()) {
-        int aValue = (*it).second;
-        aValue -= aQty;
-        if (aValue <= 0)
-            erase(it);
-        else
-            insert(pair<int, int>(aPid, aValue));
+    Inventory &inv = Inventory::instance();
+    
+    for (Lines::iterator it = _lines.begin(); it != _lines.end(); it++) {
+        unsigned long & rid = (*it).reservation;
+        
+        if (rid && inv.isValid(rid) && inv.adjust(rid, (*it).qty))
+            continue;
+        
+        if ((rid = inv.reserve((*it).pid, (*it).qty)) == 0)
+            return false;
     }
+    
+    return true;
 }
 
 /**
-   @brief Items count
+   @brief Change the unit price remembered by a line
  
-   Return the number of item currently present in the basket.
+   Used when an order was refused because the price of a product 
+   changed since it was added: the total follows.
  
-   @return Number of items
+   @param[in]    pid       Product ID
+   @param[in]    aPrice    Its current price
+   @return    True if the line had a different price
  */
-int Basket::itemCount()
+bool Basket::reprice(int pid, const Money & aPrice)
 {
-    map<int,int>::const_iterator it;
-    int count = 0;
+    Lines::iterator it = _find(pid);
+    if (it == _lines.end() || (*it).price == aPrice)
+        return false;
     
-    for (it = begin(); it != end(); it++)
-        count += (*it).second;
+    _total -= (*it).price * (*it).qty;
+    (*it).price = aPrice;
+    _total += aPrice * (*it).qty;
+    
+    return true;
+}
+
+/**
+   @brief Turn all reservations into sales
+ 
+   Call this method once the order has been placed: the basket can 
+   then be emptied.
+ 
+   @param[in]    isPersisted True if placing the order already 
+                             decreased products availability
+   @see Inventory::commit()
+ */
+void Basket::commitReservations(bool isPersisted)
+{
+    Inventory &inv = Inventory::instance();
     
-    return count;
+    for (Lines::iterator it = _lines.begin(); it != _lines.end(); it++) {
+        if ((*it).reservation)
+            inv.commit((*it).reservation, isPersisted);
+        (*it).reservation = 0;
+    }
 }
 
 /**
-   @brief Return the total cost of the basket
+   @brief Remove a product from the basket
  
-   @return    The total, expressed as float
+   The function looks for the given product and decreases 
+   the quantity: if this value goes down below or equal to 
+   zero, the product is removed; otherwise only quantity is 
+   decreased.
+ 
+   @param[in]    p    Pointer to Product to be removed
+   @param[in]    aQty    Requested quantity to remove
  */
-float Basket::total() const
-{ 
-    return _tot; 
+void Basket::removeProduct(Product *p, int aQty)
+{
+    Lines::iterator it = _find(p->intForKey(p->primaryKey()));
+    if (it == _lines.end() || aQty <= 0)
+        return;
+    
+    int removed = (aQty < (*it).qty) ? aQty : (*it).qty;
+    int aValue = (*it).qty - removed;
+    _count -= removed;
+    _total -= (*it).price * removed;
+    
+    // give back removed pieces
+    if ((*it).reservation)
+        Inventory::instance().adjust((*it).reservation, aValue);
+    
+    if (aValue == 0)
+        _lines.erase(it);
+    else
+        (*it).qty = aValue;
 }
 
 ostream& operator<<(ostream& aStream, Basket & p) {    
-    for (map<int, int>::const_iterator it=p.begin(); it != p.end(); it++) {
-        ProductProxy p = ProductProxy( (*it).first );
-        aStream << left << setw(30) << p.getName() << " | " << right
-                << (*it).second << endl;
+    for (Basket::const_iterator it=p.begin(); it != p.end(); it++) {
+        aStream << left << setw(30) << (*it).name << " | " << right
+                << (*it).qty << endl;
     }
         
     return aStream;
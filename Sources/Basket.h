@@ -9,6 +9,11 @@
 #define __BASKET_H__
 
 #include "common.h"
+#include "Money.h"
+#include "SmallVector.h"
+
+/** Basket lines kept inside the basket itself */
+#define BASKET_INLINE_LINES     16
 
 // forward declaration
 class Product;
@@ -18,12 +23,46 @@ class ProductProxy;
    The class Basket represents the basket of the customer who 
    wants to buy one or more products: it's intended to be used 
    by User class only.
+ 
+   Units added to the basket are reserved in the Inventory, so that 
+   they can't be sold to another customer until the order is placed, 
+   the product is removed from the basket or the reservation expires.
+ 
+   Each product is a line, sorted by product ID, which remembers the 
+   name and the price of the product when it was first added: the 
+   total and the number of items are kept up to date as lines change, 
+   so showing the basket doesn't look up any product.
  */
-class Basket : public std::map<int, int> 
+class Basket
 {
+public:
+    /** A product in the basket */
+    struct Line {
+        int pid;
+        int qty;
+        /** Unit price when the product was added */
+        Money price;
+        std::string name;
+        /** Inventory reservation, 0 if none */
+        unsigned long reservation;
+        
+        Line(int aPid = 0) : pid(aPid), qty(0), reservation(0) {}
+    };
+    typedef SmallVector<Line, BASKET_INLINE_LINES> Lines;
+    typedef Lines::const_iterator const_iterator;
+    
 private:
-    float _tot;
-    void _realAddProduct(int pid, int qty);
+    Lines _lines;
+    Money _total;
+    int _count;
+    
+    Lines::iterator _find(int pid);
+    bool _addProduct(int pid, const std::string & aName, const Money & aPrice, 
+                     int qty);
+    bool _reserve(Line & aLine, int qty);
+    
+    Basket(const Basket &);
+    Basket & operator=(const Basket &);
     
 public:
     Basket();
@@ -31,10 +70,17 @@ public:
     
     bool addProduct(Product *p, int aQty = 1);
     bool addProduct(ProductProxy *p, int aQty = 1);
-    float total() const;
+    Money total() const { return _total; }
     void empty();
     void removeProduct(Product *p, int aQty = 1);
-    int itemCount();
+    int itemCount() const { return _count; }
+    
+    const_iterator begin() const { return _lines.begin(); }
+    const_iterator end() const { return _lines.end(); }
+    size_t size() const { return _lines.size(); }
+    bool renewReservations();
+    bool reprice(int pid, const Money & aPrice);
+    void commitReservations(bool isPersisted = false);
 
     friend std::ostream & operator<<(std::ostream &, Basket &);
 };
@@ -0,0 +1,762 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#include "CatalogSnapshot.h"
+#include "Database.h"
+#include "Money.h"
+#include "Product.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <cstring>
+#include <cerrno>
+
+#define SQL_SNAPSHOT_CAT    "SELECT cid, name FROM categories ORDER BY cid"
+#define SQL_SNAPSHOT_PRD    "SELECT pid, cid, name, descr, price, " \
+                            "availability, deleted, version, change_seq " \
+                            "FROM products ORDER BY pid"
+#define SQL_SNAPSHOT_OFF    "SELECT oid, name FROM offers ORDER BY oid"
+#define SQL_SNAPSHOT_CONF   "SELECT oid, pid FROM configurations " \
+                            "ORDER BY oid, pid"
+
+/**
+   Cheap summary of the catalog tables: any insert, delete, versioned
+   update or rename changes at least one of the values.
+ */
+#define SQL_SNAPSHOT_FINGERPRINT \
+    "SELECT (SELECT COUNT(*) FROM products), " \
+    "(SELECT MAX(pid) FROM products), " \
+    "(SELECT SUM(version) FROM products), " \
+    "(SELECT SUM(deleted) FROM products), " \
+    "(SELECT COUNT(*) FROM categories), " \
+    "(SELECT MAX(cid) FROM categories), " \
+    "(SELECT SUM(LENGTH(name)) FROM categories), " \
+    "(SELECT COUNT(*) FROM offers), " \
+    "(SELECT SUM(LENGTH(name)) FROM offers), " \
+    "(SELECT COUNT(*) FROM configurations), " \
+    "(SELECT SUM(oid * 65536 + pid) FROM configurations)"
+
+/** Products written after a watermark, sales and deletions included */
+#define SQL_SNAPSHOT_CHANGES "SELECT pid FROM products WHERE change_seq > %0 " \
+                             "UNION SELECT pid FROM product_tombstones " \
+                             "WHERE change_seq > %0"
+
+/** Columns of a product record, as returned by "SELECT * FROM products" */
+static const char *snapshotProductColumns[] = {
+    "pid", "cid", "name", "descr", "price", "availability", "deleted",
+    "version", "change_seq"
+};
+
+/** Tables whose writes make the catalog listing stale */
+static const char *snapshotTables[] = {
+    "categories", "offers", "configurations"
+};
+
+/**
+   @brief Default constructor
+
+   No file is mapped until open() is called.
+ */
+CatalogSnapshot::CatalogSnapshot()
+{
+    LOG_CTOR();
+    _base = NULL;
+    _size = 0;
+    _watermark = 0;
+    _checked = 0;
+    _stale = false;
+}
+
+/**
+   @brief Default destructor
+ */
+CatalogSnapshot::~CatalogSnapshot()
+{
+    LOG_DTOR();
+    close();
+}
+
+/**
+   @brief Compute the fingerprint of the catalog in the database
+
+   @return    A hash of the catalog summary, 0 on failure
+ */
+ulonglong CatalogSnapshot::liveFingerprint()
+{
+    Database &db = Database::instance();
+    ResultSet res;
+
+    if (!db.isConnected() || !db.select(SQL_SNAPSHOT_FINGERPRINT, res) ||
+        res.empty())
+        return 0;
+
+    // FNV-1a over all the values, NULLs included
+    ulonglong hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < res[0].size(); i++) {
+        string value = res[0][int(i)].isNull() ? "-" : res[0][int(i)].str();
+        value += ';';
+        for (size_t c = 0; c < value.size(); c++) {
+            hash ^= (unsigned char) value[c];
+            hash *= 1099511628211ULL;
+        }
+    }
+
+    return hash;
+}
+
+/**
+   @brief Format an integer value
+ */
+static string number(long aValue)
+{
+    stringstream value;
+
+    value << aValue;
+
+    return value.str();
+}
+
+/**
+   @brief Append a string to the heap of a snapshot being built
+
+   @param[in,out]    heap    The heap
+   @param[in]        aField  The value to store
+   @return    The offset of the string, CATALOG_SNAPSHOT_NULL if NULL
+ */
+static uint32_t heapString(string & heap, const Field & aField)
+{
+    if (aField.isNull())
+        return CATALOG_SNAPSHOT_NULL;
+
+    uint32_t offset = heap.size();
+    heap.append(aField.str());
+    heap.push_back('\0');
+
+    return offset;
+}
+
+/**
+   @brief Write a snapshot of the catalog
+
+   The catalog is read from the database within one transaction and
+   written to a temporary file, which then replaces aPath: a process
+   mapping the old file keeps reading it until it calls open() again.
+
+   @param[in]    aPath   Path of the snapshot
+   @return    True if successful
+ */
+bool CatalogSnapshot::exportTo(const string & aPath)
+{
+    Database &db = Database::instance();
+    StorageBackend *conn = db.connection();
+    ResultSet cat, prd, off, conf;
+
+    if (!conn || !conn->begin())
+        return false;
+
+    ulonglong fingerprint = liveFingerprint();
+    bool success = fingerprint && db.select(SQL_SNAPSHOT_CAT, cat) &&
+                   db.select(SQL_SNAPSHOT_PRD, prd) &&
+                   db.select(SQL_SNAPSHOT_OFF, off) &&
+                   db.select(SQL_SNAPSHOT_CONF, conf);
+    conn->commit();
+    if (!success)
+        return false;
+
+    vector<CategoryRecord> categories(cat.numRows());
+    vector<ProductRecord> products(prd.numRows());
+    vector<OfferRecord> offers(off.numRows());
+    vector<ConfigurationRecord> configurations(conf.numRows());
+    string heap;
+
+    for (size_t i = 0; i < cat.numRows(); i++) {
+        categories[i].cid = (int) cat[i][0];
+        categories[i].name = heapString(heap, cat[i][1]);
+    }
+
+    for (size_t i = 0; i < prd.numRows(); i++) {
+        ProductRecord & p = products[i];
+
+        memset(&p, 0, sizeof(p));
+        p.pid = (int) prd[i][0];
+        p.cid = (int) prd[i][1];
+        p.name = heapString(heap, prd[i][2]);
+        p.descr = heapString(heap, prd[i][3]);
+        Money price;
+        Money::parse(prd[i][4].str(), price);
+        p.price = price.cents();
+        p.availability = (int) prd[i][5];
+        p.deleted = ((int) prd[i][6] != 0);
+        p.version = (int) prd[i][7];
+        p.changeSeq = strtoull(prd[i][8].c_str(), NULL, 10);
+    }
+
+    // configurations are sorted by offer: each offer gets its range
+    size_t c = 0;
+    for (size_t i = 0; i < off.numRows(); i++) {
+        offers[i].oid = (int) off[i][0];
+        offers[i].name = heapString(heap, off[i][1]);
+
+        while (c < conf.numRows() && (int) conf[c][0] < offers[i].oid)
+            c++;
+        offers[i].first = c;
+        while (c < conf.numRows() && (int) conf[c][0] == offers[i].oid)
+            c++;
+        offers[i].count = c - offers[i].first;
+    }
+
+    for (size_t i = 0; i < conf.numRows(); i++) {
+        configurations[i].oid = (int) conf[i][0];
+        configurations[i].pid = (int) conf[i][1];
+    }
+
+    // lay out sections one after the other, then the heap
+    Header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CATALOG_SNAPSHOT_MAGIC, sizeof(h.magic));
+    h.format = CATALOG_SNAPSHOT_FORMAT;
+    h.fingerprint = fingerprint;
+    h.created = time(NULL);
+
+    uint32_t offset = sizeof(Header);
+    h.categories.offset = offset, h.categories.count = categories.size();
+    offset += categories.size() * sizeof(CategoryRecord);
+    h.products.offset = offset, h.products.count = products.size();
+    offset += products.size() * sizeof(ProductRecord);
+    h.offers.offset = offset, h.offers.count = offers.size();
+    offset += offers.size() * sizeof(OfferRecord);
+    h.configurations.offset = offset;
+    h.configurations.count = configurations.size();
+    offset += configurations.size() * sizeof(ConfigurationRecord);
+    h.heap.offset = offset, h.heap.count = heap.size();
+    h.size = offset + heap.size();
+
+    string data((const char *) &h, sizeof(h));
+    if (!categories.empty())
+        data.append((const char *) &categories[0],
+                    categories.size() * sizeof(CategoryRecord));
+    if (!products.empty())
+        data.append((const char *) &products[0],
+                    products.size() * sizeof(ProductRecord));
+    if (!offers.empty())
+        data.append((const char *) &offers[0],
+                    offers.size() * sizeof(OfferRecord));
+    if (!configurations.empty())
+        data.append((const char *) &configurations[0],
+                    configurations.size() * sizeof(ConfigurationRecord));
+    data.append(heap);
+
+    if (!write(aPath, data))
+        return false;
+
+    LOG(2, "Catalog snapshot written to %s: %u products, %u bytes\n",
+        aPath.c_str(), h.products.count, h.size);
+
+    return true;
+}
+
+/**
+   @brief Atomically replace a file
+
+   @param[in]    aPath   Path of the file
+   @param[in]    aData   New content
+   @return    True if successful
+ */
+bool CatalogSnapshot::write(const string & aPath, const string & aData)
+{
+    string tmp = aPath + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        cerr << "unable to write " << tmp << " (" << strerror(errno)
+             << ")\n";
+        return false;
+    }
+
+    size_t done = 0;
+    while (done < aData.size()) {
+        ssize_t n = ::write(fd, aData.data() + done, aData.size() - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+    }
+
+    bool success = (done == aData.size() && fsync(fd) == 0);
+    ::close(fd);
+
+    if (!success || rename(tmp.c_str(), aPath.c_str()) != 0) {
+        cerr << "unable to write " << aPath << " (" << strerror(errno)
+             << ")\n";
+        unlink(tmp.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+/**
+   @brief Map a snapshot file
+
+   Any previously mapped file is released first: records obtained
+   from it must not be used anymore.
+
+   @param[in]    aPath   Path of the snapshot
+   @return    True if the file is a valid snapshot
+ */
+bool CatalogSnapshot::open(const string & aPath)
+{
+    close();
+
+    int fd = ::open(aPath.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    void *base = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(Header))
+        base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+
+    if (base == MAP_FAILED)
+        return false;
+
+    _base = (const char *) base;
+    _size = st.st_size;
+    if (!validate()) {
+        LOG(1, "Invalid catalog snapshot %s\n", aPath.c_str());
+        close();
+        return false;
+    }
+
+    _path = aPath;
+    Database &db = Database::instance();
+    for (size_t i = 0; i < sizeof(snapshotTables) / sizeof(char *); i++)
+        _versions[snapshotTables[i]] = db.tableVersion(snapshotTables[i]);
+
+    MutexLocker lock(_lock);
+    _changed.clear();
+    _watermark = Product::changeWatermark();
+    _checked = time(NULL);
+    _stale = false;
+
+    LOG(2,"Catalog snapshot %s mapped: %u products\n", aPath.c_str(),
+        header()->products.count);
+
+    return true;
+}
+
+/**
+   @brief Map a snapshot, regenerating it if missing or stale
+
+   When the database can't be reached the snapshot is used as it is,
+   so that the catalog can be browsed offline.
+
+   @param[in]    aPath   Path of the snapshot
+   @return    True if an up to date snapshot is mapped
+ */
+bool CatalogSnapshot::openFresh(const string & aPath)
+{
+    if (open(aPath) && (isFresh() || !Database::instance().isConnected()))
+        return true;
+
+    LOG(2, "Catalog snapshot %s is stale, regenerating it\n",
+        aPath.c_str());
+    close();
+
+    return exportTo(aPath) && open(aPath);
+}
+
+/**
+   @brief Release the mapped file
+ */
+void CatalogSnapshot::close()
+{
+    if (_base)
+        munmap((void *) _base, _size);
+
+    _base = NULL;
+    _size = 0;
+    _path.clear();
+    _versions.clear();
+}
+
+/**
+   @brief Check that the mapped file is a snapshot we can read
+
+   @return    True if header and sections are consistent
+ */
+bool CatalogSnapshot::validate() const
+{
+    const Header *h = header();
+
+    if (memcmp(h->magic, CATALOG_SNAPSHOT_MAGIC, sizeof(h->magic)) ||
+        h->format != CATALOG_SNAPSHOT_FORMAT || h->size != _size)
+        return false;
+
+    const Section *sections[] = { &h->categories, &h->products,
+                                  &h->offers, &h->configurations,
+                                  &h->heap };
+    const size_t widths[] = { sizeof(CategoryRecord), sizeof(ProductRecord),
+                              sizeof(OfferRecord),
+                              sizeof(ConfigurationRecord), 1 };
+
+    for (size_t i = 0; i < 5; i++) {
+        uint64_t end = (uint64_t) sections[i]->offset +
+                       (uint64_t) sections[i]->count * widths[i];
+        if (sections[i]->offset < sizeof(Header) || end > _size)
+            return false;
+    }
+
+    // strings must be terminated inside the heap
+    return (h->heap.count == 0 || _base[_size - 1] == '\0');
+}
+
+/**
+   @brief Returns the header of the mapped file
+ */
+const CatalogSnapshot::Header *CatalogSnapshot::header() const
+{
+    return (const Header *) _base;
+}
+
+/**
+   @brief Check if a file is mapped
+
+   @return    True if open() succeeded
+ */
+bool CatalogSnapshot::isOpen() const
+{
+    return (_base != NULL);
+}
+
+/**
+   @brief Compare the snapshot with the live database
+
+   @return    True if the catalog didn't change since the export
+ */
+bool CatalogSnapshot::isFresh() const
+{
+    return isOpen() && header()->fingerprint == liveFingerprint();
+}
+
+/**
+   @brief Check if categories or offers were written since open()
+ */
+bool CatalogSnapshot::tablesChanged() const
+{
+    Database &db = Database::instance();
+    map<string, ulonglong>::const_iterator it;
+
+    for (it = _versions.begin(); it != _versions.end(); it++)
+        if (db.tableVersion((*it).first) != (*it).second)
+            return true;
+
+    return false;
+}
+
+/**
+   @brief Look for products written by other processes
+
+   Must be called with the lock held. At most once every
+   CATALOG_SNAPSHOT_CHECK_INTERVAL seconds, the products written since
+   the last check are added to the changed ones; if the schema doesn't
+   number changes, the fingerprint is compared instead.
+
+   @return    False if the snapshot must not be used anymore
+ */
+bool CatalogSnapshot::syncChanges() const
+{
+    time_t now = time(NULL);
+    if (_stale || now - _checked < CATALOG_SNAPSHOT_CHECK_INTERVAL)
+        return !_stale;
+
+    _checked = now;
+    if (_watermark == 0) {
+        _stale = !isFresh();
+        if (_stale)
+            LOG(2, "Catalog snapshot %s is stale, bypassed\n", _path.c_str());
+        return !_stale;
+    }
+
+    ulonglong watermark = Product::changeWatermark();
+    if (watermark == _watermark)
+        return true;
+
+    // the watermark is read first: a write committed meanwhile is
+    // seen again at the next check, never missed
+    ResultSet res;
+    if (!Database::instance().select(SQL_SNAPSHOT_CHANGES, res,
+                                     SqlParams() << _watermark)) {
+        _stale = true;
+        return false;
+    }
+
+    for (size_t i = 0; i < res.numRows(); i++)
+        _changed.insert((int) res[i][0]);
+    _watermark = watermark;
+
+    LOG(3, "%d product(s) of the catalog snapshot written elsewhere\n",
+        (int) res.numRows());
+
+    return true;
+}
+
+/**
+   @brief Check if the whole catalog can be served by the snapshot
+
+   @return    True if mapped and nothing was written since open()
+ */
+bool CatalogSnapshot::isCurrent() const
+{
+    if (!isOpen() || tablesChanged())
+        return false;
+
+    MutexLocker lock(_lock);
+
+    return syncChanges() && _changed.empty();
+}
+
+/**
+   @brief Returns the number of categories
+ */
+size_t CatalogSnapshot::categoryCount() const
+{
+    return isOpen() ? header()->categories.count : 0;
+}
+
+/**
+   @brief Returns a category by position (categories are sorted by ID)
+ */
+const CatalogSnapshot::CategoryRecord *
+CatalogSnapshot::categoryAt(size_t anIndex) const
+{
+    return (const CategoryRecord *) (_base + header()->categories.offset) +
+           anIndex;
+}
+
+/**
+   @brief Look up a category
+
+   @param[in]    aCid    The category ID
+   @return    The record, NULL if not found or if categories changed
+ */
+const CatalogSnapshot::CategoryRecord *CatalogSnapshot::category(int aCid) const
+{
+    if (!isOpen() || tablesChanged())
+        return NULL;
+
+    {
+        MutexLocker lock(_lock);
+        if (!syncChanges())
+            return NULL;
+    }
+
+    const CategoryRecord *first = categoryAt(0);
+    const CategoryRecord *last = first + header()->categories.count;
+
+    while (first < last) {
+        const CategoryRecord *mid = first + (last - first) / 2;
+        if (mid->cid < aCid)
+            first = mid + 1;
+        else
+            last = mid;
+    }
+
+    return (first < categoryAt(0) + header()->categories.count &&
+            first->cid == aCid) ? first : NULL;
+}
+
+/**
+   @brief Returns the number of products (deleted ones included)
+ */
+size_t CatalogSnapshot::productCount() const
+{
+    return isOpen() ? header()->products.count : 0;
+}
+
+/**
+   @brief Returns a product by position (products are sorted by ID)
+ */
+const CatalogSnapshot::ProductRecord *
+CatalogSnapshot::productAt(size_t anIndex) const
+{
+    return (const ProductRecord *) (_base + header()->products.offset) +
+           anIndex;
+}
+
+/**
+   @brief Look up a product in the pid index
+
+   @param[in]    aPid    The product ID
+   @return    The record, NULL if not found or written since open()
+ */
+const CatalogSnapshot::ProductRecord *CatalogSnapshot::product(int aPid) const
+{
+    if (!isOpen())
+        return NULL;
+
+    {
+        MutexLocker lock(_lock);
+        if (!syncChanges() || _changed.find(aPid) != _changed.end())
+            return NULL;
+    }
+
+    const ProductRecord *first = productAt(0);
+    const ProductRecord *end = first + header()->products.count;
+    const ProductRecord *last = end;
+
+    while (first < last) {
+        const ProductRecord *mid = first + (last - first) / 2;
+        if (mid->pid < aPid)
+            first = mid + 1;
+        else
+            last = mid;
+    }
+
+    return (first < end && first->pid == aPid) ? first : NULL;
+}
+
+/**
+   @brief Returns a string of the heap
+
+   @param[in]    anOffset    Offset of the string
+   @return    The string, NULL for CATALOG_SNAPSHOT_NULL
+ */
+const char *CatalogSnapshot::text(uint32_t anOffset) const
+{
+    if (anOffset == CATALOG_SNAPSHOT_NULL)
+        return NULL;
+
+    return _base + header()->heap.offset + anOffset;
+}
+
+/**
+   @brief Build a record of table "products" from the snapshot
+
+   The record can be passed to Product(const Record &).
+
+   @param[in]    aProduct    The product
+   @return    The record
+ */
+Record CatalogSnapshot::productRow(const ProductRecord *aProduct) const
+{
+    // initialized once, even if several threads get here together
+    static ColumnNames names(new vector<string>(snapshotProductColumns,
+                                                snapshotProductColumns + 9));
+
+    Record row(names);
+
+    row.append(Field(number(aProduct->pid)));
+    row.append(Field(number(aProduct->cid)));
+    row.append(Field(text(aProduct->name)));
+    row.append(aProduct->descr == CATALOG_SNAPSHOT_NULL ? Field() :
+               Field(text(aProduct->descr)));
+    row.append(Field(Money::fromCents(aProduct->price).str()));
+    row.append(Field(number(aProduct->availability)));
+    row.append(Field(aProduct->deleted ? "1" : "0"));
+    row.append(Field(number(aProduct->version)));
+
+    stringstream changeSeq;
+    changeSeq << aProduct->changeSeq;
+    row.append(Field(changeSeq.str()));
+
+    return row;
+}
+
+/**
+   @brief Same result sets as procedure "offers_by_product"
+
+   For each offer including the product, a set with its name and
+   total price is followed by a set with its products.
+
+   @param[in]    aPid    The product ID
+   @param[out]   res     The result sets
+   @return    True if the snapshot could answer
+ */
+bool CatalogSnapshot::offersByProduct(int aPid, ResultSets & res) const
+{
+    if (!isCurrent())
+        return false;
+
+    const Header *h = header();
+    const OfferRecord *offers =
+        (const OfferRecord *) (_base + h->offers.offset);
+    const ConfigurationRecord *conf =
+        (const ConfigurationRecord *) (_base + h->configurations.offset);
+
+    for (size_t o = 0; o < h->offers.count; o++) {
+        const ConfigurationRecord *first = conf + offers[o].first;
+        const ConfigurationRecord *last = first + offers[o].count;
+        const ConfigurationRecord *c;
+
+        for (c = first; c < last && c->pid != aPid; c++)
+            ;
+        if (c == last)
+            continue;
+
+        ResultSet summary, items;
+        Money total;
+
+        items.addColumn("pid"), items.addColumn("cid");
+        items.addColumn("name"), items.addColumn("descr");
+        items.addColumn("price"), items.addColumn("availability");
+        items.addColumn("deleted"), items.addColumn("version");
+        items.addColumn("change_seq"), items.addColumn("category");
+
+        for (c = first; c < last; c++) {
+            const ProductRecord *p = product(c->pid);
+            if (!p)
+                continue;
+
+            Record row = productRow(p);
+            Record & item = items.addRecord();
+            for (size_t f = 0; f < row.size(); f++)
+                item.append(row[int(f)]);
+
+            const CategoryRecord *cat = category(p->cid);
+            item.append(cat ? Field(text(cat->name)) : Field());
+            total += Money::fromCents(p->price);
+        }
+
+        summary.addColumn("offer_name");
+        summary.addColumn("offer_price");
+        Record & r = summary.addRecord();
+        r.append(Field(text(offers[o].name)));
+        r.append(Field(number((long) total.rounded())));
+
+        res.push_back(summary);
+        res.push_back(items);
+    }
+
+    return true;
+}
+
+/**
+   @brief Stop serving a product written by this process
+
+   The catalog listing is no longer served either, since the product
+   could have been added, moved to another category or deleted.
+
+   @param[in]    aPid    The product ID
+ */
+void CatalogSnapshot::productDidChange(int aPid)
+{
+    MutexLocker lock(_lock);
+
+    _changed.insert(aPid);
+}
+
+ostream& operator<<(ostream& aStream, CatalogSnapshot& s) {
+    if (!s.isOpen())
+        return aStream << "Catalog snapshot: not mapped\n";
+
+    return aStream << "Catalog snapshot: " << s._path << ", "
+                   << s.header()->products.count << " products, "
+                   << s._size << " bytes"
+                   << (s.isCurrent() ? "" : " (bypassed)") << "\n";
+}
@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#ifndef __CATALOGSNAPSHOT_H__
+#define __CATALOGSNAPSHOT_H__
+
+#include <stdint.h>
+#include "common.h"
+#include "Storage.h"
+#include "Mutex.h"
+
+using namespace std;
+
+/** Magic number at the beginning of a snapshot file */
+#define CATALOG_SNAPSHOT_MAGIC      "ECSN"
+/** Version of the file format: bump it whenever a record changes */
+#define CATALOG_SNAPSHOT_FORMAT     3
+/** Offset of a NULL string */
+#define CATALOG_SNAPSHOT_NULL       0xFFFFFFFFU
+/** Seconds between two looks for writes made by other processes */
+#define CATALOG_SNAPSHOT_CHECK_INTERVAL 5
+
+/**
+   @brief Memory-mapped binary snapshot of the catalog
+
+   A snapshot holds products, categories, offers and their
+   configurations in a compact file made up of a header, one array of
+   fixed-width records per table and a heap with all the strings
+   (NUL terminated, referenced by offset). Every array is sorted by
+   its key, so a lookup is a binary search on the mapped pages: the
+   products array is the pid index. Values are stored in the byte
+   order of the host which wrote the file.
+
+   The file is written by exportTo() (see option -x of ec++) and
+   mapped read-only by open(): nothing is parsed at startup and the
+   catalog can be browsed even before the first query is issued.
+
+   The header keeps a fingerprint of the catalog tables: openFresh()
+   compares it with the live database and regenerates a stale file.
+   Stock levels are not part of the fingerprint, since they change
+   at every sale: live availability comes from Inventory.
+
+   Once open, the snapshot stops serving a product as soon as it's
+   written by this process (see productDidChange()), and stops
+   serving the catalog listing when any product or category changes.
+   Callers then fall back to the database. Writes made by other
+   processes are looked for at most every
+   CATALOG_SNAPSHOT_CHECK_INTERVAL seconds: products numbered by
+   "change_seq" after the file was opened are no longer served and,
+   if the schema doesn't number changes, a moved fingerprint
+   bypasses the whole snapshot.
+
+   @see ProductProxy::catalog(), CategoryTable
+ */
+class CatalogSnapshot : public Singleton<CatalogSnapshot>
+{
+public:
+    /** Position and number of records of a section */
+    struct Section {
+        uint32_t offset;
+        uint32_t count;
+    };
+
+    /** First bytes of the file */
+    struct Header {
+        char magic[4];
+        uint32_t format;
+        uint32_t size;
+        uint32_t reserved;
+        uint64_t fingerprint;
+        uint64_t created;
+        Section categories;
+        Section products;
+        Section offers;
+        Section configurations;
+        Section heap;
+    };
+
+    struct CategoryRecord {
+        int32_t cid;
+        uint32_t name;
+    };
+
+    struct ProductRecord {
+        int32_t pid;
+        int32_t cid;
+        uint32_t name;
+        uint32_t descr;
+        /** In cents (see Money) */
+        int64_t price;
+        uint64_t changeSeq;
+        int32_t availability;
+        int32_t version;
+        uint8_t deleted;
+        uint8_t pad[7];
+    };
+
+    /** An offer, with the range of its configurations */
+    struct OfferRecord {
+        int32_t oid;
+        uint32_t name;
+        uint32_t first;
+        uint32_t count;
+    };
+
+    /** A product included in an offer, sorted by (oid, pid) */
+    struct ConfigurationRecord {
+        int32_t oid;
+        int32_t pid;
+    };
+
+private:
+    const char *_base;
+    size_t _size;
+    string _path;
+    /** Versions of the catalog tables when the file was opened */
+    map<string, ulonglong> _versions;
+    /** Products written since the file was opened */
+    mutable set<int> _changed;
+    /** Last change of table "products" seen, zero if not numbered */
+    mutable ulonglong _watermark;
+    /** When writes of other processes were last looked for */
+    mutable time_t _checked;
+    /** The catalog changed in a way which can't be tracked */
+    mutable bool _stale;
+    /** Protects _changed, _watermark, _checked and _stale */
+    mutable Mutex _lock;
+
+    const Header *header() const;
+    bool validate() const;
+    bool tablesChanged() const;
+    bool syncChanges() const;
+
+    static bool write(const string & aPath, const string & aData);
+
+protected:
+    friend class Singleton<CatalogSnapshot>;
+    CatalogSnapshot();
+    virtual ~CatalogSnapshot();
+
+public:
+    static bool exportTo(const string & aPath);
+    static ulonglong liveFingerprint();
+
+    bool open(const string & aPath);
+    bool openFresh(const string & aPath);
+    void close();
+    bool isOpen() const;
+    bool isFresh() const;
+    bool isCurrent() const;
+
+    size_t categoryCount() const;
+    const CategoryRecord *categoryAt(size_t anIndex) const;
+    const CategoryRecord *category(int aCid) const;
+    size_t productCount() const;
+    const ProductRecord *productAt(size_t anIndex) const;
+    const ProductRecord *product(int aPid) const;
+    const char *text(uint32_t anOffset) const;
+
+    Record productRow(const ProductRecord *aProduct) const;
+    bool offersByProduct(int aPid, ResultSets & res) const;
+
+    void productDidChange(int aPid);
+
+    friend ostream& operator<<(ostream &, CatalogSnapshot &);
+};
+
+#endif /* __CATALOGSNAPSHOT_H__ */
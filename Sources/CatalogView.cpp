@@ -0,0 +1,319 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#include "CatalogView.h"
+#include "Product.h"
+#include "Database.h"
+#include "Inventory.h"
+#include <algorithm>
+
+#define SQL_CATALOG_VIEW    "SELECT pid, cid, name, price, availability, " \
+                            "deleted FROM products"
+
+/** Columns of Product mirrored by the view */
+static const char *catalogViewKeys[] = {
+    KEY_PRD_CID, KEY_PRD_NAME, KEY_PRD_PRICE, KEY_PRD_AVAILABILITY,
+    KEY_PRD_DELETED
+};
+
+/**
+   @brief Default constructor
+
+   The view is empty until load() is called.
+ */
+CatalogView::CatalogView() : _lock(true)
+{
+    LOG_CTOR();
+    _watermark = 0;
+    _refreshed = 0;
+    _loaded = false;
+}
+
+/**
+   @brief Default destructor
+ */
+CatalogView::~CatalogView()
+{
+    LOG_DTOR();
+}
+
+/**
+   @brief Fill the view with all products
+
+   The watermark is read first: changes made while loading are
+   applied again by the next refresh.
+
+   @return    True if successful
+ */
+bool CatalogView::load()
+{
+    // get an instance of the database
+    Database &db = Database::instance();
+    MutexLocker lock(_lock);
+
+    unload();
+    _watermark = Product::changeWatermark();
+    _refreshed = time(NULL);
+
+    ResultSet res;
+    if (!db.select(SQL_CATALOG_VIEW, res))
+        return false;
+
+    for (size_t i = 0; i < res.numRows(); ++i) {
+        Entry e;
+        e.pid = (int) res[i][0];
+        e.cid = (int) res[i][1];
+        e.name = res[i][2].str();
+        Money::parse(res[i][3].str(), e.price);
+        e.availability = (int) res[i][4];
+        e.deleted = ((int) res[i][5] != 0);
+        update(e);
+    }
+
+    __atomic_store_n(&_loaded, true, __ATOMIC_RELEASE);
+    LOG(2, "Catalog view loaded: %d products\n", (int) _entries.size());
+
+    return true;
+}
+
+/**
+   @brief Empty the view
+
+   Products instantiated from now on are not observed.
+ */
+void CatalogView::unload()
+{
+    MutexLocker lock(_lock);
+
+    _entries.clear();
+    _byName.clear();
+    _byPrice.clear();
+    __atomic_store_n(&_loaded, false, __ATOMIC_RELEASE);
+}
+
+/**
+   @brief Check if the view is loaded
+
+   Doesn't lock: products check it whenever they are instantiated.
+ */
+bool CatalogView::isLoaded() const
+{
+    return __atomic_load_n(&_loaded, __ATOMIC_ACQUIRE);
+}
+
+/**
+   @brief Add a product to the sort indexes (if not deleted)
+ */
+void CatalogView::index(const Entry & anEntry)
+{
+    if (anEntry.deleted)
+        return;
+
+    _byName.insert(make_pair(anEntry.name, anEntry.pid));
+    _byPrice.insert(make_pair(anEntry.price, anEntry.pid));
+}
+
+/**
+   @brief Remove a product from the sort indexes
+ */
+void CatalogView::unindex(const Entry & anEntry)
+{
+    _byName.erase(make_pair(anEntry.name, anEntry.pid));
+    _byPrice.erase(make_pair(anEntry.price, anEntry.pid));
+}
+
+/**
+   @brief Insert or replace an entry, keeping indexes up to date
+ */
+void CatalogView::update(const Entry & anEntry)
+{
+    map<int, Entry>::iterator it = _entries.find(anEntry.pid);
+
+    if (it != _entries.end()) {
+        unindex((*it).second);
+        (*it).second = anEntry;
+    } else
+        _entries[anEntry.pid] = anEntry;
+
+    index(anEntry);
+}
+
+/**
+   @brief Apply the changes to products since the last sync
+
+   Called by listings, at most once every
+   CATALOG_VIEW_REFRESH_INTERVAL seconds.
+ */
+void CatalogView::refresh()
+{
+    if (time(NULL) - _refreshed < CATALOG_VIEW_REFRESH_INTERVAL)
+        return;
+
+    _refreshed = time(NULL);
+    if (_watermark == 0)
+        return;
+
+    vector<Product *> changed;
+    vector<int> removed;
+    if (!Product::changesSince(_watermark, changed, removed))
+        return;
+
+    for (size_t i = 0; i < changed.size(); ++i)
+        productDidChange(*changed[i]);
+    for (size_t i = 0; i < removed.size(); ++i)
+        productRemoved(removed[i]);
+
+    for_each(changed.begin(), changed.end(), deletePtr<Product>());
+}
+
+/**
+   @brief Current stock of a product
+
+   @param[in]    anEntry The product
+   @return    Live stock if connected, the stored one otherwise
+ */
+int CatalogView::availability(const Entry & anEntry) const
+{
+    if (!Database::instance().isConnected())
+        return anEntry.availability;
+
+    return Inventory::instance().available(anEntry.pid);
+}
+
+/**
+   @brief Returns a product
+
+   @param[in]    aPid    The product ID
+   @param[out]   anEntry A copy of the entry of the product
+   @return    False if the product is not in the view
+ */
+bool CatalogView::entry(int aPid, Entry & anEntry) const
+{
+    MutexLocker lock(_lock);
+    map<int, Entry>::const_iterator it = _entries.find(aPid);
+
+    if (it == _entries.end())
+        return false;
+
+    anEntry = (*it).second;
+    return true;
+}
+
+/**
+   @brief Return the products on sale, as view "catalogue" does
+
+   @param[in]    aCid    The category ID, zero for all categories
+   @param[in]    aKey    The listing order
+   @return    The products
+ */
+ResultList<ProductProxy> CatalogView::catalog(int aCid, SortKey aKey)
+{
+    ResultList<ProductProxy> catalog;
+    vector<int> pids;
+    MutexLocker lock(_lock);
+
+    refresh();
+
+    if (aKey == SortByName) {
+        set< pair<string, int> >::const_iterator it;
+        for (it = _byName.begin(); it != _byName.end(); it++)
+            pids.push_back((*it).second);
+    } else if (aKey == SortByPrice) {
+        set< pair<Money, int> >::const_iterator it;
+        for (it = _byPrice.begin(); it != _byPrice.end(); it++)
+            pids.push_back((*it).second);
+    } else {
+        map<int, Entry>::const_iterator it;
+        for (it = _entries.begin(); it != _entries.end(); it++)
+            pids.push_back((*it).first);
+    }
+
+    CategoryTable &categories = CategoryTable::instance();
+    catalog.reserve(pids.size());
+    for (size_t i = 0; i < pids.size(); ++i) {
+        const Entry & e = _entries[pids[i]];
+
+        if (e.deleted || (aCid != 0 && e.cid != aCid) ||
+            !categories.contains(e.cid) || availability(e) <= 0)
+            continue;
+        catalog.add(e.pid);
+    }
+
+    return catalog;
+}
+
+/**
+   @brief Update the entry of a product if aKey is shown by the view
+
+   @param[in]    aProduct    The product
+   @param[in]    aKey        The column which was set
+ */
+void CatalogView::productValueDidChange(Product & aProduct,
+                                        const StringRef & aKey)
+{
+    if (!isLoaded())
+        return;
+
+    size_t count = sizeof(catalogViewKeys) / sizeof(catalogViewKeys[0]);
+    for (size_t i = 0; i < count; i++) {
+        if (aKey == StringRef(catalogViewKeys[i])) {
+            LOG(3, "Catalog view: %s changed\n", catalogViewKeys[i]);
+            productDidChange(aProduct);
+            return;
+        }
+    }
+}
+
+/**
+   @brief Copy the values of a product into its entry
+
+   @param[in]    aProduct    The product
+   @param[in]    aPid        Its ID, if not yet known by the product
+                             (just stored)
+ */
+void CatalogView::productDidChange(Product & aProduct, int aPid)
+{
+    Entry e;
+
+    e.pid = aPid ? aPid : atoi(aProduct.valueForKey(KEY_PRD_PID).c_str());
+    if (!isLoaded() || e.pid <= 0)
+        return;
+
+    e.cid = atoi(aProduct.valueForKey(KEY_PRD_CID).c_str());
+    e.name = aProduct.valueForKey(KEY_PRD_NAME);
+    Money::parse(aProduct.valueForKey(KEY_PRD_PRICE), e.price);
+    e.availability = atoi(aProduct.valueForKey(KEY_PRD_AVAILABILITY).c_str());
+    e.deleted = (atoi(aProduct.valueForKey(KEY_PRD_DELETED).c_str()) != 0);
+
+    MutexLocker lock(_lock);
+    update(e);
+}
+
+/**
+   @brief Remove a product from the view
+
+   @param[in]    aPid    The product ID
+ */
+void CatalogView::productRemoved(int aPid)
+{
+    MutexLocker lock(_lock);
+    map<int, Entry>::iterator it= _entries.find(aPid);
+    if (it == _entries.end())
+        return;
+
+    unindex((*it).second);
+    _entries.erase(it);
+}
+
+ostream& operator<<(ostream& aStream, CatalogView& v) {
+    if (!v.isLoaded())
+        return aStream << "Catalog view: not loaded\n";
+
+    MutexLocker lock(v._lock);
+    return aStream<< "Catalog view: " << v._entries.size()
+                   << " products, " << v._byName.size() << " not deleted\n";
+}
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#ifndef __CATALOGVIEW_H__
+#define __CATALOGVIEW_H__
+
+#include <ctime>
+#include "common.h"
+#include "Storage.h"
+#include "Mutex.h"
+#include "ResultList.h"
+#include "Money.h"
+
+using namespace std;
+
+/** Seconds between two delta syncs of the view */
+#define CATALOG_VIEW_REFRESH_INTERVAL   5
+
+// Forward declarations
+class Product;
+class ProductProxy;
+
+/**
+   @brief In-memory materialized view of the catalog
+
+   The view keeps, for every product, the columns shown by listing
+   screens (name, category, price, stock and deleted flag), together
+   with sort indexes by name and by price, so that listings are built
+   without any query.
+
+   Products tell the view when one of the columns above is set (see
+   Product::valueDidChange()), stored or updated: the entry and its
+   indexes are updated in place, as soon as the change is made. Changes
+   made within a NotificationScope update the entry once, when the
+   product is updated. Writes which don't go through a Product, such as
+   changes made by other processes, are caught up every few seconds
+   with Product::changesSince(); sales are not, they only change the
+   stock.
+
+   As for the catalog snapshot, live stock comes from Inventory while
+   connected to the database.
+
+   The view is shared by all the threads of the process: entries are
+   returned by copy, under a lock.
+
+   @see ProductProxy::catalog()
+ */
+class CatalogView : public Singleton<CatalogView>
+{
+public:
+    /** Listing order */
+    enum SortKey {
+        SortByID,
+        SortByName,
+        SortByPrice
+    };
+
+    /** The columns of a product shown by listings */
+    struct Entry {
+        int pid;
+        int cid;
+        string name;
+        Money price;
+        int availability;
+        bool deleted;
+    };
+
+private:
+    /** Entries, indexed by product ID */
+    map<int, Entry> _entries;
+    /** Not deleted products, by name */
+    set< pair<string, int> > _byName;
+    /** Not deleted products, by price */
+    set< pair<Money, int> > _byPrice;
+    /** Last change of table "products" applied, zero if unknown */
+    ulonglong _watermark;
+    time_t _refreshed;
+    bool _loaded;
+    /** Protects entries and indexes (recursive) */
+    mutable Mutex _lock;
+
+    void index(const Entry & anEntry);
+    void unindex(const Entry & anEntry);
+    void update(const Entry & anEntry);
+    void refresh();
+
+protected:
+    friend class Singleton<CatalogView>;
+    CatalogView();
+    virtual ~CatalogView();
+
+public:
+    bool load();
+    void unload();
+    bool isLoaded() const;
+
+    bool entry(int aPid, Entry & anEntry) const;
+    int availability(const Entry & anEntry) const;
+    ResultList<ProductProxy> catalog(int aCid = 0, SortKey aKey = SortByID);
+
+    void productValueDidChange(Product & aProduct, const StringRef & aKey);
+    void productDidChange(Product & aProduct, int aPid = 0);
+    void productRemoved(int aPid);
+
+    friend ostream& operator<<(ostream &, CatalogView &);
+};
+
+#endif /* __CATALOGVIEW_H__ */
@@ -7,11 +7,14 @@
 
 #include "Category.h"
 #include "Database.h"
+#include "CatalogSnapshot.h"
+#include "Product.h"
+#include <algorithm>
 
 #define KEY_CAT_CID         "cid"
 #define KEY_CAT_NAME        "name"
-#define SQL_CATEGORY_BYID   "SELECT cid, name FROM categories WHERE cid = "
 #define SQL_CATEGORY_CAT    "SELECT cid, name FROM categories ORDER BY cid"
+#define SQL_CATEGORY_PRD    "SELECT pid, cid FROM products WHERE deleted = 0"
 
 /**
    @brief Class constructor
@@ -24,29 +27,23 @@ Category::Category() : ManagedObject("categories")
 /**
    @brief Fetch a category by specifing its ID
  
+   The category is read from CategoryTable, no query is issued.
+ 
    @param[in]    aCid Category ID to be fetched
-   @return    An instance of category
+   @return    An instance of category, NULL if not found
  */
 Category *Category::categoryByID(int aCid)
 {
-    Category *cat = NULL;
+    CategoryTable &table = CategoryTable::instance();
     
-    // get an instance of the database
-    Database &db = Database::instance();
+    if (!table.contains(aCid))
+        return NULL;
     
-    // obtain an instance of mysqlpp::Query and init it
-    Query q = db.getConnection()->query();
-    q << SQL_CATEGORY_BYID << aCid;
-    StoreQueryResult res = q.store();
-    if (!res.empty()) {
-        cat = new Category();
-        cat->setIntForKey(KEY_CAT_CID, aCid);
-        cat->setValueForKey(KEY_CAT_NAME, (string) res[0][KEY_CAT_NAME]);
-        
-        return cat;
-    }
-
-    return NULL;
+    Category *cat = new Category();
+    cat->setIntForKey(KEY_CAT_CID, aCid);
+    cat->setValueForKey(KEY_CAT_NAME, table.nameForID(aCid));
+    
+    return cat;
 }
 
 /**
@@ -80,45 +77,24 @@ string Category::primaryKey()
 /**
    @brief Returns the list of available categories.
  
-   @return    Vector of pointer to Category
+   Categories are read from CategoryTable, no query is issued.
+ 
+   @return    The categories (empty if there are none)
  */
-vector<Category *> &Category::catalog()
+ResultList<Category> Category::catalog()
 {
-    // get an instance of the database
-    Database& db = Database::instance();
-    vector<Category *> *catalog = NULL;
+    CategoryTable &table = CategoryTable::instance();
+    vector<int> ids = table.categoryIDs();
+    ResultList<Category> catalog;
     
-    try {
-        // ask Database for a valid connection to mySQL
-        Connection *conn = db.getConnection();
-        
-        // obtain an instance of mysqlpp::Query and init it
-        Query q = conn->query(SQL_CATEGORY_CAT);
-        StoreQueryResult res = q.store();
-        
-        if (!res.empty()) {
-            catalog = new vector<Category *>;
-            catalog->reserve(res.num_rows());
-            
-            for (size_t i = 0; i < res.num_rows(); ++i) {
-                Category *c = new Category();
-                c->setValueForKey(KEY_CAT_CID, 
-                                 (string) res[i][KEY_CAT_CID]);
-                c->setValueForKey(KEY_CAT_NAME, 
-                                  (string) res[i][KEY_CAT_NAME]);
-                catalog->push_back(c);
-            }
-        }                
-    }
-    catch (const mysqlpp::BadQuery& e) {
-        // Something went wrong with the SQL query.
-        cerr << "Query failed: " << e.what() << endl;
+    catalog.reserve(ids.size());
+    for (size_t i = 0; i < ids.size(); ++i) {
+        Category & c = catalog.add();
+        c.setIntForKey(KEY_CAT_CID, ids[i]);
+        c.setValueForKey(KEY_CAT_NAME, table.nameForID(ids[i]));
     }
-    catch (const Exception& er) {
-        cerr << "Error: " << er.what() << endl;
-    }    
     
-    return *catalog;
+    return catalog;
 }
 
 /**
@@ -126,13 +102,280 @@ vector<Category *> &Category::catalog()
  
    @return A string representing the category
  */
-string Category::getName()
+const string & Category::getName() const
 {
     return valueForKey(KEY_CAT_NAME);
 }
 
+/**
+   @brief Returns the number of products of this category
+ 
+   @return    How many (not deleted) products belong to the category
+   @see CategoryTable::productCount()
+ */
+int Category::productCount()
+{
+    int cid;
+    
+    if (!tryIntForKey(KEY_CAT_CID, cid))
+        return 0;
+    
+    return CategoryTable::instance().productCount(cid);
+}
+
 ostream& operator<<(ostream& aStream, Category & c) {    
     return aStream << right << setfill(' ') << setw(4) << 
            c.valueForKey(KEY_CAT_CID) << " | " << left << setw(30) <<
            c.valueForKey(KEY_CAT_NAME);
 }
+
+
+/**
+   @brief Default constructor
+ 
+   The table is empty until first used.
+ */
+CategoryTable::CategoryTable() : _lock(true)
+{
+    LOG_CTOR();
+    _version = 0;
+    _watermark = 0;
+    _refreshed = 0;
+    _loaded = false;
+}
+
+/**
+   @brief Ensure the table is up to date
+ 
+   The table is (re)loaded if it was never loaded or if the version 
+   of "categories" changed since last load; otherwise changes to 
+   products are synced, at most once every CATEGORY_REFRESH_INTERVAL 
+   seconds.
+ */
+void CategoryTable::validate()
+{
+    Database &db = Database::instance();
+    
+    if (!_loaded || _version != db.tableVersion("categories"))
+        load();
+    else if (time(NULL) - _refreshed >= CATEGORY_REFRESH_INTERVAL)
+        refresh();
+}
+
+/**
+   @brief Load categories and products count from the database
+ 
+   Products are fetched once, together with their category, so that 
+   counts can be computed (and later kept up to date) in memory. 
+   Nothing is fetched when the catalog snapshot is current.
+ */
+void CategoryTable::load()
+{
+    // get an instance of the database
+    Database &db = Database::instance();
+    
+    _names.clear();
+    _counts.clear();
+    _productCategory.clear();
+    _version = db.tableVersion("categories");
+    
+    // changes made while loading are applied again by refresh()
+    _watermark = Product::changeWatermark();
+    _refreshed = time(NULL);
+    
+    // the catalog snapshot, if mapped, has everything we need
+    CatalogSnapshot &snapshot = CatalogSnapshot::instance();
+    if (snapshot.isCurrent()) {
+        for (size_t i = 0; i < snapshot.categoryCount(); ++i) {
+            const CatalogSnapshot::CategoryRecord *c = snapshot.categoryAt(i);
+            _names[c->cid] = snapshot.text(c->name);
+            _counts[c->cid] = 0;
+        }
+        
+        for (size_t i = 0; i < snapshot.productCount(); ++i) {
+            const CatalogSnapshot::ProductRecord *p = snapshot.productAt(i);
+            if (p->deleted)
+                continue;
+            _productCategory[p->pid] = p->cid;
+            _counts[p->cid]++;
+        }
+        
+        _loaded = true;
+        LOG(3, "%d categories loaded from snapshot\n", (int) _names.size());
+        
+        return;
+    }
+    
+    ResultSet res;
+    if (db.select(SQL_CATEGORY_CAT, res)) {
+        for (size_t i = 0; i < res.numRows(); ++i) {
+            int cid = (int) res[i][KEY_CAT_CID];
+            _names[cid] = (string) res[i][KEY_CAT_NAME];
+            _counts[cid] = 0;
+        }
+    }
+    
+    if (db.select(SQL_CATEGORY_PRD, res)) {
+        for (size_t i = 0; i < res.numRows(); ++i) {
+            int pid = (int) res[i][0], cid = (int) res[i][1];
+            _productCategory[pid] = cid;
+            _counts[cid]++;
+        }
+        
+        _loaded = true;
+    }
+
+    LOG(3, "%d categories loaded\n", (int) _names.size());
+}
+
+/**
+   @brief Apply the changes to products since the last sync
+ 
+   Only changed rows are fetched, so the cost depends on how many 
+   products were written, not on the size of the catalog.
+ */
+void CategoryTable::refresh()
+{
+    _refreshed = time(NULL);
+    if (_watermark == 0)
+        return;
+    
+    vector<Product *> changed;
+    vector<int> removed;
+    if (!Product::changesSince(_watermark, changed, removed))
+        return;
+    
+    // a malformed row is skipped, not worth dropping the others
+    for (size_t i = 0; i < changed.size(); ++i) {
+        Product *p = changed[i];
+        int pid, cid;
+        bool isDeleted;
+        
+        if (p->tryIntForKey(KEY_PRD_PID, pid) && 
+            p->tryIntForKey(KEY_PRD_CID, cid) && 
+            p->tryBoolForKey(KEY_PRD_DELETED, isDeleted))
+            productDidChange(pid, cid, isDeleted);
+        else
+            LOG(1, "Skipped product with invalid values\n");
+    }
+    for (size_t i = 0; i < removed.size(); ++i)
+        productRemoved(removed[i]);
+    
+    for_each(changed.begin(), changed.end(), deletePtr<Product>());
+}
+
+/**
+   @brief Check if a category exists
+ 
+   @param[in]    aCid    The category ID
+   @return    True if the category exists
+ */
+bool CategoryTable::contains(int aCid)
+{
+    MutexLocker lock(_lock);
+    validate();
+    
+    return (_names.find(aCid) != _names.end());
+}
+
+/**
+   @brief Returns the name of a category
+ 
+   @param[in]    aCid    The category ID
+   @return    The category name, an empty string if not found
+ */
+string CategoryTable::nameForID(int aCid)
+{
+    MutexLocker lock(_lock);
+    validate();
+    
+    map<int, string>::const_iterator it = _names.find(aCid);
+    
+    return (it != _names.end()) ? (*it).second : "";
+}
+
+/**
+   @brief Returns the ID of all categories, in ascending order
+ 
+   @return    A vector of category IDs
+ */
+vector<int> CategoryTable::categoryIDs()
+{
+    MutexLocker lock(_lock);
+    validate();
+    
+    vector<int> ids;
+    ids.reserve(_names.size());
+    
+    map<int, string>::const_iterator it;
+    for (it = _names.begin(); it != _names.end(); it++)
+        ids.push_back((*it).first);
+    
+    return ids;
+}
+
+/**
+   @brief Returns the number of products of a category
+ 
+   @param[in]    aCid    The category ID
+   @return    How many (not deleted) products belong to the category
+ */
+int CategoryTable::productCount(int aCid)
+{
+    MutexLocker lock(_lock);
+    validate();
+    
+    map<int, int>::const_iterator it = _counts.find(aCid);
+    
+    return (it != _counts.end()) ? (*it).second : 0;
+}
+
+/**
+   @brief Keep products count up to date after a product is written
+ 
+   Moves the product to its (possibly new) category, or removes it 
+   from counts if it has been marked as deleted.
+ 
+   @param[in]    aPid        The product ID
+   @param[in]    aCid        The category of the product
+   @param[in]    isDeleted   True if the product is marked as deleted
+ */
+void CategoryTable::productDidChange(int aPid, int aCid, bool isDeleted)
+{
+    MutexLocker lock(_lock);
+    
+    if (!_loaded || aPid <= 0)
+        return;
+    
+    productRemoved(aPid);
+    if (!isDeleted) {
+        _productCategory[aPid] = aCid;
+        _counts[aCid]++;
+    }
+}
+
+/**
+   @brief Keep products count up to date after a product is deleted
+ 
+   @param[in]    aPid    The product ID
+ */
+void CategoryTable::productRemoved(int aPid)
+{
+    MutexLocker lock(_lock);
+    map<int, int>::iterator it = _productCategory.find(aPid);
+    if (it == _productCategory.end())
+        return;
+    
+    _counts[(*it).second]--;
+    _productCategory.erase(it);
+}
+
+/**
+   @brief Force a reload on next access (e.g. after the table has 
+          been altered by another process)
+ */
+void CategoryTable::invalidate()
+{
+    MutexLocker lock(_lock);
+    _loaded = false;
+}
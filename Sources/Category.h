@@ -10,9 +10,13 @@
 
 #include "common.h"
 #include "ManagedObject.h"
+#include "Mutex.h"
+#include "ResultList.h"
 
 using namespace std;
-using namespace mysqlpp;
+
+/** Seconds between two delta syncs of CategoryTable */
+#define CATEGORY_REFRESH_INTERVAL   5
 
 /**
    The class Category represents a logical group of products of the 
@@ -28,12 +32,71 @@ public:
     Category();
     static Category *categoryByID(int aCid);
     static Category *factory(string aValue);
-    static vector<Category *> & catalog();
+    static ResultList<Category> catalog();
 
     string primaryKey();
-    string getName();
+    const string & getName() const;
+    int productCount();
     
     friend ostream& operator<<(ostream &, Category &);
 };
 
+
+/**
+   The class CategoryTable keeps the whole "categories" table in 
+   memory, indexed by category ID: categories are a handful of rows 
+   which almost never change, while they are read every time a menu 
+   lists them or a product shows its category.
+ 
+   The table is loaded on first use and reloaded whenever the version 
+   of "categories" changes (i.e. after Category::store()). It also 
+   keeps the number of products of each category, updated as products 
+   are stored or deleted, so that category pickers can display counts 
+   without querying the database.
+ 
+   Products written by other processes are caught up every few 
+   seconds, fetching only the changes since the last sync.
+ 
+   The table is shared by all the threads of the process, every 
+   method holds its lock.
+ 
+   @see Database::tableVersion(), Product::changesSince()
+ */
+class CategoryTable : public Singleton<CategoryTable>
+{
+private:
+    /** Category names, indexed by category ID */
+    map<int, string> _names;
+    /** Number of (not deleted) products of each category */
+    map<int, int> _counts;
+    /** Category of each (not deleted) product */
+    map<int, int> _productCategory;
+    /** Version of table "categories" when loaded */
+    ulonglong _version;
+    /** Last change of table "products" applied, zero if unknown */
+    ulonglong _watermark;
+    time_t _refreshed;
+    bool _loaded;
+    /** Protects the whole table (recursive) */
+    Mutex _lock;
+    
+    void validate();
+    void load();
+    void refresh();
+    
+protected:
+    friend class Singleton<CategoryTable>;
+    CategoryTable();
+    
+public:
+    bool contains(int aCid);
+    string nameForID(int aCid);
+    vector<int> categoryIDs();
+    int productCount(int aCid);
+    
+    void productDidChange(int aPid, int aCid, bool isDeleted = false);
+    void productRemoved(int aPid);
+    void invalidate();
+};
+
 #endif /* __CATEGORY_H__ */
@@ -8,6 +8,7 @@
 #include "CommandLine.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
 
 /**
    @brief Default constructor
@@ -22,14 +23,21 @@
    @param[in]    argv    Array of parameters
  */
 CommandLine::CommandLine(int argc, char * const argv[]) : 
-                        _argc(argc), _argv(argv), _opts("u:p:s:d:")
+                        _argc(argc), _argv(argv), _opts("u:p:s:d:e:c:x:m:j:l:w:")
 {
     int ch;
     
     _fault = false;
     _debug = 0;
     _user = "root", _password = "secret", _server = "localhost";
-    
+    _dump = NULL;
+    _snapshot = NULL;
+    _export = false;
+    _shared = NULL;
+    _journals = NULL;
+    _listen = NULL;
+    _workers = 0;
+
     while ((ch = parseNext()) != EOF) {
         switch (ch) {
             case 'p': 
@@ -44,6 +52,32 @@ CommandLine::CommandLine(int argc, char * const argv[]) :
             case 'd':
                 _debug = atoi(optionArgument());
                 break;
+            case 'e':
+                _dump = optionArgument();
+                break;
+            case 'c':
+                _snapshot = optionArgument();
+                break;
+            case 'x':
+                _snapshot = optionArgument();
+                _export = true;
+                break;
+            case 'm':
+                _shared = optionArgument();
+                break;
+            case 'j':
+                _journals = optionArgument();
+                break;
+            case 'l':
+                _listen = optionArgument();
+                break;
+            case 'w':
+                _workers = atoi(optionArgument());
+                if (_workers <= 0) {
+                    parseError();
+                    return;
+                }
+                break;
             default:
                 parseError();
                 return;
@@ -67,7 +101,19 @@ void CommandLine::parseError()
 void CommandLine::printUsage() const 
 { 
     cerr << "usage: ec++ [ -u user ] [ -p password ] " \
-            "[ -s server ] [-d level]\n\n";
+            "[ -s server ] [-d level] [ -e dump ]\n" \
+            "            [ -c snapshot | -x snapshot ] [ -m name ]\n" \
+            "            [ -j dir ] [ -l address [ -w workers ] ]\n\n" \
+            "  -e dump       use the embedded database, loaded from dump\n" \
+            "  -c snapshot   serve the catalog from a snapshot file\n" \
+            "  -x snapshot   write a snapshot of the catalog and exit\n" \
+            "  -m name       share fetched products with local processes\n" \
+            "  -j dir        keep the journal of deferred writes in dir, an\n" \
+            "                absolute path (default /var/tmp)\n" \
+            "  -l address    serve sessions on a Unix socket (a path) or on\n" \
+            "                a TCP port ([host:]port) instead of the terminal;\n" \
+            "                a bare port is only reachable from this host\n" \
+            "  -w workers    threads running the commands of the sessions\n\n";
 }
 
 /**
@@ -100,6 +146,76 @@ const char * CommandLine::dbServer() const
     return _fault?NULL:_server; 
 }
 
+/**
+   @brief Returns the dump to load into the embedded database
+ 
+   @return The path of the dump, NULL if the MySQL server is to be used
+ */
+const char * CommandLine::embeddedDump() const 
+{ 
+    return _fault?NULL:_dump; 
+}
+
+/**
+   @brief Returns the catalog snapshot file
+ 
+   @return The path of the snapshot, NULL if not requested
+ */
+const char * CommandLine::catalogSnapshot() const 
+{ 
+    return _fault?NULL:_snapshot; 
+}
+
+/**
+   @brief Check if the catalog snapshot is to be written
+ 
+   @return True if the program should only export the snapshot
+ */
+bool CommandLine::exportSnapshot() const
+{
+    return _export;
+}
+
+/**
+   @brief Returns the name of the shared product cache
+ 
+   @return The name of the segment, NULL if not requested
+ */
+const char * CommandLine::sharedCache() const 
+{ 
+    return _fault?NULL:_shared; 
+}
+
+/**
+   @brief Returns the directory of the journals of deferred writes
+ 
+   @return The path of the directory, NULL if not given
+ */
+const char * CommandLine::journalDir() const 
+{ 
+    return _fault?NULL:_journals; 
+}
+
+/**
+   @brief Returns the address to serve sessions on
+ 
+   @return A socket path or a TCP port, NULL to use the terminal
+ */
+const char * CommandLine::listenAddress() const 
+{ 
+    return _fault?NULL:_listen; 
+}
+
+/**
+   @brief Returns the number of server workers
+ 
+   @return The number of threads, 0 if not given
+ */
+int CommandLine::workers() const
+{
+    return _workers;
+}
+
 /**
    @brief Returns debug log level
  
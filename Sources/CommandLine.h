@@ -39,6 +39,13 @@ private:
     const char *_password;
     const char *_user;
     const char *_server;
+    const char *_dump;
+    const char *_snapshot;
+    bool _export;
+    const char *_shared;
+    const char *_journals;
+    const char *_listen;
+    int _workers;
     int _debug;
     
 protected:
@@ -53,6 +60,13 @@ public:
     const char * dbUser() const;
     const char * dbPasswd() const;
     const char * dbServer() const;
+    const char * embeddedDump() const;
+    const char * catalogSnapshot() const;
+    bool exportSnapshot() const;
+    const char * sharedCache() const;
+    const char * journalDir() const;
+    const char * listenAddress() const;
+    int workers() const;
     int debugLevel();
     bool isFault();
 
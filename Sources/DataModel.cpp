@@ -7,6 +7,84 @@
 
 #include "DataModel.h"
 #include "Database.h"
+#include <algorithm>
+
+/**
+   @brief Build the descriptor of an entity
+ 
+   @param[in]    anEntity        Entity name
+   @param[in]    keys            Columns of the entity
+   @param[in]    aSchemaVersion  Version of the schema keys were read from
+ */
+EntityDescriptor::EntityDescriptor(const string & anEntity, 
+                                   const StringSet & keys, 
+                                   const string & aSchemaVersion) :
+    _entity(anEntity), _keys(keys), _schemaVersion(aSchemaVersion)
+{
+    PropertyKeys &names = PropertyKeys::instance();
+    
+    // keys are sorted: so is the index
+    StringSet::const_iterator it;
+    _ids.reserve(_keys.size());
+    for (it = _keys.begin(); it != _keys.end(); it++)
+        _ids.push_back(make_pair(*it, names.intern(*it)));
+}
+
+/**
+   @brief Returns the entity name
+ */
+const string & EntityDescriptor::entity() const
+{
+    return _entity;
+}
+
+/**
+   @brief Returns the columns of the entity
+ 
+   @return    A set of string representing table columns
+   @see StringSet
+ */
+const StringSet & EntityDescriptor::keys() const
+{
+    return _keys;
+}
+
+/**
+   @brief Check if the entity has a column
+ 
+   @param[in]    aKey    The column name
+   @return    True if the column exists
+ */
+bool EntityDescriptor::hasKey(const StringRef & aKey) const
+{
+    return (keyID(aKey) != KEY_NONE);
+}
+
+/**
+   @brief Returns the interned ID of a column
+ 
+   @param[in]    aKey    The column name
+   @return    The ID of the column, KEY_NONE if the entity hasn't it
+ */
+KeyID EntityDescriptor::keyID(const StringRef & aKey) const
+{
+    vector< pair<string, KeyID> >::const_iterator it = 
+        lower_bound(_ids.begin(), _ids.end(), aKey, PairKeyLess());
+    
+    if (it == _ids.end() || StringRef((*it).first) != aKey)
+        return KEY_NONE;
+    
+    return (*it).second;
+}
+
+/**
+   @brief Returns the version of the schema the descriptor was read from
+ */
+const string & EntityDescriptor::schemaVersion() const
+{
+    return _schemaVersion;
+}
+
 
 /**
    @brief Default constructor
@@ -14,6 +92,8 @@
 DataModel::DataModel()
 {
     LOG_CTOR();
+    _checked = 0;
+    _interval = DATAMODEL_CHECK_INTERVAL;
 }
 
 /**
@@ -27,54 +107,105 @@ DataModel::~DataModel()
     _models.clear();
 }
 
+/**
+   @brief Drop all descriptors if the schema changed
+ 
+   The schema version is asked to the database at most once every 
+   check interval. Tables of the dropped descriptors are marked as 
+   changed, since cached reads of them hold the old columns.
+ 
+   @note Must be called with _lock held
+ */
+void DataModel::checkSchema()
+{
+    time_t now = time(NULL);
+    if (now - _checked < _interval)
+        return;
+    _checked = now;
+    
+    // get an instance of the database
+    Database & db = Database::instance();
+    string version = db.schemaVersion();
+    if (version == _schemaVersion)
+        return;
+    
+    if (!_schemaVersion.empty()) {
+        LOG(1, "Schema changed, reloading data model\n");
+        
+        map<std::string, EntityDescriptorPtr>::const_iterator it;
+        for (it = _models.begin(); it != _models.end(); it++)
+            db.tableDidChange((*it).first);
+        _models.clear();
+    }
+    _schemaVersion = version;
+}
+
 /**
    @brief Ask for the data model of given entity
  
-   The first time the method keysForEntity() is called, the class 
-   asks the database for attributes list of given entity, while
+   The first time the method descriptorForEntity() is called, the 
+   class asks the database for attributes list of given entity, while
    immediately returns the same information whenever the same question is
-   issued again. 
+   issued again (until the schema changes). 
  
    @param[in]    anEntity    Entity name
-   @return    A set of string representing table columns
+   @return    The descriptor of the entity: it has no keys if the 
+              entity couldn't be read
  
-   @see StringSet
+   @see EntityDescriptor
  */
-StringSet & DataModel::keysForEntity(string anEntity)
+EntityDescriptorPtr DataModel::descriptorForEntity(const string & anEntity)
 {
-    map<std::string, StringSet *>::const_iterator it = _models.find(anEntity);
+    MutexLocker lock(_lock);
+    checkSchema();
+    
+    map<std::string, EntityDescriptorPtr>::const_iterator it = 
+        _models.find(anEntity);
     if (it != _models.end()) {
         LOG(3, "Data model for entity '%s' found in cache.\n", anEntity.c_str());
-        StringSet *ss = (*it).second;
         
-        return *ss;
+        return (*it).second;
     }
     
     // get an instance of the database
     Database & db = Database::instance();
-    StringSet *ss = new StringSet();
+    StringSet ss;
     
-    try {
-        // ask Database for a valid connection to mySQL
-        Connection *conn = db.getConnection();
-        
-        // obtain an instance of mysqlpp::Query and init it
-        Query q = conn->query("SELECT * FROM " + anEntity);
-        StoreQueryResult res = q.store();
-        
-        for (size_t i = 0; i < res.field_names()->size(); i++) {
-            ss->insert(res.field_name(i).c_str());
+    // no record is needed, column names are enough
+    ResultSet res;
+    bool found = db.select("SELECT * FROM " + anEntity + " LIMIT 0", res);
+    if (found) {
+        for (size_t i = 0; i < res.numFields(); i++) {
+            ss.insert(res.fieldName(i));
         }
-        
-        _models.insert(pair<string, StringSet *>(anEntity, ss));
-    }
-    catch (const mysqlpp::BadQuery& er) {
-        cerr << "Query error: " << er.what() << endl;
-    }
-    catch (const mysqlpp::Exception& er) {
-        cerr << "Error: " << er.what() << endl;
     }
+    
+    EntityDescriptorPtr descriptor(new EntityDescriptor(anEntity, ss, 
+                                                        _schemaVersion));
+    if (found)
+        _models[anEntity] = descriptor;
     LOG(3, "Data model for entity '%s' loaded.\n", anEntity.c_str());
     
-    return *ss;
+    return descriptor;
+}
+
+/**
+   @brief Change how often the schema is checked
+ 
+   @param[in]    aValue  Seconds between two checks, zero to check 
+                         at every request
+ */
+void DataModel::setCheckInterval(time_t aValue)
+{
+    MutexLocker lock(_lock);
+    _interval = aValue;
+}
+
+/**
+   @brief Check the schema on next request, regardless of the interval
+ */
+void DataModel::reload()
+{
+    MutexLocker lock(_lock);
+    _checked = 0;
 }
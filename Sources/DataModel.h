@@ -8,10 +8,51 @@
 #ifndef __DATAMODEL_H__
 #define __DATAMODEL_H__
 
+#include <ctime>
+#include <tr1/memory>
 #include "common.h"
+#include "Mutex.h"
+#include "Observable.h"
+#include "StringRef.h"
 
 using namespace std;
 
+/** Default number of seconds between two checks of the schema */
+#define DATAMODEL_CHECK_INTERVAL    30
+
+/**
+   An EntityDescriptor lists the properties (columns) of an entity, 
+   as read from the schema at a given time. Descriptors are never 
+   changed once built: when the schema changes, a new descriptor 
+   replaces the old one in DataModel, while objects already created 
+   keep a reference to the one they were built with.
+ 
+   Column names are interned when the descriptor is built, so that 
+   objects notify their observers by key ID (see PropertyKeys). They 
+   are looked up by StringRef: checking a key doesn't build a string.
+ */
+class EntityDescriptor
+{
+private:
+    string _entity;
+    StringSet _keys;
+    /** Interned ID of each key, sorted by key */
+    vector< pair<string, KeyID> > _ids;
+    string _schemaVersion;
+    
+public:
+    EntityDescriptor(const string & anEntity, const StringSet & keys, 
+                     const string & aSchemaVersion);
+    
+    const string & entity() const;
+    const StringSet & keys() const;
+    bool hasKey(const StringRef & aKey) const;
+    KeyID keyID(const StringRef & aKey) const;
+    const string & schemaVersion() const;
+};
+
+typedef tr1::shared_ptr<const EntityDescriptor> EntityDescriptorPtr;
+
 /**
    An DataModel object describes a schema — a collection of entities
    (data models) that you use in your application.
@@ -19,11 +60,24 @@ using namespace std;
    in the schema. Each entity name object has property description 
    objects that represent the properties (or fields) of the entity 
    in the schema.
+ 
+   Every few seconds a single metadata query tells if the schema 
+   changed (see Database::schemaVersion()): if so, all descriptors 
+   are dropped at once and read again on demand, so that running 
+   sessions pick up new columns without being restarted.
  */
 class DataModel : public Singleton<DataModel>
 {
 private:
-    map<std::string, StringSet *> _models;
+    map<std::string, EntityDescriptorPtr> _models;
+    /** Version of the schema the descriptors were read from */
+    string _schemaVersion;
+    time_t _checked;
+    time_t _interval;
+    /** Protects all of the above */
+    Mutex _lock;
+    
+    void checkSchema();
 
 protected:
     friend class Singleton<DataModel>;
@@ -31,7 +85,9 @@ protected:
     virtual ~DataModel();
     
 public:
-    StringSet & keysForEntity(string anEntity);
+    EntityDescriptorPtr descriptorForEntity(const string & anEntity);
+    void setCheckInterval(time_t aValue);
+    void reload();
 };
 
 #endif /* __DATAMODEL_H__ */
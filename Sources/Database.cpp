@@ -6,6 +6,11 @@
  */
 
 #include "Database.h"
+#include "MySQLBackend.h"
+#include "SQLiteBackend.h"
+
+/** Connection of the calling thread, if it has its own */
+static __thread StorageBackend *threadConnection = NULL;
 
 /**
    @brief Default constructor
@@ -21,7 +26,7 @@ Database::Database()
     setPassword("secret");
     setDB("seng");
     
-    _conn = NULL;
+    _backend = NULL;
 }
 
 /**
@@ -47,23 +52,52 @@ Database::~Database()
  */
 bool Database::connect()
 {    
-    if (_conn)
+    if (_backend)
         disconnect();
     
-    try {
-        _conn = new Connection(false);
-        _conn->set_option(new MultiStatementsOption(true));
-        _conn->connect(_db.c_str(), 0, _user.c_str(), _passwd.c_str());        
-    }
-    catch (std::exception &e) {
-        cerr << "unable to connect to database ("
-             << _conn->error() << endl;
-        delete _conn;
+    _backend = createBackend();
+    if (!_backend)
+        return false;
+    
+    if (!_backend->connect()) {
+        delete _backend;
+        _backend = NULL;
         
         return false;
     }
     
-    return _conn->connected();
+    LOG(2, "Connected to %s storage backend\n", _backend->name());
+    
+    return true;
+}
+
+/**
+   @brief Build the storage backend, according to the settings
+ 
+   The embedded backend is used when a dump to load has been given, 
+   the MySQL one otherwise.
+ 
+   @return    A new backend, not yet connected (NULL if the required 
+              backend has not been compiled in)
+   @see setEmbedded()
+ */
+StorageBackend *Database::createBackend()
+{
+    if (!_dump.empty()) {
+#ifdef HAVE_SQLITE3
+        return new SQLiteBackend(_dump);
+#else
+        cerr << "embedded backend not available in this build\n";
+        return NULL;
+#endif
+    }
+    
+#ifdef HAVE_MYSQLPP
+    return new MySQLBackend(_server, _user, _passwd, _db);
+#else
+    cerr << "MySQL backend not available in this build\n";
+    return NULL;
+#endif
 }
 
 /**
@@ -71,21 +105,70 @@ bool Database::connect()
  */
 void Database::disconnect()
 {
-    if (_conn) {
-        _conn->disconnect();
-        delete _conn;
-        _conn = NULL;
+    if (_backend) {
+        _backend->disconnect();
+        delete _backend;
+        _backend = NULL;
     }
 }
 
 /**
-   @brief Return a connection to the database
+   @brief Return the backend used by the main thread
  
-   @return An instance of mysqlpp::Connection
+   @return The storage backend, NULL if not connected
  */
-Connection *Database::getConnection() 
+StorageBackend *Database::backend() 
 { 
-    return _conn; 
+    return _backend; 
+}
+
+/**
+   @brief Return the backend statements of the calling thread run on
+ 
+   @return The connection of the thread, if set with 
+           setThreadConnection(), the main backend otherwise
+ */
+StorageBackend *Database::connection()
+{
+    return threadConnection ? threadConnection : _backend;
+}
+
+/**
+   @brief Give the calling thread a connection of its own
+ 
+   From now on, statements run by the thread through this class use 
+   aBackend instead of the main one, so that worker threads can share 
+   the entity layer. The caller keeps the ownership of the backend.
+ 
+   @param[in]    aBackend    A connection returned by newConnection(), 
+                             NULL to go back to the main backend
+ */
+void Database::setThreadConnection(StorageBackend *aBackend)
+{
+    threadConnection = aBackend;
+}
+
+/**
+   @brief Open a new connection to the database
+ 
+   Threads other than the main one can't share the backend returned
+   by backend(): this method opens a private one, using the same 
+   settings.
+ 
+   @return    A new, connected, backend (to be deleted by the caller), 
+              NULL on failure
+ */
+StorageBackend *Database::newConnection()
+{
+    StorageBackend *conn = (_backend ? _backend->clone() : createBackend());
+    
+    if (conn && !conn->connect()) {
+        delete conn;
+        
+        return NULL;
+    }
+    
+    return conn;
 }
 
 /**
@@ -158,9 +241,27 @@ void Database::setDB(string aValue)
     if (_db != aValue) {
         _db = aValue;
         
-        if (isConnected()) {
-            _conn->select_db(_db);
-        }        
+        if (isConnected())
+            disconnect();
+    }
+}
+
+/**
+   @brief Use the embedded backend
+ 
+   The database is built in memory from the given dump at connect(), 
+   no server is needed. Pass an empty string to go back to MySQL.
+ 
+   @param[in]    aDump   Path of the dump to load
+   @see SQLiteBackend
+ */
+void Database::setEmbedded(string aDump)
+{
+    if (_dump != aDump) {
+        _dump = aDump;
+        
+        if (isConnected())
+            disconnect();
     }
 }
 
@@ -171,7 +272,9 @@ void Database::setDB(string aValue)
  */
 bool Database::isConnected() 
 {
-    return ((_conn) && (_conn->connected()));
+    StorageBackend *conn = connection();
+    
+    return ((conn) && (conn->isConnected()));
 }
 
 /**
@@ -183,7 +286,7 @@ bool Database::isConnected()
    @param[in]    widths Vector of column widths
    @param[in]    row The row to be printed
  */
-void Database::printRow(IntVector & widths, Row & row)
+void Database::printRow(IntVector & widths, const Record & row)
 {
     cout << "  |" << setfill(' ');
     for (size_t i = 0; i < row.size(); ++i) {
@@ -201,27 +304,273 @@ void Database::printRow(IntVector & widths, Row & row)
    @param[in]    res The result set
    @see    printRow()
  */
-void Database::printResult(StoreQueryResult& res)
+void Database::printResult(const ResultSet & res)
 {
-    StoreQueryResult::size_type num_results = res.size();
-    if (!res || (num_results == 0)) {
+    size_t num_results = res.numRows();
+    if (num_results == 0) {
         return;
     }
     
     IntVector widths;
-    size_t size = res.num_fields();
+    size_t size = res.numFields();
     for (size_t i = 0; i < size; i++) {
-        widths.push_back(max(res.field(i).max_length(), 
-                             res.field_name(i).size()));
+        widths.push_back(max(res.maxLength(i), 
+                             res.fieldName(i).size()));
     }
 
-    for (StoreQueryResult::size_type i = 0; i < num_results; ++i) {
+    for (size_t i = 0; i < num_results; ++i) {
         printRow(widths, res[i]);
     }
 }
 
+/**
+   @brief Expand the placeholders of a statement
+ 
+   %N is replaced by the N-th parameter as it is, %Nq by the parameter 
+   quoted and escaped by the backend; any other % is left untouched 
+   (DATE_FORMAT patterns, LIKE wildcards).
+ 
+   @param[in]    aSql    The statement
+   @param[in]    params  Values of the placeholders
+   @return    The statement, ready to be run
+ */
+string Database::format(const string & aSql, const SqlParams & params)
+{
+    if (params.empty())
+        return aSql;
+    
+    string sql;
+    size_t i = 0;
+    
+    sql.reserve(aSql.size() + 16 * params.size());
+    while (i < aSql.size()) {
+        size_t j = i + 1;
+        
+        if (aSql[i] != '%' || j >= aSql.size() || !isdigit(aSql[j])) {
+            sql += aSql[i++];
+            continue;
+        }
+        
+        size_t n = 0;
+        while (j < aSql.size() && isdigit(aSql[j]))
+            n = n * 10 + (aSql[j++] - '0');
+        
+        if (n >= params.size()) {
+            LOG(1, "Missing parameter %u in: %s\n", (unsigned) n, 
+                aSql.c_str());
+            sql += aSql.substr(i, j - i);
+        } else if (j < aSql.size() && aSql[j] == 'q') {
+            sql += quote(params[n]);
+            j++;
+        } else {
+            sql += params[n];
+        }
+        i = j;
+    }
+    
+    return sql;
+}
+
+/**
+   @brief Quote and escape a value for the current backend
+ 
+   @param[in]    aValue  The value
+   @return    The SQL string literal
+ */
+string Database::quote(const string & aValue)
+{
+    return connection()->quote(aValue);
+}
+
+/**
+   @brief Run a statement returning records
+ 
+   @param[in]    aSql    The statement, with %N placeholders if params
+                         are given
+   @param[out]   res     The first result set of the statement
+   @param[in]    params  Values of the placeholders
+   @return    True if successful
+ */
+bool Database::select(const string & aSql, ResultSet & res, 
+                      const SqlParams & params)
+{
+    ResultSets all;
+    
+    if (!selectAll(aSql, all, params))
+        return false;
+    
+    res = (all.empty() ? ResultSet() : all.front());
+    
+    return true;
+}
+
+/**
+   @brief Run a statement returning multiple result sets (such as a 
+          stored procedure)
+ 
+   @param[in]    aSql    The statement, with %N placeholders if params
+                         are given
+   @param[out]   res     All the result sets of the statement
+   @param[in]    params  Values of the placeholders
+   @return    True if successful
+ */
+bool Database::selectAll(const string & aSql, ResultSets & res, 
+                         const SqlParams & params)
+{
+    string sql = format(aSql, params);
+    
+    LOG(3, "Query: %s\n", sql.c_str());
+    StorageBackend *conn = connection();
+    if (!conn->query(sql, res)) {
+        cerr << "Query failed: " << conn->error() << endl;
+        return false;
+    }
+    
+    return true;
+}
+
+/**
+   @brief Run a statement returning no records
+ 
+   @param[in]    aSql        The statement, with %N placeholders if 
+                             params are given
+   @param[in]    params      Values of the placeholders
+   @param[out]   rows        Number of affected rows, if not NULL
+   @param[out]   insertID    Last generated key, if not NULL
+   @return    True if successful
+ */
+bool Database::execute(const string & aSql, const SqlParams & params,
+                       ulonglong *rows, ulonglong *insertID)
+{
+    string sql = format(aSql, params);
+    
+    LOG(3, "Execute: %s\n", sql.c_str());
+    StorageBackend *conn = connection();
+    if (!conn->execute(sql, rows, insertID)) {
+        cerr << "Query failed: " << conn->error() << endl;
+        return false;
+    }
+    
+    return true;
+}
+
+/**
+   @brief Run a read-only statement through the query cache
+ 
+   If the statement (with the same parameters) was already executed 
+   and none of the tables it reads has been written since, the cached 
+   result is returned without contacting the database server.
+ 
+   @param[in]    aSql    The statement, with %N placeholders if params
+                         are given
+   @param[in]    tables  Comma separated list of tables read by the 
+                         statement (views must be expanded)
+   @param[in]    params  Values of the placeholders
+   @return    The first result set of the statement
+   @see cachedStoreAll(), tableDidChange()
+ */
+ResultSet Database::cachedStore(const string & aSql, 
+                                const string & tables,
+                                const SqlParams & params)
+{
+    ResultSets res = cachedStoreAll(aSql, tables, params);
+    
+    return (res.empty() ? ResultSet() : res.front());
+}
+
+/**
+   @brief Run a statement returning multiple result sets (such as a 
+          stored procedure) through the query cache
+ 
+   @param[in]    aSql    The statement, with %N placeholders if params
+                         are given
+   @param[in]    tables  Comma separated list of tables read by the 
+                         statement
+   @param[in]    params  Values of the placeholders
+   @return    All the result sets returned by the statement
+   @see cachedStore()
+ */
+ResultSets Database::cachedStoreAll(const string & aSql, 
+                                    const string & tables,
+                                    const SqlParams & params)
+{
+    string key = QueryCache::makeKey(aSql, params);
+    ResultSets res;
+    
+    if (_cache.lookup(key, res)) {
+        LOG(3, "Query cache hit: %s\n", key.c_str());
+        return res;
+    }
+    
+    // versions are taken first: a write committed while the statement 
+    // runs keeps its result out of the cache
+    QueryCache::TableVersions versions = _cache.versions(tables);
+    
+    // failures are not cached
+    if (!selectAll(aSql, res, params))
+        return res;
+    
+    _cache.insert(key, versions, res);
+    
+    return res;
+}
+
+/**
+   @brief Notify that a table has been written
+ 
+   All cached results built from the table are invalidated: this 
+   method must be called after any statement altering the table 
+   (ManagedObject::store() and ManagedObject::update() already do it).
+ 
+   @param[in]    aTable  The name of the table
+ */
+void Database::tableDidChange(const string & aTable)
+{
+    _cache.tableDidChange(aTable);
+}
+
+/**
+   @brief Returns the version of a table
+ 
+   The version is increased by tableDidChange(): comparing two 
+   versions tells if the table was written in the meanwhile.
+ 
+   @param[in]    aTable  The name of the table
+   @return    The current version of the table
+ */
+ulonglong Database::tableVersion(const string & aTable) const
+{
+    return _cache.tableVersion(aTable);
+}
+
+/**
+   @brief Returns the version of the schema
+ 
+   @return    A value which changes whenever a table is altered, an 
+              empty string if the backend can't tell
+   @see StorageBackend::schemaVersion()
+ */
+string Database::schemaVersion()
+{
+    StorageBackend *conn = connection();
+    
+    return conn ? conn->schemaVersion() : "";
+}
+
+/**
+   @brief Returns the query cache, to inspect its statistics or to 
+          tune its memory budget
+ 
+   @return    The query cache
+ */
+QueryCache & Database::queryCache()
+{
+    return _cache;
+}
+
 ostream& operator<<(ostream& aStream, Database& d) {
     return  aStream << "Connection to database is" << 
-    (d._conn->connected()?"":" NOT") << " established\n";
+    (d.isConnected()?"":" NOT") << " established" << 
+    (d._backend ? string(" (") + d._backend->name() + ")" : "") << "\n" << 
+    d._cache;
 }
-
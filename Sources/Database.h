@@ -8,12 +8,11 @@
 #ifndef __DATABASE_H__
 #define __DATABASE_H__
 
-#include <mysql++.h>
-#include <query.h>
 #include "common.h"
+#include "Storage.h"
+#include "QueryCache.h"
 
 using namespace std;
-using namespace mysqlpp;
 
 /**
    Manages the connection to the database server.
@@ -22,22 +21,33 @@ using namespace mysqlpp;
    Database needs to be initialized early, such as in your main, 
    with default parameter (use private constructor).
     
-   @see Singleton
+   Statements are run by a storage backend: MySQL by default, or the 
+   embedded one if a dump to load has been given with setEmbedded(). 
+   The entity layer only talks to this class.
+    
+   Worker threads can be given a connection of their own with 
+   setThreadConnection(): statements they run go through it, while the 
+   query cache and the settings stay shared.
+    
+   @see Singleton, StorageBackend
  */
 class Database : public Singleton<Database>
 {
 private:    
-    Connection *_conn;
+    StorageBackend *_backend;
     string _server;
     string _user;
     string _passwd;
     string _db;
+    string _dump;
+    QueryCache _cache;
     
 protected:
     friend class Singleton<Database>;
     Database();
     
-    void printRow(IntVector & widths, Row& row);
+    void printRow(IntVector & widths, const Record & row);
+    StorageBackend *createBackend();
     
 public:
     virtual ~Database();
@@ -45,14 +55,36 @@ public:
     bool isConnected();
     bool connect();
     void disconnect();    
-    Connection *getConnection();
-    void printResult(StoreQueryResult& res);
+    StorageBackend *backend();
+    StorageBackend *connection();
+    StorageBackend *newConnection();
+    void setThreadConnection(StorageBackend *aBackend);
+    void printResult(const ResultSet & res);
+    
+    string format(const string & aSql, const SqlParams & params);
+    bool select(const string & aSql, ResultSet & res, 
+                const SqlParams & params = SqlParams());
+    bool selectAll(const string & aSql, ResultSets & res, 
+                   const SqlParams & params = SqlParams());
+    bool execute(const string & aSql, const SqlParams & params = SqlParams(),
+                 ulonglong *rows = NULL, ulonglong *insertID = NULL);
+    string quote(const string & aValue);
+    
+    ResultSet cachedStore(const string & aSql, const string & tables,
+                          const SqlParams & params = SqlParams());
+    ResultSets cachedStoreAll(const string & aSql, const string & tables,
+                              const SqlParams & params = SqlParams());
+    void tableDidChange(const string & aTable);
+    ulonglong tableVersion(const string & aTable) const;
+    string schemaVersion();
+    QueryCache & queryCache();
     
     void setServer(string aValue);
     void setUser(string aValue);
     void setPassword(string aValue);
     void setDB(string aValue);
-    
+    void setEmbedded(string aDump);
+
     friend ostream& operator<<(ostream &, Database &);
 };    
 
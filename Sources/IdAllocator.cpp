@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#include "IdAllocator.h"
+#include "Database.h"
+
+#define SQL_NEXT_ID_BLOCK   "CALL next_id_block(%0q)"
+
+/**
+   @brief Class constructor
+
+   No block is reserved until the first ID is requested.
+
+   @param[in]    aSequence   Name of the sequence, such as "orders"
+ */
+IdAllocator::IdAllocator(const string & aSequence) : _sequence(aSequence)
+{
+    LOG_CTOR();
+    _state = 0;
+    _blockSize = 0;
+}
+
+/**
+   @brief Returns a new unique ID
+
+   The reservation of a new block is attempted ID_BLOCK_ATTEMPTS times.
+
+   @return    The ID, zero if no block could be reserved: the caller
+              must then give up its write
+ */
+unsigned long long IdAllocator::next()
+{
+    int failures = 0;
+
+    for (;;) {
+        // the size is read first: once it's set, the state holds a block
+        unsigned long long size = _blockSize;
+        __sync_synchronize();
+
+        unsigned long long state = __sync_fetch_and_add(&_state, 1);
+        unsigned long long hi = state >> 32, lo = state & 0xffffffffULL;
+
+        if (size && lo < size)
+            return hi * size + lo;
+
+        // block exhausted (or never reserved): get a new one
+        if (!refill(hi) && ++failures == ID_BLOCK_ATTEMPTS) {
+            LOG(1, "No block of sequence '%s' available\n",
+                _sequence.c_str());
+            return 0;
+        }
+    }
+}
+
+/**
+   @brief Reserve a new block of IDs
+
+   Several threads can find the same block exhausted: only the first
+   one asks the database for a new block, the others just retry.
+
+   @param[in]    anExhausted Index of the block found exhausted
+   @return    True if a block is available
+ */
+bool IdAllocator::refill(unsigned long long anExhausted)
+{
+    MutexLocker lock(_lock);
+
+    // somebody else already replaced the exhausted block
+    unsigned long long state = _state;
+    if (_blockSize && ((state >> 32) != anExhausted ||
+                       (state & 0xffffffffULL) < _blockSize))
+        return true;
+
+    // get an instance of the database
+    Database &db = Database::instance();
+
+    // the status of the procedure call is fetched (and ignored) too
+    ResultSet res;
+    if (!db.select(SQL_NEXT_ID_BLOCK, res, SqlParams() << _sequence))
+        return false;
+
+    if (res.empty() || (int) res[0]["block_size"] <= 0) {
+        LOG(2, "Sequence '%s' not found\n", _sequence.c_str());
+        return false;
+    }
+
+    // the block is published before its size, see next()
+    unsigned long long hi = (int) res[0]["hi"];
+    __sync_lock_test_and_set(&_state, hi << 32);
+    __sync_synchronize();
+    _blockSize = (int) res[0]["block_size"];
+
+    LOG(3, "Reserved block %llu of sequence '%s'\n", hi,
+        _sequence.c_str());
+
+    return true;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#ifndef __IDALLOCATOR_H__
+#define __IDALLOCATOR_H__
+
+#include <string>
+#include "Mutex.h"
+
+using namespace std;
+
+/** Attempts at reserving a block before next() gives up */
+#define ID_BLOCK_ATTEMPTS   3
+
+/**
+   @brief Block based(hi/lo) allocation of unique IDs
+
+   The class IdAllocator hands out unique IDs for an entity without
+   asking the database for each of them: a whole block of IDs is
+   reserved from table "sequences" with a single call to the stored
+   procedure "next_id_block", then IDs are returned one after the
+   other. Being the block exclusively owned by this process, there's
+   no contention with other sessions, nor any need to wait for an
+   AUTO_INCREMENT value before writing related rows.
+
+   The block index (hi) and the position inside the block (lo) are
+   packed in a single word updated with atomic operations, so IDs are
+   handed out without locks; only the refill of an exhausted block is
+   serialized.
+
+   IDs taken from blocks must not be mixed with AUTO_INCREMENT values
+   of the same table: those would fall in a block another process may
+   reserve next. When no block can be reserved the write must fail.
+ */
+class IdAllocator
+{
+private:
+    /** Name of the sequence (row of table "sequences") */
+    string _sequence;
+    /** Current block index (high 32 bits) and next position (low) */
+    volatile unsigned long long _state;
+    /** Number of IDs in each block */
+    volatile unsigned long long _blockSize;
+    /** Serializes block refills */
+    Mutex _lock;
+
+    bool refill(unsigned long long anExhausted);
+
+public:
+    IdAllocator(const string & aSequence);
+
+    unsigned long long next();
+};
+
+#endif /* __IDALLOCATOR_H__ */
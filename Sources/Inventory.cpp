@@ -0,0 +1,484 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#include "Inventory.h"
+#include "Database.h"
+#include "WriteBehind.h"
+#include "SharedCache.h"
+
+#define SQL_INVENTORY_LOAD  "SELECT pid, availability FROM products " \
+                            "WHERE deleted = 0"
+#define SQL_INVENTORY_PID   "SELECT availability FROM products " \
+                            "WHERE deleted = 0 AND pid = %0"
+
+/**
+   @brief Default constructor
+ */
+Inventory::Inventory()
+{
+    LOG_CTOR();
+    _lastReservation = 0;
+    _oldestSale = 0;
+    _ttl = INVENTORY_RESERVATION_TTL;
+    _batchSize = INVENTORY_BATCH_SIZE;
+}
+
+/**
+   @brief Default destructor
+
+   @note Units sold and not yet written back are lost: call flush()
+         before the program ends.
+ */
+Inventory::~Inventory()
+{
+    LOG_DTOR();
+
+    map<int, Stock *>::iterator it;
+    for (it = _stock.begin(); it != _stock.end(); it++)
+        delete (*it).second;
+}
+
+/**
+   @brief Align the in-memory stock with the database
+
+   Availability of all products is fetched in a single query: units
+   currently reserved or sold but not yet written back are subtracted.
+   Queued stock adjustments are applied first, so they aren't lost.
+   Call this method at startup, after the connection to the database
+   has been established.
+   The counters are moved by the difference rather than overwritten: 
+   reservations and restocks change them under the same lock, so the 
+   units counted in the reservations are exactly those taken.
+
+   @return    True if successful
+ */
+bool Inventory::reconcile()
+{
+    // get an instance of the database
+    Database &db = Database::instance();
+    ResultSet res;
+
+    if (!WriteBehind::instance().drain())
+        return false;
+
+    if (!db.select(SQL_INVENTORY_LOAD, res))
+        return false;
+
+    MutexLocker lock(_lock);
+
+    // units put aside for customers are not available
+    map<int, int> reserved;
+    map<unsigned long, Reservation>::const_iterator rit;
+    for (rit = _reservations.begin(); rit != _reservations.end(); rit++)
+        reserved[(*rit).second.pid] += (*rit).second.qty;
+
+    for (size_t i = 0; i < res.numRows(); i++) {
+        int pid = (int) res[i][0];
+        int qty = (int) res[i][1];
+
+        Stock *s = _stock[pid];
+        if (!s) {
+            s = _stock[pid] = new Stock;
+            s->available = 0;
+            s->sold = 0;
+        }
+        int current = __atomic_load_n(&s->available, __ATOMIC_RELAXED);
+        __sync_fetch_and_add(&s->available, 
+                             qty - reserved[pid] - s->sold - current);
+    }
+
+    LOG(2, "Inventory reconciled: %d products\n", (int) res.numRows());
+
+    return true;
+}
+
+/**
+   @brief Returns the stock of a product
+
+   Products not yet known (e.g. added after reconcile()) are fetched
+   from the database the first time they're requested.
+
+   @param[in]    aPid    The product ID
+   @return    The stock of the product, NULL if not found or deleted
+ */
+Inventory::Stock *Inventory::stockFor(int aPid)
+{
+    MutexLocker lock(_lock);
+
+    map<int, Stock *>::const_iterator it = _stock.find(aPid);
+    if (it != _stock.end())
+        return (*it).second;
+
+    // get an instance of the database
+    Database &db = Database::instance();
+
+    ResultSet res;
+    if (!db.select(SQL_INVENTORY_PID, res, SqlParams() << aPid) || 
+        res.empty())
+        return NULL;
+
+    Stock *s = new Stock;
+    s->available = (int) res[0][0];
+    s->sold = 0;
+    _stock[aPid] = s;
+
+    return s;
+}
+
+/**
+   @brief Atomically remove units from the available stock
+
+   @param[in]    s       The stock of the product
+   @param[in]    aQty    Units to take
+   @return    True if enough units were available
+ */
+bool Inventory::take(Stock *s, int aQty)
+{
+    int current;
+
+    do {
+        current = __atomic_load_n(&s->available, __ATOMIC_RELAXED);
+        if (current < aQty)
+            return false;
+    } while (!__sync_bool_compare_and_swap(&s->available, current,
+                                           current - aQty));
+
+    return true;
+}
+
+/**
+   @brief Atomically put units back into the available stock
+
+   @param[in]    s       The stock of the product
+   @param[in]    aQty    Units to give back
+ */
+void Inventory::give(Stock *s, int aQty)
+{
+    __sync_fetch_and_add(&s->available, aQty);
+}
+
+/**
+   @brief Returns how many units of a product can be reserved
+
+   @param[in]    aPid    The product ID
+   @return    Units available
+ */
+int Inventory::available(int aPid)
+{
+    Stock *s = stockFor(aPid);
+
+    return s ? __atomic_load_n(&s->available, __ATOMIC_RELAXED) : 0;
+}
+
+/**
+   @brief Reserve units of a product
+
+   @param[in]    aPid    The product ID
+   @param[in]    aQty    Units to reserve
+   @return    The reservation ID, zero if not enough units are available
+ */
+unsigned long Inventory::reserve(int aPid, int aQty)
+{
+    if (aQty <= 0)
+        return 0;
+
+    // expired reservations could free the units we need
+    releaseExpired();
+
+    Stock *s = stockFor(aPid);
+    if (!s)
+        return 0;
+
+    // reconcile() must never see the units taken but not yet reserved
+    MutexLocker lock(_lock);
+    if (!take(s, aQty))
+        return 0;
+
+    Reservation r;
+    r.pid = aPid;
+    r.qty = aQty;
+    r.expires = time(NULL) + _ttl;
+
+    unsigned long rid = __sync_add_and_fetch(&_lastReservation, 1);
+    _reservations[rid] = r;
+    LOG(3, "Reservation #%lu: %d unit(s) of product %d\n", rid, aQty, aPid);
+
+    return rid;
+}
+
+/**
+   @brief Change the quantity of a reservation
+
+   The expiry of the reservation is renewed; a quantity less or equal
+   to zero releases the reservation.
+
+   @param[in]    aRid    The reservation ID
+   @param[in]    aQty    The new quantity
+   @return    True if successful, false if the reservation doesn't
+              exist or not enough units are available
+ */
+bool Inventory::adjust(unsigned long aRid, int aQty)
+{
+    if (aQty <= 0) {
+        release(aRid);
+        return true;
+    }
+
+    MutexLocker lock(_lock);
+
+    map<unsigned long, Reservation>::iterator it = _reservations.find(aRid);
+    if (it == _reservations.end())
+        return false;
+
+    Reservation & r = (*it).second;
+    Stock *s = _stock[r.pid];
+    int delta = aQty - r.qty;
+
+    if (delta > 0 && !take(s, delta))
+        return false;
+    if (delta < 0)
+        give(s, -delta);
+
+    r.qty = aQty;
+    r.expires = time(NULL) + _ttl;
+
+    return true;
+}
+
+/**
+   @brief Check if a reservation is still alive
+
+   @param[in]    aRid    The reservation ID
+   @return    True if the reservation exists and is not expired
+ */
+bool Inventory::isValid(unsigned long aRid)
+{
+    MutexLocker lock(_lock);
+
+    map<unsigned long, Reservation>::const_iterator it;
+    it = _reservations.find(aRid);
+
+    return (it != _reservations.end() && (*it).second.expires > time(NULL));
+}
+
+/**
+   @brief Turn a reservation into a sale
+
+   Reserved units are scheduled to be written back to the database:
+   the write-back happens when enough products have been sold or the
+   oldest sale waited too long. If the sale has already decreased the
+   availability stored in the database (see Order::create()), units
+   are simply removed from the stock.
+
+   @param[in]    aRid        The reservation ID
+   @param[in]    isPersisted True if the database is already up to date
+   @return    True if successful, false if the reservation expired
+ */
+bool Inventory::commit(unsigned long aRid, bool isPersisted)
+{
+    bool mustFlush;
+
+    {
+        MutexLocker lock(_lock);
+
+        map<unsigned long, Reservation>::iterator it;
+        it = _reservations.find(aRid);
+        if (it == _reservations.end())
+            return false;
+
+        Reservation & r = (*it).second;
+        int pid = r.pid, qty = r.qty;
+        _reservations.erase(it);
+
+        if (isPersisted)
+            return true;
+
+        __sync_fetch_and_add(&(_stock[pid]->sold), qty);
+        _dirty.insert(pid);
+
+        time_t now = time(NULL);
+        if (_oldestSale == 0)
+            _oldestSale = now;
+
+        mustFlush = (_dirty.size() >= _batchSize ||
+                     now - _oldestSale >= INVENTORY_MAX_DELAY);
+    }
+
+    if (mustFlush)
+        flush();
+
+    return true;
+}
+
+/**
+   @brief Cancel a reservation, units go back to stock
+
+   @param[in]    aRid    The reservation ID
+ */
+void Inventory::release(unsigned long aRid)
+{
+    MutexLocker lock(_lock);
+
+    map<unsigned long, Reservation>::iterator it = _reservations.find(aRid);
+    if (it == _reservations.end())
+        return;
+
+    give(_stock[(*it).second.pid], (*it).second.qty);
+    _reservations.erase(it);
+}
+
+/**
+   @brief Give back to stock the units of expired reservations
+ */
+void Inventory::releaseExpired()
+{
+    MutexLocker lock(_lock);
+    time_t now = time(NULL);
+
+    map<unsigned long, Reservation>::iterator it = _reservations.begin();
+    while (it != _reservations.end()) {
+        if ((*it).second.expires <= now) {
+            LOG(3, "Reservation #%lu expired\n", (*it).first);
+            give(_stock[(*it).second.pid], (*it).second.qty);
+            _reservations.erase(it++);
+        } else
+            it++;
+    }
+}
+
+/**
+   @brief Forget the stock of a deleted product
+
+   @param[in]    aPid    The product ID
+ */
+void Inventory::productRemoved(int aPid)
+{
+    MutexLocker lock(_lock);
+
+    map<int, Stock *>::iterator it = _stock.find(aPid);
+    if (it != _stock.end())
+        __sync_lock_test_and_set(&((*it).second->available), 0);
+}
+
+/**
+   @brief Add or remove units of a product (e.g. goods received)
+
+   The in-memory stock changes at once, while the database is updated
+   by the write-behind flusher.
+
+   @param[in]    aPid    The product ID
+   @param[in]    aDelta  Units to add, negative to remove
+   @return    True if successful, false if the product doesn't exist or
+              there are not enough units to remove
+ */
+bool Inventory::restock(int aPid, int aDelta)
+{
+    Stock *s = stockFor(aPid);
+    if (!s)
+        return false;
+
+    {
+        MutexLocker lock(_lock);
+
+        if (aDelta < 0 && !take(s, -aDelta))
+            return false;
+        if (aDelta > 0)
+            give(s, aDelta);
+    }
+
+    stringstream pid;
+    pid << aPid;
+    // the flusher invalidates the shared copy once it's written
+    WriteBehind::instance().increment("products", "pid", pid.str(),
+                                      "availability", aDelta);
+    LOG(2, "Product %d restocked: %+d unit(s)\n", aPid, aDelta);
+
+    return true;
+}
+
+/**
+   @brief Write back to the database all sold units
+
+   A single UPDATE statement decreases the availability of every
+   product sold since last write-back; if the statement fails, units
+   are kept in memory and written back by the next flush.
+
+   @return    True if successful
+ */
+bool Inventory::flush()
+{
+    map<int, int> sales;
+
+    {
+        MutexLocker lock(_lock);
+
+        set<int>::const_iterator it;
+        for (it = _dirty.begin(); it != _dirty.end(); it++) {
+            int qty = __sync_fetch_and_and(&(_stock[*it]->sold), 0);
+            if (qty)
+                sales[*it] = qty;
+        }
+        _dirty.clear();
+        _oldestSale = 0;
+    }
+
+    if (sales.empty())
+        return true;
+
+    stringstream sql, pids;
+    map<int, int>::const_iterator it;
+
+    sql << "UPDATE products SET availability = availability - CASE pid";
+    for (it = sales.begin(); it != sales.end(); it++) {
+        sql << " WHEN " << (*it).first << " THEN " << (*it).second;
+        pids << (it == sales.begin() ? "" : ",") << (*it).first;
+    }
+    sql << " END WHERE pid IN (" << pids.str() << ")";
+
+    // get an instance of the database
+    Database &db = Database::instance();
+    LOG(2, "SQL: %s\n", sql.str().c_str());
+
+    if (!db.execute(sql.str())) {
+        // keep sold units for next write-back
+        MutexLocker lock(_lock);
+
+        for (it = sales.begin(); it != sales.end(); it++) {
+            __sync_fetch_and_add(&(_stock[(*it).first]->sold), (*it).second);
+            _dirty.insert((*it).first);
+        }
+        _oldestSale = time(NULL);
+
+        return false;
+    }
+
+    db.tableDidChange("products");
+    for (it = sales.begin(); it != sales.end(); it++)
+        SharedCache::instance().invalidate((*it).first);
+
+    return true;
+}
+
+/**
+   @brief Change how long a reservation is kept
+
+   @param[in]    aValue  Time to live, in seconds
+ */
+void Inventory::setReservationTTL(time_t aValue)
+{
+    _ttl = aValue;
+}
+
+/**
+   @brief Change how many products must be sold before a write-back
+
+   @param[in]    aValue  Number of products
+ */
+void Inventory::setBatchSize(size_t aValue)
+{
+    _batchSize = aValue;
+}
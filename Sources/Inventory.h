@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#ifndef __INVENTORY_H__
+#define __INVENTORY_H__
+
+#include <ctime>
+#include "common.h"
+#include "Mutex.h"
+
+using namespace std;
+
+/** Seconds a reservation is kept before its units go back to stock */
+#define INVENTORY_RESERVATION_TTL   900
+/** Number of products with sold units that triggers a write-back */
+#define INVENTORY_BATCH_SIZE        16
+/** Seconds a sale can wait in memory before being written back */
+#define INVENTORY_MAX_DELAY         60
+
+/**
+   The class Inventory keeps the stock of every product in memory, so
+   that availability checks don't need a round trip to the database.
+
+   Customers don't buy a product straight away: units are first
+   reserved (when added to the basket), then either committed (the
+   order is placed) or released (removed from the basket, logout, or
+   reservation expired). Counters are updated with atomic operations,
+   so two buyers can never obtain the same unit.
+
+   Committed units are written back to "products.availability" in
+   batches; the in-memory stock is reconciled with the database at
+   startup. Stock adjustments made by administrators go through the
+   write-behind queue.
+
+   @see Basket
+ */
+class Inventory : public Singleton<Inventory>
+{
+private:
+    /** Stock of a product */
+    struct Stock {
+        /** Units neither reserved nor sold */
+        volatile int available;
+        /** Units sold but not yet written back to the database */
+        volatile int sold;
+    };
+
+    /** A set of units put aside for a customer */
+    struct Reservation {
+        int pid;
+        int qty;
+        time_t expires;
+    };
+
+    /** Stock of each product, indexed by product ID */
+    map<int, Stock *> _stock;
+    /** Pending reservations, indexed by reservation ID */
+    map<unsigned long, Reservation> _reservations;
+    /** Products with units to write back */
+    set<int> _dirty;
+    /** Protects the maps above (counters are atomic) */
+    Mutex _lock;
+    volatile unsigned long _lastReservation;
+    time_t _oldestSale;
+    time_t _ttl;
+    size_t _batchSize;
+
+    Stock *stockFor(int aPid);
+    bool take(Stock *s, int aQty);
+    void give(Stock *s, int aQty);
+    void releaseExpired();
+
+protected:
+    friend class Singleton<Inventory>;
+    Inventory();
+    virtual ~Inventory();
+
+public:
+    bool reconcile();
+    int available(int aPid);
+
+    unsigned long reserve(int aPid, int aQty);
+    bool adjust(unsigned long aRid, int aQty);
+    bool isValid(unsigned long aRid);
+    bool commit(unsigned long aRid, bool isPersisted = false);
+    void release(unsigned long aRid);
+    void productRemoved(int aPid);
+    bool restock(int aPid, int aDelta);
+    bool flush();
+
+    void setReservationTTL(time_t aValue);
+    void setBatchSize(size_t aValue);
+};
+
+#endif /* __INVENTORY_H__ */
@@ -7,6 +7,11 @@
 
 #include "ManagedObject.h"
 #include "DataModel.h"
+#include "NotificationScope.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
 
 /**
    @brief Default constructor
@@ -26,22 +31,24 @@ ManagedObject::ManagedObject(string anEntityName)
  
    Construct an instance of ManagedObject linking with a corresponding 
    table on database named "anEntityName" and reading data from
-   mysqlpp::Row.
+   a Record.
+ 
+   Fields are filled in directly: nobody can observe an object still 
+   being built, so no notification is sent.
  */
-ManagedObject::ManagedObject(string anEntityName, Row & aRow)
+ManagedObject::ManagedObject(string anEntityName, const Record & aRow)
 {
     LOG_CTOR();
     initEntity(anEntityName);
     
+    const StringSet & keys = _model->keys();
     set<string>::const_iterator it;
     
-    for (it =_keys.begin(); it != _keys.end(); it++) {
-        string key = *it;
-        setValueForKey(key, (string) aRow[key.c_str()]);
-    }
-    
-    _fault = false;
-    _updatedKeys.clear();
+    // keys are sorted: each one is appended at the end of the list
+    _fields.clear();
+    _fields.reserve(keys.size());
+    for (it= keys.begin(); it != keys.end(); it++)
+        _fields.push_back(FieldValue(*it, aRow[*it].str()));
 }
 
 /**
@@ -52,6 +59,110 @@ ManagedObject::~ManagedObject()
     LOG_DTOR();
 }
 
+/**
+   @brief Bring the object back to the state of a new one
+ 
+   Used to recycle instances (see ObjectPool): values are emptied, 
+   but the list keeps its entries and the strings their buffers, which 
+   is the same for ManagedObject as a missing value. Observers are not 
+   touched: objects still observed must not be recycled. Changes not 
+   yet delivered by a NotificationScope are dropped, as if the object 
+   was destroyed.
+ */
+void ManagedObject::reset()
+{
+    NotificationScope::forget(this);
+    
+    FieldValues::iterator it;
+    for (it = _fields.begin(); it != _fields.end(); it++)
+        it->second.clear();
+    
+    _updatedKeys.clear();
+    initEntity(_entityName);
+}
+
+/**
+   @brief Bring the object back to the state of one read from aRow
+ 
+   Values are copied over the ones already in place: recycling an 
+   object of the same entity doesn't allocate entries, and reuses the 
+   buffers of the strings large enough.
+ 
+   @param[in]    aRow    A record of the entity
+ */
+void ManagedObject::reset(const Record & aRow)
+{
+    NotificationScope::forget(this);
+    _updatedKeys.clear();
+    initEntity(_entityName);
+    
+    const StringSet & keys = _model->keys();
+    set<string>::const_iterator kit;
+    FieldValues::iterator fit = _fields.begin();
+    
+    // both are sorted: walk them together, dropping keys no longer known
+    for (kit = keys.begin(); kit != keys.end(); kit++, fit++) {
+        while (fit != _fields.end() && fit->first < *kit)
+            fit = _fields.erase(fit);
+        
+        if (fit != _fields.end() && fit->first == *kit)
+            fit->second.assign(aRow[*kit].str());
+        else
+            fit = _fields.insert(fit, FieldValue(*kit, aRow[*kit].str()));
+    }
+    _fields.erase(fit, _fields.end());
+}
+
+/**
+   @brief Returns true if the object can be reset and used again
+ 
+   An object somebody observes can't: the observer still refers to it.
+ */
+bool ManagedObject::isRecyclable() const
+{
+    return !hasObservers();
+}
+
+/**
+   @brief Returns where the value of aKey is, or would be, in _fields
+ */
+ManagedObject::FieldValues::iterator 
+ManagedObject::findField(const StringRef & aKey)
+{
+    return lower_bound(_fields.begin(), _fields.end(), aKey, PairKeyLess());
+}
+
+/**
+   @brief Returns the value of aKey, empty if it was never set
+ 
+   The key is not checked against the entity.
+ */
+const string & ManagedObject::fieldValue(const StringRef & aKey) const
+{
+    static const string empty;
+    
+    FieldValues::const_iterator it = 
+        lower_bound(_fields.begin(), _fields.end(), aKey, PairKeyLess());
+    if (it == _fields.end() || StringRef((*it).first) != aKey)
+        return empty;
+    
+    return (*it).second;
+}
+
+/**
+   @brief Returns the value of aKey, to be written
+ 
+   An empty value is added if the key was never set.
+ */
+string & ManagedObject::fieldForKey(const StringRef & aKey)
+{
+    FieldValues::iterator it = findField(aKey);
+    if (it == _fields.end() || StringRef((*it).first) != aKey)
+        it = _fields.insert(it, FieldValue(aKey.str(), string()));
+    
+    return (*it).second;
+}
+
 /**
    @brief Internal init
  
@@ -62,8 +173,13 @@ void ManagedObject::initEntity(string anEntityName)
     _entityName = anEntityName;
     _lastInsertID = 0;
     _fault = false;    
+    _conflict = false;
     
-    _keys = DataModel::instance().keysForEntity(anEntityName);
+    _model = DataModel::instance().descriptorForEntity(anEntityName);
+    
+    // new records start from the first version
+    if (isVersioned())
+        fieldForKey(KEY_MO_VERSION) = "0";
 }
 
 /**
@@ -77,26 +193,51 @@ void ManagedObject::initEntity(string anEntityName)
                        belong to this entity
    @see Observable, willChangeValueForKey, didChangeValueForKey
  */
-void ManagedObject::setValueForKey(string aKey, 
-                                   string aValue) throw (InvalidArgument)
+void ManagedObject::setValueForKey(const StringRef & aKey, 
+                                   const string & aValue) 
+                                   throw (InvalidArgument)
 {
     // first check if the key is valid, anyway throw an exception
-    set<string>::const_iterator it = _keys.find(aKey);
-    if (it == _keys.end())
-        throw InvalidArgument(aKey);
+    KeyID anID = _model->keyID(aKey);
+    if (anID == KEY_NONE)
+        throw InvalidArgument(aKey.str());
     
     // Set the value only if differs from the old one
-    if (aValue != *it) {        
-        // notify observers that this key is going to change
-        willChangeValueForKey(aKey);
-        
-        _fields[aKey] = aValue;
-        _fault = true;
-        _updatedKeys.insert(aKey);
-        
-        // notify observers that this key is changed
-        didChangeValueForKey(aKey);        
-    }
+    FieldValues::iterator it = findField(aKey);
+    bool found = (it != _fields.end() && StringRef((*it).first) == aKey);
+    if (found && (*it).second == aValue)
+        return;
+    
+    // observers are told the old value, copy it only for them
+    Field anOld;
+    if (hasObservers() && found)
+        anOld = Field((*it).second);
+    
+    // notify observers that this key is going to change
+    willChangeValueForKey(anID);
+    
+    // found again: observers could have added values meanwhile
+    fieldForKey(aKey) = aValue;
+    _fault = true;
+    _updatedKeys.insert(aKey.str());
+    
+    // notify observers that this key is changed
+    if (hasObservers())
+        didChangeValueForKey(anID, anOld, Field(aValue));        
+    
+    valueDidChange(aKey);
+}
+
+/**
+   @brief Called after a property is set, observed or not
+ 
+   Subclasses whose values are mirrored elsewhere (e.g. Product and 
+   the catalog view) override it; the default does nothing.
+ 
+   @param[in]    aKey    The name of the property which changed
+ */
+void ManagedObject::valueDidChange(const StringRef &)
+{
 }
 
 /**
@@ -110,7 +251,7 @@ void ManagedObject::setValueForKey(string aKey,
    @param[in]    aValue The new value for the property specified 
                        by key. 
  */
-void ManagedObject::setIntForKey(string aKey, int aValue)
+void ManagedObject::setIntForKey(const StringRef & aKey, int aValue)
 {
     setFloatForKey(aKey, (float)aValue);
 }
@@ -126,7 +267,7 @@ void ManagedObject::setIntForKey(string aKey, int aValue)
    @param[in]    aValue The new value for the property specified 
                        by key.
  */
-void ManagedObject::setFloatForKey(string aKey, float aValue)
+void ManagedObject::setFloatForKey(const StringRef & aKey, float aValue)
 {
     stringstream tmpSS;
     string tmpStr;
@@ -136,6 +277,22 @@ void ManagedObject::setFloatForKey(string aKey, float aValue)
     setValueForKey(aKey, tmpStr);
 }
 
+/**
+   @brief Set an amount of money
+ 
+   The amount is stored with two decimals.
+ 
+   @param[in]    aKey   The name of one of the receiver's 
+                       properties.
+   @param[in]    aValue The new value for the property specified 
+                       by key.
+ */
+void ManagedObject::setMoneyForKey(const StringRef & aKey, 
+                                   const Money & aValue)
+{
+    setValueForKey(aKey, aValue.str());
+}
+
 /**
    @brief Set a boolean value
  
@@ -147,7 +304,7 @@ void ManagedObject::setFloatForKey(string aKey, float aValue)
    @param[in]    aValue The new value for the property specified 
                        by key.
  */
-void ManagedObject::setBoolForKey(string aKey, bool aValue)
+void ManagedObject::setBoolForKey(const StringRef & aKey, bool aValue)
 {
     setValueForKey(aKey, (aValue?"1":"0"));
 }
@@ -163,15 +320,17 @@ void ManagedObject::setBoolForKey(string aKey, bool aValue)
  
    @exception InvalidArgument Thrown if the specified key doesn't 
                 belong to this entity 
+   @note The value is not copied: the reference is valid until the 
+         property is changed
 */
-string ManagedObject::valueForKey(string aKey) throw (InvalidArgument)
+const string & ManagedObject::valueForKey(const StringRef & aKey) const 
+                                          throw (InvalidArgument)
 {
     // first check if the key is valid, anyway throw an exception
-    set<string>::const_iterator it = _keys.find(aKey);
-    if (it == _keys.end())
-        throw InvalidArgument(aKey);
+    if (!_model->hasKey(aKey))
+        throw InvalidArgument(aKey.str());
     
-    return _fields[aKey];
+    return fieldValue(aKey);
 }
 
 /**
@@ -183,16 +342,15 @@ string ManagedObject::valueForKey(string aKey) throw (InvalidArgument)
    @exception InvalidArgument Thrown if the specified key doesn't 
                 belong to this entity 
  */
-bool ManagedObject::boolForKey(string aKey) throw (InvalidArgument)
+bool ManagedObject::boolForKey(const StringRef & aKey) const 
+                               throw (InvalidArgument)
 {
-    string aValue = valueForKey(aKey);
-    istringstream aStream(aValue);
-    int i;
+    bool aValue;
     
-    if (!(aStream >> i))
-        throw InvalidArgument(aKey);
+    if (!tryBoolForKey(aKey, aValue))
+        throw InvalidArgument(aKey.str());
     
-    return (i == 1);
+    return aValue;
 }
 
 /**
@@ -204,16 +362,15 @@ bool ManagedObject::boolForKey(string aKey) throw (InvalidArgument)
    @exception InvalidArgument Thrown if the specified key doesn't 
                      belong to this entity 
  */
-int ManagedObject::intForKey(string aKey) throw (InvalidArgument)
+int ManagedObject::intForKey(const StringRef & aKey) const 
+                             throw (InvalidArgument)
 {
-    string value = valueForKey(aKey);
-    istringstream aStream(value);
-    int i;
+    int aValue;
     
-    if (!(aStream >> i))
-        throw InvalidArgument(aKey);
+    if (!tryIntForKey(aKey, aValue))
+        throw InvalidArgument(aKey.str());
     
-    return i;
+    return aValue;
 }
 
 /**
@@ -225,16 +382,129 @@ int ManagedObject::intForKey(string aKey) throw (InvalidArgument)
    @exception InvalidArgument Thrown if the specified key doesn't 
                      belong to this entity 
  */
-float ManagedObject::floatForKey(string aKey) throw (InvalidArgument)
+float ManagedObject::floatForKey(const StringRef & aKey) const 
+                                 throw (InvalidArgument)
+{
+    float aValue;
+    
+    if (!tryFloatForKey(aKey, aValue))
+        throw InvalidArgument(aKey.str());
+    
+    return aValue;
+}
+
+/**
+   @brief Returns the value as an amount of money for the property 
+          identified by a given key.
+ 
+   @param[in]    aKey The key to read from
+   @return Value of the property
+   @exception InvalidArgument Thrown if the specified key doesn't 
+                     belong to this entity 
+ */
+Money ManagedObject::moneyForKey(const StringRef & aKey) const 
+                                 throw (InvalidArgument)
+{
+    Money aValue;
+    
+    if (!tryMoneyForKey(aKey, aValue))
+        throw InvalidArgument(aKey.str());
+    
+    return aValue;
+}
+
+/**
+   @brief Read the value of a property as an integer, without throwing
+ 
+   As with a stream, leading blanks are skipped and the number ends at 
+   the first character which is not a digit; the value is parsed in 
+   place, nothing is allocated.
+ 
+   @param[in]     aKey      The key to read from
+   @param[out]    aValue    The value, unchanged on failure
+   @return    False if the key doesn't belong to this entity, or its 
+              value isn't an integer or doesn't fit an int
+ */
+bool ManagedObject::tryIntForKey(const StringRef & aKey, int & aValue) const
 {
-    string value = valueForKey(aKey);
-    istringstream aStream(value);
-    int f;
+    if (!_model->hasKey(aKey))
+        return false;
     
-    if (!(aStream >> f))
-        throw InvalidArgument(aKey);
+    const char *aString = fieldValue(aKey).c_str();
+    char *end;
     
-    return f;
+    errno = 0;
+    long l = strtol(aString, &end, 10);
+    if (end == aString || errno == ERANGE || l < INT_MIN || l > INT_MAX)
+        return false;
+    
+    aValue = (int) l;
+    return true;
+}
+
+/**
+   @brief Read the value of a property as a float, without throwing
+ 
+   @param[in]     aKey      The key to read from
+   @param[out]    aValue    The value, unchanged on failure
+   @return    False if the key doesn't belong to this entity, or its 
+              value isn't a number
+ */
+bool ManagedObject::tryFloatForKey(const StringRef & aKey, 
+                                   float & aValue) const
+{
+    if (!_model->hasKey(aKey))
+        return false;
+    
+    const char *aString = fieldValue(aKey).c_str();
+    char *end;
+    
+    errno = 0;
+    double d = strtod(aString, &end);
+    if (end == aString || errno == ERANGE)
+        return false;
+    
+    aValue = (float) d;
+    return true;
+}
+
+/**
+   @brief Read the value of a property as money, without throwing
+ 
+   @param[in]     aKey      The key to read from
+   @param[out]    aValue    The value, unchanged on failure
+   @return    False if the key doesn't belong to this entity, or its 
+              value isn't a number
+   @see Money::parse()
+ */
+bool ManagedObject::tryMoneyForKey(const StringRef & aKey, 
+                                   Money & aValue) const
+{
+    if (!_model->hasKey(aKey))
+        return false;
+    
+    return Money::parse(fieldValue(aKey), aValue);
+}
+
+/**
+   @brief Read the value of a property as a boolean, without throwing
+ 
+   Booleans are stored as integers: only 1 is true.
+ 
+   @param[in]     aKey      The key to read from
+   @param[out]    aValue    The value, unchanged on failure
+   @return    False if the key doesn't belong to this entity, or its 
+              value isn't an integer
+ */
+bool ManagedObject::tryBoolForKey(const StringRef & aKey, bool & aValue) const
+{
+    int i;
+    
+    if (!tryIntForKey(aKey, i))
+        return false;
+    
+    aValue = (i == 1);
+    return true;
 }
 
 /**
@@ -248,70 +518,85 @@ float ManagedObject::floatForKey(string aKey) throw (InvalidArgument)
          record and not an existing one.
  
    @return    True if save was successful
-   @see    update
+   @see    update, insert
  */
 bool ManagedObject::store()
+{
+    return write("REPLACE");
+}
+
+/**
+   @brief Add this instance to database, unless it's already there
+ 
+   Unlike store(), which replaces any record having the same primary 
+   or unique key, the statement fails on a duplicate: use it for 
+   records created on behalf of somebody who must not overwrite 
+   others', such as a new user.
+ 
+   @return    True if the record was added
+   @see    store
+ */
+bool ManagedObject::insert()
+{
+    return write("INSERT");
+}
+
+/**
+   @brief Build and run the statement of store() or insert()
+ 
+   @param[in]    aCommand    "REPLACE" or "INSERT"
+   @return    True if successful
+ */
+bool ManagedObject::write(const string & aCommand)
 {    
-    SQLQueryParms qp;
+    SqlParams qp;
     string cols = " (";
     stringstream values;
+    string pk = primaryKey();
     int i=0;
     
     /**
        Iterate on all key/value in order to create the VALUE() part 
-       of REPLACE statement; we also fill a SQLQueryParams to pass to 
-       mysqlpp::query::execute.
+       of the statement; we also fill the SqlParams to pass to 
+       Database::execute.
      
        We don't make use of valueMerge template method becuase we 
        need to know on which field we're iterating, in order to 
        properly fill "qp" and "values".
+     
+       An empty (or zero) primary key is left out, so that every 
+       backend generates it; so is the change sequence, set by the 
+       triggers of the entity.
      */
     values << "VALUES (";
-    set<string>::reverse_iterator it;
-    for (it = _keys.rbegin(); it != _keys.rend(); it++) {
+    set<string>::const_reverse_iterator it;
+    for (it = _model->keys().rbegin(); it != _model->keys().rend(); it++) {
+        const string & aValue = fieldValue(*it);
+        if (*it == pk && (aValue.empty() || aValue == "0"))
+            continue;
+        if (*it == KEY_MO_CHANGE_SEQ)
+            continue;
+        
         cols += *it + ",";
-        qp += _fields[*it];
+        qp << aValue;
         values << "%" << i++ << "q,";
     }
     
-    // build the entire REPLACE statement
+    // build the entire statement
     cols[cols.length()-1] = ')', cols += " ";
-    string sql = "REPLACE " + _entityName + cols + values.str();
+    string sql = aCommand + " INTO " + _entityName + cols + values.str();
     sql[sql.length()-1] = ')';
     
     // get an instance of the database
     Database & db = Database::instance();
     
-    try {
-        // ask Database for a valid connection to mySQL
-        Connection *conn = db.getConnection();
-        
-        // obtain an instance of mysqlpp::Query and init it
-        Query q = conn->query(sql);
-        q.parse();
-        
-        LOG(2, "SQL: %s\n", q.str(qp).c_str());
-
-        // check if command was successful: if not, log the error 
-        // and its detail
-        SimpleResult r = q.execute(qp);
-        if (r == false) {
-            LOG(2, "An error occurred during mysqlpp:query::execute\n"
-                   "ERR: %s\nQuery was: %s\n", q.error(), 
-                   q.str(qp).c_str());
-                
-            return false;
-        }
-        
-        _lastInsertID = q.insert_id();
-    }
-    catch (const Exception& er) {
-        cerr << "Error: " << er.what() << endl;        
+    // check if command was successful: errors are logged by Database
+    if (!db.execute(sql, qp, NULL, &_lastInsertID))
         return false;
-    }    
-    
-    // restore fault state
+
+    // restore fault state and invalidate cached reads of the entity
     _fault = false;
+    db.tableDidChange(_entityName);
     
     return true;
 }
@@ -322,18 +607,25 @@ bool ManagedObject::store()
    Attempts to update unsaved changes to the persistent store.
    Fault state is reset if update is successful.
  
+   If the entity is versioned, the record is updated only if its 
+   version is still the one read from the database, and the version 
+   is increased: when no record matches, somebody else changed it in 
+   the meanwhile, the update fails and hasConflict() returns true.
+   The object should then be fetched again before retrying.
+ 
    @note ManagedObject::update should be called only to update 
          existing record and not an to store a new record.
  
    @return    True if update was successful
-   @see    store
+   @see    store, hasConflict
  */
 bool ManagedObject::update()
 {
+    _conflict = false;
     if (!_fault)
         return true;
     
-    SQLQueryParms qp;
+    SqlParams qp;
     set<string>::const_iterator ckit;
     vector<string> vValues;
     stringstream aValue;
@@ -345,14 +637,23 @@ bool ManagedObject::update()
        we need to know on which field we're iterating, in order to 
        properly fill "qp" and "values".
     */
+    bool versioned = isVersioned();
     for (i=0, ckit = _updatedKeys.begin(); 
-         ckit != _updatedKeys.end(); ckit++, i++) {
+         ckit != _updatedKeys.end(); ckit++) {
+        // the version is handled below
+        if ((versioned && *ckit == KEY_MO_VERSION) || 
+            *ckit == KEY_MO_CHANGE_SEQ)
+            continue;
+        
         aValue.str("");
-        aValue << *ckit << "=%" << i << "q";
+        aValue << *ckit << "=%" << i++ << "q";
         vValues.push_back(aValue.str());
-        qp += _fields[*ckit];
+        qp << fieldValue(*ckit);
     }
     
+    if (versioned)
+        vValues.push_back(KEY_MO_VERSION "=" KEY_MO_VERSION "+1");
+    
     sql = "UPDATE " + _entityName + " SET " + 
             valueMerge(vValues.begin(), vValues.end(), (string)",");
 
@@ -360,44 +661,68 @@ bool ManagedObject::update()
     string pk = primaryKey();
     
     // add the WHERE condition to properly identify the right record
-    sql += " WHERE " + pk + " = " + _fields[pk];
+    sql += " WHERE " + pk + " = " + fieldValue(pk);
+    
+    // ...and to make sure it didn't change since it was read
+    int version = 0;
+    if (versioned) {
+        version = atoi(fieldValue(KEY_MO_VERSION).c_str());
+        aValue.str("");
+        aValue << " AND " KEY_MO_VERSION " = " << version;
+        sql += aValue.str();
+    }
 
     // get an instance of the database
     Database& db = Database::instance();
     
-    try {
-        // ask Database for a valid connection to mySQL
-        Connection *conn = db.getConnection();
-        
-        // obtain an instance of mysqlpp::Query and init it
-        Query q = conn->query(sql);
-        
-        LOG(2, "SQL: %s\n", q.str(qp).c_str());
-        
-        q.parse();
-        
-        SimpleResult r = q.execute(qp);
-        if (r == false) {
-            cerr << "An error occurred during Person::store()\n" << endl 
-            << q.error() << endl << "Query was: " << q.str() << endl;
-            return false;
-        }
-    }
-    catch (const mysqlpp::BadQuery& e) {
-        // Something went wrong with the SQL query.
-        cerr << "Query failed: " << e.what() << endl;
+    ulonglong rows = 0;
+    if (!db.execute(sql, qp, &rows))
         return false;
-    }
-    catch (const Exception& er) {
-        cerr << "Error: " << er.what() << endl;
-        return false;
-    }    
     
+    if (versioned && rows == 0) {
+        LOG(2, "Update conflict on %s %s = %s (version %d)\n", 
+            _entityName.c_str(), pk.c_str(), fieldValue(pk).c_str(), 
+            version);
+        _conflict = true;
+        return false;
+    }
+
     _fault = false;
+    _updatedKeys.clear();
+    db.tableDidChange(_entityName);
+    
+    // keep track of the version we wrote
+    if (versioned) {
+        aValue.str("");
+        aValue << version + 1;
+        fieldForKey(KEY_MO_VERSION) = aValue.str();
+    }
     
     return true;
 }
 
+/**
+   @brief Check if the entity supports optimistic concurrency control
+ 
+   @return    True if the entity has a "version" column
+ */
+bool ManagedObject::isVersioned() const
+{
+    return _model->hasKey(KEY_MO_VERSION);
+}
+
+/**
+   @brief Check if last update failed because of a concurrent change
+ 
+   @return    True if the record was changed by someone else since it 
+              was read
+   @see update()
+ */
+bool ManagedObject::hasConflict() const
+{
+    return _conflict;
+}
+
 /**
    @brief Returns the ID of the autoincrement of the last query (INSERT)
  
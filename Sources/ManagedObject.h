@@ -11,9 +11,16 @@
 #include "Observable.h"
 #include "Exceptions.h"
 #include "Database.h"
+#include "DataModel.h"
+#include "StringRef.h"
+#include "Money.h"
 
 using namespace std;
-using namespace mysqlpp;
+
+/** Column used for optimistic concurrency control, if present */
+#define KEY_MO_VERSION      "version"
+/** Column maintained by the schema (triggers), never written */
+#define KEY_MO_CHANGE_SEQ   "change_seq"
 
 
 /**
@@ -24,43 +31,83 @@ using namespace mysqlpp;
    the class is created, a connection to the database is automatically 
    requested in order to fetch all the available columns of the linked
    table.
+ 
+   Entities having a "version" column are protected against lost 
+   updates: update() succeeds only if the record wasn't changed by 
+   someone else since it was read (optimistic concurrency control).
+   A "change_seq" column, if present, is left to the database.
+ 
+   Keys are passed as StringRef, values are returned by reference: 
+   reading a property neither builds nor copies a string. The typed 
+   getters throw InvalidArgument on a wrong key or value, their try 
+   variants return false instead, for loops which would rather skip 
+   a bad record.
  */
 class ManagedObject : public Observable
 {
 private:
     ulonglong _lastInsertID;
     void initEntity(string anEntityName);
+    bool write(const string & aCommand);
     
 protected:
-    /** List of possible keys associated with this entity */
-    set<string> _keys;
+    /** A property and its value */
+    typedef pair<string, string> FieldValue;
+    /** Values of the properties, sorted by key */
+    typedef vector<FieldValue> FieldValues;
+    
+    /** Keys associated with this entity, when the object was built */
+    EntityDescriptorPtr _model;
     /** List of the updated keys to update */
     set<string> _updatedKeys;
-    /** Map of key/value associated to the entity */
-    map<string, string> _fields;
+    /** Values of the entity, searched in place by key */
+    FieldValues _fields;
     /** The entity name */
     string _entityName;
     /** Fault state: if true the entity need to be serialized */
     bool _fault;
+    /** True if last update() found the record changed by someone else */
+    bool _conflict;
+    
+    FieldValues::iterator findField(const StringRef & aKey);
+    const string & fieldValue(const StringRef & aKey) const;
+    string & fieldForKey(const StringRef & aKey);
+    virtual void valueDidChange(const StringRef & aKey);
     
 public:
     ManagedObject(string anEntityName);
-    ManagedObject(string anEntityName, Row & aRow);
+    ManagedObject(string anEntityName, const Record & aRow);
     virtual ~ManagedObject();
     
-    void setBoolForKey(string aKey, bool aValue);
-    void setFloatForKey(string aKey, float aValue);
-    void setIntForKey(string aKey, int aValue);
-    void setValueForKey(string aKey, string aValue) throw (InvalidArgument);
+    virtual void reset();
+    virtual void reset(const Record & aRow);
+    virtual bool isRecyclable() const;
+    
+    void setBoolForKey(const StringRef & aKey, bool aValue);
+    void setFloatForKey(const StringRef & aKey, float aValue);
+    void setIntForKey(const StringRef & aKey, int aValue);
+    void setMoneyForKey(const StringRef & aKey, const Money & aValue);
+    void setValueForKey(const StringRef & aKey, 
+                        const string & aValue) throw (InvalidArgument);
+    
+    float floatForKey(const StringRef & aKey) const throw (InvalidArgument);
+    int intForKey(const StringRef & aKey) const throw (InvalidArgument);
+    bool boolForKey(const StringRef & aKey) const throw (InvalidArgument);
+    Money moneyForKey(const StringRef & aKey) const throw (InvalidArgument);
+    const string & valueForKey(const StringRef & aKey) const 
+                               throw (InvalidArgument);
     
-    float floatForKey(string aKey) throw (InvalidArgument);
-    int intForKey(string aKey) throw (InvalidArgument);
-    bool boolForKey(string aKey) throw (InvalidArgument);
-    string valueForKey(string aKey) throw (InvalidArgument);
+    bool tryFloatForKey(const StringRef & aKey, float & aValue) const;
+    bool tryIntForKey(const StringRef & aKey, int & aValue) const;
+    bool tryBoolForKey(const StringRef & aKey, bool & aValue) const;
+    bool tryMoneyForKey(const StringRef & aKey, Money & aValue) const;
     
     ulonglong getLastInsertID() const;
-    bool store();
-    bool update();
+    bool isVersioned() const;
+    bool hasConflict() const;
+    virtual bool store();
+    bool insert();
+    virtual bool update();
     
     virtual string primaryKey() = 0;
 };
@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#include "Money.h"
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+/** Digits of the integer part accepted by parse() */
+#define MONEY_MAX_DIGITS    15
+
+/**
+   @brief Convert an amount computed in floating point
+
+   @param[in]    aValue    The amount, rounded to the nearest cent
+   @return    The amount
+ */
+Money Money::fromFloat(double aValue)
+{
+    return Money((long long) floor(aValue * 100 + 0.5));
+}
+
+/**
+   @brief Read an amount from its decimal text
+
+   As with strtod(), leading blanks are skipped and the number ends at
+   the first character which doesn't belong to it; decimals beyond the
+   cents are rounded. Numbers in exponent notation, which a backend
+   may return for a floating point column, are converted through
+   fromFloat().
+
+   @param[in]     aText     The text
+   @param[out]    aValue    The amount, unchanged on failure
+   @return    False if the text doesn't start with an amount
+ */
+bool Money::parse(const StringRef & aText, Money & aValue)
+{
+    const char *p = aText.data(), *end = p + aText.size();
+    bool negative = false;
+    long long units = 0, cents = 0;
+    int digits = 0, decimals = 0;
+
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    if (p < end && (*p == '-' || *p == '+'))
+        negative = (*p++ == '-');
+
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        if (++digits > MONEY_MAX_DIGITS)
+            return false;
+        units = units * 10 + (*p - '0');
+    }
+
+    if (p < end && *p == '.') {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++, decimals++) {
+            if (decimals < 2)
+                cents = cents * 10 + (*p - '0');
+            else if (decimals == 2 && *p >= '5')
+                cents++;
+        }
+    }
+    if (digits == 0 && decimals == 0)
+        return false;
+
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        std::string text = aText.str();
+        aValue = fromFloat(strtod(text.c_str(), NULL));
+        return true;
+    }
+
+    if (decimals == 1)
+        cents *= 10;
+    long long total = units * 100 + cents;
+    aValue = Money(negative ? -total : total);
+
+    return true;
+}
+
+/**
+   @brief Add many amounts
+
+   @param[in]    aValues    The amounts
+   @param[in]    aCount     How many
+   @return    Their sum
+ */
+Money Money::sum(const Money *aValues, size_t aCount)
+{
+    long long s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    size_t i = 0;
+
+    // four independent sums: no addition waits for the previous one
+    for (; i + 4 <= aCount; i += 4) {
+        s0 += aValues[i]._cents;
+        s1 += aValues[i + 1]._cents;
+        s2 += aValues[i + 2]._cents;
+        s3 += aValues[i + 3]._cents;
+    }
+    for (; i < aCount; i++)
+        s0 += aValues[i]._cents;
+
+    return Money(s0 + s1 + s2 + s3);
+}
+
+/**
+   @brief Returns the amount with two decimals, such as "19.90"
+ */
+std::string Money::str() const
+{
+    char buf[32];
+    long long a = (_cents < 0) ? -_cents : _cents;
+
+    snprintf(buf, sizeof(buf), "%s%lld.%02lld", (_cents < 0) ? "-" : "",
+             a / 100, a % 100);
+
+    return buf;
+}
+
+std::ostream & operator<<(std::ostream & aStream, const Money & anAmount)
+{
+    return aStream << anAmount.str();
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#ifndef __MONEY_H__
+#define __MONEY_H__
+
+#include <string>
+#include <ostream>
+#include "StringRef.h"
+
+/**
+   @brief An amount of money, in cents
+
+   Prices and totals are kept as a whole number of cents (64 bits), so
+   that sums are exact: adding 0.10 ten times makes 1.00. Amounts are
+   read from the text returned by the database ("19.9", "19.90",
+   "175") and printed with two decimals.
+
+   sum() adds long runs of amounts, such as the orders of a report: it
+   keeps independent partial sums, so that no addition waits for the
+   previous one.
+ */
+class Money
+{
+private:
+    long long _cents;
+
+    explicit Money(long long aCents) : _cents(aCents) {}
+
+public:
+    Money() : _cents(0) {}
+
+    static Money fromCents(long long aCents) { return Money(aCents); }
+    static Money fromFloat(double aValue);
+    static bool parse(const StringRef & aText, Money & aValue);
+
+    static Money sum(const Money *aValues, size_t aCount);
+
+    long long cents() const { return _cents; }
+    /** The amount rounded to whole units */
+    long long rounded() const {
+        return (_cents >= 0 ? _cents + 50 : _cents - 50) / 100;
+    }
+    std::string str() const;
+
+    Money & operator+=(const Money & anAmount) {
+        _cents += anAmount._cents;
+        return *this;
+    }
+    Money & operator-=(const Money & anAmount) {
+        _cents -= anAmount._cents;
+        return *this;
+    }
+    Money operator+(const Money & anAmount) const {
+        return Money(_cents + anAmount._cents);
+    }
+    Money operator-(const Money & anAmount) const {
+        return Money(_cents - anAmount._cents);
+    }
+    Money operator*(int aQuantity) const {
+        return Money(_cents * aQuantity);
+    }
+
+    bool operator==(const Money & anAmount) const {
+        return _cents == anAmount._cents;
+    }
+    bool operator!=(const Money & anAmount) const {
+        return _cents != anAmount._cents;
+    }
+    bool operator<(const Money & anAmount) const {
+        return _cents < anAmount._cents;
+    }
+    bool operator<=(const Money & anAmount) const {
+        return _cents <= anAmount._cents;
+    }
+    bool operator>(const Money & anAmount) const {
+        return _cents > anAmount._cents;
+    }
+};
+
+std::ostream & operator<<(std::ostream &, const Money &);
+
+#endif /* __MONEY_H__ */
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#ifndef __MUTEX_H__
+#define __MUTEX_H__
+
+#include <pthread.h>
+#include <sys/time.h>
+
+/**
+   @brief Thin wrapper around a pthread mutex
+
+   The mutex can't be copied: use it as a member of the class whose
+   state it protects. A recursive mutex can be locked again by the
+   thread that already owns it.
+
+   @see MutexLocker
+ */
+class Mutex
+{
+private:
+    pthread_mutex_t _mutex;
+
+    Mutex(const Mutex &);
+    Mutex & operator=(const Mutex &);
+
+public:
+    Mutex(bool isRecursive = false) {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        if (isRecursive)
+            pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&_mutex, &attr);
+        pthread_mutexattr_destroy(&attr);
+    }
+    ~Mutex() { pthread_mutex_destroy(&_mutex); }
+
+    void lock() { pthread_mutex_lock(&_mutex); }
+    void unlock() { pthread_mutex_unlock(&_mutex); }
+    bool tryLock() { return (pthread_mutex_trylock(&_mutex) == 0); }
+    pthread_mutex_t *handle() { return &_mutex; }
+};
+
+/**
+   @brief Scoped lock: the mutex is acquired by the constructor and
+          released by the destructor.
+ */
+class MutexLocker
+{
+private:
+    Mutex & _mutex;
+
+    MutexLocker(const MutexLocker &);
+    MutexLocker & operator=(const MutexLocker &);
+
+public:
+    MutexLocker(Mutex & aMutex) : _mutex(aMutex) { _mutex.lock(); }
+    ~MutexLocker() { _mutex.unlock(); }
+};
+
+/**
+   @brief Thin wrapper around a pthread condition variable
+
+   The associated Mutex must be held by the caller of wait() and
+   timedWait(); spurious wake-ups are possible, so always re-check the
+   predicate in a loop.
+ */
+class Condition
+{
+private:
+    pthread_cond_t _cond;
+
+    Condition(const Condition &);
+    Condition & operator=(const Condition &);
+
+public:
+    Condition() { pthread_cond_init(&_cond, NULL); }
+    ~Condition() { pthread_cond_destroy(&_cond); }
+
+    void wait(Mutex & aMutex) { pthread_cond_wait(&_cond, aMutex.handle()); }
+    void signal() { pthread_cond_signal(&_cond); }
+    void broadcast() { pthread_cond_broadcast(&_cond); }
+
+    /** Wait at most aMsec milliseconds, returns false on timeout */
+    bool timedWait(Mutex & aMutex, long aMsec) {
+        struct timeval now;
+        struct timespec until;
+
+        gettimeofday(&now, NULL);
+        long usec = now.tv_usec + (aMsec % 1000) * 1000;
+        until.tv_sec = now.tv_sec + aMsec / 1000 + usec / 1000000;
+        until.tv_nsec = (usec % 1000000) * 1000;
+
+        return (pthread_cond_timedwait(&_cond, aMutex.handle(),
+                                       &until) == 0);
+    }
+};
+
+#endif /* __MUTEX_H__ */
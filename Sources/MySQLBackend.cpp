@@ -0,0 +1,267 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#include "MySQLBackend.h"
+
+#ifdef HAVE_MYSQLPP
+
+#include <mysql++.h>
+
+/**
+   @brief Default constructor
+
+   @param[in]    aServer     Server to connect to
+   @param[in]    anUser      Username
+   @param[in]    aPasswd     Password
+   @param[in]    aDB         Database name
+ */
+MySQLBackend::MySQLBackend(const string & aServer, const string & anUser,
+                           const string & aPasswd, const string & aDB) :
+    _server(aServer), _user(anUser), _passwd(aPasswd), _db(aDB)
+{
+    LOG_CTOR();
+    _conn = NULL;
+}
+
+/**
+   @brief Default destructor
+ */
+MySQLBackend::~MySQLBackend()
+{
+    LOG_DTOR();
+    disconnect();
+}
+
+/**
+   @brief Returns the name of the backend
+ */
+const char *MySQLBackend::name() const
+{
+    return "mysql";
+}
+
+/**
+   @brief Connect to the server
+
+   Multiple statements are enabled, since stored procedures return
+   more than one result set.
+
+   @return    True if connection was established successfully
+ */
+bool MySQLBackend::connect()
+{
+    disconnect();
+
+    _conn = new mysqlpp::Connection(false);
+    _conn->set_option(new mysqlpp::MultiStatementsOption(true));
+    if (!_conn->connect(_db.c_str(), _server.c_str(), _user.c_str(),
+                        _passwd.c_str())) {
+        cerr << "unable to connect to database (" << _conn->error()
+             << ")\n";
+        delete _conn;
+        _conn = NULL;
+
+        return false;
+    }
+
+    return true;
+}
+
+/**
+   @brief Drop the connection to the server
+ */
+void MySQLBackend::disconnect()
+{
+    if (_conn) {
+        _conn->disconnect();
+        delete _conn;
+        _conn = NULL;
+    }
+}
+
+/**
+   @brief Test connection status
+
+   @return    True if connected
+ */
+bool MySQLBackend::isConnected()
+{
+    return (_conn && _conn->connected());
+}
+
+/**
+   @brief Returns a new backend with the same settings
+ */
+StorageBackend *MySQLBackend::clone()
+{
+    return new MySQLBackend(_server, _user, _passwd, _db);
+}
+
+/**
+   @brief Copy a mysql++ result into a backend neutral one
+
+   @param[in]    aResult The result fetched by mysql++
+   @param[out]   res     The converted result
+ */
+void MySQLBackend::convert(mysqlpp::StoreQueryResult & aResult,
+                           ResultSet & res)
+{
+    for (size_t i = 0; i < aResult.num_fields(); i++)
+        res.addColumn(aResult.field_name(i));
+
+    for (size_t r = 0; r < aResult.num_rows(); r++) {
+        const mysqlpp::Row & row = aResult[r];
+        Record & rec = res.addRecord();
+
+        for (size_t f = 0; f < row.size(); f++) {
+            const mysqlpp::String & value = row[int(f)];
+            rec.append(Field(string(value.data(), value.length()),
+                             value.is_null()));
+        }
+    }
+}
+
+/**
+   @brief Run a statement returning one or more result sets
+
+   @param[in]    aSql    The statement
+   @param[out]   res     All the result sets
+   @return    True if successful
+ */
+bool MySQLBackend::query(const string & aSql, ResultSets & res)
+{
+    mysqlpp::Query q = _conn->query(aSql);
+    mysqlpp::StoreQueryResult r = q.store();
+
+    if (!r && _conn->errnum())
+        return false;
+
+    res.push_back(ResultSet());
+    convert(r, res.back());
+
+    // fetch all remaining result sets, if any
+    while (q.more_results()) {
+        r = q.store_next();
+        res.push_back(ResultSet());
+        convert(r, res.back());
+    }
+
+    return true;
+}
+
+/**
+   @brief Run a statement returning no records
+
+   @param[in]    aSql        The statement
+   @param[out]   rows        Number of affected rows, if not NULL
+   @param[out]   insertID    Last AUTO_INCREMENT value, if not NULL
+   @return    True if successful
+ */
+bool MySQLBackend::execute(const string & aSql, ulonglong *rows,
+                           ulonglong *insertID)
+{
+    mysqlpp::Query q = _conn->query(aSql);
+    mysqlpp::SimpleResult r = q.execute();
+
+    if (!r)
+        return false;
+
+    if (rows)
+        *rows = r.rows();
+    if (insertID)
+        *insertID = r.insert_id();
+
+    // stored procedures also return a status
+    while (q.more_results())
+        q.store_next();
+
+    return true;
+}
+
+/**
+   @brief Quote and escape a value, according to the connection charset
+
+   @param[in]    aValue  The value
+   @return    The SQL string literal
+ */
+string MySQLBackend::quote(const string & aValue)
+{
+    mysqlpp::Query q = _conn->query();
+    q << mysqlpp::quote << aValue;
+
+    return q.str();
+}
+
+/**
+   @brief Start a transaction
+ */
+bool MySQLBackend::begin()
+{
+    return execute("START TRANSACTION");
+}
+
+/**
+   @brief Commit the current transaction
+ */
+bool MySQLBackend::commit()
+{
+    return execute("COMMIT");
+}
+
+/**
+   @brief Rollback the current transaction
+ */
+bool MySQLBackend::rollback()
+{
+    return execute("ROLLBACK");
+}
+
+/**
+   @brief Returns the message of the last error
+ */
+string MySQLBackend::error()
+{
+    return _conn ? _conn->error() : "not connected";
+}
+
+/**
+   @brief Checksum of the columns of all tables of the database
+
+   A single query on information_schema: a column added, dropped,
+   renamed, moved or retyped changes the result.
+ */
+string MySQLBackend::schemaVersion()
+{
+    ResultSets res;
+
+    if (!query("SELECT COUNT(*), SUM(CRC32(CONCAT_WS('.', table_name, "
+               "column_name, ordinal_position, column_type))) "
+               "FROM information_schema.columns "
+               "WHERE table_schema = DATABASE()", res) ||
+        res.empty() || res[0].empty())
+        return "";
+
+    return res[0][0][0].str() + ":" + res[0][0][1].str();
+}
+
+/**
+   @brief Init the client library for the calling thread
+ */
+void MySQLBackend::threadStart()
+{
+    mysqlpp::Connection::thread_start();
+}
+
+/**
+   @brief Release the resources of the calling thread
+ */
+void MySQLBackend::threadEnd()
+{
+    mysqlpp::Connection::thread_end();
+}
+
+#endif /* HAVE_MYSQLPP */
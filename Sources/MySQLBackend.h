@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#ifndef __MYSQLBACKEND_H__
+#define __MYSQLBACKEND_H__
+
+#include "Storage.h"
+
+#ifdef HAVE_MYSQLPP
+
+namespace mysqlpp {
+    class Connection;
+    class StoreQueryResult;
+}
+
+/**
+   @brief Storage backend talking to a MySQL server through mysql++
+
+   This is the default backend: the schema, views and stored
+   procedures are the ones of Database/seng_dump.sql.
+ */
+class MySQLBackend : public StorageBackend
+{
+private:
+    mysqlpp::Connection *_conn;
+    string _server;
+    string _user;
+    string _passwd;
+    string _db;
+
+    void convert(mysqlpp::StoreQueryResult & aResult, ResultSet & res);
+
+public:
+    MySQLBackend(const string & aServer, const string & anUser,
+                 const string & aPasswd, const string & aDB);
+    virtual ~MySQLBackend();
+
+    const char *name() const;
+    bool connect();
+    void disconnect();
+    bool isConnected();
+    StorageBackend *clone();
+
+    bool query(const string & aSql, ResultSets & res);
+    bool execute(const string & aSql, ulonglong *rows = NULL,
+                 ulonglong *insertID = NULL);
+    string quote(const string & aValue);
+
+    bool begin();
+    bool commit();
+    bool rollback();
+    string error();
+    string schemaVersion();
+
+    void threadStart();
+    void threadEnd();
+};
+
+#endif /* HAVE_MYSQLPP */
+
+#endif /* __MYSQLBACKEND_H__ */
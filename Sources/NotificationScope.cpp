@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#include "NotificationScope.h"
+
+/** Innermost open scope of the thread */
+static __thread NotificationScope *currentScope = NULL;
+/** Scopes of the thread being delivered, innermost first */
+static __thread NotificationScope *deliveringScope = NULL;
+
+/**
+   @brief Returns the name of the changed key
+ */
+const string & ChangeSet::Change::name() const
+{
+    return PropertyKeys::instance().name(key);
+}
+
+/**
+   @brief Add a change, coalescing it with the previous ones
+
+   @param[in]    aKey    The key which changed
+   @param[in]    anOld   Its value before the change
+   @param[in]    aNew    Its value after the change
+ */
+void ChangeSet::record(KeyID aKey, const Field & anOld, const Field & aNew)
+{
+    vector<Change>::iterator it;
+    for (it = _changes.begin(); it != _changes.end(); it++) {
+        if ((*it).key == aKey) {
+            // the old value is the one before the first change
+            (*it).newValue = aNew;
+            return;
+        }
+    }
+
+    Change c;
+    c.key = aKey;
+    c.oldValue = anOld;
+    c.newValue = aNew;
+    _changes.push_back(c);
+}
+
+/**
+   @brief Add the changes made after the ones of the receiver
+
+   @param[in]    aChangeSet  The later changes
+ */
+void ChangeSet::merge(const ChangeSet & aChangeSet)
+{
+    const_iterator it;
+    for (it = aChangeSet.begin(); it != aChangeSet.end(); it++)
+        record((*it).key, (*it).oldValue, (*it).newValue);
+}
+
+/**
+   @brief Look for the change of a key
+
+   @param[in]    aKey    The key
+   @return    The change, NULL if the key didn't change
+ */
+const ChangeSet::Change *ChangeSet::change(KeyID aKey) const
+{
+    const_iterator it;
+    for (it = _changes.begin(); it != _changes.end(); it++)
+        if ((*it).key == aKey)
+            return &(*it);
+
+    return NULL;
+}
+
+/**
+   @brief Look for the change of a key, by name
+
+   @param[in]    aKey    The name of the key
+   @return    The change, NULL if the key didn't change
+ */
+const ChangeSet::Change *ChangeSet::change(const string & aKey) const
+{
+    KeyID anID = PropertyKeys::instance().find(aKey);
+
+    return (anID != KEY_NONE) ? change(anID) : NULL;
+}
+
+
+/**
+   @brief Open a scope on the calling thread
+
+   If a scope is already open, the new one is nested in it.
+ */
+NotificationScope::NotificationScope()
+{
+    LOG_CTOR();
+    _outer = currentScope;
+    _closed = false;
+    currentScope = this;
+}
+
+/**
+   @brief Commit the scope, if not yet committed nor discarded
+ */
+NotificationScope::~NotificationScope()
+{
+    LOG_DTOR();
+    commit();
+}
+
+/**
+   @brief Returns the innermost open scope of the calling thread
+
+   @return    The scope, NULL if changes are notified immediately
+ */
+NotificationScope *NotificationScope::current()
+{
+    return currentScope;
+}
+
+/**
+   @brief Stop collecting changes
+
+   Scopes must be closed in reverse order of creation: the outer scope
+   becomes the current one again.
+ */
+void NotificationScope::close()
+{
+    _closed = true;
+    if (currentScope == this)
+        currentScope = _outer;
+}
+
+/**
+   @brief Collect a change of an observed object
+
+   @param[in]    anObject    The object which changed
+   @param[in]    aKey        The key which changed
+   @param[in]    anOld       The value before the change
+   @param[in]    aNew        The value after the change
+ */
+void NotificationScope::record(Observable *anObject, KeyID aKey,
+                               const Field & anOld, const Field & aNew)
+{
+    map<Observable *, size_t>::const_iterator it = _index.find(anObject);
+
+    if (it == _index.end()) {
+        _index[anObject] = _pending.size();
+        _pending.push_back(make_pair(anObject, ChangeSet()));
+        _pending.back().second.record(aKey, anOld, aNew);
+    } else
+        _pending[(*it).second].second.record(aKey, anOld, aNew);
+}
+
+/**
+   @brief Drop the changes of an object which is being destroyed
+
+   Called by Observable: the changes of the object are removed from
+   every open or delivering scope of the thread.
+
+   @param[in]    anObject    The object
+ */
+void NotificationScope::forget(Observable *anObject)
+{
+    NotificationScope *scopes[] = { currentScope, deliveringScope };
+
+    for (int i = 0; i < 2; i++) {
+        for (NotificationScope *s = scopes[i]; s; s = s->_outer) {
+            map<Observable *, size_t>::iterator it = s->_index.find(anObject);
+            if (it == s->_index.end())
+                continue;
+
+            // keep positions valid: the entry is skipped when delivering
+            s->_pending[(*it).second].first = NULL;
+            s->_index.erase(it);
+        }
+    }
+}
+
+/**
+   @brief Deliver the collected changes
+
+   A nested scope hands its changes over to the outer one. The
+   outermost scope calls Observer::objectDidChange() once per changed
+   object and observer; changes made by observers while being notified
+   are notified immediately.
+ */
+void NotificationScope::commit()
+{
+    if (_closed)
+        return;
+    close();
+
+    if (_outer) {
+        for (size_t i = 0; i < _pending.size(); ++i) {
+            Observable *o = _pending[i].first;
+            const ChangeSet & changes = _pending[i].second;
+
+            ChangeSet::const_iterator it;
+            for (it = changes.begin(); o && it != changes.end(); it++)
+                _outer->record(o, (*it).key, (*it).oldValue, (*it).newValue);
+        }
+    } else {
+        // link this scope in the delivering chain, in place of _outer
+        _outer = deliveringScope;
+        deliveringScope = this;
+
+        LOG(3, "Delivering changes of %d objects\n", (int) _pending.size());
+        for (size_t i = 0; i < _pending.size(); ++i)
+            if (_pending[i].first)
+                _pending[i].first->notifyChanges(_pending[i].second);
+
+        deliveringScope = _outer;
+        _outer = NULL;
+    }
+
+    _pending.clear();
+    _index.clear();
+}
+
+/**
+   @brief Drop the collected changes, without notifying them
+ */
+void NotificationScope::discard()
+{
+    if (_closed)
+        return;
+    close();
+
+    LOG(3, "Discarded changes of %d objects\n", (int) _pending.size());
+    _pending.clear();
+    _index.clear();
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#ifndef __NOTIFICATIONSCOPE_H__
+#define __NOTIFICATIONSCOPE_H__
+
+#include "common.h"
+#include "Storage.h"
+#include "Observable.h"
+
+using namespace std;
+
+/**
+   @brief The changes made to an object within a NotificationScope
+
+   There is one entry per key, however many times the key was set: it
+   holds the value before the first change and the value after the
+   last one. Values are null when unknown (e.g. the key had never been
+   set, or the object didn't tell).
+ */
+class ChangeSet
+{
+public:
+    /** A changed key, with its old and new values */
+    struct Change {
+        KeyID key;
+        Field oldValue;
+        Field newValue;
+
+        const string & name() const;
+    };
+
+    typedef vector<Change>::const_iterator const_iterator;
+
+private:
+    vector<Change> _changes;
+
+public:
+    void record(KeyID aKey, const Field & anOld, const Field & aNew);
+    void merge(const ChangeSet & aChangeSet);
+
+    const Change *change(KeyID aKey) const;
+    const Change *change(const string & aKey) const;
+    bool contains(KeyID aKey) const { return change(aKey) != NULL; }
+
+    size_t size() const { return _changes.size(); }
+    bool empty() const { return _changes.empty(); }
+    const_iterator begin() const { return _changes.begin(); }
+    const_iterator end() const { return _changes.end(); }
+};
+
+/**
+   @brief Batches the change notifications of a unit of work
+
+   While a scope is open on a thread, observed objects changed by that
+   thread don't notify their observers key by key: changes are
+   collected, coalesced per object and key, and delivered when the
+   scope is committed (or destroyed) with one call to
+   Observer::objectDidChange() per object and observer.
+   willChangeValueForKey() is not sent within a scope: the old values
+   travel in the change set.
+
+   Scopes can be nested: an inner scope hands its changes over to the
+   outer one when committed, only the outermost delivers them.
+   Discarding a scope drops the changes collected by it, e.g. when the
+   transaction they belonged to failed.
+
+   @code
+   NotificationScope scope;
+   p->setValueForKey(KEY_PRD_NAME, aName);
+   p->setValueForKey(KEY_PRD_PRICE, aPrice);
+   if (p->update())
+       scope.commit();
+   else
+       scope.discard();
+   @endcode
+ */
+class NotificationScope
+{
+private:
+    /** The scope this one is nested in, if any */
+    NotificationScope *_outer;
+    /** Changed objects, in order of first change */
+    vector< pair<Observable *, ChangeSet> > _pending;
+    /** Position of each changed object in _pending */
+    map<Observable *, size_t> _index;
+    bool _closed;
+
+    void close();
+
+    NotificationScope(const NotificationScope &);
+    NotificationScope & operator=(const NotificationScope &);
+
+public:
+    NotificationScope();
+    ~NotificationScope();
+
+    void record(Observable *anObject, KeyID aKey,
+                const Field & anOld, const Field & aNew);
+    static void forget(Observable *anObject);
+    void commit();
+    void discard();
+
+    static NotificationScope *current();
+};
+
+#endif /* __NOTIFICATIONSCOPE_H__ */
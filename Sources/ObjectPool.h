@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#ifndef __OBJECTPOOL_H__
+#define __OBJECTPOOL_H__
+
+#include <vector>
+#include <ostream>
+#include "Mutex.h"
+
+/** Idle objects kept by a pool, the others are deleted */
+#define POOL_CAPACITY       64
+
+/**
+   @brief Recycles the instances of a class
+
+   Objects given back to the pool are not deleted but reset in place
+   and kept aside, up to a capacity: the next acquire() takes one of
+   them instead of building a new one. Containers and strings of the
+   object keep the memory they already hold, so reading a record into
+   a recycled entity mostly copies characters.
+
+   The class T must offer a reset() for each constructor used through
+   the pool, leaving the object as that constructor would, and an
+   isRecyclable() telling whether nobody else can still refer to it
+   (refused objects are deleted). The object is reset by the thread
+   releasing it, so that its state bound to that thread can be dropped.
+
+   @code
+   Product *p = Product::pool().acquire(row);
+   ...
+   Product::pool().release(p);
+   @endcode
+
+   Pools are shared by all the threads.
+ */
+template <class T>
+class ObjectPool
+{
+private:
+    const char *_name;
+    size_t _capacity;
+    std::vector<T *> _idle;
+    Mutex _lock;
+
+    unsigned long _created;
+    unsigned long _reused;
+    unsigned long _released;
+    unsigned long _dropped;
+
+    /** An idle object, NULL if there is none */
+    T *take() {
+        MutexLocker locker(_lock);
+        if (_idle.empty()) {
+            _created++;
+            return NULL;
+        }
+
+        T *anObject = _idle.back();
+        _idle.pop_back();
+        _reused++;
+        return anObject;
+    }
+
+    ObjectPool(const ObjectPool &);
+    ObjectPool & operator=(const ObjectPool &);
+
+public:
+    ObjectPool(const char *aName, size_t aCapacity = POOL_CAPACITY) :
+        _name(aName), _capacity(aCapacity), _created(0), _reused(0),
+        _released(0), _dropped(0) {
+        _idle.reserve(aCapacity);
+    }
+
+    ~ObjectPool() {
+        for (size_t i = 0; i < _idle.size(); i++)
+            delete _idle[i];
+    }
+
+    /** An object as built by its default constructor */
+    T *acquire() {
+        T *anObject = take();
+
+        return anObject ? anObject : new T();
+    }
+
+    /** An object as built from a1 */
+    template <class A1> T *acquire(const A1 & a1) {
+        T *anObject = take();
+        if (!anObject)
+            return new T(a1);
+
+        anObject->reset(a1);
+        return anObject;
+    }
+
+    /** Give back an object got from acquire(), NULL is ignored */
+    void release(T *anObject) {
+        if (!anObject)
+            return;
+
+        bool keep = anObject->isRecyclable();
+        if (keep)
+            anObject->reset();
+
+        {
+            MutexLocker locker(_lock);
+            _released++;
+            if (keep && _idle.size() < _capacity) {
+                _idle.push_back(anObject);
+                return;
+            }
+            _dropped++;
+        }
+
+        delete anObject;
+    }
+
+    /** Objects acquired and not released yet */
+    unsigned long inUse() {
+        MutexLocker locker(_lock);
+        return _created + _reused - _released;
+    }
+
+    /** Objects waiting to be reused */
+    size_t idle() {
+        MutexLocker locker(_lock);
+        return _idle.size();
+    }
+
+    /** Percentage of acquire() served by a recycled object */
+    unsigned int reuseRate() {
+        MutexLocker locker(_lock);
+        unsigned long total = _created + _reused;
+        return total ? (unsigned int) (_reused * 100 / total) : 0;
+    }
+
+    friend std::ostream & operator<<(std::ostream & aStream,
+                                     ObjectPool & p) {
+        unsigned long inUse = p.inUse();
+        size_t idle = p.idle();
+        unsigned int rate = p.reuseRate();
+
+        MutexLocker locker(p._lock);
+        return aStream << p._name << " pool: " << inUse << " in use, "
+                       << idle << "/" << p._capacity << " idle, "
+                       << p._created << " created, " << p._reused
+                       << " reused (" << rate << "%), " << p._dropped
+                       << " dropped\n";
+    }
+};
+
+#endif /* __OBJECTPOOL_H__ */
@@ -7,6 +7,98 @@
 
 #include "Observable.h"
 #include "Observer.h"
+#include "NotificationScope.h"
+#include <algorithm>
+
+/**
+   @brief Notification of the changes made within a NotificationScope
+ 
+   Only the keys the observer registered for are in the change set.
+ 
+   @param[in]    anObject    The object which changed
+   @param[in]    aChangeSet  Its changes, with old and new values
+ */
+void Observer::objectDidChange(Observable *anObject, 
+                               const ChangeSet & aChangeSet)
+{
+    ChangeSet::const_iterator it;
+    for (it = aChangeSet.begin(); it != aChangeSet.end(); it++)
+        didChangeValueForKey((*it).name(), anObject);
+}
+
+/**
+   @brief Intern a property name
+ 
+   @param[in]    aKey    The name of the property
+   @return    The ID of the name, the same at every call
+ */
+KeyID PropertyKeys::intern(const string & aKey)
+{
+    KeyID anID = find(aKey);
+    if (anID != KEY_NONE)
+        return anID;
+    
+    MutexLocker lock(_lock);
+    
+    // interned by another thread in the meanwhile?
+    map<string, KeyID>::const_iterator it = _table->ids.find(aKey);
+    if (it != _table->ids.end())
+        return (*it).second;
+    
+    Table *aTable = new Table(*_table);
+    anID = aTable->names.size();
+    aTable->names.push_back(new string(aKey));
+    aTable->ids[aKey] = anID;
+    
+    Table *old = _table;
+    rcuPublish(_table, aTable);
+    Rcu::retire(old);
+    
+    return anID;
+}
+
+/**
+   @brief Look for an interned property name
+ 
+   @param[in]    aKey    The name of the property
+   @return    The ID of the name, KEY_NONE if never interned
+ */
+KeyID PropertyKeys::find(const string & aKey)
+{
+    RcuReader reader;
+    const Table *aTable = rcuDereference(_table);
+    
+    map<string, KeyID>::const_iterator it = aTable->ids.find(aKey);
+    
+    return (it != aTable->ids.end()) ? (*it).second : KEY_NONE;
+}
+
+/**
+   @brief Returns the name of an interned property
+ 
+   @param[in]    anID    The ID returned by intern()
+   @return    The name of the property
+ */
+const string & PropertyKeys::name(KeyID anID)
+{
+    RcuReader reader;
+    
+    return *(rcuDereference(_table)->names[anID]);
+}
+
+
+/**
+   @brief Serializes the changes to dispatch tables
+ 
+   Registration is rare, a single lock is enough; it's never 
+   destroyed, since objects can be destroyed while the program exits.
+ */
+static Mutex & observersLock()
+{
+    static Mutex *aLock = new Mutex;
+    
+    return *aLock;
+}
 
 /**
    @brief Default constructor
@@ -14,6 +106,37 @@
 Observable::Observable()
 {
     LOG_CTOR();
+    _observers = NULL;
+}
+
+/**
+   @brief Copy constructor
+ 
+   The copy is observed by the same observers as the original.
+ */
+Observable::Observable(const Observable & anObject)
+{
+    LOG_CTOR();
+    RcuReader reader;
+    const ObserverTable *aTable = anObject.observers();
+    
+    _observers = aTable ? new ObserverTable(*aTable) : NULL;
+}
+
+/**
+   @brief Assignment operator, observers are copied as well
+ */
+Observable & Observable::operator=(const Observable & anObject)
+{
+    if (this != &anObject) {
+        RcuReader reader;
+        const ObserverTable *aTable = anObject.observers();
+        
+        MutexLocker lock(observersLock());
+        publish(aTable ? new ObserverTable(*aTable) : NULL);
+    }
+    
+    return *this;
 }
 
 /**
@@ -22,6 +145,24 @@ Observable::Observable()
 Observable::~Observable()
 {
     LOG_DTOR();
+    NotificationScope::forget(this);
+    Rcu::retire(_observers);
+}
+
+/**
+   @brief Replace the dispatch table
+ 
+   Called with observersLock() held: the old table is destroyed when 
+   no thread is dispatching through it.
+ 
+   @param[in]    aTable  The new table, NULL if nobody observes
+ */
+void Observable::publish(const ObserverTable *aTable)
+{
+    const ObserverTable *old = _observers;
+    
+    rcuPublish(_observers, aTable);
+    Rcu::retire(old);
 }
 
 /**
@@ -35,20 +176,39 @@ Observable::~Observable()
    @param[in]    o    Object registering as an observer. 
                       This value must not be NULL
  */
-void Observable::addObserver(std::string aKey, Observer & o)
+void Observable::addObserver(const string & aKey, Observer & o)
+{
+    addObserver(PropertyKeys::instance().intern(aKey), o);
+}
+
+/**
+   @brief Register an observer for an interned key
+ 
+   An observer registered twice for the same key is notified once.
+ 
+   @param[in]    aKey The ID of the notification
+   @param[in]    o    Object registering as an observer
+ */
+void Observable::addObserver(KeyID aKey, Observer & o)
 {
-    map<string, set<Observer *> >::iterator it = _observers.find(aKey);
-    set<Observer *> *aSet;
+    MutexLocker lock(observersLock());
     
-    LOG(3, "Added new observer: %s\n", o.toString().c_str());
+    ObserverTable::const_iterator it;
+    if (_observers) {
+        for (it = _observers->begin(); it != _observers->end(); it++)
+            if ((*it).key == aKey && (*it).observer == &o)
+                return;
+    }
     
-    if (it != _observers.end())
-        aSet = &(*it).second;
-    else
-        aSet = new set<Observer *>();
+    LOG(3, "Added new observer: %s\n", o.toString().c_str());
     
-    aSet->insert(&o);
-    _observers[aKey] = *aSet;
+    ObserverTable *aTable = _observers ? new ObserverTable(*_observers) 
+                                       : new ObserverTable;
+    Registration r;
+    r.key = aKey;
+    r.observer = &o;
+    aTable->push_back(r);
+    publish(aTable);
 }
 
 /**
@@ -61,17 +221,48 @@ void Observable::addObserver(std::string aKey, Observer & o)
 					   the observer
    @param[in]    o     Observer to remove from the dispatch table
  */
-void Observable::removeObserver(string aKey, Observer& o)
+void Observable::removeObserver(const string & aKey, Observer& o)
 {
-    map<string, set<Observer *> >::iterator it = _observers.find(aKey);
-    if (it == _observers.end())
+    KeyID anID = PropertyKeys::instance().find(aKey);
+    if (anID != KEY_NONE)
+        removeObserver(anID, o);
+}
+
+/**
+   @brief Unregister an observer for an interned key
+ 
+   The dispatch table is released with its last entry.
+ 
+   @param[in]    aKey  The ID of the notification
+   @param[in]    o     Observer to remove from the dispatch table
+ */
+void Observable::removeObserver(KeyID aKey, Observer& o)
+{
+    MutexLocker lock(observersLock());
+    
+    if (!_observers)
         return;
     
-    LOG(3, "Removed observer: %s\n", o.toString().c_str());
+    ObserverTable *aTable = new ObserverTable;
+    ObserverTable::const_iterator it;
+    for (it = _observers->begin(); it != _observers->end(); it++) {
+        if ((*it).key == aKey && (*it).observer == &o) {
+            LOG(3, "Removed observer: %s\n", o.toString().c_str());
+            continue;
+        }
+        aTable->push_back(*it);
+    }
+    
+    if (aTable->size() == _observers->size()) {
+        delete aTable;
+        return;
+    }
     
-    set<Observer *> *aSet = &(*it).second;
-    aSet->erase(aSet->find(&o));
-    _observers[aKey] = *aSet;
+    if (aTable->empty()) {
+        delete aTable;
+        aTable = NULL;
+    }
+    publish(aTable);
 }
 
 /**
@@ -79,7 +270,10 @@ void Observable::removeObserver(string aKey, Observer& o)
  */
 void Observable::removeAllObservers() 
 {
-    _observers.clear();
+    MutexLocker lock(observersLock());
+    
+    if (_observers)
+        publish(NULL);
 }
 
 /**
@@ -89,49 +283,159 @@ void Observable::removeAllObservers()
  */
 int Observable::countObservers()
 {
-    return _observers.size();
+    set<KeyID> keys;
+    
+    RcuReader reader;
+    const ObserverTable *aTable = observers();
+    if (!aTable)
+        return 0;
+    
+    ObserverTable::const_iterator it;
+    for (it = aTable->begin(); it != aTable->end(); it++)
+        keys.insert((*it).key);
+    
+    return keys.size();
 }
 
 /**
    @brief Notification before value changes
  
    Invoked to inform the receiver that the value of a given property 
-   is about to change. 
+   is about to change. Only called when the object has observers (see
+   willChangeValueForKey()).
 
    @return    aKey The name of the property that will change.
  */
-void Observable::willChangeValueForKey(string aKey)
+void Observable::notifyWillChange(const string & aKey)
 {
-    map<string, set<Observer *> >::iterator it = _observers.find(aKey);
-    if (it == _observers.end())
-        return;
-    
-    LOG(3, "willChangeValueForKey('%s')\n", aKey.c_str());
-    
-    set<Observer *> *aSet = &(*it).second;
-    set<Observer *>::iterator sit;
-    for (sit = aSet->begin(); sit != aSet->end(); sit++)
-        (*sit)->willChangeValueForKey(aKey, this);
+    KeyID anID = PropertyKeys::instance().find(aKey);
+    if (anID != KEY_NONE)
+        notifyWillChange(anID);
 }
 
 /**
    @brief Notification after value changed
  
    Invoked to inform the receiver that the value of a given property 
-   has changed.
+   has changed. Only called when the object has observers (see
+   didChangeValueForKey()).
  
    @return    aKey The name of the property that changed.
  */
-void Observable::didChangeValueForKey(string aKey)
+void Observable::notifyDidChange(const string & aKey)
 {
-    map<string, set<Observer *> >::iterator it = _observers.find(aKey);
-    if (it == _observers.end())
+    KeyID anID = PropertyKeys::instance().find(aKey);
+    if (anID != KEY_NONE)
+        notifyDidChange(anID);
+}
+
+/**
+   @brief Notification before value changes, by interned key
+ 
+   @return    aKey The ID of the property that will change.
+ */
+void Observable::notifyWillChange(KeyID aKey)
+{
+    // within a scope, old values are delivered with the change set
+    if (NotificationScope::current())
+        return;
+    
+    RcuReader reader;
+    const ObserverTable *aTable = observers();
+    
+    for (size_t i = 0; aTable && i < aTable->size(); i++) {
+        const Registration & r = (*aTable)[i];
+        if (r.key != aKey)
+            continue;
+        
+        const string & name = PropertyKeys::instance().name(aKey);
+        LOG(3, "willChangeValueForKey('%s')\n", name.c_str());
+        r.observer->willChangeValueForKey(name, this);
+    }
+}
+
+/**
+   @brief Notification after value changed, by interned key
+ 
+   @return    aKey The ID of the property that changed.
+ */
+void Observable::notifyDidChange(KeyID aKey)
+{
+    notifyDidChange(aKey, Field(), Field());
+}
+
+/**
+   @brief Notification after value changed, with the values
+ 
+   Within a NotificationScope the change is collected, to be notified 
+   when the scope is committed; otherwise observers are notified now.
+ 
+   @param[in]    aKey    The ID of the property that changed
+   @param[in]    anOld   The value before the change
+   @param[in]    aNew    The value after the change
+ */
+void Observable::notifyDidChange(KeyID aKey, 
+                                 const Field & anOld, const Field & aNew)
+{
+    NotificationScope *scope = NotificationScope::current();
+    if (scope) {
+        scope->record(this, aKey, anOld, aNew);
         return;
+    }
+    
+    RcuReader reader;
+    const ObserverTable *aTable = observers();
+    
+    for (size_t i = 0; aTable && i < aTable->size(); i++) {
+        const Registration & r = (*aTable)[i];
+        if (r.key != aKey)
+            continue;
+        
+        const string & name = PropertyKeys::instance().name(aKey);
+        LOG(3, "didChangeValueForKey('%s')\n", name.c_str());
+        r.observer->didChangeValueForKey(name, this);
+    }
+}
+
+/**
+   @brief Deliver the changes collected by a NotificationScope
+ 
+   Each observer is called once, with the changes of the keys it 
+   registered for.
+ 
+   @param[in]    aChangeSet  The changes of the receiver
+ */
+void Observable::notifyChanges(const ChangeSet & aChangeSet)
+{
+    RcuReader reader;
+    const ObserverTable *aTable = observers();
+    if (!aTable)
+        return;
+    
+    // build the change set of each observer first
+    vector<Observer *> targets;
+    vector<ChangeSet> changes;
     
-    LOG(3, "didChangeValueForKey('%s')\n", aKey.c_str());
+    ChangeSet::const_iterator c;
+    ObserverTable::const_iterator it;
+    for (c = aChangeSet.begin(); c != aChangeSet.end(); c++) {
+        for (it = aTable->begin(); it != aTable->end(); it++) {
+            if ((*it).key != (*c).key)
+                continue;
+            
+            size_t j = find(targets.begin(), targets.end(), 
+                            (*it).observer) - targets.begin();
+            if (j == targets.size()) {
+                targets.push_back((*it).observer);
+                changes.push_back(ChangeSet());
+            }
+            changes[j].record((*c).key, (*c).oldValue, (*c).newValue);
+        }
+    }
     
-    set<Observer *> *aSet = &(*it).second;
-    set<Observer *>::iterator sit;
-    for (sit = aSet->begin(); sit != aSet->end(); sit++)
-        (*sit)->didChangeValueForKey(aKey, this);
+    for (size_t i = 0; i < targets.size(); ++i) {
+        LOG(3, "objectDidChange(%d keys): %s\n", (int) changes[i].size(), 
+            targets[i]->toString().c_str());
+        targets[i]->objectDidChange(this, changes[i]);
+    }
 }
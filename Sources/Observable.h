@@ -9,11 +9,60 @@
 #define __OBSERVABLE_H__
 
 #include "common.h"
+#include "Mutex.h"
+#include "SmallVector.h"
+#include "Rcu.h"
 
 using namespace std;
 
-// Forward declaration
+// Forward declarations
 class Observer;
+class Field;
+class ChangeSet;
+class NotificationScope;
+
+/** Interned property key */
+typedef unsigned int KeyID;
+/** A key which was never interned */
+#define KEY_NONE            ((KeyID) -1)
+/** Observers stored inside an Observable before allocating */
+#define OBSERVERS_INLINE    4
+
+/**
+   The class PropertyKeys interns property names: each name gets a 
+   small integer ID, the same for every entity and for the whole life 
+   of the process, so that observers can be matched by comparing 
+   integers instead of strings.
+ 
+   Entity columns are interned as soon as their descriptor is read 
+   (see EntityDescriptor).
+ 
+   Lookups don't lock: interning a new name publishes a new copy of 
+   the table (see Rcu). Names are never freed.
+ */
+class PropertyKeys : public Singleton<PropertyKeys>
+{
+private:
+    /** An immutable version of the table */
+    struct Table {
+        map<string, KeyID> ids;
+        /** Names, indexed by ID */
+        vector<const string *> names;
+    };
+    
+    Table *_table;
+    /** Serializes intern() */
+    Mutex _lock;
+    
+protected:
+    friend class Singleton<PropertyKeys>;
+    PropertyKeys() : _table(new Table) {}
+    
+public:
+    KeyID intern(const string & aKey);
+    KeyID find(const string & aKey);
+    const string & name(KeyID anID);
+};
 
 /**
    The class Observable defines a mechanism that allows objects to be 
@@ -22,23 +71,84 @@ class Observer;
    You can observe any object properties including simple attributes. 
    Observers are informed of the type of change made — as well as which 
    objects are involved in the change.
+ 
+   Keys are interned (see PropertyKeys): registering an observer and 
+   dispatching a change compare integers only.
+ 
+   Almost no object is ever observed: the dispatch table is allocated 
+   by the first addObserver(), and until then notifying a change costs 
+   an inline test of a null pointer.
+ 
+   Within a NotificationScope changes are not notified one by one, but 
+   collected with their old and new values and delivered at once.
+ 
+   Observers can be registered and removed by any thread, while other 
+   threads notify changes: the dispatch table is never changed in 
+   place, registration publishes a new copy and retires the old one 
+   (see Rcu). Dispatch takes no lock, it walks the version current when 
+   it started: an observer removed meanwhile may still receive that 
+   notification, so it must not be destroyed before every thread which 
+   could be notifying it has returned.
  */
 class Observable
 {
 private:
-    /** Association between the key and the list of observers */
-    map<string, set<Observer *> > _observers;
+    /** An observer registered for a key */
+    struct Registration {
+        KeyID key;
+        Observer *observer;
+    };
+    
+    /** Dispatch table: a flat list, observed objects have a few entries */
+    typedef SmallVector<Registration, OBSERVERS_INLINE> ObserverTable;
+    
+    /** Published version of the table, NULL while nobody observes */
+    const ObserverTable *_observers;
+    
+    const ObserverTable *observers() const { 
+        return rcuDereference(_observers); 
+    }
+    void publish(const ObserverTable *aTable);
+    
+    void notifyWillChange(const string & aKey);
+    void notifyDidChange(const string & aKey);
+    void notifyWillChange(KeyID aKey);
+    void notifyDidChange(KeyID aKey);
+    void notifyDidChange(KeyID aKey, const Field & anOld, const Field & aNew);
+    void notifyChanges(const ChangeSet & aChangeSet);
+    
+    friend class NotificationScope;
 
 protected:
-    virtual void willChangeValueForKey(string aKey);
-    virtual void didChangeValueForKey(string aKey);
+    void willChangeValueForKey(const string & aKey) {
+        if (observers()) notifyWillChange(aKey);
+    }
+    void didChangeValueForKey(const string & aKey) {
+        if (observers()) notifyDidChange(aKey);
+    }
+    void willChangeValueForKey(KeyID aKey) {
+        if (observers()) notifyWillChange(aKey);
+    }
+    void didChangeValueForKey(KeyID aKey) {
+        if (observers()) notifyDidChange(aKey);
+    }
+    void didChangeValueForKey(KeyID aKey, 
+                              const Field & anOld, const Field & aNew) {
+        if (observers()) notifyDidChange(aKey, anOld, aNew);
+    }
     
 public:
     Observable();
+    Observable(const Observable & anObject);
+    Observable & operator=(const Observable & anObject);
     virtual ~Observable();
+    
+    bool hasObservers() const { return observers() != NULL; }
 
-    virtual void addObserver(string aKey, Observer & o);    
-    virtual void removeObserver(string aKey, Observer & o);    
+    void addObserver(const string & aKey, Observer & o);
+    void removeObserver(const string & aKey, Observer & o);
+    virtual void addObserver(KeyID aKey, Observer & o);    
+    virtual void removeObserver(KeyID aKey, Observer & o);    
     virtual void removeAllObservers();    
     virtual int countObservers();
 };
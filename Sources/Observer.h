@@ -12,8 +12,9 @@
 
 using namespace std;
 
-// Forward declaration
+// Forward declarations
 class Observable;
+class ChangeSet;
 
 /**
    The class Observer is the base class to derive in order to receive 
@@ -22,15 +23,21 @@ class Observable;
    attribute of an instance of a class: whenever this attribute is 
    changed, the observer is notified before and after value changed.
  
-   @see Observable
+   Changes made within a NotificationScope are notified by a single 
+   call to objectDidChange() per object; by default, it calls 
+   didChangeValueForKey() for each changed key.
+ 
+   @see Observable, NotificationScope
  */
 class Observer 
 {
 public:
     virtual ~Observer() {}
     
-    virtual void willChangeValueForKey(string, Observable *) = 0;
-    virtual void didChangeValueForKey(string, Observable *) = 0;
+    virtual void willChangeValueForKey(const string &, Observable *) = 0;
+    virtual void didChangeValueForKey(const string &, Observable *) = 0;
+    virtual void objectDidChange(Observable *anObject, 
+                                 const ChangeSet & aChangeSet);
     virtual string & toString() = 0;
 };
 
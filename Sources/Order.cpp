@@ -7,12 +7,16 @@
 
 #include "Order.h"
 #include "User.h"
-#include <ctime>
+#include "Inventory.h"
+#include "IdAllocator.h"
+#include "SharedCache.h"
+#include "CatalogSnapshot.h"
 
 #define KEY_ORD_OID         "oid"
 #define KEY_ORD_UID         "uid"
 #define KEY_ORD_DATE        "date"
 #define KEY_ORD_TOTAL       "total"
+#define SQL_PLACE_ORDER     "CALL place_order(%0, %1, %2q)"
 
 /**
    @brief Default constructor
@@ -20,167 +24,205 @@
 Order::Order() : ManagedObject("orders")
 {
     LOG_CTOR();
-    _user = NULL;
 }
 
 /**
    @brief Construct an instance of Order with data fetched 
           from the database
  
-   @param[in] aRow An instance of mysqlpp::Row with data
+   @param[in] aRow A record with data
  */
-Order::Order(Row &aRow) : ManagedObject("orders", aRow)
+Order::Order(const Record &aRow): ManagedObject("orders", aRow)
 {    
     LOG_CTOR();
-    _user = User::userByID(intForKey(KEY_ORD_UID));
+    _user.reset(User::userByID(intForKey(KEY_ORD_UID)));
 }
 
 /**
    @brief Default destructor
  
-   If the user is linked to an user, dealloc the instance of class User.
+   The instance of class User is deallocated with the last copy of the 
+   order.
  */
 Order::~Order()
 {
     LOG_DTOR();
-    if (_user)
-        delete _user;
 }
 
 /**
    @brief Create a new order
  
+   The whole order is placed with a single call to the stored 
+   procedure "place_order": within one transaction the procedure 
+   locks the rows of the products in the basket, checks and decreases 
+   their availability, inserts the order and its details and returns 
+   the order ID and its final total.
+   Basket lines are passed as a list of "pid:qty:price", separated 
+   by commas: the order is refused if a product no longer has the 
+   price shown in the basket, whose line then takes the new price.
+   The order ID is taken from a block reserved by this process (see 
+   IdAllocator), so that the header and its details are written 
+   together without waiting for an AUTO_INCREMENT value.
+ 
    @param[in] anUid    ID of user that places the order
    @param[in] bsk User basket containing products
  
-   @return A pointer to an instance of Order if successful
+   @return A pointer to an instance of Order if successful, NULL if 
+           a product is no longer available, its price changed or an 
+           error occurred
  */
 Order * Order::create(int anUid, Basket & bsk)
 {
-    Order *o = new Order();
-    
-    // get current date and format as expected by mySQL
-    time_t now = time(NULL);
-    struct tm *tmNow = gmtime((const time_t *)&now);
+    // IDs are shared by all the orders placed by this process
+    static IdAllocator orderIDs("orders");
+    unsigned long long oid = orderIDs.next();
     
-    stringstream nowStr;
-    nowStr << (1900+tmNow->tm_year) << "-" << tmNow->tm_mon << "-" 
-           << setfill('0') << setw(2) << tmNow->tm_mday << " " 
-           << tmNow->tm_hour << ":" << tmNow->tm_min  
-           << ":" << tmNow->tm_sec;
-        
-    // set other attributes
-    o->setIntForKey(KEY_ORD_OID, 0);
-    o->setFloatForKey(KEY_ORD_TOTAL, bsk.total());
-    o->setValueForKey(KEY_ORD_DATE, nowStr.str());
-    o->setIntForKey(KEY_ORD_UID, anUid);
-    if (!o->store()) {
-        delete o;
-        LOG(2, "Unable to place the order.\n");
-        
+    // an AUTO_INCREMENT order ID could belong to somebody else's block
+    if (oid == 0)
         return NULL;
-    }
     
-    ulonglong oid = o->getLastInsertID();
+    // encode basket lines
+    stringstream lines;
+    for (Basket::const_iterator it=bsk.begin(); it != bsk.end(); it++) {
+        lines << (it == bsk.begin() ? "" : ",") << (*it).pid << ":" 
+              << (*it).qty << ":" << (*it).price;
+    }
     
     // get an instance of the database
     Database& db = Database::instance();
+    ResultSet res;
     
-    // ask Database for a valid connection to mySQL
-    Connection *conn = db.getConnection();
+    // the status of the procedure call is fetched (and ignored) too
+    SqlParams qp;
+    qp << oid <<anUid << lines.str();
+    if (!db.select(SQL_PLACE_ORDER, res, qp))
+        return NULL;
+
+    if (res.empty() || (int) res[0][KEY_ORD_OID] == 0) {
+        LOG(2, "Unable to place the order (product %d).\n", 
+            res.empty() ? 0 : (int) res[0]["pid"]);
+        
+        // the customer must see the new price before buying
+        Money price;
+        if (!res.empty() && Money::parse(res[0]["price"].str(), price) &&
+            bsk.reprice(res[0]["pid"], price))
+            return NULL;
+        
+        // our stock was out of date: reload it
+        Inventory::instance().reconcile();
+        
+        return NULL;
+    }
     
-    // obtain an instance of mysqlpp::Query and init it
-    Query q = conn->query();
+    db.tableDidChange("orders");
+    db.tableDidChange("order_details");
+    db.tableDidChange("products");
     
-    // add to "order_details" all items present in the basket
+    // the procedure decreased the stock of every product sold
     for (Basket::const_iterator it=bsk.begin(); it != bsk.end(); it++) {
-        q << "INSERT INTO order_details VALUES (" << oid << ", " 
-          << (*it).first << ", " << (*it).second << ")";
-        q.exec();
-        q.reset();
+        CatalogSnapshot::instance().productDidChange((*it).pid);
+        SharedCache::instance().invalidate((*it).pid);
     }
-
+    
+    Order *o = new Order();
+    o->setValueForKey(KEY_ORD_OID, (string) res[0][KEY_ORD_OID]);
+    o->setValueForKey(KEY_ORD_TOTAL, (string) res[0][KEY_ORD_TOTAL]);
+    o->setValueForKey(KEY_ORD_DATE, (string) res[0][KEY_ORD_DATE]);
+    o->setIntForKey(KEY_ORD_UID, anUid);
+    
+    // the order has already been stored by the procedure
+    o->_fault = false;
+    o->_updatedKeys.clear();
+    
     return o;
 }
 
+/**
+   @brief Returns the total of the order
+ */
+Money Order::getTotal() const
+{
+    Money aTotal;
+    
+    tryMoneyForKey(KEY_ORD_TOTAL, aTotal);
+    
+    return aTotal;
+}
+
+/**
+   @brief Returns the sum of the totals of many orders
+ 
+   @param[in] orders    The orders, such as the ones of a customer
+   @return    Their grand total
+ */
+Money Order::totalOf(const ResultList<Order> & orders)
+{
+    SmallVector<Money, RESULTLIST_INLINE> totals;
+    
+    totals.reserve(orders.size());
+    for (size_t i = 0; i < orders.size(); i++)
+        totals.push_back(orders[i].getTotal());
+    
+    return Money::sum(totals.begin(), totals.size());
+}
+
 /**
    @brief Return the list of all orders of a given user
  
    @param[in] pp    An instance of User
  
-   @return    A vector of Order
+   @return    The orders (empty if the user placed none)
  */
-vector<Order *> & Order::ordersForUser(User & pp)
+ResultList<Order> Order::ordersForUser(User & pp)
 {
-    vector<Order *> *orders = new vector<Order *>;
+    ResultList<Order> orders;
     
     // get an instance of the database
     Database& db = Database::instance();
     
-    try {
-        // ask Database for a valid connection to mySQL
-        Connection *conn = db.getConnection();
-        
-        // obtain an instance of mysqlpp::Query and init it
-        Query q = conn->query();
-        q << "SELECT * FROM orders WHERE uid = " << pp.uniqueID()
-          << " ORDER BY oid, date";
-        
-        StoreQueryResult res = q.store();
-        if (!res.empty()) {
-            orders->reserve(res.num_rows());
-            StoreQueryResult::const_iterator it;
-
-            for (it = res.begin(); it != res.end(); it++){
-                Row row = *it;
-                orders->push_back(new Order(row));
-            }
+    ResultSet res;
+    if (db.select("SELECT * FROM orders WHERE uid = %0 ORDER BY oid, date", 
+                  res, SqlParams() << pp.uniqueID()) && !res.empty()) {
+        orders.reserve(res.numRows());
+        ResultSet::const_iterator it;
+
+        for (it = res.begin(); it != res.end(); it++){
+            orders.add(*it);
         }
-    } catch (std::exception &e) {
-        cerr << "an error occurred: " << e.what() << endl;
     }
-    
-    return *orders;
+
+    return orders;
 }
 
 /**
    @brief Returns the list of products (and requested quantity) of an order
  
-   @return    A std::map where the key is product ID and the value the quantity
+   @return    Pairs of product ID and quantity, sorted by product ID 
+              (empty if the order has no details)
  */
-map<int, int>& Order::products()
+ResultList< pair<int, int> > Order::products()
 {
-    map<int, int> *prd = NULL;
+    ResultList< pair<int, int> > prd;
     
     // get an instance of the database
     Database& db = Database::instance();
     
-    try {
-        // ask Database for a valid connection to mySQL
-        Connection *conn = db.getConnection();
-        
-        // obtain an instance of mysqlpp::Query and init it
-        Query q = conn->query();
-        q << "SELECT * FROM order_details WHERE oid = "
-        << valueForKey(KEY_ORD_OID);            
+    ResultSet res;
+    if (db.select("SELECT * FROM order_details WHERE oid = %0 ORDER BY pid", 
+                  res, SqlParams() << valueForKey(KEY_ORD_OID)) && 
+        !res.empty()) {
+        ResultSet::const_iterator it;
         
-        StoreQueryResult res = q.store();
-        if (!res.empty()) {
-            prd = new map<int, int>;
-            StoreQueryResult::const_iterator it;
-            
-            for (it = res.begin(); it != res.end(); it++){
-                Row row = *it;
-                int key = atoi(row["pid"]);
-                int qty = atoi(row["qty"]);
-                (*prd)[key] = qty;
-            }
+        prd.reserve(res.numRows());
+        for (it = res.begin(); it != res.end(); it++){
+            const Record & row = *it;
+            int key = row["pid"];
+            int qty = row["qty"];
+            prd.add(key, qty);
         }
-    } catch (std::exception &e) {
-        cerr << "an error occurred: " << e.what() << endl;
     }
-    
-    return *prd;
+
+    return prd;
 }
 
 /**
@@ -194,8 +236,12 @@ string Order::primaryKey()
 }
 
 ostream& operator<<(ostream& aStream, Order & o) {    
+    // orders placed by create() know only the ID of their buyer
+    if (!o._user)
+        o._user.reset(User::userByID(o.intForKey(KEY_ORD_UID)));
+    
     return aStream << "ORDER DETAIL\n============\n" <<
-    "Buyer : " << o._user->fullName() << endl <<
+    "Buyer : " << (o._user ? o._user->fullName() : "") << endl <<
     "Date  : " << o.valueForKey(KEY_ORD_DATE) << endl <<
-    "Total : " << o.valueForKey(KEY_ORD_TOTAL) << endl;
+    "Total : " << o.getTotal() << endl;
 }
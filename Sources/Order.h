@@ -10,8 +10,7 @@
 
 #include "ManagedObject.h"
 #include "Basket.h"
-
-using namespace mysqlpp;
+#include "ResultList.h"
 
 // forward declaration
 class User;
@@ -28,18 +27,21 @@ class User;
 class Order : public ManagedObject 
 {
 private:
-    User *_user;
+    /** The buyer, shared by the copies of the order */
+    tr1::shared_ptr<User> _user;
     
 public:
     Order();
-    Order(Row &aRow);
+    Order(const Record &aRow);
     ~Order();
     
     string primaryKey();
     
     static Order *create(int anUid, Basket & bsk);
-    static vector<Order *> & ordersForUser(User & pp);
-    map<int, int>& products();
+    static ResultList<Order> ordersForUser(User & pp);
+    static Money totalOf(const ResultList<Order> & orders);
+    Money getTotal() const;
+    ResultList< pair<int, int> > products();
     
     friend ostream& operator<<(ostream &, Order &);
 };
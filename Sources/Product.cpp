@@ -7,9 +7,34 @@
 
 #include "Product.h"
 #include "Database.h"
+#include "Inventory.h"
+#include "CatalogSnapshot.h"
+#include "SharedCache.h"
+#include "CatalogView.h"
+#include "NotificationScope.h"
 
 #define SQL_CATALOG_PROXY        "SELECT pid FROM catalogue "
-#define SQL_PRODUCT_PROXY        "SELECT * FROM products WHERE pid = "
+#define SQL_PRODUCT_PROXY        "SELECT * FROM products WHERE pid = %0"
+#define SQL_PRODUCT_WATERMARK    "SELECT next_hi FROM sequences " \
+                                 "WHERE name = 'products_changes'"
+#define SQL_PRODUCT_CHANGES      "SELECT * FROM products " \
+                                 "WHERE change_seq > %0 ORDER BY change_seq"
+#define SQL_PRODUCT_TOMBSTONES   "SELECT pid FROM product_tombstones " \
+                                 "WHERE change_seq > %0"
+
+/**
+   @brief Current stock of a product read from the catalog snapshot
+ 
+   The snapshot keeps the stock at export time: the live one is asked 
+   to Inventory, unless we're browsing offline.
+ */
+static int snapshotAvailability(const CatalogSnapshot::ProductRecord *aProduct)
+{
+    if (!Database::instance().isConnected())
+        return aProduct->availability;
+    
+    return Inventory::instance().available(aProduct->pid);
+}
 
 /**
    @brief Default constructor
@@ -21,11 +46,11 @@ Product::Product() : ManagedObject("products")
 
 /**
    @brief Construct a Product with values contained in a 
-          mysqlpp::Row
+          Record
  
-   @see mysqlpp::Row
+   @see Record
  */
-Product::Product(Row & aRow) : ManagedObject("products", aRow)
+Product::Product(const Record & aRow): ManagedObject("products", aRow)
 {
     LOG_CTOR();
 }
@@ -37,6 +62,34 @@ Product::~Product()
 {
 }
 
+/**
+   @brief Keep the entry of the catalog view up to date
+ 
+   Called for every property set, observed or not: the view is told as 
+   soon as one of the columns it shows changes, before the change is 
+   stored. Within a NotificationScope the view waits for update(), so 
+   that a discarded edit never shows.
+ 
+   @param[in]    aKey    The name of the property which changed
+ */
+void Product::valueDidChange(const StringRef & aKey)
+{
+    if (NotificationScope::current())
+        return;
+    
+    CatalogView::instance().productValueDidChange(*this, aKey);
+}
+
+/**
+   @brief Returns the pool of products, used by ProductProxy
+ */
+ObjectPool<Product> & Product::pool()
+{
+    static ObjectPool<Product> products("Product");
+    
+    return products;
+}
+
 /**
    @brief New product creation
  
@@ -52,7 +105,7 @@ Product::~Product()
  
    @return    An instance of the new product
  */
-Product *Product::factory(string aName, int aCid, float aPrice, string aDescr,
+Product *Product::factory(string aName, int aCid, Money aPrice, string aDescr,
                           int aQty, bool isDel)
 {        
     Product *newProduct = new Product();
@@ -60,7 +113,7 @@ Product *Product::factory(string aName, int aCid, float aPrice, string aDescr,
     newProduct->setIntForKey(KEY_PRD_CID, aCid);
     newProduct->setValueForKey(KEY_PRD_NAME, aName);
     newProduct->setValueForKey(KEY_PRD_DESCR, aDescr);
-    newProduct->setFloatForKey(KEY_PRD_PRICE, aPrice);
+    newProduct->setMoneyForKey(KEY_PRD_PRICE, aPrice);
     newProduct->setIntForKey(KEY_PRD_AVAILABILITY, aQty);
     newProduct->setBoolForKey(KEY_PRD_DELETED, isDel);
     
@@ -70,32 +123,108 @@ Product *Product::factory(string aName, int aCid, float aPrice, string aDescr,
 /**
    @brief Returns a product with given ID
  
-   @param[in] aPid    The requested product ID
+   Copies of the product (catalog snapshot, shared segment) may lag 
+   behind writes of other processes: a product about to be changed 
+   must be read from the database, or its versioned update() would 
+   fail again and again.
+ 
+   @param[in] aPid           The requested product ID
+   @param[in] isForUpdate    True to bypass the copies of the product
  
    @return A pointer to the requested Product, NULL if not found
  */
-Product * Product::productByID(int aPid)
+Product * Product::productByID(int aPid, bool isForUpdate)
 {
     // get an instance of the database
     Database &db = Database::instance();
     
-    // ask Database for a valid connection to mySQL
-    Connection *conn = db.getConnection();
+    // served by the catalog snapshot, if mapped
+    CatalogSnapshot &snapshot = CatalogSnapshot::instance();
+    const CatalogSnapshot::ProductRecord *r = NULL;
+    if (!isForUpdate && (r = snapshot.product(aPid)))
+        return new Product(snapshot.productRow(r));
     
-    // obtain an instance of mysqlpp::Query and init it
-    Query q = conn->query();
-    q << SQL_PRODUCT_PROXY << aPid;    
-    StoreQueryResult res = q.store();
-    if (!res.empty()) {
-        StoreQueryResult::const_iterator it = res.begin();
-        Row row = *it;
-        
+    // then by the segment shared with other local processes
+    SharedCache &shared = SharedCache::instance();
+    Record row;
+    uint32_t ticket;
+    if (shared.lookup(aPid, row, &ticket) && !isForUpdate)
         return new Product(row);
+    
+    ResultSet res;
+    if (db.select(SQL_PRODUCT_PROXY, res, SqlParams() << aPid) && 
+        !res.empty()) {
+        shared.put(res.front(), ticket);
+        return new Product(res.front());
     }
     
     return NULL;
 }
 
+/**
+   @brief Returns the number of the last committed write to products
+ 
+   @return    The current watermark, zero if the schema doesn't 
+              number changes
+   @see changesSince()
+ */
+ulonglong Product::changeWatermark()
+{
+    // get an instance of the database
+    Database &db = Database::instance();
+    
+    ResultSet res;
+    if (!db.select(SQL_PRODUCT_WATERMARK, res) || res.empty())
+        return 0;
+    
+    return strtoull(res[0][0].c_str(), NULL, 10);
+}
+
+/**
+   @brief Fetch the products written after a watermark
+ 
+   Products changed (or marked as deleted, see "deleted") since 
+   aWatermark are returned in the order they were written, removed 
+   ones by ID only. The watermark is read before the changes: a 
+   write committed meanwhile can be returned twice, never missed.
+ 
+   @param[in,out] aWatermark  The last watermark seen, updated to the 
+                              current one on success
+   @param[out]    changed     Changed products, to be deleted by the 
+                              caller
+   @param[out]    removed     IDs of the products removed
+   @return    True if successful
+ */
+bool Product::changesSince(ulonglong & aWatermark, 
+                           vector<Product *> & changed, 
+                           vector<int> & removed)
+{
+    // get an instance of the database
+    Database &db = Database::instance();
+    
+    ulonglong watermark = changeWatermark();
+    if (watermark == 0)
+        return false;
+    if (watermark == aWatermark)
+        return true;
+    
+    ResultSet res, gone;
+    if (!db.select(SQL_PRODUCT_CHANGES, res, SqlParams() << aWatermark) ||
+        !db.select(SQL_PRODUCT_TOMBSTONES, gone, SqlParams() << aWatermark))
+        return false;
+    
+    for (size_t i = 0; i < res.numRows(); ++i)
+        changed.push_back(new Product(res[i]));
+    for (size_t i = 0; i < gone.numRows(); ++i)
+        removed.push_back((int) gone[i][0]);
+    
+    LOG(3, "%d product(s) changed, %d removed since %llu\n", 
+        (int) res.numRows(), (int) gone.numRows(), aWatermark);
+    aWatermark = watermark;
+    
+    return true;
+}
+
 /**
    @brief Primary key
  
@@ -108,14 +237,65 @@ string Product::primaryKey()
     return KEY_PRD_PID;
 }
 
+/**
+   @brief Add this product to database
+ 
+   Besides storing the record, products count of CategoryTable is 
+   updated.
+ 
+   @return    True if save was successful
+   @see ManagedObject::store(), CategoryTable::productDidChange()
+ */
+bool Product::store()
+{
+    if (!ManagedObject::store())
+        return false;
+    
+    int pid = intForKey(KEY_PRD_PID);
+    if (pid == 0)
+        pid = (int) getLastInsertID();
+    
+    CategoryTable::instance().productDidChange(pid, intForKey(KEY_PRD_CID),
+                                               boolForKey(KEY_PRD_DELETED));
+    CatalogSnapshot::instance().productDidChange(pid);
+    SharedCache::instance().invalidate(pid);
+    CatalogView::instance().productDidChange(*this, pid);
+    
+    return true;
+}
+
+/**
+   @brief Make changes to this product persistent
+ 
+   Besides updating the record, products count of CategoryTable is 
+   updated (the product could have been moved to another category).
+ 
+   @return    True if update was successful
+   @see ManagedObject::update(), CategoryTable::productDidChange()
+ */
+bool Product::update()
+{
+    if (!ManagedObject::update())
+        return false;
+    
+    CategoryTable::instance().productDidChange(intForKey(KEY_PRD_PID), 
+                                               intForKey(KEY_PRD_CID),
+                                               boolForKey(KEY_PRD_DELETED));
+    CatalogSnapshot::instance().productDidChange(intForKey(KEY_PRD_PID));
+    SharedCache::instance().invalidate(intForKey(KEY_PRD_PID));
+    CatalogView::instance().productDidChange(*this);
+    
+    return true;
+}
+
 /**
    @brief Return the price
  
-   @return A float representing the price
+   @return The price, exact to the cent
  */
-float Product::getPrice()
+Money Product::getPrice()
 {
-    return floatForKey(KEY_PRD_PRICE);
+    return moneyForKey(KEY_PRD_PRICE);
 }
 
 /**
@@ -138,27 +318,26 @@ void Product::showCompatibleProducts(int aPid)
     // get an instance of the database
     Database& db = Database::instance();
     
-    // ask Database for a valid connection to mySQL
-    Connection *conn = db.getConnection();
-    
-    // obtain an instance of mysqlpp::Query and init it
-    Query q = conn->query();
-    q << "CALL offers_by_product(" << aPid << ")";
-    StoreQueryResult res = q.store();
+    // the procedure returns two result sets for each configuration 
+    // (header and products), followed by the status of the call; 
+    // the catalog snapshot, if mapped, returns the same sets
+    ResultSets res;
+    if (!CatalogSnapshot::instance().offersByProduct(aPid, res)) {
+        stringstream sql;
+        sql << "CALL offers_by_product(" << aPid << ")";
+        res = db.cachedStoreAll(sql.str(), 
+                        "configurations,offers,products,categories");
+    }
     
-    for (int i = 1; q.more_results(); ++i) {
+    for (size_t i = 0; i + 1 < res.size(); i += 2) {
         cout << "\n\nCONFIGURATION DETAIL\n====================\n";        
-        db.printResult(res);
+        db.printResult(res[i]);
 
         cout << "\nConfiguration includes the following products:\n"
                 "=============================================\n";
 
-        res = q.store_next();
-        db.printResult(res);
+        db.printResult(res[i+1]);
         cout << endl;
-        
-        res = q.store_next();        
-        StoreQueryResult res = q.store();
     }
 }
 
@@ -177,7 +356,7 @@ ostream& operator<<(ostream& aStream, Product & p) {
            "Category    : " << *(p.getCategory())                  << endl <<
            "Name        : " << p.valueForKey(KEY_PRD_NAME)         << endl <<
            "Description : " << p.valueForKey(KEY_PRD_DESCR)        << endl <<
-           "Price       : " << p.valueForKey(KEY_PRD_PRICE)        << endl <<
+           "Price       : " << p.getPrice()                        << endl <<
            "Availability: " << p.valueForKey(KEY_PRD_AVAILABILITY) << endl;
 }
 
@@ -198,12 +377,11 @@ ProductProxy::ProductProxy(int aPid)
 /**
    @brief Default destructor
  
-   Dealloc instance of real object if it was allocated.
+   The real object, if it was allocated, goes back to the pool.
  */
 ProductProxy::~ProductProxy()
 {
-    if (_theProduct)
-        delete _theProduct;
+    Product::pool().release(_theProduct);
 }
 
 /**
@@ -222,20 +400,29 @@ Product *ProductProxy::getProduct() throw (InvalidArgument)
         // get an instance of the database
         Database &db = Database::instance();
         
-        // ask Database for a valid connection to mySQL and obtain a Query
-        Query q = db.getConnection()->query();
+        CatalogSnapshot &snapshot = CatalogSnapshot::instance();
+        const CatalogSnapshot::ProductRecord *r = snapshot.product(_pid);
+        if (r) {
+            _theProduct = Product::pool().acquire(snapshot.productRow(r));
+            return _theProduct;
+        }
+        
+        SharedCache &shared = SharedCache::instance();
+        Record row;
+        uint32_t ticket;
+        if (shared.lookup(_pid, row, &ticket)) {
+            _theProduct = Product::pool().acquire(row);
+            return _theProduct;
+        }
         
-        // obtain an instance of mysqlpp::Query and init it
-        q << SQL_PRODUCT_PROXY << _pid;
-        StoreQueryResult res = q.store();        
+        ResultSet res;
+        db.select(SQL_PRODUCT_PROXY, res, SqlParams() << _pid);
         
         if (res.empty())
             throw InvalidArgument("PID");
         
-        StoreQueryResult::const_iterator it = res.begin();
-        Row row = *it;
-        
-        _theProduct = new Product(row);
+        shared.put(res.front(), ticket);
+        _theProduct= Product::pool().acquire(res.front());
     }
     
     return _theProduct;
@@ -247,8 +434,16 @@ Product *ProductProxy::getProduct() throw (InvalidArgument)
    @return    The price of the product
    @see getProduct(), Product() 
  */
-float ProductProxy::getPrice()
+Money ProductProxy::getPrice()
 {
+    CatalogView::Entry e;
+    if (!_theProduct && CatalogView::instance().entry(_pid, e))
+        return e.price;
+    
+    const CatalogSnapshot::ProductRecord *r;
+    if (!_theProduct && (r = CatalogSnapshot::instance().product(_pid)))
+        return Money::fromCents(r->price);
+    
     return getProduct()->getPrice();
 }
 
@@ -260,6 +455,14 @@ float ProductProxy::getPrice()
  */
 string ProductProxy::getName() 
 { 
+    CatalogView::Entry e;
+    if (!_theProduct && CatalogView::instance().entry(_pid, e))
+        return e.name;
+    
+    const CatalogSnapshot::ProductRecord *r;
+    if (!_theProduct && (r = CatalogSnapshot::instance().product(_pid)))
+        return CatalogSnapshot::instance().text(r->name);
+    
     return getProduct()->valueForKey(KEY_PRD_NAME);
 }
 
@@ -271,6 +474,12 @@ string ProductProxy::getName()
  */
 string ProductProxy::getDescr()
 {
+    const CatalogSnapshot::ProductRecord *r;
+    if (!_theProduct && (r = CatalogSnapshot::instance().product(_pid))) {
+        const char *descr = CatalogSnapshot::instance().text(r->descr);
+        return descr ? descr : "";
+    }
+    
     return getProduct()->valueForKey(KEY_PRD_DESCR);
 }
 
@@ -291,6 +500,14 @@ int ProductProxy::uniqueID() const
  */
 int ProductProxy::getAvailability()
 {
+    CatalogView::Entry e;
+    if (!_theProduct && CatalogView::instance().entry(_pid, e))
+        return CatalogView::instance().availability(e);
+    
+    const CatalogSnapshot::ProductRecord *r;
+    if (!_theProduct && (r = CatalogSnapshot::instance().product(_pid)))
+        return snapshotAvailability(r);
+    
     return getProduct()->intForKey(KEY_PRD_AVAILABILITY);
 }
 
@@ -299,45 +516,58 @@ int ProductProxy::getAvailability()
  
    @param[in]    aCid    The category ID
  
-   @return    A vector of ProductProxy
+   @return    The products (empty if there are none)
  
    @note Pass zero as category ID to get all products 
  */
-vector<ProductProxy *> & ProductProxy::catalog(int aCid)
+ResultList<ProductProxy> ProductProxy::catalog(int aCid)
 {
     // get an instance of the database
     Database& db = Database::instance();
-    vector<ProductProxy *> *catalog = NULL;
+    ResultList<ProductProxy> catalog;
     
-    try {
-        // ask Database for a valid connection to mySQL
-        Connection *conn = db.getConnection();
-        
-        // obtain an instance of mysqlpp::Query and init it
-        Query q = conn->query();
-        q << SQL_CATALOG_PROXY;
-        if (aCid != 0)
-            q << "WHERE cid = " << aCid;
-        q << " ORDER BY pid, category, name";
-        StoreQueryResult res = q.store();
-        
-        if (!res.empty()) {
-            catalog = new vector<ProductProxy *>;
-            catalog->reserve(res.num_rows());
-            
-            for (size_t i = 0; i < res.num_rows(); ++i) {
-                catalog->push_back(new ProductProxy((int) res[i][0]));
-            }
-        }                
+    // no query at all if the catalog view is loaded
+    CatalogView &view = CatalogView::instance();
+    if (view.isLoaded()) {
+        view.catalog(aCid).swap(catalog);
+        return catalog;
     }
-    catch (const mysqlpp::BadQuery& e) {
-        // Something went wrong with the SQL query.
-        cerr << "Query failed: " << e.what() << endl;
+    
+    // same filter as view "catalogue", on the catalog snapshot
+    CatalogSnapshot &snapshot = CatalogSnapshot::instance();
+    if (snapshot.isCurrent()) {
+        catalog.reserve(snapshot.productCount());
+        for(size_t i = 0; i < snapshot.productCount(); ++i) {
+            const CatalogSnapshot::ProductRecord *r = snapshot.productAt(i);
+            
+            if (r->deleted || (aCid != 0 && r->cid != aCid) || 
+                !snapshot.category(r->cid) || snapshotAvailability(r) <= 0)
+                continue;
+            catalog.add(r->pid);
+        }
+        
+        return catalog;
     }
-    catch (const Exception& er) {
-        cerr << "Error: " << er.what() << endl;
-    }        
-    return *catalog;
+    
+    // build the statement: view "catalogue" joins products 
+    // and categories
+    stringstream sql;
+    sql << SQL_CATALOG_PROXY;
+    if (aCid != 0)
+        sql << "WHERE cid = " << aCid;
+    sql << " ORDER BY pid, category, name";
+    ResultSet res = db.cachedStore(sql.str(), "products,categories");
+    
+    if (!res.empty()) {
+        catalog.reserve(res.numRows());
+        
+        for (size_t i = 0; i < res.numRows(); ++i) {
+            int aPid = res[i][0];
+            catalog.add(aPid);
+        }
+    }                
+    
+    return catalog;
 }
 
 /**
@@ -350,6 +580,18 @@ bool ProductProxy::isValid()
     return (getProduct() != NULL);
 }
 
+/**
+   @brief Copy constructor
+ 
+   Only the product ID is copied: the copy instantiates its own 
+   product, if needed.
+ */
+ProductProxy::ProductProxy(const ProductProxy &pp)
+{
+    _pid = pp._pid;
+    _theProduct = NULL;
+}
+
 /**
    @brief Assignment operator
  
@@ -360,7 +602,8 @@ ProductProxy & ProductProxy::operator=(const ProductProxy &pp)
 {
     if (this != &pp) {
         _pid = pp._pid;
-        _theProduct = NULL;        
+        Product::pool().release(_theProduct);
+        _theProduct = NULL;
     }
     
     return *this;
@@ -373,6 +616,14 @@ ProductProxy & ProductProxy::operator=(const ProductProxy &pp)
  */
 auto_ptr<Category> ProductProxy::getCategory()
 {
+    CatalogView::Entry e;
+    if (!_theProduct && CatalogView::instance().entry(_pid, e))
+        return auto_ptr<Category>(Category::categoryByID(e.cid));
+    
+    const CatalogSnapshot::ProductRecord *r;
+    if (!_theProduct && (r = CatalogSnapshot::instance().product(_pid)))
+        return auto_ptr<Category>(Category::categoryByID(r->cid));
+    
     return getProduct()->getCategory();
 }
 
@@ -11,6 +11,8 @@
 #include "common.h"
 #include "ManagedObject.h"
 #include "Category.h"
+#include "ResultList.h"
+#include "ObjectPool.h"
 
 #define KEY_PRD_PID             "pid"
 #define KEY_PRD_CID             "cid"
@@ -21,7 +23,6 @@
 #define KEY_PRD_DELETED         "deleted"
 
 using namespace std;
-using namespace mysqlpp;
 
 // forward declaration
 class ProductProxy;
@@ -37,24 +38,42 @@ class ProductProxy;
    a new instance of product, as well as productByID() fetches a 
    product from the persistent store based on the specified criteria
    and catalog() returns the entire list of available products.
+ 
+   Every write to table "products" is numbered by the schema (column 
+   "change_seq", set by triggers; hard deletes leave a tombstone): 
+   changesSince() returns only what changed after a given watermark, 
+   so that in-memory copies of the catalog can be refreshed without 
+   reloading it. Changes of "availability" alone are not numbered, so 
+   that orders don't queue on the sequence: the live stock is kept by 
+   Inventory.
 */
 class Product : public ManagedObject
 {
+protected:
+    void valueDidChange(const StringRef & aKey);
+    
 public:
     Product();
-    Product(Row & aRow);
+    Product(const Record & aRow);
     ~Product();
     
-    static Product * factory(string aName, int aCid, float aPrice, 
+    static Product * factory(string aName, int aCid, Money aPrice, 
                               string aDescr = "empty", int aQty = 0, 
                              bool isDel = false);
-    static Product * productByID(int aPid);
+    static Product * productByID(int aPid, bool isForUpdate = false);
     static void showCompatibleProducts(int aPid);
+    static ObjectPool<Product> & pool();
+    static ulonglong changeWatermark();
+    static bool changesSince(ulonglong & aWatermark, 
+                             vector<Product *> & changed, 
+                             vector<int> & removed);
     
     auto_ptr<Category> getCategory();
-    float getPrice();
+    Money getPrice();
     int getAvailability();
     string primaryKey();
+    bool store();
+    bool update();
     
     friend ostream& operator<<(ostream &, Product &);
 };
@@ -68,6 +87,9 @@ public:
    Whenever other information are requested, ProductProxy provides 
    lazy creation of the product and forwards the request.
  
+   Products created this way come from Product::pool() and go back to 
+   it with the proxy.
+ 
    @see Product, getProduct()
  */
 class ProductProxy
@@ -84,11 +106,11 @@ public:
     ProductProxy(int aPid);
     ~ProductProxy();
     
-    static vector<ProductProxy *> & catalog(int aCid = 0);
+    static ResultList<ProductProxy> catalog(int aCid = 0);
 
     auto_ptr<Category> getCategory();
     int uniqueID() const;
-    float getPrice();
+    Money getPrice();
     string getName();
     string getDescr();
     int getAvailability();
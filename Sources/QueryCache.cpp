@@ -0,0 +1,421 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#include "QueryCache.h"
+#include <cctype>
+
+/**
+   @brief Default constructor
+
+   @param[in]    aMaxBytes Memory budget of the cache
+ */
+QueryCache::QueryCache(size_t aMaxBytes)
+{
+    LOG_CTOR();
+    _maxBytes = aMaxBytes;
+    _bytes = 0;
+    _hits = _misses = _evictions = _invalidations = 0;
+}
+
+/**
+   @brief Default destructor
+ */
+QueryCache::~QueryCache()
+{
+    LOG_DTOR();
+}
+
+/**
+   @brief Normalize an SQL statement
+
+   Runs of blanks outside quoted literals are collapsed into a single
+   space, leading/trailing blanks and a final semicolon are removed:
+   two statements differing only by layout share the same cache entry.
+
+   @param[in]    aSql    The statement to normalize
+   @return    The normalized statement
+ */
+string QueryCache::normalize(const string & aSql)
+{
+    string norm;
+    char quote = 0;
+    bool blank = false;
+
+    norm.reserve(aSql.size());
+    for (size_t i = 0; i < aSql.size(); i++) {
+        char c = aSql[i];
+
+        if (quote) {
+            norm += c;
+            if (c == '\\' && i + 1 < aSql.size())
+                norm += aSql[++i];
+            else if (c == quote)
+                quote = 0;
+            continue;
+        }
+
+        if (isspace((unsigned char) c)) {
+            blank = true;
+            continue;
+        }
+
+        if (blank && !norm.empty())
+            norm += ' ';
+        blank = false;
+
+        if (c == '\'' || c == '"' || c == '`')
+            quote = c;
+        norm += c;
+    }
+
+    if (!norm.empty() && norm[norm.length()-1] == ';')
+        norm.erase(norm.length()-1);
+
+    return norm;
+}
+
+/**
+   @brief Build the cache key of a statement
+
+   @param[in]    aSql    The statement text
+   @param[in]    params  Values of the statement placeholders, if any
+   @return    A key identifying the statement and its parameters
+ */
+string QueryCache::makeKey(const string & aSql, const vector<string> & params)
+{
+    string key = normalize(aSql);
+
+    for (size_t i = 0; i < params.size(); i++)
+        key += '\x1f' + params[i];
+
+    return key;
+}
+
+/**
+   @brief Look for a cached statement
+
+   A hit is returned only if none of the tables read by the statement
+   has been written since the entry was stored; otherwise the entry is
+   dropped and the lookup counts as a miss.
+
+   @param[in]    aKey    Statement key, as returned by makeKey()
+   @param[out]   res     Cached result sets, filled on hit
+   @return    True on cache hit
+ */
+bool QueryCache::lookup(const string & aKey, ResultSets & res)
+{
+    MutexLocker lock(_lock);
+
+    map<string, Entry>::iterator it = _entries.find(aKey);
+    if (it == _entries.end()) {
+        _misses++;
+        return false;
+    }
+
+    if (isStale((*it).second)) {
+        LOG(3, "Stale entry dropped: %s\n", aKey.c_str());
+        drop(it);
+        _invalidations++;
+        _misses++;
+        return false;
+    }
+
+    // move the entry in front of the LRU list
+    _lru.splice(_lru.begin(), _lru, (*it).second.lru);
+    _hits++;
+    res = (*it).second.results;
+
+    return true;
+}
+
+/**
+   @brief Returns the current version of the tables read by a statement
+
+   Call it before running the statement, and pass the result to
+   insert(): the result is then cached only if no table was written
+   in the meanwhile.
+
+   @param[in]    tables  Comma separated list of tables read by the
+                         statement (views must be expanded)
+   @return    The version of each table
+ */
+QueryCache::TableVersions QueryCache::versions(const string & tables) const
+{
+    TableVersions result;
+    MutexLocker lock(_lock);
+
+    size_t start = 0;
+    while (start < tables.size()) {
+        size_t end = tables.find(',', start);
+        if (end == string::npos)
+            end = tables.size();
+
+        string table = tables.substr(start, end - start);
+        table.erase(0, table.find_first_not_of(' '));
+        table.erase(table.find_last_not_of(' ') + 1);
+        if (!table.empty())
+            result[table] = versionOf(table);
+
+        start = end + 1;
+    }
+
+    return result;
+}
+
+/**
+   @brief Cache the result sets of a statement
+
+   A table written after its version was taken could have been read
+   either before or after the write: the result is then not cached.
+
+   @param[in]    aKey        Statement key, as returned by makeKey()
+   @param[in]    versions    Versions of the tables read by the
+                             statement, taken by versions() before
+                             running it
+   @param[in]    res         The result sets to cache
+   @return    True if the result was cached
+ */
+bool QueryCache::insert(const string & aKey, const TableVersions & versions,
+                        const ResultSets & res)
+{
+    size_t size = sizeOf(res) + aKey.size();
+    MutexLocker lock(_lock);
+
+    if (size > _maxBytes)
+        return false;
+
+    TableVersions::const_iterator vit;
+    for (vit = versions.begin(); vit != versions.end(); vit++)
+        if (versionOf((*vit).first) != (*vit).second) {
+            LOG(3, "Result of a changed table not cached: %s\n",
+                aKey.c_str());
+            return false;
+        }
+
+    map<string, Entry>::iterator it = _entries.find(aKey);
+    if (it != _entries.end())
+        drop(it);
+
+    evictToFit(size);
+
+    Entry & e = _entries[aKey];
+    e.results = res;
+    e.bytes = size;
+    e.versions = versions;
+
+    _lru.push_front(aKey);
+    e.lru = _lru.begin();
+    _bytes += size;
+
+    return true;
+}
+
+/**
+   @brief Notify a write on a table
+
+   Bumps the version of the table: all the entries built from it
+   become stale and are dropped on their next lookup.
+
+   @param[in]    aTable  The table which has been written
+ */
+void QueryCache::tableDidChange(const string & aTable)
+{
+    MutexLocker lock(_lock);
+
+    ulonglong version = ++_versions[aTable];
+    LOG(3, "Table '%s' now at version %llu\n", aTable.c_str(), version);
+}
+
+/**
+   @brief Returns the current version of a table
+
+   @param[in]    aTable  The table name
+   @return    The version number, zero if never written
+ */
+ulonglong QueryCache::tableVersion(const string & aTable) const
+{
+    MutexLocker lock(_lock);
+
+    return versionOf(aTable);
+}
+
+/**
+   @brief Returns the current version of a table (lock already held)
+
+   @param[in]    aTable  The table name
+   @return    The version number, zero if never written
+ */
+ulonglong QueryCache::versionOf(const string & aTable) const
+{
+    map<string, ulonglong>::const_iterator it = _versions.find(aTable);
+
+    return (it != _versions.end()) ? (*it).second : 0;
+}
+
+/**
+   @brief Remove all cached entries (table versions are kept)
+ */
+void QueryCache::clear()
+{
+    MutexLocker lock(_lock);
+
+    _entries.clear();
+    _lru.clear();
+    _bytes = 0;
+}
+
+/**
+   @brief Check if an entry was built from an outdated table
+
+   @param[in]    anEntry The entry to check
+   @return    True if at least one table changed after the entry was
+              stored
+ */
+bool QueryCache::isStale(const Entry & anEntry) const
+{
+    TableVersions::const_iterator it;
+
+    for (it = anEntry.versions.begin(); it != anEntry.versions.end(); it++)
+        if (versionOf((*it).first) != (*it).second)
+            return true;
+
+    return false;
+}
+
+/**
+   @brief Remove an entry from the cache
+
+   @param[in]    it  Iterator to the entry to remove
+ */
+void QueryCache::drop(map<string, Entry>::iterator it)
+{
+    _bytes -= (*it).second.bytes;
+    _lru.erase((*it).second.lru);
+    _entries.erase(it);
+}
+
+/**
+   @brief Evict least recently used entries
+
+   @param[in]    aSize   Room needed for a new entry
+ */
+void QueryCache::evictToFit(size_t aSize)
+{
+    while (!_lru.empty() && _bytes + aSize > _maxBytes) {
+        map<string, Entry>::iterator it = _entries.find(_lru.back());
+
+        LOG(3, "Evicting entry: %s\n", (*it).first.c_str());
+        drop(it);
+        _evictions++;
+    }
+}
+
+/**
+   @brief Estimate the memory used by a list of result sets
+
+   @param[in]    res The result sets
+   @return    Approximate size in bytes
+ */
+size_t QueryCache::sizeOf(const ResultSets & res)
+{
+    size_t size = sizeof(Entry);
+
+    for (size_t i = 0; i < res.size(); i++) {
+        size += sizeof(ResultSet);
+
+        for (size_t r = 0; r < res[i].numRows(); r++) {
+            const Record & row = res[i][r];
+
+            size += sizeof(Record);
+            for (size_t f = 0; f < row.size(); f++)
+                size += sizeof(Field) + row[int(f)].length();
+        }
+    }
+
+    return size;
+}
+
+/**
+   @brief Change the memory budget, evicting entries if needed
+
+   @param[in]    aValue  The new budget, in bytes
+ */
+void QueryCache::setMaxBytes(size_t aValue)
+{
+    MutexLocker lock(_lock);
+
+    _maxBytes = aValue;
+    evictToFit(0);
+}
+
+/**
+   @brief Returns the memory budget of the cache
+ */
+size_t QueryCache::maxBytes() const
+{
+    return _maxBytes;
+}
+
+/**
+   @brief Returns the estimated memory used by cached entries
+ */
+size_t QueryCache::bytes() const
+{
+    MutexLocker lock(_lock);
+
+    return _bytes;
+}
+
+/**
+   @brief Returns the number of cached entries
+ */
+size_t QueryCache::count() const
+{
+    MutexLocker lock(_lock);
+
+    return _entries.size();
+}
+
+/**
+   @brief Returns the number of lookups satisfied by the cache
+ */
+ulonglong QueryCache::hits() const
+{
+    return _hits;
+}
+
+/**
+   @brief Returns the number of lookups that missed the cache
+ */
+ulonglong QueryCache::misses() const
+{
+    return _misses;
+}
+
+/**
+   @brief Returns the number of entries evicted to respect the budget
+ */
+ulonglong QueryCache::evictions() const
+{
+    return _evictions;
+}
+
+/**
+   @brief Returns the number of entries dropped because stale
+ */
+ulonglong QueryCache::invalidations() const
+{
+    return _invalidations;
+}
+
+ostream& operator<<(ostream& aStream, QueryCache& c) {
+    return aStream << "Query cache: " << c.count() << " entries, "
+           << c.bytes() << "/" << c.maxBytes() << " bytes, "
+           << c.hits() << " hits, " << c.misses() << " misses, "
+           << c.evictions() << " evictions, " << c.invalidations()
+           << " invalidations\n";
+}
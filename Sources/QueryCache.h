@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#ifndef __QUERYCACHE_H__
+#define __QUERYCACHE_H__
+
+#include <list>
+#include "common.h"
+#include "Storage.h"
+#include "Mutex.h"
+
+using namespace std;
+
+/** Default memory budget of the query cache (bytes) */
+#define QUERY_CACHE_MAX_BYTES   (4 * 1024 * 1024)
+
+/**
+   @brief Query-result cache with table-version invalidation
+
+   The class QueryCache keeps the result sets of read-only statements,
+   keyed on the normalized SQL text plus its parameters. Each table
+   has a version number which is bumped whenever the table is written:
+   every entry remembers the versions of the tables it was built from,
+   so a lookup that finds a newer version drops the stale entry instead
+   of returning it.
+
+   Memory is bounded: the least recently used entries are evicted as
+   soon as the estimated size of the cache exceeds the budget.
+
+   All public methods can be called from any thread.
+
+   @see Database::cachedStore()
+ */
+class QueryCache
+{
+public:
+    /** Version of each table read by a statement */
+    typedef map<string, ulonglong> TableVersions;
+
+private:
+    /** A cached statement */
+    struct Entry {
+        ResultSets results;
+        TableVersions versions;
+        size_t bytes;
+        list<string>::iterator lru;
+    };
+
+    /** Cached entries, keyed on normalized SQL and parameters */
+    map<string, Entry> _entries;
+    /** Keys ordered by last use, most recent first */
+    list<string> _lru;
+    /** Current version of each table */
+    TableVersions _versions;
+    size_t _bytes;
+    size_t _maxBytes;
+    ulonglong _hits;
+    ulonglong _misses;
+    ulonglong _evictions;
+    ulonglong _invalidations;
+    /** Protects all the members above */
+    mutable Mutex _lock;
+
+    ulonglong versionOf(const string & aTable) const;
+    bool isStale(const Entry & anEntry) const;
+    void drop(map<string, Entry>::iterator it);
+    void evictToFit(size_t aSize);
+    static size_t sizeOf(const ResultSets & res);
+
+public:
+    QueryCache(size_t aMaxBytes = QUERY_CACHE_MAX_BYTES);
+    ~QueryCache();
+
+    static string normalize(const string & aSql);
+    static string makeKey(const string & aSql, const vector<string> & params);
+
+    bool lookup(const string & aKey, ResultSets & res);
+    TableVersions versions(const string & tables) const;
+    bool insert(const string & aKey, const TableVersions & versions,
+                const ResultSets & res);
+    void tableDidChange(const string & aTable);
+    ulonglong tableVersion(const string & aTable) const;
+    void clear();
+
+    void setMaxBytes(size_t aValue);
+    size_t maxBytes() const;
+    size_t bytes() const;
+    size_t count() const;
+    ulonglong hits() const;
+    ulonglong misses() const;
+    ulonglong evictions() const;
+    ulonglong invalidations() const;
+
+    friend ostream& operator<<(ostream &, QueryCache &);
+};
+
+#endif /* __QUERYCACHE_H__ */
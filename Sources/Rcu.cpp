@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#include "Rcu.h"
+#include "Mutex.h"
+#include <vector>
+#include <sched.h>
+
+using namespace std;
+
+/** An object waiting to be destroyed, with its deleter */
+typedef pair<void *, void (*)(void *)> Retired;
+
+/** Readers inside a read section, per epoch */
+static long rcuReaders[2];
+/** Epoch new readers enter */
+static int rcuEpoch;
+
+/**
+   @brief The objects retired, protected by their lock
+
+   Never destroyed: objects can be retired while the program exits.
+ */
+struct RcuState {
+    Mutex lock;
+    /** Objects retired since the last flip */
+    vector<Retired> pending;
+    /** Objects retired before the last flip, waiting for its readers */
+    vector<Retired> waiting;
+    /** The epoch waiting objects could be seen from */
+    int waitingEpoch;
+};
+
+static RcuState & rcuState()
+{
+    static RcuState *aState = new RcuState;
+
+    return *aState;
+}
+
+/**
+   @brief Collect the objects whose grace period ended, then flip
+
+   Called with the lock of aState held; the objects are destroyed by
+   the caller, once the lock is released (deleters may retire objects
+   in turn).
+
+   @param[in]    aState  The retired objects
+   @param[out]   aList   The objects which can be destroyed
+ */
+static void rcuCollect(RcuState & aState, vector<Retired> & aList)
+{
+    if (!aState.waiting.empty()) {
+        if (__atomic_load_n(&rcuReaders[aState.waitingEpoch],
+                            __ATOMIC_ACQUIRE))
+            return;
+
+        aList.swap(aState.waiting);
+    }
+
+    if (aState.pending.empty())
+        return;
+
+    // readers entering from now on can't see what's pending
+    aState.waitingEpoch = __atomic_load_n(&rcuEpoch, __ATOMIC_RELAXED);
+    __atomic_store_n(&rcuEpoch, 1 - aState.waitingEpoch, __ATOMIC_SEQ_CST);
+    aState.waiting.swap(aState.pending);
+}
+
+/**
+   @brief Destroy a list of collected objects
+ */
+static void rcuDestroy(const vector<Retired> & aList)
+{
+    for (size_t i = 0; i < aList.size(); ++i)
+        aList[i].second(aList[i].first);
+}
+
+/**
+   @brief Enter a read section
+
+   @return    The epoch to pass to readUnlock()
+ */
+int Rcu::readLock()
+{
+    for (;;) {
+        int anEpoch = __atomic_load_n(&rcuEpoch, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&rcuReaders[anEpoch], 1, __ATOMIC_SEQ_CST);
+
+        // an epoch flipped in the meanwhile may be already collected
+        if (__atomic_load_n(&rcuEpoch, __ATOMIC_SEQ_CST) == anEpoch)
+            return anEpoch;
+        __atomic_fetch_sub(&rcuReaders[anEpoch], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+/**
+   @brief Leave a read section
+
+   @param[in]    anEpoch The value returned by readLock()
+ */
+void Rcu::readUnlock(int anEpoch)
+{
+    __atomic_fetch_sub(&rcuReaders[anEpoch], 1, __ATOMIC_RELEASE);
+}
+
+/**
+   @brief Destroy an object once no reader can see it any more
+
+   The object must have been unpublished already.
+
+   @param[in]    anObject    The object
+   @param[in]    aDeleter    The function destroying it
+ */
+void Rcu::retire(void *anObject, void (*aDeleter)(void *))
+{
+    RcuState &state = rcuState();
+    vector<Retired> collected;
+
+    {
+        MutexLocker lock(state.lock);
+        state.pending.push_back(make_pair(anObject, aDeleter));
+        rcuCollect(state, collected);
+    }
+    rcuDestroy(collected);
+}
+
+/**
+   @brief Wait until every object retired so far is destroyed
+
+   Must not be called from a read section.
+ */
+void Rcu::synchronize()
+{
+    RcuState &state = rcuState();
+
+    for (;;) {
+        vector<Retired> collected;
+        bool done;
+
+        {
+            MutexLocker lock(state.lock);
+            rcuCollect(state, collected);
+            done = state.waiting.empty() && state.pending.empty();
+        }
+        rcuDestroy(collected);
+        if (done)
+            return;
+        sched_yield();
+    }
+}
+
+/**
+   @brief Returns the number of objects waiting to be destroyed
+ */
+size_t Rcu::retired()
+{
+    RcuState &state = rcuState();
+    MutexLocker lock(state.lock);
+
+    return state.pending.size() + state.waiting.size();
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#ifndef __RCU_H__
+#define __RCU_H__
+
+#include <cstddef>
+
+/**
+   @brief Read-copy-update, for data read far more often than written
+
+   Readers of a shared structure enter a read section and use the
+   current version without taking any lock. Writers never change a
+   published version: they build a new one, publish it with an atomic
+   store of its pointer and retire the old one, which is destroyed once
+   every reader that could still see it has left its read section.
+
+   Reads are tracked with two counters and a global epoch: a reader
+   increments the counter of the current epoch; retiring flips the
+   epoch, and objects retired before the flip are destroyed as soon as
+   the counter of the previous epoch drops to zero. Retiring never
+   waits: reclamation happens in later calls, so a reader may retire
+   objects (e.g. an observer removing itself while being notified).
+
+   Read sections can be nested, but must not call synchronize().
+
+   @see RcuReader, Observable
+ */
+class Rcu
+{
+private:
+    Rcu();
+
+    template <class T> static void destroy(void *anObject) {
+        delete static_cast<T *>(anObject);
+    }
+
+public:
+    static int readLock();
+    static void readUnlock(int anEpoch);
+
+    static void retire(void *anObject, void (*aDeleter)(void *));
+    template <class T> static void retire(T *anObject) {
+        if (anObject)
+            retire(const_cast<void *>(static_cast<const void *>(anObject)),
+                   &destroy<T>);
+    }
+
+    static void synchronize();
+    static size_t retired();
+};
+
+/**
+   @brief Scoped read section: entered by the constructor and left by
+          the destructor.
+ */
+class RcuReader
+{
+private:
+    int _epoch;
+
+    RcuReader(const RcuReader &);
+    RcuReader & operator=(const RcuReader &);
+
+public:
+    RcuReader() : _epoch(Rcu::readLock()) {}
+    ~RcuReader() { Rcu::readUnlock(_epoch); }
+};
+
+/** Read a pointer published by rcuPublish() */
+#define rcuDereference(p)   __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+/** Publish a pointer, once the object it points to is initialized */
+#define rcuPublish(p, v)    __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+#endif /* __RCU_H__ */
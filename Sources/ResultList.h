@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#ifndef __RESULTLIST_H__
+#define __RESULTLIST_H__
+
+#include "SmallVector.h"
+
+/** Elements of a result list stored inside the list itself */
+#define RESULTLIST_INLINE   4
+
+/**
+   @brief The objects found by a finder, owned by value
+
+   A finder builds its result with add(), constructing each object in
+   place, after a reserve() sized on the records fetched: a result set
+   takes one allocation, none at all when it holds up to N objects.
+   The list is returned by value; the compiler builds it directly in
+   the caller's variable, and swap() hands it over without copying
+   the objects kept on the heap.
+
+   The objects are destroyed with the list: nothing is left to free.
+
+   @code
+   ResultList<ProductProxy> v = ProductProxy::catalog(aCid);
+   for (size_t i = 0; i < v.size(); i++)
+       cout << v[i].getName() << endl;
+   @endcode
+
+   @see SmallVector
+ */
+template <class T, size_t N = RESULTLIST_INLINE>
+class ResultList : public SmallVector<T, N>
+{
+public:
+    /** Append an object built by its default constructor */
+    T & add() {
+        T *anObject = new (this->allocateBack()) T();
+        this->constructedBack();
+        return *anObject;
+    }
+
+    /** Append an object built from one argument */
+    template <class A1> T & add(const A1 & a1) {
+        T *anObject = new (this->allocateBack()) T(a1);
+        this->constructedBack();
+        return *anObject;
+    }
+
+    /** Append an object built from two arguments */
+    template <class A1, class A2> T & add(const A1 & a1, const A2 & a2) {
+        T *anObject = new (this->allocateBack()) T(a1, a2);
+        this->constructedBack();
+        return *anObject;
+    }
+};
+
+#endif /* __RESULTLIST_H__ */
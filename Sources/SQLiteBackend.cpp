@@ -0,0 +1,1053 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#include "SQLiteBackend.h"
+#include "Money.h"
+
+#ifdef HAVE_SQLITE3
+
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <ctime>
+
+/**
+   @brief Returns a string without leading and trailing blanks
+ */
+static string trim(const string & aValue)
+{
+    size_t first = aValue.find_first_not_of(" \t\r\n");
+    if (first == string::npos)
+        return "";
+
+    return aValue.substr(first, aValue.find_last_not_of(" \t\r\n") -
+                         first + 1);
+}
+
+/**
+   @brief Check if a string starts with a prefix, ignoring case
+ */
+static bool startsWith(const string & aValue, const char *aPrefix)
+{
+    return (strncasecmp(aValue.c_str(), aPrefix, strlen(aPrefix)) == 0);
+}
+
+/**
+   @brief Returns the current date, formatted as MySQL does
+ */
+static string now()
+{
+    char buf[32];
+    time_t t = time(NULL);
+
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", localtime(&t));
+
+    return buf;
+}
+
+/**
+   @brief Default constructor
+
+   @param[in]    aDump   The MySQL dump to load
+   @param[in]    aPath   The SQLite database file: if it already holds
+                         some tables, the dump is not loaded
+ */
+SQLiteBackend::SQLiteBackend(const string & aDump, const string & aPath) :
+    _dump(aDump), _path(aPath)
+{
+    LOG_CTOR();
+    _shared = NULL;
+    _inTransaction = false;
+}
+
+/**
+   @brief Default destructor
+ */
+SQLiteBackend::~SQLiteBackend()
+{
+    LOG_DTOR();
+    disconnect();
+}
+
+/**
+   @brief Returns the name of the backend
+ */
+const char *SQLiteBackend::name() const
+{
+    return "sqlite";
+}
+
+/**
+   @brief Open the database and load the dump
+
+   Clones are connected as soon as they're created.
+
+   @return    True if successful
+ */
+bool SQLiteBackend::connect()
+{
+    if (_shared)
+        return true;
+
+    _shared = new Shared();
+    if (sqlite3_open_v2(_path.c_str(), &_shared->db, SQLITE_OPEN_READWRITE |
+                        SQLITE_OPEN_CREATE | SQLITE_OPEN_FULLMUTEX,
+                        NULL) != SQLITE_OK) {
+        cerr << "unable to open embedded database " << _path << " ("
+             << sqlite3_errmsg(_shared->db) << ")\n";
+        disconnect();
+
+        return false;
+    }
+
+    registerFunctions(_shared->db);
+
+    ResultSets res;
+    if (!run("SELECT COUNT(*) FROM sqlite_master", &res) ||
+        ((int) res[0][0][0] == 0 && !load())) {
+        cerr << "unable to load " << _dump << " (" << _error << ")\n";
+        disconnect();
+
+        return false;
+    }
+
+    return true;
+}
+
+/**
+   @brief Release the database (it's closed by the last clone)
+ */
+void SQLiteBackend::disconnect()
+{
+    if (!_shared)
+        return;
+
+    if (_inTransaction)
+        rollback();
+
+    if (__sync_sub_and_fetch(&_shared->refs, 1) == 0) {
+        sqlite3_close(_shared->db);
+        delete _shared;
+    }
+    _shared = NULL;
+}
+
+/**
+   @brief Test connection status
+
+   @return    True if the database is open
+ */
+bool SQLiteBackend::isConnected()
+{
+    return (_shared != NULL);
+}
+
+/**
+   @brief Returns a backend sharing the same database
+ */
+StorageBackend *SQLiteBackend::clone()
+{
+    SQLiteBackend *b = new SQLiteBackend(_dump, _path);
+
+    if (_shared) {
+        __sync_add_and_fetch(&_shared->refs, 1);
+        b->_shared = _shared;
+    }
+
+    return b;
+}
+
+/**
+   @brief Execute one or more statements
+
+   @param[in]    aSql    The statements, separated by semicolons
+   @param[out]   res     Result sets of the statements returning
+                         records, if not NULL
+   @param[out]   rows    Rows changed by the other statements are added
+                         to it, if not NULL
+   @return    True if successful
+ */
+bool SQLiteBackend::run(const string & aSql, ResultSets *res,
+                        ulonglong *rows)
+{
+    MutexLocker lock(_shared->lock);
+    const char *tail = aSql.c_str();
+    ulonglong changes = 0;
+
+    while (*tail) {
+        sqlite3_stmt *stmt;
+        int before = sqlite3_total_changes(_shared->db);
+
+        if (sqlite3_prepare_v2(_shared->db, tail, -1, &stmt,
+                               &tail) != SQLITE_OK) {
+            _error = sqlite3_errmsg(_shared->db);
+            return false;
+        }
+
+        // only blanks or comments
+        if (!stmt)
+            continue;
+
+        int cols = sqlite3_column_count(stmt);
+        ResultSet *set = NULL;
+        if (cols && res) {
+            res->push_back(ResultSet());
+            set = &res->back();
+            for (int i = 0; i < cols; i++)
+                set->addColumn(sqlite3_column_name(stmt, i));
+        }
+
+        int rc;
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            if (!set)
+                continue;
+
+            Record & rec = set->addRecord();
+            for (int i = 0; i < cols; i++) {
+                switch (sqlite3_column_type(stmt, i)) {
+                    case SQLITE_NULL:
+                        rec.append(Field());
+                        break;
+                    case SQLITE_FLOAT: {
+                        // print 2150 rather than 2150.0, as MySQL does
+                        char buf[32];
+                        snprintf(buf, sizeof(buf), "%.15g",
+                                 sqlite3_column_double(stmt, i));
+                        rec.append(Field(buf));
+                        break;
+                    }
+                    default:
+                        rec.append(Field(string((const char *)
+                                   sqlite3_column_text(stmt, i),
+                                   sqlite3_column_bytes(stmt, i))));
+                }
+            }
+        }
+
+        if (rc != SQLITE_DONE) {
+            _error = sqlite3_errmsg(_shared->db);
+            sqlite3_finalize(stmt);
+            return false;
+        }
+
+        // rows changed by triggers are not counted, as MySQL does
+        if (sqlite3_total_changes(_shared->db) != before)
+            changes += sqlite3_changes(_shared->db);
+        sqlite3_finalize(stmt);
+    }
+
+    if (rows)
+        *rows += changes;
+
+    return true;
+}
+
+/**
+   @brief Run a statement returning one or more result sets
+
+   @param[in]    aSql    The statement
+   @param[out]   res     All the result sets
+   @return    True if successful
+ */
+bool SQLiteBackend::query(const string & aSql, ResultSets & res)
+{
+    if (!_shared) {
+        _error = "not connected";
+        return false;
+    }
+
+    bool success = startsWith(trim(aSql), "CALL ") ?
+                       call(aSql, &res, NULL) : run(aSql, &res);
+
+    // callers always expect at least one result set
+    if (success && res.empty())
+        res.push_back(ResultSet());
+
+    return success;
+}
+
+/**
+   @brief Run a statement returning no records
+
+   @param[in]    aSql        The statement
+   @param[out]   rows        Number of affected rows, if not NULL
+   @param[out]   insertID    Last AUTOINCREMENT value, if not NULL
+   @return    True if successful
+ */
+bool SQLiteBackend::execute(const string & aSql, ulonglong *rows,
+                            ulonglong *insertID)
+{
+    if (!_shared) {
+        _error = "not connected";
+        return false;
+    }
+
+    MutexLocker lock(_shared->lock);
+    ulonglong changes = 0;
+
+    bool success = startsWith(trim(aSql), "CALL ") ?
+                       call(aSql, NULL, &changes) :
+                       run(aSql, NULL, &changes);
+
+    if (rows)
+        *rows = changes;
+    if (insertID)
+        *insertID = sqlite3_last_insert_rowid(_shared->db);
+
+    return success;
+}
+
+/**
+   @brief Quote a value as an SQL string literal
+
+   @param[in]    aValue  The value
+   @return    The literal
+ */
+string SQLiteBackend::quote(const string & aValue)
+{
+    string literal = "'";
+
+    for (size_t i = 0; i < aValue.size(); i++) {
+        if (aValue[i] == '\'')
+            literal += '\'';
+        literal += aValue[i];
+    }
+
+    return literal + "'";
+}
+
+/**
+   @brief Start a transaction
+
+   Other clones can't run statements until the transaction ends.
+ */
+bool SQLiteBackend::begin()
+{
+    if (!_shared || _inTransaction)
+        return false;
+
+    _shared->lock.lock();
+    if (!run("BEGIN")) {
+        _shared->lock.unlock();
+        return false;
+    }
+    _inTransaction = true;
+
+    return true;
+}
+
+/**
+   @brief Commit the current transaction
+ */
+bool SQLiteBackend::commit()
+{
+    if (!_inTransaction)
+        return false;
+
+    bool success = run("COMMIT");
+    if (!success)
+        run("ROLLBACK");
+    _inTransaction = false;
+    _shared->lock.unlock();
+
+    return success;
+}
+
+/**
+   @brief Rollback the current transaction
+ */
+bool SQLiteBackend::rollback()
+{
+    if (!_inTransaction)
+        return false;
+
+    bool success = run("ROLLBACK");
+    _inTransaction = false;
+    _shared->lock.unlock();
+
+    return success;
+}
+
+/**
+   @brief Returns the message of the last error
+ */
+string SQLiteBackend::error()
+{
+    return _error;
+}
+
+/**
+   @brief The schema cookie, increased by SQLite at every DDL statement
+ */
+string SQLiteBackend::schemaVersion()
+{
+    ResultSets res;
+
+    if (!_shared || !run("PRAGMA schema_version", &res) || res.empty() ||
+        res[0].empty())
+        return "";
+
+    return res[0][0][0].str();
+}
+
+/**
+   @brief Load the dump into the (empty) database
+
+   @return    True if successful
+ */
+bool SQLiteBackend::load()
+{
+    ifstream in(_dump.c_str());
+    if (!in) {
+        _error = "file not found";
+        return false;
+    }
+
+    string text((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+    vector<string> statements = splitDump(text);
+    int count = 0;
+
+    run("BEGIN");
+    for (size_t i = 0; i < statements.size(); i++) {
+        string sql = translate(statements[i]);
+        if (sql.empty())
+            continue;
+
+        if (!run(sql)) {
+            LOG(1, "Statement was: %s\n", sql.c_str());
+            run("ROLLBACK");
+            return false;
+        }
+        count++;
+    }
+    run("COMMIT");
+
+    LOG(2, "%d statements loaded from %s\n", count, _dump.c_str());
+
+    return true;
+}
+
+/**
+   @brief Split a MySQL dump into statements
+
+   Statements end with the current delimiter (changed by DELIMITER
+   lines), outside of quotes and comments; "--" comments are dropped,
+   version comments such as "/ *!50001 ... * /" are kept.
+
+   @param[in]    aText   The dump
+   @return    The statements, without delimiter
+ */
+vector<string> SQLiteBackend::splitDump(const string & aText)
+{
+    vector<string> statements;
+    string delimiter = ";", current;
+    bool lineStart = true;
+    size_t i = 0;
+
+    while (i < aText.size()) {
+        if (lineStart && aText.compare(i, 10, "DELIMITER ") == 0) {
+            size_t eol = aText.find('\n', i);
+            delimiter = trim(aText.substr(i + 10, eol - i - 10));
+            i = (eol == string::npos) ? aText.size() : eol + 1;
+            continue;
+        }
+
+        if (lineStart && aText.compare(i, 2, "--") == 0) {
+            size_t eol = aText.find('\n', i);
+            i = (eol == string::npos) ? aText.size() : eol + 1;
+            continue;
+        }
+
+        char c = aText[i];
+        lineStart = false;
+
+        if (c == '\'' || c == '"' || c == '`') {
+            // copy the quoted string as it is
+            current += aText[i++];
+            while (i < aText.size() && aText[i] != c) {
+                if (aText[i] == '\\' && c != '`')
+                    current += aText[i++];
+                if (i < aText.size())
+                    current += aText[i++];
+            }
+            if (i < aText.size())
+                current += aText[i++];
+        } else if (aText.compare(i, 2, "/*") == 0) {
+            size_t end = aText.find("*/", i + 2);
+            end = (end == string::npos) ? aText.size() : end + 2;
+            current += aText.substr(i, end - i);
+            i = end;
+        } else if (aText.compare(i, delimiter.size(), delimiter) == 0) {
+            if (!trim(current).empty())
+                statements.push_back(trim(current));
+            current.clear();
+            i += delimiter.size();
+        } else {
+            current += c;
+            lineStart = (c == '\n');
+            i++;
+        }
+    }
+
+    if (!trim(current).empty())
+        statements.push_back(trim(current));
+
+    return statements;
+}
+
+/**
+   @brief Translate a statement of the dump to SQLite syntax
+
+   Tables, data and views are kept, triggers are replaced by their
+   SQLite version (see translateTrigger()); stored procedures, locks
+   and session settings are dropped.
+
+   @param[in]    aStatement  The MySQL statement
+   @return    The SQLite statements, empty if nothing has to be run
+ */
+string SQLiteBackend::translate(const string & aStatement)
+{
+    if (startsWith(aStatement, "/*!") &&
+        aStatement.find("TRIGGER `") != string::npos)
+        return translateTrigger(aStatement);
+
+    if (startsWith(aStatement, "/*!")) {
+        // "/*!50001 CREATE ...*/ /*!50013 ...*/ /*!50001 VIEW `v` AS ...*/"
+        size_t view = aStatement.find("VIEW `");
+        if (view == string::npos || aStatement.find(" AS ", view) ==
+            string::npos)
+            return "";
+
+        return "CREATE " + aStatement.substr(view,
+                                   aStatement.rfind("*/") - view);
+    }
+
+    if (startsWith(aStatement, "CREATE TABLE"))
+        return translateTable(aStatement);
+    if (startsWith(aStatement, "INSERT"))
+        return translateLiterals(aStatement);
+    if (startsWith(aStatement, "DROP TABLE"))
+        return aStatement;
+
+    return "";
+}
+
+/**
+   @brief Translate a CREATE TABLE statement
+
+   The AUTO_INCREMENT column becomes an INTEGER PRIMARY KEY, UNIQUE
+   KEYs become UNIQUE constraints and the other KEYs become indexes;
+   table options and column comments are dropped.
+
+   @param[in]    aStatement  The MySQL statement
+   @return    The SQLite statements
+ */
+string SQLiteBackend::translateTable(const string & aStatement)
+{
+    size_t open = aStatement.find('(');
+    size_t close = aStatement.rfind(')');
+    string head = aStatement.substr(0, open);
+    string table = trim(head.substr(strlen("CREATE TABLE")));
+    vector<string> lines, defs;
+    string autoIncrement, indexes;
+
+    stringstream body(aStatement.substr(open + 1, close - open - 1));
+    string line;
+    while (getline(body, line)) {
+        line = trim(line);
+        if (!line.empty() && line[line.size()-1] == ',')
+            line.erase(line.size() - 1);
+        if (line.empty())
+            continue;
+
+        if (line.find("AUTO_INCREMENT") != string::npos)
+            autoIncrement = line.substr(0, line.find('`', 1) + 1);
+        lines.push_back(line);
+    }
+
+    for (size_t i = 0; i < lines.size(); i++) {
+        string def = lines[i];
+
+        if (startsWith(def, "PRIMARY KEY")) {
+            if (!autoIncrement.empty() &&
+                def.find("(" + autoIncrement + ")") != string::npos)
+                continue;
+        } else if (startsWith(def, "UNIQUE KEY")) {
+            def = "UNIQUE " + def.substr(def.find('('));
+        } else if (startsWith(def, "KEY ")) {
+            string name = trim(def.substr(4, def.find('(') - 4));
+            string tableName = table.substr(1, table.size() - 2);
+            indexes += ";\nCREATE INDEX `" + tableName + "_" +
+                       name.substr(1, name.size() - 2) + "` ON " + table +
+                       " " + def.substr(def.find('('));
+            continue;
+        } else if (!startsWith(def, "CONSTRAINT")) {
+            // a column definition
+            if (def.find("AUTO_INCREMENT") != string::npos) {
+                def = autoIncrement + " INTEGER PRIMARY KEY AUTOINCREMENT";
+            } else {
+                size_t comment = def.find(" COMMENT '");
+                if (comment != string::npos)
+                    def.erase(comment);
+                size_t sign = def.find(" unsigned");
+                if (sign != string::npos)
+                    def.erase(sign, strlen(" unsigned"));
+            }
+        }
+
+        defs.push_back(def);
+    }
+
+    return head + "(\n  " + valueMerge(defs.begin(), defs.end(),
+                                      string(",\n  ")) + "\n)" + indexes;
+}
+
+/**
+   @brief SQLite version of the triggers of the dump
+
+   MySQL triggers set NEW columns in BEFORE triggers, which SQLite
+   doesn't allow: the same changes are made by AFTER triggers, which
+   don't fire again since recursive triggers are disabled (nor fire
+   the update trigger, which ignores changes to change_seq). As in
+   MySQL, updates of the stock alone are not numbered.
+ */
+static const char *sqliteTriggers[][2] = {
+    { "products_bi",
+      "CREATE TRIGGER products_bi AFTER INSERT ON products BEGIN "
+      "UPDATE sequences SET next_hi = next_hi + 1 "
+      "WHERE name = 'products_changes'; "
+      "UPDATE products SET change_seq = (SELECT next_hi FROM sequences "
+      "WHERE name = 'products_changes') WHERE pid = NEW.pid; "
+      "DELETE FROM product_tombstones WHERE pid = NEW.pid; END" },
+    { "products_bu",
+      "CREATE TRIGGER products_bu AFTER UPDATE ON products "
+      "WHEN NEW.change_seq = OLD.change_seq AND NOT (NEW.pid IS OLD.pid "
+      "AND NEW.cid IS OLD.cid AND NEW.name IS OLD.name AND "
+      "NEW.descr IS OLD.descr AND NEW.price IS OLD.price AND "
+      "NEW.deleted IS OLD.deleted AND NEW.version IS OLD.version) BEGIN "
+      "UPDATE sequences SET next_hi = next_hi + 1 "
+      "WHERE name = 'products_changes'; "
+      "UPDATE products SET change_seq = (SELECT next_hi FROM sequences "
+      "WHERE name = 'products_changes') WHERE pid = NEW.pid; END" },
+    { "products_ad",
+      "CREATE TRIGGER products_ad AFTER DELETE ON products BEGIN "
+      "UPDATE sequences SET next_hi = next_hi + 1 "
+      "WHERE name = 'products_changes'; "
+      "INSERT OR REPLACE INTO product_tombstones SELECT OLD.pid, next_hi "
+      "FROM sequences WHERE name = 'products_changes'; END" }
+};
+
+/**
+   @brief Translate a CREATE TRIGGER statement
+
+   Trigger bodies use the MySQL procedural syntax, so they are not
+   translated: known triggers are replaced by their SQLite version,
+   unknown ones are skipped.
+
+   @param[in]    aStatement  The MySQL statement
+   @return    The SQLite statement, empty if the trigger is unknown
+ */
+string SQLiteBackend::translateTrigger(const string & aStatement)
+{
+    size_t start = aStatement.find("TRIGGER `") + strlen("TRIGGER `");
+    string name = aStatement.substr(start, aStatement.find('`', start) -
+                                    start);
+
+    size_t count = sizeof(sqliteTriggers) / sizeof(sqliteTriggers[0]);
+    for (size_t i = 0; i < count; i++)
+        if (name == sqliteTriggers[i][0])
+            return sqliteTriggers[i][1];
+
+    LOG(1, "Trigger %s not supported, skipped\n", name.c_str());
+
+    return "";
+}
+
+/**
+   @brief Convert the backslash escapes of MySQL string literals
+
+   @param[in]    aStatement  The MySQL statement
+   @return    The statement, with standard SQL literals
+ */
+string SQLiteBackend::translateLiterals(const string & aStatement)
+{
+    string sql;
+    bool quoted = false;
+
+    sql.reserve(aStatement.size());
+    for (size_t i = 0; i < aStatement.size(); i++) {
+        char c = aStatement[i];
+
+        if (!quoted) {
+            quoted = (c == '\'');
+            sql += c;
+            continue;
+        }
+
+        if (c == '\\' && i + 1 < aStatement.size()) {
+            switch (c = aStatement[++i]) {
+                case 'n': sql += '\n'; break;
+                case 'r': sql += '\r'; break;
+                case 't': sql += '\t'; break;
+                case '0': break;
+                case '\'': sql += "''"; break;
+                default: sql += c;
+            }
+        } else if (c == '\'' && i + 1 < aStatement.size() &&
+                   aStatement[i+1] == '\'') {
+            sql += "''";
+            i++;
+        } else {
+            quoted = (c != '\'');
+            sql += c;
+        }
+    }
+
+    return sql;
+}
+
+/**
+   @brief NOW(): the current date and time
+ */
+static void sqlNow(sqlite3_context *ctx, int, sqlite3_value **)
+{
+    sqlite3_result_text(ctx, now().c_str(), -1, SQLITE_TRANSIENT);
+}
+
+/**
+   @brief CONCAT(s1, s2, ...): NULL if any argument is NULL
+ */
+static void sqlConcat(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+    string value;
+
+    for (int i = 0; i < argc; i++) {
+        if (sqlite3_value_type(argv[i]) == SQLITE_NULL) {
+            sqlite3_result_null(ctx);
+            return;
+        }
+        value += (const char *) sqlite3_value_text(argv[i]);
+    }
+
+    sqlite3_result_text(ctx, value.c_str(), value.size(), SQLITE_TRANSIENT);
+}
+
+/**
+   @brief DATE_FORMAT(date, format), for the specifiers %Y %m %d %H %i %s
+ */
+static void sqlDateFormat(sqlite3_context *ctx, int, sqlite3_value **argv)
+{
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        sqlite3_result_null(ctx);
+        return;
+    }
+
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    sscanf((const char *) sqlite3_value_text(argv[0]), "%d-%d-%d %d:%d:%d",
+           &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min,
+           &tm.tm_sec);
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+
+    // MySQL uses %i for minutes and %s for seconds
+    string format = (const char *) sqlite3_value_text(argv[1]);
+    for (size_t i = 0; i + 1 < format.size(); i++)
+        if (format[i] == '%') {
+            i++;
+            if (format[i] == 'i')
+                format[i] = 'M';
+            else if (format[i] == 's')
+                format[i] = 'S';
+        }
+
+    char buf[64];
+    strftime(buf, sizeof(buf), format.c_str(), &tm);
+    sqlite3_result_text(ctx, buf, -1, SQLITE_TRANSIENT);
+}
+
+/**
+   @brief Register the MySQL functions used by the application
+ */
+void SQLiteBackend::registerFunctions(sqlite3 *db)
+{
+    sqlite3_create_function(db, "NOW", 0, SQLITE_UTF8, NULL, sqlNow,
+                            NULL, NULL);
+    sqlite3_create_function(db, "CONCAT", -1, SQLITE_UTF8, NULL, sqlConcat,
+                            NULL, NULL);
+    sqlite3_create_function(db, "DATE_FORMAT", 2, SQLITE_UTF8, NULL,
+                            sqlDateFormat, NULL, NULL);
+}
+
+/**
+   @brief Emulate a stored procedure of the dump
+
+   @param[in]    aSql    The CALL statement, with literal arguments
+   @param[out]   res     Result sets returned by the procedure, if not
+                         NULL
+   @param[out]   rows    Rows changed by the procedure are added to it,
+                         if not NULL
+   @return    True if successful
+ */
+bool SQLiteBackend::call(const string & aSql, ResultSets *res,
+                         ulonglong *rows)
+{
+    string sql = trim(aSql);
+    size_t open = sql.find('(');
+    size_t close = sql.rfind(')');
+    if (open == string::npos || close == string::npos || close < open) {
+        _error = "syntax error in CALL statement";
+        return false;
+    }
+
+    string name = trim(sql.substr(strlen("CALL "), open - strlen("CALL ")));
+    vector<string> args;
+
+    // split arguments, unquoting string literals
+    string arg;
+    bool quoted = false, literal = false;
+    for (size_t i = open + 1; i < close; i++) {
+        char c = sql[i];
+
+        if (quoted) {
+            if (c == '\'' && i + 1 < close && sql[i+1] == '\'')
+                arg += sql[++i];
+            else if (c == '\'')
+                quoted = false;
+            else
+                arg += c;
+        } else if (c == '\'') {
+            quoted = literal = true;
+        } else if (c == ',') {
+            args.push_back(literal ? arg : trim(arg));
+            arg.clear();
+            literal = false;
+        } else if (!literal)
+            arg += c;
+    }
+    if (literal || !trim(arg).empty())
+        args.push_back(literal ? arg : trim(arg));
+
+    LOG(3, "Emulating procedure %s (%d arguments)\n", name.c_str(),
+        (int) args.size());
+
+    ResultSets out;
+    bool success;
+    MutexLocker lock(_shared->lock);
+    int before = sqlite3_total_changes(_shared->db);
+
+    if (name == "next_id_block" && args.size() == 1)
+        success = nextIdBlock(args, out);
+    else if (name == "offers_by_product" && args.size() == 1)
+        success = offersByProduct(args, out);
+    else if (name == "product_delete" && args.size() == 1)
+        success = productDelete(args, out);
+    else if (name == "place_order" && args.size() == 3)
+        success = placeOrder(args, out);
+    else {
+        _error = "unknown procedure " + name;
+        return false;
+    }
+
+    if (res)
+        res->insert(res->end(), out.begin(), out.end());
+    if (rows)
+        *rows += sqlite3_total_changes(_shared->db) - before;
+
+    return success;
+}
+
+/**
+   @brief Emulation of next_id_block(name)
+ */
+bool SQLiteBackend::nextIdBlock(const vector<string> & args,
+                                ResultSets & res)
+{
+    string name = quote(args[0]);
+    ResultSets seq;
+
+    if (!run("SAVEPOINT next_id_block"))
+        return false;
+
+    if (!run("SELECT next_hi AS hi, block_size FROM sequences WHERE "
+             "name = " + name, &seq) ||
+        !run("UPDATE sequences SET next_hi = next_hi + 1 WHERE name = " +
+             name)) {
+        run("ROLLBACK TO next_id_block; RELEASE next_id_block");
+        return false;
+    }
+    run("RELEASE next_id_block");
+
+    // like SELECT ... INTO, an unknown sequence yields NULL values
+    if (seq[0].empty()) {
+        Record & rec = seq[0].addRecord();
+        rec.append(Field());
+        rec.append(Field());
+    }
+    res.push_back(seq[0]);
+
+    return true;
+}
+
+/**
+   @brief Emulation of offers_by_product(pid)
+
+   For each offer including the product, two result sets are returned:
+   name and price of the offer, then its products.
+ */
+bool SQLiteBackend::offersByProduct(const vector<string> & args,
+                                    ResultSets & res)
+{
+    ResultSets offers;
+
+    if (!run("SELECT DISTINCT oid FROM configurations WHERE pid = " +
+             quote(args[0]), &offers))
+        return false;
+
+    for (size_t i = 0; i < offers[0].size(); i++) {
+        string oid = quote(offers[0][i][0]);
+
+        // the procedure stores the price in an INT variable
+        if (!run("SELECT (SELECT name FROM offers WHERE oid = " + oid +
+                 ") AS offer_name, CAST(ROUND((SELECT SUM(P.price) FROM "
+                 "products P, configurations C WHERE P.pid = C.pid AND "
+                 "C.oid = " + oid + ")) AS INTEGER) AS offer_price", &res) ||
+            !run("SELECT P.*, CA.name AS category FROM products P, "
+                 "configurations C, categories CA WHERE C.pid = P.pid AND "
+                 "C.oid = " + oid + " AND P.cid = CA.cid", &res))
+            return false;
+    }
+
+    return true;
+}
+
+/**
+   @brief Emulation of product_delete(pid)
+
+   Products already sold are only marked as deleted.
+ */
+bool SQLiteBackend::productDelete(const vector<string> & args,
+                                  ResultSets &)
+{
+    string pid = quote(args[0]);
+    ResultSets sold;
+
+    if (!run("SELECT COUNT(*) FROM order_details WHERE pid = " + pid,
+             &sold))
+        return false;
+
+    if ((int) sold[0][0][0] > 0)
+        return run("UPDATE products SET deleted = 1 WHERE pid = " + pid);
+
+    return run("DELETE FROM products WHERE pid = " + pid);
+}
+
+/**
+   @brief Emulation of place_order(oid, uid, lines)
+
+   The order is stored and the stock decreased in a single transaction;
+   the result set holds oid, date, total, the product that caused a
+   failure (-1 for an SQL error) and its current price, as the
+   procedure does. Lines are "pid:qty:price": a price which is no
+   longer the current one fails the order, and so does a missing oid.
+ */
+bool SQLiteBackend::placeOrder(const vector<string> & args,
+                               ResultSets & res)
+{
+    string date = now();
+    int oid = atoi(args[0].c_str());
+    int failed = 0;
+    Money total, price;
+    bool priced = false;
+    stringstream sql;
+
+    if (!run("SAVEPOINT place_order"))
+        return false;
+
+    sql << "INSERT INTO orders (oid, uid, date, total) VALUES (" << oid
+        << ", " << quote(args[1]) << ", " << quote(date) << ", 0)";
+
+    // without an ID from next_id_block() the order fails like an SQL error
+    bool success = oid > 0 && run(sql.str());
+
+    stringstream lines(args[2]);
+    string line;
+    while (success && !failed && getline(lines, line, ',')) {
+        size_t colon = line.find(':'), last = line.rfind(':');
+        int pid = atoi(line.c_str());
+        int qty = atoi(line.substr(colon + 1).c_str());
+        Money expected;
+        ResultSets stock;
+
+        Money::parse(line.substr(last + 1), expected);
+
+        sql.str("");
+        sql << "SELECT availability, price FROM products WHERE pid = "
+            << pid << " AND deleted = 0";
+        if (!(success = run(sql.str(), &stock)))
+            break;
+
+        priced = !stock[0].empty() &&
+                 Money::parse(stock[0][0][1].str(), price);
+        if (stock[0].empty() || qty <= 0 ||
+            (int) stock[0][0][0] < qty || price != expected) {
+            failed = pid;
+            break;
+        }
+
+        sql.str("");
+        sql << "UPDATE products SET availability = availability - " << qty
+            << " WHERE pid = " << pid << "; INSERT INTO order_details "
+            << "VALUES (" << oid << ", " << pid << ", " << qty << ")";
+        success = run(sql.str());
+
+        total += price * qty;
+    }
+
+    if (success && !failed) {
+        sql.str("");
+        sql << "UPDATE orders SET total = " << total << " WHERE oid = "
+            << oid;
+        success = run(sql.str());
+    }
+
+    ResultSet out;
+    out.addColumn("oid");
+    out.addColumn("date");
+    out.addColumn("total");
+    out.addColumn("pid");
+    out.addColumn("price");
+    Record & rec = out.addRecord();
+
+    if (success && !failed) {
+        run("RELEASE place_order");
+
+        stringstream id, amount;
+        id << oid;
+        amount << total;
+        rec.append(Field(id.str()));
+        rec.append(Field(date));
+        rec.append(Field(amount.str()));
+        rec.append(Field("0"));
+        rec.append(Field());
+    } else {
+        run("ROLLBACK TO place_order; RELEASE place_order");
+
+        sql.str("");
+        sql << (success ? failed : -1);
+        rec.append(Field("0"));
+        rec.append(Field());
+        rec.append(Field("0"));
+        rec.append(Field(sql.str()));
+        rec.append(failed && priced ? Field(price.str()) : Field());
+    }
+    res.push_back(out);
+
+    return true;
+}
+
+#endif /* HAVE_SQLITE3 */
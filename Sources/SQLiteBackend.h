@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#ifndef __SQLITEBACKEND_H__
+#define __SQLITEBACKEND_H__
+
+#include "Storage.h"
+#include "Mutex.h"
+
+#ifdef HAVE_SQLITE3
+
+#include <sqlite3.h>
+
+/** Default dump loaded by the embedded backend */
+#define SQLITE_DEFAULT_DUMP     "../Database/seng_dump.sql"
+/** Keep the embedded database in memory only */
+#define SQLITE_MEMORY           ":memory:"
+
+/**
+   @brief Embedded storage backend based on SQLite
+
+   The database lives inside the process (in memory, by default) and
+   is populated from a MySQL dump, such as Database/seng_dump.sql: the
+   DDL is translated to SQLite syntax on the fly, the MySQL functions
+   used by the application (NOW, CONCAT, DATE_FORMAT) are registered
+   as SQLite functions, the stored procedures of the dump are
+   emulated in C++ and its triggers are replaced by SQLite ones.
+
+   It needs no server at all, so it's suited to hermetic tests and
+   benchmarks, or to serve reads from a local copy of the catalog.
+
+   Clones share the same database: statements are serialized by a
+   lock, which is held from begin() to commit() or rollback().
+ */
+class SQLiteBackend : public StorageBackend
+{
+private:
+    /** Database shared by a backend and its clones */
+    struct Shared {
+        sqlite3 *db;
+        Mutex lock;
+        volatile int refs;
+
+        Shared() : db(NULL), lock(true), refs(1) {}
+    };
+
+    Shared *_shared;
+    string _dump;
+    string _path;
+    string _error;
+    bool _inTransaction;
+
+    bool run(const string & aSql, ResultSets *res = NULL,
+             ulonglong *rows = NULL);
+    bool load();
+    bool call(const string & aSql, ResultSets *res, ulonglong *rows);
+
+    bool nextIdBlock(const vector<string> & args, ResultSets & res);
+    bool offersByProduct(const vector<string> & args, ResultSets & res);
+    bool productDelete(const vector<string> & args, ResultSets & res);
+    bool placeOrder(const vector<string> & args, ResultSets & res);
+
+    static vector<string> splitDump(const string & aText);
+    static string translate(const string & aStatement);
+    static string translateTable(const string & aStatement);
+    static string translateTrigger(const string & aStatement);
+    static string translateLiterals(const string & aStatement);
+    static void registerFunctions(sqlite3 *db);
+
+public:
+    SQLiteBackend(const string & aDump = SQLITE_DEFAULT_DUMP,
+                  const string & aPath = SQLITE_MEMORY);
+    virtual ~SQLiteBackend();
+
+    const char *name() const;
+    bool connect();
+    void disconnect();
+    bool isConnected();
+    StorageBackend *clone();
+
+    bool query(const string & aSql, ResultSets & res);
+    bool execute(const string & aSql, ulonglong *rows = NULL,
+                 ulonglong *insertID = NULL);
+    string quote(const string & aValue);
+
+    bool begin();
+    bool commit();
+    bool rollback();
+    string error();
+    string schemaVersion();
+};
+
+#endif /* HAVE_SQLITE3 */
+
+#endif /* __SQLITEBACKEND_H__ */
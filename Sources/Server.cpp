@@ -0,0 +1,503 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#include "Server.h"
+#include "Session.h"
+#include "Database.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/**
+   @brief Default constructor
+
+   The server doesn't listen until listen() is called.
+ */
+Server::Server()
+{
+    LOG_CTOR();
+    _listenFd = -1;
+    _wakeFd[0] = _wakeFd[1] = -1;
+    _stopping = 0;
+    _accepted = 0;
+    _commands = 0;
+    _sessions = 0;
+    _highWater = 0;
+}
+
+/**
+   @brief Default destructor
+
+   Closes the listening socket, removing it if it's a Unix one.
+ */
+Server::~Server()
+{
+    LOG_DTOR();
+    if (_listenFd >= 0)
+        close(_listenFd);
+    if (!_unixPath.empty())
+        unlink(_unixPath.c_str());
+}
+
+/**
+   @brief Put a descriptor in non-blocking mode
+ */
+static bool setNonBlocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL);
+
+    return (flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0);
+}
+
+/**
+   @brief Start listening for clients
+
+   @param[in]    anAddress   The path of a Unix socket (it must contain
+                             a '/', e.g. "./ec++.sock"), or a TCP port,
+                             optionally preceded by the address to bind
+                             ("127.0.0.1:4000")
+   @return    True if the socket is ready to accept clients
+ */
+bool Server::listen(const string & anAddress)
+{
+    bool success;
+
+    if (_listenFd >= 0)
+        return false;
+
+    if (anAddress.find('/') != string::npos)
+        success = listenUnix(anAddress);
+    else
+        success = listenTcp(anAddress);
+
+    if (success && !setNonBlocking(_listenFd)) {
+        close(_listenFd);
+        _listenFd = -1;
+        success = false;
+    }
+    if (success)
+        LOG(1, "Listening on %s\n", anAddress.c_str());
+
+    return success;
+}
+
+/**
+   @brief Listen on a Unix socket, replacing a stale one
+
+   @param[in]    aPath   Path of the socket
+ */
+bool Server::listenUnix(const string & aPath)
+{
+    struct sockaddr_un addr;
+
+    if (aPath.size() >= sizeof(addr.sun_path)) {
+        cerr << "Socket path too long: " << aPath << endl;
+        return false;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, aPath.c_str());
+
+    if ((_listenFd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        return false;
+    }
+
+    unlink(aPath.c_str());
+    if (bind(_listenFd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+        ::listen(_listenFd, SOMAXCONN) != 0) {
+        perror(aPath.c_str());
+        close(_listenFd);
+        _listenFd = -1;
+        return false;
+    }
+    _unixPath = aPath;
+
+    return true;
+}
+
+/**
+   @brief Listen on a TCP port
+
+   Without a host the port is bound to the loopback interface only:
+   sessions accept registrations from anybody who can connect, so
+   remote clients must be allowed explicitly ("0.0.0.0:port").
+
+   @param[in]    anAddress   "port" or "host:port"
+ */
+bool Server::listenTcp(const string & anAddress)
+{
+    string host, port = anAddress;
+    size_t colon = anAddress.rfind(':');
+    struct addrinfo hints, *res;
+    int one = 1;
+
+    if (colon != string::npos) {
+        host = anAddress.substr(0, colon);
+        port = anAddress.substr(colon + 1);
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(),
+                          &hints, &res);
+    if (err != 0) {
+        cerr << anAddress << ": " << gai_strerror(err) << endl;
+        return false;
+    }
+
+    _listenFd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (_listenFd >= 0) {
+        setsockopt(_listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(_listenFd, res->ai_addr, res->ai_addrlen) != 0 ||
+            ::listen(_listenFd, SOMAXCONN) != 0) {
+            close(_listenFd);
+            _listenFd = -1;
+        }
+    }
+    if (_listenFd < 0)
+        perror(anAddress.c_str());
+    freeaddrinfo(res);
+
+    return (_listenFd >= 0);
+}
+
+/**
+   @brief Serve clients until stop() is called
+
+   Starts the workers, then runs the event loop on the calling thread.
+   When the server stops, the workers finish the commands they're
+   running and every session is closed.
+
+   @param[in]    aWorkers    Number of worker threads
+   @return    False if the server couldn't start
+ */
+bool Server::run(size_t aWorkers)
+{
+    if (_listenFd < 0 || aWorkers == 0)
+        return false;
+
+    if (pipe(_wakeFd) != 0 || !setNonBlocking(_wakeFd[0]) ||
+        !setNonBlocking(_wakeFd[1])) {
+        perror("pipe");
+        return false;
+    }
+
+    for (size_t i = 0; i < aWorkers; i++) {
+        pthread_t t;
+        if (pthread_create(&t, NULL, &Server::work, this) != 0) {
+            cerr << "Unable to start a server worker\n";
+            stop();
+            break;
+        }
+        _threads.push_back(t);
+    }
+
+    while (!isStopping()) {
+        collect();
+
+        // idle clients only: the busy ones belong to a worker
+        vector<struct pollfd> fds(2);
+        vector<Client *> polled;
+        fds[0].fd = _listenFd;
+        fds[1].fd = _wakeFd[0];
+        fds[0].events = fds[1].events = POLLIN;
+        map<int, Client *>::const_iterator it;
+        for (it = _clients.begin(); it != _clients.end(); it++) {
+            Client *c = (*it).second;
+            if (c->busy)
+                continue;
+
+            struct pollfd p;
+            p.fd = c->fd;
+            p.events = POLLIN;
+            fds.push_back(p);
+            polled.push_back(c);
+        }
+
+        if (poll(&fds[0], fds.size(), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            break;
+        }
+
+        if (fds[1].revents) {
+            char buf[64];
+            while (read(_wakeFd[0], buf, sizeof(buf)) > 0)
+                ;
+        }
+        if (fds[0].revents)
+            acceptClients();
+        for (size_t i = 0; i < polled.size(); i++)
+            if (fds[i + 2].revents)
+                readClient(polled[i]);
+    }
+
+    // let the workers finish, then drop every session
+    {
+        MutexLocker lock(_lock);
+        stop();
+        _ready.broadcast();
+    }
+    for (size_t i = 0; i < _threads.size(); i++)
+        pthread_join(_threads[i], NULL);
+    _threads.clear();
+
+    _queue.clear();
+    _done.clear();
+    while (!_clients.empty())
+        closeClient((*_clients.begin()).second);
+
+    close(_wakeFd[0]);
+    close(_wakeFd[1]);
+    _wakeFd[0] = _wakeFd[1] = -1;
+    LOG(1, "Server stopped\n");
+
+    return true;
+}
+
+/**
+   @brief Stop the server
+
+   Safe to call from a signal handler or from any thread.
+ */
+void Server::stop()
+{
+    int saved = errno;
+
+    __atomic_store_n(&_stopping, 1, __ATOMIC_RELEASE);
+    wake();
+    errno = saved;
+}
+
+/**
+   @brief Wake up the event loop
+ */
+void Server::wake()
+{
+    char b = 0;
+
+    if (_wakeFd[1] >= 0)
+        (void) write(_wakeFd[1], &b, 1);
+}
+
+/**
+   @brief Accept all pending connections, with a new session each
+ */
+void Server::acceptClients()
+{
+    int fd;
+
+    while ((fd = accept(_listenFd, NULL, NULL)) >= 0) {
+        // a client that stops reading can't hold a worker forever
+        struct timeval tv = { SERVER_SEND_TIMEOUT, 0 };
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (_unixPath.empty())
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        Client *c = new Client;
+        c->fd = fd;
+        c->session = new Session();
+        c->busy = false;
+        c->closing = false;
+        _clients[fd] = c;
+
+        MutexLocker lock(_lock);
+        _accepted++;
+        if (++_sessions > _highWater)
+            _highWater = _sessions;
+    }
+}
+
+/**
+   @brief Read from an idle client, queueing it once a line is complete
+
+   @param[in]    c   The client
+ */
+void Server::readClient(Client *c)
+{
+    char buf[4096];
+    ssize_t n = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT);
+
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return;
+    if (n <= 0) {
+        closeClient(c);
+        return;
+    }
+
+    c->input.append(buf, n);
+    if (c->input.find('\n') == string::npos) {
+        if (c->input.size() > SERVER_MAX_LINE) {
+            LOG(1, "Dropping client %d: line too long\n", c->fd);
+            closeClient(c);
+        }
+        return;
+    }
+
+    MutexLocker lock(_lock);
+    c->busy = true;
+    _queue.push_back(c);
+    _ready.signal();
+}
+
+/**
+   @brief Close the connection and the session of an idle client
+
+   @param[in]    c   The client, deleted
+ */
+void Server::closeClient(Client *c)
+{
+    LOG(2, "Closing client %d after %llu commands\n", c->fd,
+        c->session->commandCount());
+    _clients.erase(c->fd);
+    close(c->fd);
+    delete c->session;
+    delete c;
+
+    MutexLocker lock(_lock);
+    _sessions--;
+}
+
+/**
+   @brief Take back the clients the workers are done with
+ */
+void Server::collect()
+{
+    vector<Client *> done;
+
+    {
+        MutexLocker lock(_lock);
+        done.swap(_done);
+    }
+
+    for (size_t i = 0; i < done.size(); i++) {
+        done[i]->busy = false;
+        if (done[i]->closing)
+            closeClient(done[i]);
+    }
+}
+
+/**
+   @brief Run the complete lines sent by a client and send the replies
+
+   Called by a worker, which owns the client meanwhile.
+
+   @param[in]    c   The client
+   @return    False if the session is over
+ */
+bool Server::serve(Client *c)
+{
+    string replies;
+    size_t start = 0, eol;
+    bool open = true;
+    int count = 0;
+
+    while (open && (eol = c->input.find('\n', start)) != string::npos) {
+        string line = c->input.substr(start, eol - start);
+        if (!line.empty() && line[line.size() - 1] == '\r')
+            line.erase(line.size() - 1);
+
+        string reply;
+        open = c->session->execute(line, reply);
+        replies += reply;
+        start = eol + 1;
+        count++;
+    }
+    c->input.erase(0, start);
+
+    for (size_t sent = 0; sent < replies.size(); ) {
+        ssize_t n = send(c->fd, replies.data() + sent, replies.size() - sent,
+                         MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        sent += n;
+    }
+
+    MutexLocker lock(_lock);
+    _commands += count;
+
+    return open;
+}
+
+/**
+   @brief Body of the worker threads
+
+   @param[in]    arg The instance of Server
+ */
+void *Server::work(void *arg)
+{
+    Server *s = (Server *) arg;
+    Database &db = Database::instance();
+    StorageBackend *backend = db.backend();
+
+    if (backend)
+        backend->threadStart();
+
+    StorageBackend *conn = db.newConnection();
+    if (!conn) {
+        cerr << "Server worker unable to connect to database\n";
+        s->stop();
+    } else
+        db.setThreadConnection(conn);
+
+    while (conn) {
+        Client *c;
+
+        {
+            MutexLocker lock(s->_lock);
+
+            while (s->_queue.empty() && !s->isStopping())
+                s->_ready.wait(s->_lock);
+            if (s->isStopping())
+                break;
+
+            c = s->_queue.front();
+            s->_queue.pop_front();
+        }
+
+        bool open = s->serve(c);
+
+        {
+            MutexLocker lock(s->_lock);
+            c->closing = !open;
+            s->_done.push_back(c);
+        }
+        s->wake();
+    }
+
+    db.setThreadConnection(NULL);
+    delete conn;
+    if (backend)
+        backend->threadEnd();
+
+    return NULL;
+}
+
+/**
+   @brief Print the statistics of the server
+ */
+ostream& operator<<(ostream& aStream, Server& s) {
+    MutexLocker lock(s._lock);
+
+    return aStream << "Server: " << s._sessions << " sessions (high "
+           << "water " << s._highWater << "), " << s._accepted
+           << " accepted, " << s._commands << " commands\n";
+}
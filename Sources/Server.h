@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#ifndef __SERVER_H__
+#define __SERVER_H__
+
+#include <deque>
+#include "common.h"
+#include "Storage.h"
+#include "Mutex.h"
+
+using namespace std;
+
+class Session;
+
+/** Worker threads started by default */
+#define SERVER_WORKERS          8
+/** Longest command line accepted, in bytes */
+#define SERVER_MAX_LINE         4096
+/** Seconds a reply can wait for a client reading too slowly */
+#define SERVER_SEND_TIMEOUT     30
+
+/**
+   @brief Serves many concurrent sessions over a local or TCP socket
+
+   The class Server replaces UserMenu when the program runs headless:
+   clients connect to a Unix socket (an address containing a '/') or
+   to a TCP port ("[host:]port", loopback only unless a host is given)
+   and talk to a Session each.
+
+   One thread runs an event loop with poll(): it accepts connections
+   and reads from idle clients. As soon as a client sent a complete
+   line, the client is handed to a pool of worker threads and ignored
+   by the loop until a worker ran all its pending commands and sent
+   the replies back: commands of a session run in order, one at a
+   time, while different sessions run in parallel.
+
+   Every worker has its own connection to the database (see
+   Database::setThreadConnection()); the query cache, the catalog
+   view, the inventory and the other singletons are shared by all of
+   them.
+
+   stop() can be called from a signal handler.
+
+   @see Session
+ */
+class Server : public Singleton<Server>
+{
+private:
+    /** A connected client */
+    struct Client {
+        int fd;
+        Session *session;
+        /** Bytes read and not yet run */
+        string input;
+        /** True while a worker owns the client */
+        bool busy;
+        /** True once the session is over */
+        bool closing;
+    };
+
+    int _listenFd;
+    string _unixPath;
+    /** Self-pipe waking up the event loop */
+    int _wakeFd[2];
+    /** Set by stop(), possibly from a signal handler */
+    int _stopping;
+    vector<pthread_t> _threads;
+    map<int, Client *> _clients;
+
+    /** Protects the queues and the counters */
+    Mutex _lock;
+    Condition _ready;
+    /** Clients with complete lines, waiting for a worker */
+    deque<Client *> _queue;
+    /** Clients given back by the workers */
+    vector<Client *> _done;
+
+    ulonglong _accepted;
+    ulonglong _commands;
+    /** Open sessions: _clients belongs to the event loop */
+    size_t _sessions;
+    size_t _highWater;
+
+    bool listenUnix(const string & aPath);
+    bool listenTcp(const string & anAddress);
+    void acceptClients();
+    void readClient(Client *c);
+    void closeClient(Client *c);
+    void collect();
+    void wake();
+    bool serve(Client *c);
+    bool isStopping() const {
+        return __atomic_load_n(&_stopping, __ATOMIC_ACQUIRE);
+    }
+    static void *work(void *arg);
+
+protected:
+    friend class Singleton<Server>;
+    Server();
+    virtual ~Server();
+
+public:
+    bool listen(const string & anAddress);
+    bool run(size_t aWorkers = SERVER_WORKERS);
+    void stop();
+
+    friend ostream & operator<<(ostream &, Server &);
+};
+
+#endif /* __SERVER_H__ */
@@ -0,0 +1,588 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#include "Session.h"
+#include "Product.h"
+#include "Category.h"
+#include "Order.h"
+#include "NotificationScope.h"
+#include <algorithm>
+
+/**
+   @brief The commands understood by a session, in HELP order
+ */
+const Session::CommandInfo Session::commands[] = {
+    { "HELP",        ANYONE,   &Session::help,          "" },
+    { "LOGIN",       ANYONE,   &Session::login,         "login password" },
+    { "REGISTER",    ANYONE,   &Session::registerUser,
+      "name|surname|address|city|login|password" },
+    { "LOGOUT",      LOGGED,   &Session::logout,        "" },
+    { "CATEGORIES",  LOGGED,   &Session::categories,    "" },
+    { "CATALOG",     LOGGED,   &Session::catalog,       "[cid]" },
+    { "PRODUCT",     LOGGED,   &Session::product,       "pid" },
+    { "PROFILE",     LOGGED,   &Session::profile,       "" },
+    { "ADD",         CUSTOMER, &Session::addToBasket,   "pid [qty]" },
+    { "BASKET",      CUSTOMER, &Session::basket,        "" },
+    { "ORDER",       CUSTOMER, &Session::placeOrder,    "" },
+    { "NEWCATEGORY", ADMIN,    &Session::addCategory,   "name" },
+    { "NEWPRODUCT",  ADMIN,    &Session::addProduct,
+      "cid|name|description|price|availability" },
+    { "SET",         ADMIN,    &Session::changeProduct,
+      "pid name|descr|price value" },
+    { "DISABLE",     ADMIN,    &Session::disableUser,   "uid" },
+    { "DELETE",      ADMIN,    &Session::deleteProduct, "pid" },
+    { "STOCK",       ADMIN,    &Session::adjustStock,   "pid delta" },
+    { NULL,          ANYONE,   NULL,                    NULL }
+};
+
+/**
+   @brief Default constructor: nobody is logged in
+ */
+Session::Session()
+{
+    LOG_CTOR();
+    _currentUser = NULL;
+    _commands = 0;
+}
+
+/**
+   @brief Default destructor
+
+   Dealloc the logged user, if any (releasing the reservations of his
+   basket).
+ */
+Session::~Session()
+{
+    LOG_DTOR();
+    if (_currentUser)
+        delete _currentUser;
+}
+
+/**
+   @brief Run a command line and format its reply
+
+   @param[in]    aLine   The command, without the line terminator
+   @param[out]   aReply  The reply to send back to the client
+   @return    False if the client asked to close the session
+ */
+bool Session::execute(const string & aLine, string & aReply)
+{
+    istringstream args(aLine);
+    ostringstream out;
+    string verb, error;
+    bool success = false;
+
+    args >> verb;
+    std::transform(verb.begin(), verb.end(), verb.begin(), ::toupper);
+    if (verb.empty()) {
+        aReply.clear();
+        return true;
+    }
+    if (verb == "QUIT") {
+        aReply = "OK bye\n.\n";
+        return false;
+    }
+
+    _commands++;
+    const CommandInfo *cmd = commands;
+    while (cmd->name && verb != cmd->name)
+        cmd++;
+
+    AdminUser *anAdmin = dynamic_cast<AdminUser *> (_currentUser);
+    if (!cmd->name)
+        error = "unknown command, try HELP";
+    else if (cmd->level != ANYONE && !_currentUser)
+        error = "login required";
+    else if (cmd->level == CUSTOMER && anAdmin)
+        error = "not available to administrators";
+    else if (cmd->level == ADMIN && !anAdmin)
+        error = "permission denied";
+    else {
+        try {
+            args >> ws;
+            success = (this->*(cmd->handler))(args, out, error);
+        }
+        catch (const exception & e) {
+            error = string("internal error: ") + e.what();
+        }
+        catch (const string & msg) {
+            error = msg;
+        }
+    }
+    LOG(2, "%s: %s\n", verb.c_str(), success ? "OK" : error.c_str());
+
+    // status line, dot-stuffed data lines and terminator
+    aReply = success ? "OK\n" : "ERR " + error + "\n";
+    istringstream data(out.str());
+    string line;
+    while (getline(data, line)) {
+        if (!line.empty() && line[0] == '.')
+            aReply += '.';
+        aReply += line + "\n";
+    }
+    aReply += ".\n";
+
+    return true;
+}
+
+/**
+   @brief Split the rest of a command line into '|' separated fields
+
+   @param[in]    args    The arguments of the command
+   @param[out]   aList   The fields found
+   @param[in]    aCount  How many fields are expected
+   @return    True if exactly aCount non-empty fields were found
+ */
+bool Session::fields(istream & args, vector<string> & aList, size_t aCount)
+{
+    string field;
+
+    aList.clear();
+    while (getline(args, field, '|'))
+        aList.push_back(field);
+
+    if (aList.size() != aCount)
+        return false;
+    for (size_t i = 0; i < aList.size(); i++)
+        if (aList[i].empty())
+            return false;
+
+    return true;
+}
+
+/**
+   @brief List the commands available to the current user
+ */
+bool Session::help(istream &, ostream & out, string &)
+{
+    AdminUser *anAdmin = dynamic_cast<AdminUser *> (_currentUser);
+
+    for (const CommandInfo *cmd = commands; cmd->name; cmd++) {
+        if ((cmd->level == ADMIN && !anAdmin) ||
+            (cmd->level == CUSTOMER && (!_currentUser || anAdmin)) ||
+            (cmd->level == LOGGED && !_currentUser))
+            continue;
+        out << cmd->name << (*cmd->synopsis ? " " : "") << cmd->synopsis
+            << endl;
+    }
+    out << "QUIT" << endl;
+
+    return true;
+}
+
+/**
+   @brief Authenticate the user of the session
+
+   @see User::login()
+ */
+bool Session::login(istream & args, ostream & out, string & error)
+{
+    string username, passwd;
+
+    if (_currentUser) {
+        error = "already logged in, LOGOUT first";
+        return false;
+    }
+    if (!(args >> username >> passwd)) {
+        error = "usage: LOGIN login password";
+        return false;
+    }
+    if (!(_currentUser = User::login(username, passwd))) {
+        error = "invalid username/password";
+        return false;
+    }
+
+    out << _currentUser->fullName()
+        << (_currentUser->isAdmin() ? " (admin)" : "") << endl;
+
+    return true;
+}
+
+/**
+   @brief Log the current user out, dropping his basket
+ */
+bool Session::logout(istream &, ostream &, string &)
+{
+    delete _currentUser, _currentUser = NULL;
+
+    return true;
+}
+
+/**
+   @brief Register a new user
+
+   @see User::factory()
+ */
+bool Session::registerUser(istream & args, ostream &, string & error)
+{
+    vector<string> f;
+
+    if (!fields(args, f, 6)) {
+        error = "usage: REGISTER name|surname|address|city|login|password";
+        return false;
+    }
+
+    User *anUser = User::factory(f[0], f[1], f[4], f[5], f[2], f[3]);
+    if (!anUser) {
+        error = "unable to register new user";
+        return false;
+    }
+    delete anUser;
+
+    return true;
+}
+
+/**
+   @brief List all categories, with the number of their products
+ */
+bool Session::categories(istream &, ostream & out, string &)
+{
+    ResultList<Category> vc = Category::catalog();
+
+    for (int i=0; i < (int)vc.size(); i++) {
+        Category & c = vc[i];
+        out << c.valueForKey(c.primaryKey()) << "|" << c.getName()
+            << "|" << c.productCount() << endl;
+    }
+
+    return true;
+}
+
+/**
+   @brief List the products of a category (all of them if none given)
+
+   @param[out]   out     Stream the products are written to
+   @param[in]    aCid    Category ID, 0 for the whole catalog
+ */
+void Session::printCatalog(ostream & out, int aCid)
+{
+    ResultList<ProductProxy> v = ProductProxy::catalog(aCid);
+
+    for (int i=0; i < (int)v.size(); i++) {
+        ProductProxy *pp = &v[i];
+        auto_ptr<Category> c = pp->getCategory();
+
+        out << pp->uniqueID() << "|" << c->getName() << "|"
+            << pp->getName() << "|" << pp->getPrice() << endl;
+    }
+}
+
+/**
+   @brief List the products of a category, or the whole catalog
+ */
+bool Session::catalog(istream & args, ostream & out, string & error)
+{
+    int cid = 0;
+
+    if (!args.eof() && !(args >> cid)) {
+        error = "usage: CATALOG [cid]";
+        return false;
+    }
+    printCatalog(out, cid);
+
+    return true;
+}
+
+/**
+   @brief Show all details of a product
+ */
+bool Session::product(istream & args, ostream & out, string & error)
+{
+    int pid;
+
+    if (!(args >> pid)) {
+        error = "usage: PRODUCT pid";
+        return false;
+    }
+
+    ProductProxy pp(pid);
+    if (!pp.isValid()) {
+        error = "invalid product ID";
+        return false;
+    }
+    out << pp;
+
+    return true;
+}
+
+/**
+   @brief Show the profile of the current user and all his orders
+ */
+bool Session::profile(istream &, ostream & out, string &)
+{
+    out << *_currentUser;
+
+    ResultList<Order> orders = Order::ordersForUser(*_currentUser);
+    ResultList<Order>::iterator it;
+    for (it = orders.begin(); it != orders.end(); it++) {
+        Order *ord = it;
+        out << endl << *ord;
+
+        ResultList< pair<int, int> > products = ord->products();
+        ResultList< pair<int, int> >::const_iterator mit;
+        for (mit = products.begin(); mit != products.end(); mit++) {
+            ProductProxy pp = ProductProxy( (*mit).first );
+            out << "  (*) Product: " << left << setw(30) << pp.getName()
+                << "Quantity: " << (*mit).second << endl;
+        }
+    }
+    if (orders.size())
+        out << endl << "Total spent: " << Order::totalOf(orders) << endl;
+
+    return true;
+}
+
+/**
+   @brief Reserve pieces of a product and add them to the basket
+ */
+bool Session::addToBasket(istream & args, ostream & out, string & error)
+{
+    int pid, qty = 1;
+
+    if (!(args >> pid) || (!args.eof() && !(args >> qty))) {
+        error = "usage: ADD pid [qty]";
+        return false;
+    }
+
+    ProductProxy pp(pid);
+    if (!pp.isValid()) {
+        error = "product not existent";
+        return false;
+    }
+
+    Basket *bkt = _currentUser->getBasket();
+    if (!bkt->addProduct(&pp, qty)) {
+        error = "unable to add requested item to basket";
+        return false;
+    }
+    out << bkt->itemCount() << endl;
+
+    return true;
+}
+
+/**
+   @brief Show the content of the basket and its total
+ */
+bool Session::basket(istream &, ostream & out, string &)
+{
+    Basket *bkt = _currentUser->getBasket();
+
+    out << *bkt << "TOTAL: " << bkt->total() << endl;
+
+    return true;
+}
+
+/**
+   @brief Turn the basket into a new order
+
+   @see NormalUser::placeOrder()
+ */
+bool Session::placeOrder(istream &, ostream & out, string & error)
+{
+    Basket *bkt = _currentUser->getBasket();
+
+    if (bkt->itemCount() == 0) {
+        error = "no products were added to basket";
+        return false;
+    }
+
+    Order *ord = _currentUser->placeOrder();
+    if (!ord) {
+        error = "unable to place the order";
+        return false;
+    }
+    // the amount charged, equal to the total of the basket
+    out << "TOTAL: " << ord->getTotal() << endl;
+    delete ord;
+
+    return true;
+}
+
+/**
+   @brief Admin operation to create a new category of products
+ */
+bool Session::addCategory(istream & args, ostream &, string & error)
+{
+    string name;
+
+    if (!getline(args, name) || name.empty()) {
+        error = "usage: NEWCATEGORY name";
+        return false;
+    }
+
+    Category *newCat = Category::factory(name);
+    bool success = newCat->store();
+    delete newCat;
+    if (!success)
+        error = "unable to store the category";
+
+    return success;
+}
+
+/**
+   @brief Admin operation to add a new product
+ */
+bool Session::addProduct(istream & args, ostream &, string & error)
+{
+    vector<string> f;
+
+    if (!fields(args, f, 5)) {
+        error = "usage: NEWPRODUCT cid|name|description|price|availability";
+        return false;
+    }
+
+    int cid = atoi(f[0].c_str());
+    Money price;
+    int qty = atoi(f[4].c_str());
+    if ((cid <= 0) || !Money::parse(f[3], price) || (price <= Money()) ||
+        !CategoryTable::instance().contains(cid)) {
+        error = "invalid category or price";
+        return false;
+    }
+
+    Product *p = Product::factory(f[1], cid, price, f[2], qty);
+    bool success = p->store();
+    delete p;
+    if (!success)
+        error = "unable to store the product";
+
+    return success;
+}
+
+/**
+   @brief Admin operation to change the name, description or price of
+          a product
+
+   Observers learn about the change only if it's stored.
+ */
+bool Session::changeProduct(istream & args, ostream &, string & error)
+{
+    int pid;
+    string attribute, value;
+
+    if (!(args >> pid >> attribute) || !getline(args >> ws, value) ||
+        value.empty()) {
+        error = "usage: SET pid name|descr|price value";
+        return false;
+    }
+
+    const char *key;
+    if (attribute == "name")
+        key = KEY_PRD_NAME;
+    else if (attribute == "descr")
+        key = KEY_PRD_DESCR;
+    else if (attribute == "price")
+        key = KEY_PRD_PRICE;
+    else {
+        error = "unknown attribute " + attribute;
+        return false;
+    }
+
+    Product *p = Product::productByID(pid, true);
+    if (!p) {
+        error = "unable to find specified product";
+        return false;
+    }
+
+    Money price;
+    if (attribute == "price" &&
+        (!Money::parse(value, price) || (price <= Money()))) {
+        error = "invalid price " + value;
+        return false;
+    }
+
+    NotificationScope scope;
+    if (attribute == "price")
+        p->setMoneyForKey(key, price);
+    else
+        p->setValueForKey(key, value);
+    bool success= p->update();
+    if (success)
+        scope.commit();
+    else {
+        scope.discard();
+        error = p->hasConflict() ? "the product was changed by someone else"
+                                 : "unable to update the product";
+    }
+    delete p;
+
+    return success;
+}
+
+/**
+   @brief Admin operation to disable a registered user
+
+   @see AdminUser::changeUserPassword()
+ */
+bool Session::disableUser(istream & args, ostream &, string & error)
+{
+    AdminUser *anAdmin = dynamic_cast<AdminUser *> (_currentUser);
+    int uid;
+
+    if (!(args >> uid) || uid <= 0) {
+        error = "usage: DISABLE uid";
+        return false;
+    }
+
+    User *anUser = User::userByID(uid);
+    if (!anUser) {
+        error = "invalid user ID";
+        return false;
+    }
+
+    bool success = anAdmin->changeUserPassword(*anUser, "*LK*");
+    if (!success)
+        error = anUser->hasConflict() ? "the user was changed by someone else"
+                                      : "unable to disable the user";
+    delete anUser;
+
+    return success;
+}
+
+/**
+   @brief Admin operation to delete a product
+
+   @see AdminUser::deleteProduct()
+ */
+bool Session::deleteProduct(istream & args, ostream &, string & error)
+{
+    AdminUser *anAdmin = dynamic_cast<AdminUser *> (_currentUser);
+    int pid;
+
+    if (!(args >> pid) || pid <= 0) {
+        error = "usage: DELETE pid";
+        return false;
+    }
+    if (!anAdmin->deleteProduct(pid)) {
+        error = "unable to delete the product";
+        return false;
+    }
+
+    return true;
+}
+
+/**
+   @brief Admin operation to add or remove units of a product
+
+   @see AdminUser::adjustStock()
+ */
+bool Session::adjustStock(istream & args, ostream &, string & error)
+{
+    AdminUser *anAdmin = dynamic_cast<AdminUser *> (_currentUser);
+    int pid, delta;
+
+    if (!(args >> pid >> delta) || pid <= 0 || delta == 0) {
+        error = "usage: STOCK pid delta";
+        return false;
+    }
+    if (!anAdmin->adjustStock(pid, delta)) {
+        error = "not enough units or unknown product";
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#ifndef __SESSION_H__
+#define __SESSION_H__
+
+#include "common.h"
+#include "User.h"
+
+using namespace std;
+
+/**
+   @brief A shopper connected to the server, driven by text commands
+
+   The class Session offers over a line-oriented protocol the same
+   operations UserMenu offers on the terminal: browsing the catalog,
+   filling the basket, placing orders and, for administrators, managing
+   categories, products, stock and users. Each command is a line of
+   words; commands taking free text (names, descriptions) separate
+   their fields with '|':
+
+   @code
+   LOGIN jdoe secret
+   CATALOG 3
+   ADD 12 2
+   ORDER
+   NEWPRODUCT 3|Keyboard|USB, 105 keys|19.90|100
+   @endcode
+
+   Every reply starts with "OK" or "ERR <reason>", followed by its data
+   lines and by a line holding a single dot; data lines starting with a
+   dot get one more in front, as in POP3.
+
+   A session is used by one thread at a time, but sessions run
+   concurrently: everything they share (database, caches, inventory)
+   is thread-safe.
+
+   @see Server, UserMenu
+ */
+class Session
+{
+private:
+    /** Who may run a command */
+    enum Level { ANYONE, LOGGED, CUSTOMER, ADMIN };
+
+    typedef bool (Session::*Command)(istream & args, ostream & out,
+                                     string & error);
+
+    struct CommandInfo {
+        const char *name;
+        Level level;
+        Command handler;
+        const char *synopsis;
+    };
+
+    static const CommandInfo commands[];
+
+    User *_currentUser;
+    ulonglong _commands;
+
+    static bool fields(istream & args, vector<string> & aList,
+                       size_t aCount);
+    void printCatalog(ostream & out, int aCid = 0);
+
+    // session handling
+    bool help(istream & args, ostream & out, string & error);
+    bool login(istream & args, ostream & out, string & error);
+    bool logout(istream & args, ostream & out, string & error);
+    bool registerUser(istream & args, ostream & out, string & error);
+
+    // user operations
+    bool categories(istream & args, ostream & out, string & error);
+    bool catalog(istream & args, ostream & out, string & error);
+    bool product(istream & args, ostream & out, string & error);
+    bool profile(istream & args, ostream & out, string & error);
+    bool addToBasket(istream & args, ostream & out, string & error);
+    bool basket(istream & args, ostream & out, string & error);
+    bool placeOrder(istream & args, ostream & out, string & error);
+
+    // admin operations
+    bool addCategory(istream & args, ostream & out, string & error);
+    bool addProduct(istream & args, ostream & out, string & error);
+    bool changeProduct(istream & args, ostream & out, string & error);
+    bool disableUser(istream & args, ostream & out, string & error);
+    bool deleteProduct(istream & args, ostream & out, string & error);
+    bool adjustStock(istream & args, ostream & out, string & error);
+
+    Session(const Session &);
+    Session & operator=(const Session &);
+
+public:
+    Session();
+    ~Session();
+
+    bool execute(const string & aLine, string & aReply);
+    bool isLoggedIn() const { return _currentUser != NULL; }
+    ulonglong commandCount() const { return _commands; }
+};
+
+#endif /* __SESSION_H__ */
@@ -0,0 +1,407 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#include "SharedCache.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <cstring>
+#include <cerrno>
+#include <sched.h>
+
+#define SHARED_CACHE_MAGIC  "ECSC"
+
+/** Columns of a cached record, as returned by "SELECT * FROM products" */
+static const char *sharedCacheColumns[] = {
+    "pid", "cid", "name", "descr", "price", "availability", "deleted",
+    "version", "change_seq"
+};
+
+/**
+   @brief Default constructor
+
+   No segment is mapped until attach() is called.
+ */
+SharedCache::SharedCache()
+{
+    LOG_CTOR();
+    _header = NULL;
+    _slots = NULL;
+    _size = 0;
+    _hits = _misses = 0;
+}
+
+/**
+   @brief Default destructor
+
+   The segment is unmapped, not removed: other processes keep using it.
+ */
+SharedCache::~SharedCache()
+{
+    LOG_DTOR();
+    detach();
+}
+
+/**
+   @brief Map the segment, creating it if this is the first process
+
+   The creator sizes and initializes the segment; the others wait for
+   it to be ready and check that the layout is the one they expect.
+
+   @param[in]    aName       Name of the segment, such as "/ec++"
+   @param[in]    aCapacity   Number of slots, if the segment is created
+   @return    True if the segment is mapped
+ */
+bool SharedCache::attach(const string & aName, size_t aCapacity)
+{
+    detach();
+
+    bool creator = true;
+    int fd = shm_open(aName.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        creator = false;
+        fd = shm_open(aName.c_str(), O_RDWR, 0600);
+    }
+    if (fd < 0) {
+        cerr << "unable to open shared cache " << aName << " ("
+             << strerror(errno) << ")\n";
+        return false;
+    }
+
+    size_t size = sizeof(Header) + aCapacity * sizeof(Slot);
+    struct stat st;
+
+    if (creator) {
+        // new pages are zero filled: all slots are empty
+        if (ftruncate(fd, size) != 0) {
+            ::close(fd);
+            shm_unlink(aName.c_str());
+            return false;
+        }
+    } else {
+        // wait for the creator to size the segment
+        for (int i = 0; i < SHARED_CACHE_SPINS; i++) {
+            if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(Header))
+                break;
+            usleep(1000);
+        }
+        size = st.st_size;
+    }
+
+    void *base = MAP_FAILED;
+    if (size >= sizeof(Header))
+        base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (base == MAP_FAILED)
+        return false;
+
+    Header *h = (Header *) base;
+    if (creator) {
+        memcpy(h->magic, SHARED_CACHE_MAGIC, sizeof(h->magic));
+        h->format = SHARED_CACHE_FORMAT;
+        h->capacity = aCapacity;
+        h->slotSize = sizeof(Slot);
+        __sync_synchronize();
+        h->ready = 1;
+    } else {
+        for (int i = 0; i < SHARED_CACHE_SPINS && !h->ready; i++)
+            usleep(1000);
+        __sync_synchronize();
+
+        if (!h->ready || memcmp(h->magic, SHARED_CACHE_MAGIC, 4) ||
+            h->format != SHARED_CACHE_FORMAT ||
+            h->slotSize != sizeof(Slot) ||
+            sizeof(Header) + h->capacity * sizeof(Slot) > size) {
+            LOG(1, "Shared cache %s has an unknown layout\n", aName.c_str());
+            munmap(base, size);
+            return false;
+        }
+    }
+
+    _header = h;
+    _slots = (Slot *) ((char *) base + sizeof(Header));
+    _size = size;
+    _name = aName;
+
+    LOG(2, "Shared cache %s %s: %u slots\n", aName.c_str(),
+        creator ? "created" : "attached", _header->capacity);
+
+    return true;
+}
+
+/**
+   @brief Unmap the segment
+ */
+void SharedCache::detach()
+{
+    if (_header)
+        munmap((void *) _header, _size);
+
+    _header = NULL;
+    _slots = NULL;
+    _size = 0;
+    _name.clear();
+}
+
+/**
+   @brief Check if a segment is mapped
+ */
+bool SharedCache::isAttached() const
+{
+    return (_header != NULL);
+}
+
+/**
+   @brief Remove a segment from the system
+
+   Processes still attached keep their mapping; the next attach()
+   creates a new, empty, segment.
+
+   @param[in]    aName   Name of the segment
+   @return    True if successful
+ */
+bool SharedCache::remove(const string & aName)
+{
+    return (shm_unlink(aName.c_str()) == 0);
+}
+
+/**
+   @brief Look for the slot of a product
+
+   @param[in]    aPid    The product ID
+   @param[in]    doClaim If true, an empty slot is claimed for aPid
+   @return    The slot, NULL if not found (or if the table is full)
+ */
+SharedCache::Slot *SharedCache::find(int aPid, bool doClaim) const
+{
+    uint32_t capacity = _header->capacity;
+    uint32_t i = ((uint32_t) aPid * 2654435761U) % capacity;
+
+    for (uint32_t n = 0; n < capacity; n++, i = (i + 1) % capacity) {
+        Slot *s = &_slots[i];
+        int32_t pid = s->pid;
+
+        if (pid == aPid)
+            return s;
+        if (pid != 0)
+            continue;
+        if (!doClaim)
+            return NULL;
+
+        // another process can claim the same slot: retry if it did
+        pid = __sync_val_compare_and_swap(&(s->pid), 0, aPid);
+        if (pid == 0 || pid == aPid)
+            return s;
+    }
+
+    return NULL;
+}
+
+/**
+   @brief Acquire a slot for writing (make its sequence odd)
+
+   @param[in]    aSlot   The slot
+   @return    False if the slot stayed busy (e.g. its writer died)
+ */
+bool SharedCache::lockSlot(Slot *aSlot) const
+{
+    for (int i = 0; i < SHARED_CACHE_SPINS; i++) {
+        uint32_t seq = aSlot->seq;
+
+        if (!(seq & 1) &&
+            __sync_bool_compare_and_swap(&(aSlot->seq), seq, seq + 1))
+            return true;
+        sched_yield();
+    }
+
+    return false;
+}
+
+/**
+   @brief Publish a slot (make its sequence even again)
+
+   @param[in]    aSlot   The slot
+   @param[in]    aSeq    The odd sequence set by lockSlot()
+ */
+void SharedCache::unlockSlot(Slot *aSlot, uint32_t aSeq) const
+{
+    __sync_synchronize();
+    aSlot->seq = aSeq + 1;
+}
+
+/**
+   @brief Copy a text value into a fixed-width field
+
+   @return    False if the value doesn't fit
+ */
+static bool copyField(char *aDest, size_t aSize, const Field & aField)
+{
+    if (aField.length() >= aSize)
+        return false;
+
+    memcpy(aDest, aField.c_str(), aField.length() + 1);
+
+    return true;
+}
+
+/**
+   @brief Fetch a product
+
+   @param[in]    aPid       The product ID
+   @param[out]   aRow       The record, as fetched from table "products"
+   @param[out]   aTicket    On a miss, the ticket to pass to put()
+   @return    True if the product was found
+ */
+bool SharedCache::lookup(int aPid, Record & aRow, uint32_t *aTicket)
+{
+    // initialized once, even if several threads get here together
+    static ColumnNames names(new vector<string>(sharedCacheColumns,
+                                                sharedCacheColumns + 9));
+
+    // never written: a slot claimed meanwhile won't match
+    if (aTicket)
+        *aTicket = 0;
+    if (!_header)
+        return false;
+
+    Slot *s = find(aPid, false);
+    if (!s) {
+        __sync_fetch_and_add(&_misses, 1);
+        return false;
+    }
+
+    for (int i = 0; i < SHARED_CACHE_SPINS; i++) {
+        uint32_t seq = s->seq;
+        if (aTicket)
+            *aTicket = seq;
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        __sync_synchronize();
+
+        Slot copy;
+        memcpy(&copy, (const void *) s, sizeof(Slot));
+
+        __sync_synchronize();
+        if (s->seq != seq)
+            continue;
+
+        if (!copy.valid)
+            break;
+
+        // the copy is consistent: terminators are in place
+        Record row(names);
+        stringstream pid;
+        pid << aPid;
+        row.append(Field(pid.str()));
+        row.append(Field(copy.cid));
+        row.append(Field(copy.name));
+        row.append(copy.hasDescr ? Field(copy.descr) : Field());
+        row.append(Field(copy.price));
+        row.append(Field(copy.availability));
+        row.append(Field(copy.deleted));
+        row.append(Field(copy.version));
+        row.append(Field(copy.changeSeq));
+        aRow = row;
+
+        __sync_fetch_and_add(&_hits, 1);
+        return true;
+    }
+
+    __sync_fetch_and_add(&_misses, 1);
+    return false;
+}
+
+/**
+   @brief Store a product fetched from the database
+
+   The slot is written only if nobody changed it since the lookup
+   which gave aTicket, so that a record read before a write can't
+   replace the invalidation made after it. Values too long for their
+   slot are not cached.
+
+   @param[in]    aRow       A record of table "products"
+   @param[in]    aTicket    Ticket returned by the lookup miss which
+                            preceded the read of aRow
+   @return    True if the product was cached
+ */
+bool SharedCache::put(const Record & aRow, uint32_t aTicket)
+{
+    if (!_header || (aTicket & 1))
+        return false;
+
+    int pid = aRow["pid"];
+    Slot *s = find(pid, true);
+    if (!s || !__sync_bool_compare_and_swap(&(s->seq), aTicket, aTicket + 1))
+        return false;
+
+    uint32_t seq = aTicket + 1;
+    const Field & descr = aRow["descr"];
+    bool fits = copyField(s->cid, sizeof(s->cid), aRow["cid"]) &&
+                copyField(s->name, sizeof(s->name), aRow["name"]) &&
+                copyField(s->descr, sizeof(s->descr), descr) &&
+                copyField(s->price, sizeof(s->price), aRow["price"]) &&
+                copyField(s->availability, sizeof(s->availability),
+                          aRow["availability"]) &&
+                copyField(s->deleted, sizeof(s->deleted), aRow["deleted"]) &&
+                copyField(s->version, sizeof(s->version), aRow["version"]) &&
+                copyField(s->changeSeq, sizeof(s->changeSeq),
+                          aRow["change_seq"]);
+    s->hasDescr = !descr.isNull();
+    s->valid = fits;
+    unlockSlot(s, seq);
+
+    return fits;
+}
+
+/**
+   @brief Drop a product, after its write has been committed
+
+   The slot is claimed even if the product isn't cached, so that the
+   tickets of pending lookups don't match anymore.
+
+   @param[in]    aPid    The product ID
+ */
+void SharedCache::invalidate(int aPid)
+{
+    Slot *s = _header ? find(aPid, true) : NULL;
+    if (!s)
+        return;
+
+    // a busy slot is being rewritten anyway: mark it again when free
+    if (lockSlot(s)) {
+        uint32_t seq = s->seq;
+        s->valid = 0;
+        unlockSlot(s, seq);
+    }
+}
+
+/**
+   @brief Returns the number of lookups served by the segment
+ */
+ulonglong SharedCache::hits() const
+{
+    return _hits;
+}
+
+/**
+   @brief Returns the number of lookups not served by the segment
+ */
+ulonglong SharedCache::misses() const
+{
+    return _misses;
+}
+
+ostream& operator<<(ostream& aStream, SharedCache& c) {
+    if (!c.isAttached())
+        return aStream << "Shared cache: not attached\n";
+
+    return aStream << "Shared cache: " << c._name << ", "
+                   << c._header->capacity << " slots, " << c.hits()
+                   << " hits, " << c.misses() << " misses\n";
+}
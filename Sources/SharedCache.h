@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#ifndef __SHAREDCACHE_H__
+#define __SHAREDCACHE_H__
+
+#include <stdint.h>
+#include "common.h"
+#include "Storage.h"
+
+using namespace std;
+
+/** Default number of products the segment can hold */
+#define SHARED_CACHE_CAPACITY   4096
+/** Version of the segment layout: bump it whenever a slot changes */
+#define SHARED_CACHE_FORMAT     2
+/** Attempts made before a busy slot is reported as a miss */
+#define SHARED_CACHE_SPINS      1000
+
+/**
+   @brief Product cache shared by all the ec++ processes of a host
+
+   Records of table "products" are kept in a POSIX shared memory
+   segment, mapped by every process attached to the same name: a
+   product fetched by one session is found by all the others without
+   asking the database again, and it's stored once per host instead
+   of once per process.
+
+   The segment is an open addressing hash table keyed by pid, with a
+   fixed number of fixed-width slots. A slot is claimed with an atomic
+   compare-and-swap on its key and is never released (invalidated
+   slots just become empty), so probe chains stay valid without locks.
+
+   Each slot is protected by a sequence counter (seqlock): a writer
+   makes it odd while it changes the slot and even again when done; a
+   reader copies the slot and retries if the counter was odd or moved
+   in the meanwhile. Readers never block writers nor each other.
+
+   A product must be invalidated after its write is committed. A miss
+   returns the sequence of the slot as a ticket, to be passed to put()
+   with the record then read from the database: if the product was
+   invalidated in the meanwhile, the record may predate the write and
+   put() refuses it.
+
+   Segments are not tied to a database: use a different name for each
+   database served on the host.
+
+   @see Product::productByID(), ProductProxy
+ */
+class SharedCache : public Singleton<SharedCache>
+{
+private:
+    /** First bytes of the segment */
+    struct Header {
+        char magic[4];
+        uint32_t format;
+        uint32_t capacity;
+        uint32_t slotSize;
+        volatile uint32_t ready;
+    };
+
+    /** A cached product, values are kept as text */
+    struct Slot {
+        volatile uint32_t seq;
+        volatile int32_t pid;
+        uint8_t valid;
+        uint8_t hasDescr;
+        char cid[12];
+        char price[24];
+        char availability[12];
+        char deleted[4];
+        char version[12];
+        char changeSeq[24];
+        char name[64];
+        char descr[256];
+    };
+
+    Header *_header;
+    Slot *_slots;
+    size_t _size;
+    string _name;
+    volatile ulonglong _hits;
+    volatile ulonglong _misses;
+
+    Slot *find(int aPid, bool doClaim) const;
+    bool lockSlot(Slot *aSlot) const;
+    void unlockSlot(Slot *aSlot, uint32_t aSeq) const;
+
+protected:
+    friend class Singleton<SharedCache>;
+    SharedCache();
+    virtual ~SharedCache();
+
+public:
+    bool attach(const string & aName,
+                size_t aCapacity = SHARED_CACHE_CAPACITY);
+    void detach();
+    bool isAttached() const;
+    static bool remove(const string & aName);
+
+    bool lookup(int aPid, Record & aRow, uint32_t *aTicket = NULL);
+    bool put(const Record & aRow, uint32_t aTicket);
+    void invalidate(int aPid);
+
+    ulonglong hits() const;
+    ulonglong misses() const;
+
+    friend ostream& operator<<(ostream &, SharedCache &);
+};
+
+#endif /* __SHAREDCACHE_H__ */
@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#ifndef __SMALLVECTOR_H__
+#define __SMALLVECTOR_H__
+
+#include <cstddef>
+#include <new>
+
+/**
+   @brief A vector keeping its first N elements inside the object
+
+   Up to N elements are stored in a buffer embedded in the vector
+   itself: no memory is allocated until the N+1th element is added,
+   then elements move to the heap as in std::vector. It suits lists
+   which are short most of the time, such as the observers of an
+   object.
+
+   Only the subset of std::vector used by the application is
+   provided; iterators are plain pointers, invalidated by any insert
+   or erase.
+ */
+template <class T, size_t N>
+class SmallVector
+{
+public:
+    typedef T value_type;
+    typedef T *iterator;
+    typedef const T *const_iterator;
+    typedef size_t size_type;
+
+private:
+    /** Embedded storage, aligned for any type */
+    union {
+        char _buffer[N * sizeof(T)];
+        long double _alignDouble;
+        void *_alignPointer;
+    };
+    T *_data;
+    size_t _size;
+    size_t _capacity;
+
+    T *inlineData() { return reinterpret_cast<T *>(_buffer); }
+
+    /** Move the elements to a heap block of (at least) aCapacity */
+    void grow(size_t aCapacity) {
+        if (aCapacity <= _capacity)
+            return;
+        if (aCapacity < 2 * _capacity)
+            aCapacity = 2 * _capacity;
+
+        T *data = static_cast<T *>(::operator new(aCapacity * sizeof(T)));
+        for (size_t i = 0; i < _size; i++) {
+            new (data + i) T(_data[i]);
+            _data[i].~T();
+        }
+        if (_data != inlineData())
+            ::operator delete(_data);
+
+        _data = data;
+        _capacity = aCapacity;
+    }
+
+protected:
+    /**
+       Returns the raw storage of a new last element, to be built in
+       place; the size grows by calling constructedBack() once built.
+     */
+    void *allocateBack() {
+        if (_size == _capacity)
+            grow(_size + 1);
+        return _data + _size;
+    }
+    void constructedBack() { _size++; }
+
+public:
+    SmallVector() : _data(inlineData()), _size(0), _capacity(N) {}
+
+    SmallVector(const SmallVector & aVector) :
+        _data(inlineData()), _size(0), _capacity(N) {
+        reserve(aVector._size);
+        for (size_t i = 0; i < aVector._size; i++)
+            push_back(aVector._data[i]);
+    }
+
+    ~SmallVector() {
+        clear();
+        if (_data != inlineData())
+            ::operator delete(_data);
+    }
+
+    SmallVector & operator=(const SmallVector & aVector) {
+        if (this != &aVector) {
+            clear();
+            reserve(aVector._size);
+            for (size_t i = 0; i < aVector._size; i++)
+                push_back(aVector._data[i]);
+        }
+        return *this;
+    }
+
+    size_t size() const { return _size; }
+    size_t capacity() const { return _capacity; }
+    bool empty() const { return _size == 0; }
+    /** True if elements are still in the embedded buffer */
+    bool isInline() const { return _data == (const T *) _buffer; }
+
+    iterator begin() { return _data; }
+    iterator end() { return _data + _size; }
+    const_iterator begin() const { return _data; }
+    const_iterator end() const { return _data + _size; }
+
+    T & operator[](size_t anIndex) { return _data[anIndex]; }
+    const T & operator[](size_t anIndex) const { return _data[anIndex]; }
+    T & front() { return _data[0]; }
+    T & back() { return _data[_size - 1]; }
+    const T & front() const { return _data[0]; }
+    const T & back() const { return _data[_size - 1]; }
+
+    void reserve(size_t aCapacity) { grow(aCapacity); }
+
+    void push_back(const T & aValue) {
+        if (_size == _capacity) {
+            // aValue could be one of our elements
+            T copy(aValue);
+            grow(_size + 1);
+            new (_data + _size) T(copy);
+        } else
+            new (_data + _size) T(aValue);
+        _size++;
+    }
+
+    void pop_back() {
+        _data[--_size].~T();
+    }
+
+    iterator insert(iterator aPosition, const T & aValue) {
+        size_t index = aPosition - _data;
+        T copy(aValue);
+
+        push_back(copy);
+        for (size_t i = _size - 1; i > index; i--)
+            _data[i] = _data[i - 1];
+        _data[index] = copy;
+
+        return _data + index;
+    }
+
+    iterator erase(iterator aPosition) {
+        for (iterator it = aPosition; it + 1 != end(); it++)
+            *it = *(it + 1);
+        pop_back();
+
+        return aPosition;
+    }
+
+    void clear() {
+        while (_size)
+            pop_back();
+    }
+
+    /**
+       Exchange the content of two vectors: heap blocks change owner,
+       elements still in an embedded buffer are copied.
+     */
+    void swap(SmallVector & aVector) {
+        if (isInline() && aVector.isInline()) {
+            SmallVector tmp(aVector);
+            aVector = *this;
+            *this = tmp;
+            return;
+        }
+
+        if (!isInline() && !aVector.isInline()) {
+            T *block = _data;
+            size_t size = _size, capacity = _capacity;
+
+            _data = aVector._data;
+            _size = aVector._size;
+            _capacity = aVector._capacity;
+            aVector._data = block;
+            aVector._size = size;
+            aVector._capacity = capacity;
+            return;
+        }
+
+        // the embedded elements move to the buffer of the heap owner
+        SmallVector & h = isInline() ? aVector : *this;
+        SmallVector & s = isInline() ? *this : aVector;
+        T *block = h._data;
+        size_t size = h._size, capacity = h._capacity;
+
+        h._data = h.inlineData();
+        h._capacity = N;
+        for (h._size = 0; h._size < s._size; h._size++) {
+            new (h._data + h._size) T(s._data[h._size]);
+            s._data[h._size].~T();
+        }
+        s._data = block;
+        s._size = size;
+        s._capacity = capacity;
+    }
+};
+
+#endif /* __SMALLVECTOR_H__ */
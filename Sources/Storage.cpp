@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#include "Storage.h"
+#include <sstream>
+
+/** Returned when a column doesn't exist */
+static const Field nullField;
+
+ostream& operator<<(ostream& aStream, const Field& f) {
+    return aStream << f.str();
+}
+
+/**
+   @brief Returns a value by position
+
+   @param[in]    anIndex Position of the column
+   @return    The value, NULL if out of range
+ */
+const Field & Record::operator[](int anIndex) const
+{
+    if (anIndex < 0 || (size_t) anIndex >= _fields.size())
+        return nullField;
+
+    return _fields[anIndex];
+}
+
+/**
+   @brief Returns a value by column name
+
+   @param[in]    aName   Name of the column
+   @return    The value, NULL if the column doesn't exist
+ */
+const Field & Record::operator[](const char *aName) const
+{
+    if (_names)
+        for (size_t i = 0; i < _names->size() && i < _fields.size(); i++)
+            if ((*_names)[i] == aName)
+                return _fields[i];
+
+    LOG(1, "Unknown column '%s'\n", aName);
+
+    return nullField;
+}
+
+/**
+   @brief Returns a value by column name
+
+   @param[in]    aName   Name of the column
+   @return    The value, NULL if the column doesn't exist
+ */
+const Field & Record::operator[](const string & aName) const
+{
+    return (*this)[aName.c_str()];
+}
+
+/**
+   @brief Append an empty record, sharing the columns of the set
+
+   @return    The new record
+ */
+Record & ResultSet::addRecord()
+{
+    push_back(Record(_names));
+
+    return back();
+}
+
+/**
+   @brief Returns the name of a column
+
+   @param[in]    anIndex Position of the column
+   @return    The column name
+ */
+const string & ResultSet::fieldName(size_t anIndex) const
+{
+    return _names->at(anIndex);
+}
+
+/**
+   @brief Returns the length of the longest value of a column (or of
+          the column name, if longer)
+
+   @param[in]    anIndex Position of the column
+   @return    The length, in characters
+ */
+size_t ResultSet::maxLength(size_t anIndex) const
+{
+    size_t len = fieldName(anIndex).size();
+
+    for (const_iterator it = begin(); it != end(); it++)
+        len = max(len, (*it)[int(anIndex)].length());
+
+    return len;
+}
+
+/**
+   @brief Append a parameter
+
+   @param[in]    aValue  The value
+ */
+SqlParams & SqlParams::operator<<(const string & aValue)
+{
+    push_back(aValue);
+
+    return *this;
+}
@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#ifndef __STORAGE_H__
+#define __STORAGE_H__
+
+#include <string>
+#include <sstream>
+#include <cstdlib>
+#include <tr1/memory>
+#include "common.h"
+
+using namespace std;
+
+typedef unsigned long long ulonglong;
+
+/** Column names shared by all the records of a result set */
+typedef tr1::shared_ptr< vector<string> > ColumnNames;
+
+/**
+   @brief A value fetched from the database
+
+   Values are kept as text, whatever the backend: conversion operators
+   let the client read them as strings or integers.
+ */
+class Field
+{
+private:
+    string _value;
+    bool _null;
+
+public:
+    Field() : _null(true) {}
+    Field(const string & aValue, bool isNull = false) :
+        _value(aValue), _null(isNull) {}
+
+    bool isNull() const { return _null; }
+    const string & str() const { return _value; }
+    const char *c_str() const { return _value.c_str(); }
+    size_t length() const { return _value.length(); }
+
+    operator string() const { return _value; }
+    operator int() const { return atoi(_value.c_str()); }
+};
+
+ostream& operator<<(ostream &, const Field &);
+
+/**
+   @brief A row of a result set
+
+   Values can be accessed by position or by column name.
+ */
+class Record
+{
+private:
+    ColumnNames _names;
+    vector<Field> _fields;
+
+public:
+    Record() {}
+    Record(const ColumnNames & names) : _names(names) {}
+
+    const Field & operator[](int anIndex) const;
+    const Field & operator[](const char *aName) const;
+    const Field & operator[](const string & aName) const;
+
+    void append(const Field & aField) { _fields.push_back(aField); }
+    size_t size() const { return _fields.size(); }
+    bool empty() const { return _fields.empty(); }
+};
+
+/**
+   @brief The records returned by a statement
+ */
+class ResultSet : public vector<Record>
+{
+private:
+    ColumnNames _names;
+
+public:
+    ResultSet() : _names(new vector<string>) {}
+
+    void addColumn(const string & aName) { _names->push_back(aName); }
+    Record & addRecord();
+
+    size_t numRows() const { return size(); }
+    size_t numFields() const { return _names->size(); }
+    const string & fieldName(size_t anIndex) const;
+    size_t maxLength(size_t anIndex) const;
+};
+
+/** All the result sets returned by a single statement */
+typedef vector<ResultSet> ResultSets;
+
+/**
+   @brief Values of the placeholders of a statement
+
+   Statements refer to parameters with %N (inserted as they are) or
+   %Nq (quoted and escaped by the backend), as mysql++ templates do.
+
+   @see Database::format()
+ */
+class SqlParams : public vector<string>
+{
+public:
+    SqlParams & operator<<(const string & aValue);
+
+    /** Append a numeric parameter */
+    template <class T> SqlParams & operator<<(const T & aValue)
+    {
+        stringstream value;
+
+        value << aValue;
+        push_back(value.str());
+
+        return *this;
+    }
+};
+
+/**
+   @brief Interface of a storage backend
+
+   A backend executes SQL statements on behalf of Database; the entity
+   layer never talks to a backend directly. Each instance is a single
+   connection and must be used by one thread at a time: call clone()
+   to get a connection for another thread.
+
+   Stored procedures are called with "CALL name(args)": backends that
+   don't support them must emulate the ones defined by the dump.
+
+   @see MySQLBackend, SQLiteBackend
+ */
+class StorageBackend
+{
+public:
+    virtual ~StorageBackend() {}
+
+    /** Short name of the backend, for diagnostics */
+    virtual const char *name() const = 0;
+    virtual bool connect() = 0;
+    virtual void disconnect() = 0;
+    virtual bool isConnected() = 0;
+    /** A new, not yet connected, instance with the same settings */
+    virtual StorageBackend *clone() = 0;
+
+    /** Run a statement returning one or more result sets */
+    virtual bool query(const string & aSql, ResultSets & res) = 0;
+    /** Run a statement returning no records */
+    virtual bool execute(const string & aSql, ulonglong *rows = NULL,
+                         ulonglong *insertID = NULL) = 0;
+    /** Returns a string literal holding aValue */
+    virtual string quote(const string & aValue) = 0;
+
+    virtual bool begin() = 0;
+    virtual bool commit() = 0;
+    virtual bool rollback() = 0;
+
+    /** Message of the last error */
+    virtual string error() = 0;
+
+    /** A value which changes whenever tables or columns change, an
+        empty string if the backend can't tell */
+    virtual string schemaVersion() { return ""; }
+
+    /** Must be called by threads other than the main one */
+    virtual void threadStart() {}
+    virtual void threadEnd() {}
+};
+
+#endif /* __STORAGE_H__ */
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#ifndef __STRINGREF_H__
+#define __STRINGREF_H__
+
+#include <cstring>
+#include <string>
+#include <ostream>
+
+/**
+   @brief A reference to characters owned by someone else
+
+   A StringRef is a pointer and a length: building one from a literal
+   or from a string copies nothing, so functions taking a StringRef
+   accept both without creating a temporary string. The characters
+   must outlive the reference, and aren't necessarily followed by a
+   null character.
+
+   StringRefs compare with each other and with strings, so that a
+   sorted sequence of strings can be searched by a StringRef.
+ */
+class StringRef
+{
+private:
+    const char *_data;
+    size_t _size;
+
+public:
+    StringRef() : _data(""), _size(0) {}
+    StringRef(const char *aString) :
+        _data(aString), _size(strlen(aString)) {}
+    StringRef(const char *aData, size_t aSize) :
+        _data(aData), _size(aSize) {}
+    StringRef(const std::string & aString) :
+        _data(aString.data()), _size(aString.size()) {}
+
+    const char *data() const { return _data; }
+    size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+
+    /** A copy of the characters */
+    std::string str() const { return std::string(_data, _size); }
+
+    /** Negative, zero or positive, as strcmp() */
+    int compare(const StringRef & aString) const {
+        size_t n = (_size < aString._size) ? _size : aString._size;
+        int result = memcmp(_data, aString._data, n);
+        if (result)
+            return result;
+
+        return (_size < aString._size) ? -1 : (_size > aString._size);
+    }
+
+    bool operator==(const StringRef & aString) const {
+        return _size == aString._size &&
+               memcmp(_data, aString._data, _size) == 0;
+    }
+    bool operator!=(const StringRef & aString) const {
+        return !(*this == aString);
+    }
+    bool operator<(const StringRef & aString) const {
+        return compare(aString) < 0;
+    }
+};
+
+/**
+   @brief Compares the key of a pair with a StringRef
+
+   Searches with lower_bound() a sequence of pairs sorted by a string
+   key, such as a map copied to a vector, without building a string.
+ */
+struct PairKeyLess
+{
+    template <class P>
+    bool operator()(const P & aPair, const StringRef & aKey) const {
+        return StringRef(aPair.first) < aKey;
+    }
+};
+
+inline std::ostream & operator<<(std::ostream & aStream,
+                                 const StringRef & aString)
+{
+    return aStream.write(aString.data(), aString.size());
+}
+
+#endif /* __STRINGREF_H__ */
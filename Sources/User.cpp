@@ -7,6 +7,11 @@
 
 #include "User.h"
 #include "Basket.h"
+#include "Category.h"
+#include "Inventory.h"
+#include "CatalogSnapshot.h"
+#include "SharedCache.h"
+#include "CatalogView.h"
 
 #define KEY_USR_UID         "uid"
 #define KEY_USR_NAME        "name"
@@ -18,7 +23,7 @@
 #define KEY_USR_ADMIN       "admin"
 #define QUERY_LOGIN         "SELECT * FROM users WHERE login = %0q AND " \
                             "password = %1q"
-#define QUERY_FETCH         "SELECT * FROM users WHERE uid = "
+#define QUERY_FETCH         "SELECT * FROM users WHERE uid = %0"
 #define QUERY_ADMIN_USERLST "SELECT * FROM users WHERE admin=0 "\
                             "ORDER BY surname, name"
 #define QUERY_ADMIN_TREND   "SELECT DATE_FORMAT(date, '%Y') AS year, " \
@@ -43,12 +48,12 @@ User::User() : ManagedObject("users")
    @brief Class constructor
  
    Constructs an instance of User and fill it with data taken from 
-   mysqlpp::Row
+   a Record
  
    @param    aRow Record fetched from the database
-   @see ManagedObject, mysqlpp::Row
+   @see ManagedObject, Record
  */
-User::User(Row &aRow) : ManagedObject("users", aRow)
+User::User(const Record &aRow): ManagedObject("users", aRow)
 {
     LOG_CTOR()    
 }
@@ -83,6 +88,8 @@ string User::primaryKey()
    @param[in]    aPasswd The password of the user
    @param[in]    anAddress The address of the user
    @param[in]    aCity The city of the user
+   @return    The new user, NULL if the login is already taken or an 
+              error occurred
  */
 User * User::factory(string aName, string aSurname, string aLogin, 
                      string aPasswd, string anAddress, string aCity)
@@ -96,7 +103,9 @@ User * User::factory(string aName, string aSurname, string aLogin,
     nu->setValueForKey(KEY_USR_CITY, aCity);
     nu->setValueForKey(KEY_USR_LOGIN, aLogin);
     nu->setValueForKey(KEY_USR_PASSWD, aPasswd);
-    if (!nu->store()) {
+    
+    // an existing login, even an administrator's, is never replaced
+    if (!nu->insert()) {
         delete nu;
         
         return NULL;
@@ -121,21 +130,14 @@ User * User::login(string username, string passwd)
     // get an instance of the database
     Database &db = Database::instance();
     
-    // ask Database for a valid connection to mySQL
-    Connection *conn = db.getConnection();
-    
-    // obtain an instance of mysqlpp::Query and init it
-    Query q = conn->query(QUERY_LOGIN);
-    q.parse();
-    
-    StoreQueryResult res = q.store(username, passwd);
+    ResultSet res;
+    db.select(QUERY_LOGIN, res, SqlParams() << username << passwd);
     if (!res.empty()) {
-        StoreQueryResult::const_iterator it = res.begin();
-        Row row = *it;
+        const Record & row = res.front();
         
         User *newUser = NULL;
         
-        if (row[KEY_USR_ADMIN] == "1")
+        if (row[KEY_USR_ADMIN].str() == "1")
             newUser = new AdminUser(row);
         else
             newUser = new NormalUser(row);
@@ -161,18 +163,12 @@ User * User::userByID(int anUid)
     // get an instance of the database
     Database &db = Database::instance();
     
-    // ask Database for a valid connection to mySQL
-    Connection *conn = db.getConnection();
-    
-    // obtain an instance of mysqlpp::Query and init it
-    Query q = conn->query();
-    q << QUERY_FETCH << anUid;    
-    StoreQueryResult res = q.store();
+    ResultSet res;
+    db.select(QUERY_FETCH, res, SqlParams() << anUid);
     if (!res.empty()) {
-        StoreQueryResult::const_iterator it = res.begin();
-        Row row = *it;
+        const Record & row = res.front();
         
-        if (row[KEY_USR_ADMIN] == "1")
+        if (row[KEY_USR_ADMIN].str() == "1")
             return new AdminUser(row);
         else
             return new NormalUser(row);
@@ -206,7 +202,7 @@ string User::fullName()
  
    @return    The login name
  */
-string User::loginName()
+const string & User::loginName() const
 {
     return valueForKey(KEY_USR_LOGIN);
 }
@@ -240,12 +236,12 @@ ostream& operator<<(ostream& aStream, User & u) {
    @brief Class constructor by fetched record
  
    Constructs an instance of AdminUser and fill it with data taken from 
-   mysqlpp::Row
+   a Record
  
    @param    aRow Record fetched from the database
    @see ManagedObject, User::User
  */
-AdminUser::AdminUser(Row &aRow) : User(aRow)
+AdminUser::AdminUser(const Record &aRow): User(aRow)
 {
     LOG_CTOR()
 }
@@ -255,34 +251,30 @@ AdminUser::AdminUser(Row &aRow) : User(aRow)
  
    Returns the list of currently registered users, even if locked.
  
+   @param[in]    anArena The arena owning the vector and the users
    @return    Vector of pointer to class User
    @see AdminUser, NormalUser, std::vector
  */
-vector<User *> & AdminUser::userList()
+vector<User *> & AdminUser::userList(Arena & anArena)
 {
     // get an instance of the database
     Database &db = Database::instance();
-    vector<User *> *users = NULL;
-    
-    // ask Database for a valid connection to mySQL
-    Connection *conn = db.getConnection();
+    vector<User *> *users = anArena.create< vector<User *> >();
     
-    // obtain an instance of mysqlpp::Query and init it
-    Query q = conn->query(QUERY_ADMIN_USERLST);
-    StoreQueryResult res = q.store();
+    ResultSet res;
+    db.select(QUERY_ADMIN_USERLST, res);
     if (!res.empty()) {
-        users = new vector<User *>;
-        users->reserve(res.num_rows());
+        users->reserve(res.numRows());
 
-        StoreQueryResult::const_iterator it;
+        ResultSet::const_iterator it;
         for (it=res.begin(); it != res.end(); it++) {
             User *anUser;
-            Row row = *it;
+            const Record & row = *it;
             
-            if (row[KEY_USR_ADMIN] == "1")
-                anUser = new AdminUser(row);
+            if (row[KEY_USR_ADMIN].str() == "1")
+                anUser = anArena.create<AdminUser>(row);
             else
-                anUser = new NormalUser(row);
+                anUser = anArena.create<NormalUser>(row);
             assert(anUser);
             users->push_back(anUser);
         }
@@ -308,24 +300,35 @@ bool AdminUser::deleteProduct(int aPid)
     // get an instance of the database
     Database& db = Database::instance();
     
-    // ask Database for a valid connection to mySQL
-    Connection *conn = db.getConnection();
-    
-    // obtain an instance of mysqlpp::Query and init it
-    Query q = conn->query();
-    q << "CALL product_delete(" << aPid << ")";
-    
-    SimpleResult r = q.execute();
-    if (r == false) {
-        LOG(2, "An error occurred during mysqlpp:query::execute\n"
-            "ERR: %s\nQuery was: %s\n", q.error(), q.str().c_str());
-        
+    if (!db.execute("CALL product_delete(%0)", SqlParams() << aPid))
         return false;
-    }
+    db.tableDidChange("products");
+    CategoryTable::instance().productRemoved(aPid);
+    CatalogSnapshot::instance().productDidChange(aPid);
+    SharedCache::instance().invalidate(aPid);
+    CatalogView::instance().productRemoved(aPid);
     
     return true;
 }
 
+/**
+   @brief Change the availability of a product
+ 
+   The new stock can be sold at once; the database is updated in 
+   background, since nobody is waiting for it.
+ 
+   @param[in]    aPid    The product ID
+   @param[in]    aDelta  Units received (or removed, if negative)
+   @return    True if operation was successful
+   @see Inventory::restock()
+ */
+bool AdminUser::adjustStock(int aPid, int aDelta)
+{
+    assert(aPid >= 0);
+    
+    return Inventory::instance().restock(aPid, aDelta);
+}
+
 /**
    @brief Change user password
    Let an administrator to change a user password: this method could 
@@ -334,8 +337,10 @@ bool AdminUser::deleteProduct(int aPid)
  
    @param[in]    anUser Instance of user to alter
    @param[in]    aPasswd New password to assign
-   @return    True if change was successful
-   @see ManagedObject::store()
+   @return    True if change was successful; if the user was changed 
+              by someone else since it was read, false is returned and 
+              anUser.hasConflict() is true
+   @see ManagedObject::update(), ManagedObject::hasConflict()
  */
 bool AdminUser::changeUserPassword(User & anUser, string aPasswd)
 {
@@ -353,12 +358,8 @@ void AdminUser::showMonthlyTrend()
     // get an instance of the database
     Database &db = Database::instance();
     
-    // ask Database for a valid connection to mySQL
-    Connection *conn = db.getConnection();
-    
-    // obtain an instance of mysqlpp::Query and init it
-    Query q = conn->query(QUERY_ADMIN_TREND);
-    StoreQueryResult res = q.store();
+    // aggregation is served by the query cache until a new order is placed
+    ResultSet res = db.cachedStore(QUERY_ADMIN_TREND, "orders");
     db.printResult(res);
 }
 
@@ -378,12 +379,12 @@ NormalUser::NormalUser() : User()
    @brief Class constructor by fetched record
  
    Constructs an instance of NormalUser and fill it with data taken 
-   from mysqlpp::Row
+   from a Record
  
    @param    aRow Record fetched from the database
-   @see ManagedObject, User::User, mysqlpp::Row
+   @see ManagedObject, User::User, Record
  */
-NormalUser::NormalUser(Row &aRow) : User(aRow)
+NormalUser::NormalUser(const Record &aRow): User(aRow)
 {
     LOG_CTOR()
 }
@@ -409,12 +410,24 @@ NormalUser::~NormalUser()
 Order * NormalUser::placeOrder() throw (string)
 {
     if (basket.size() == 0)
-        throw "Basket must contain at least one product";
+        throw string("Basket must contain at least one product");
+    
+    // reservations could have expired while the user was shopping
+    if (!basket.renewReservations())
+        throw string("Some products are no longer available");
     
+    // stock and prices are checked, and stock decreased, by the 
+    // database while placing the order
+    Money shown = basket.total();
     Order *newOrder = Order::create(intForKey(KEY_USR_UID), basket);
-    if (newOrder) {
-        basket.clear();
-    }
+    if (!newOrder && basket.total() != shown)
+        throw string("Prices changed, the basket total is now ") + 
+              basket.total().str();
+    if (!newOrder)
+        throw string("Unable to place the order");
+    
+    basket.commitReservations(true);
+    basket.empty();
     
     return newOrder;
 }
@@ -12,9 +12,9 @@
 #include "ManagedObject.h"
 #include "Basket.h"
 #include "Order.h"
+#include "Arena.h"
 
 using namespace std;
-using namespace mysqlpp;
 
 /**
    User is the base class to permit login into the system and benefit
@@ -33,7 +33,7 @@ class User : public ManagedObject
 {
 public:
     User();
-    User(Row & aRow);
+    User(const Record & aRow);
     virtual ~User();
     
     static User * factory(string aName, string aSurname, string aLogin, 
@@ -47,7 +47,7 @@ public:
 
     ulonglong uniqueID();
     string fullName();
-    string loginName();
+    const string & loginName() const;
     bool isAdmin();
     string primaryKey();
     
@@ -69,13 +69,14 @@ public:
 class AdminUser : public User
 {
 public:
-    AdminUser(Row &aRow);
+    AdminUser(const Record &aRow);
     Basket * getBasket() { return NULL; };
     Order * placeOrder() throw (string) { return NULL; };
-    vector<User *> & userList();
+    vector<User *> & userList(Arena & anArena);
     bool changeUserPassword(User & anUser, string aPasswd);
     void showMonthlyTrend();
     bool deleteProduct(int aPid);
+    bool adjustStock(int aPid, int aDelta);
 };
 
 /**
@@ -97,7 +98,7 @@ private:
     
 public:
     NormalUser();
-    NormalUser(Row &aRow);
+    NormalUser(const Record &aRow);
     ~NormalUser();
     Order * placeOrder() throw (string);
     Basket * getBasket() { return &basket; };
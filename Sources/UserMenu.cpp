@@ -8,6 +8,7 @@
 #include "UserMenu.h"
 #include "Product.h"
 #include "Order.h"
+#include "NotificationScope.h"
 #include <termios.h>
 #include <algorithm>
 
@@ -31,6 +32,7 @@ UserMenu::UserMenu()
     adm_operations[3] = &UserMenu::disableUser;
     adm_operations[4] = &UserMenu::displayMonthlyTrend;
     adm_operations[5] = &UserMenu::deleteProduct;
+    adm_operations[6] = &UserMenu::adjustStock;
     
     LOG(3, "#%d usr operations loaded\n", (int)usr_operations.size());
     LOG(3, "#%d adm operations loaded\n", (int)adm_operations.size());
@@ -110,6 +112,7 @@ void UserMenu::displayUnprivilegedMenu() throw (BadAuthException)
             int idx = choice - 1;
             op anOP = usr_operations[idx];
             (this->*anOP)();
+            _arena.release();
         }
     } while (choice != 0);
     
@@ -135,13 +138,11 @@ void UserMenu::browseProductCatalog() throw (BadAuthException)
     
     // list all available category and ask the user to choose one of them
     cout << "BROWSE PRODUCT CATALOG\n\nCATEGORY LIST\n";
-    vector<Category *> & vc = Category::catalog();
-    if (&vc && vc.size()) {
-        for (int i=0; i < (int)vc.size(); i++) {
-            cout << *(vc[i]) << endl;
-        }
+    ResultList<Category> vc = Category::catalog();
+    for (int i=0; i < (int)vc.size(); i++) {
+        cout << vc[i] << " (" << vc[i].productCount() 
+             << " products)" << endl;
     }
-    std::for_each(vc.begin(), vc.end(), deletePtr<Category>());
     cout << "\nEnter category ID [0 to browse all]: ";
     cin >> cid;
     cout << endl;
@@ -161,10 +162,10 @@ void UserMenu::printCatalog(int aCid)
 {
     // list all product belonging to selected category (or display them all if
     // zero was selected.
-    vector<ProductProxy *> & v = ProductProxy::catalog(aCid);
-    if (&v && v.size()) {
+    ResultList<ProductProxy> v = ProductProxy::catalog(aCid);
+    if (v.size()) {
         for (int i=0; i < (int)v.size(); i++) {
-            ProductProxy *pp = v[i];
+            ProductProxy *pp = &v[i];
             auto_ptr<Category> c = pp->getCategory();
             
             cout << "  |" << setfill(' ') << setw(5) << right << pp->uniqueID() 
@@ -173,10 +174,6 @@ void UserMenu::printCatalog(int aCid)
                  << setw(7) << right << pp->getPrice() << endl;
         }
         cout << endl;
-        
-        // dealloc container
-        std::for_each(v.begin(), v.end(), deletePtr<ProductProxy>());
-        delete &v;    
     }    
 }
 
@@ -253,20 +250,18 @@ void UserMenu::showUserProfile() throw (BadAuthException)
     cout << "USER DETAILS\n" << *_currentUser << endl << endl;
     
     // obtain a vector containing all orders for current logged user
-    vector<Order *> & orders = Order::ordersForUser(*_currentUser);
+    ResultList<Order> orders = Order::ordersForUser(*_currentUser);
     
     if (orders.size()) {        
-        // we don't need to update this vector: 
-        // let's use a const_iterator (safe)
-        vector<Order *>::const_iterator it;
+        ResultList<Order>::iterator it;
         
         // iterate on all vector items and print them
         for (it = orders.begin(); it != orders.end(); it++) {
-            Order *ord = (Order *) *it;
+            Order *ord = it;
             cout << *ord << endl;
             
-            map<int, int> &products = ord->products();
-            map<int,int>::const_iterator mit;
+            ResultList< pair<int, int> > products = ord->products();
+            ResultList< pair<int, int> >::const_iterator mit;
             
             for (mit = products.begin(); mit != products.end(); mit++) {
                 ProductProxy pp = ProductProxy( (*mit).first );
@@ -274,17 +269,12 @@ void UserMenu::showUserProfile() throw (BadAuthException)
                 << "Quantity: " << (*mit).second << endl;
             }
             cout << endl << endl;
-            delete &products;
         }
-        
-        // dealloc container
-        std::for_each(orders.begin(), orders.end(), deletePtr<Order>());        
+        cout << "Total spent: " << Order::totalOf(orders) << endl;
     } else {
         cout << "[INFO] User didn't place any order at the moment.\n";
     }
     
-    delete &orders;    
-    
     wait();
 }
 
@@ -341,7 +331,14 @@ void UserMenu::placeNewOrder() throw (BadAuthException)
     }
     cout << "\nSUMMARY\n=======\n" << *(_currentUser->getBasket()) << endl
          << "TOTAL: " << _currentUser->getBasket()->total() << endl;
-    _currentUser->placeOrder();
+    try {
+        Order *ord = _currentUser->placeOrder();
+        cout << "\nOrder placed, amount charged: " << ord->getTotal() << endl;
+        delete ord;
+    }
+    catch (const string & msg) {
+        cerr << "\nUnable to place the order: " << msg << endl;
+    }
     wait();
 }
 
@@ -367,6 +364,7 @@ void UserMenu::displayAdminMenu() throw (BadAuthException)
         "(4)  Disable an user\n"
         "(5)  Display monthly trend\n"
         "(6)  Delete a product\n"
+        "(7)  Adjust product stock\n"
         "(0)  EXIT\n\n"
         "Current admin: " << _currentUser->fullName() <<
         "\n\nMake your choice: ";
@@ -376,6 +374,7 @@ void UserMenu::displayAdminMenu() throw (BadAuthException)
             int idx = choice - 1;
             op anOP = adm_operations[idx];
             (this->*anOP)();
+            _arena.release();
         }
     } while (choice != 0);
 }
@@ -439,17 +438,18 @@ void UserMenu::addNewProduct() throw (BadAuthException)
         throw BadAuthException();
     
     string name, descr = "", cidStr, priceStr, qtyStr;
-    float price;
+    Money price;
     int qty, cid;
     bool success;
     
     system(CLEAR_SCREEN_CMD);
     cout << "ADD NEW PRODUCT\n\nChoose the category of new product from list\n";    
     
-    vector<Category *> & v = Category::catalog();
-    if (&v && v.size()) {
+    ResultList<Category> v = Category::catalog();
+    if (v.size()) {
         for (int i=0; i < (int)v.size(); i++) {
-            cout << *(v[i]) << endl;
+            cout << v[i] << " (" << v[i].productCount() 
+                 << " products)" << endl;
         }
     } else {
         cerr << "There are no categories avabilable." << endl
@@ -459,10 +459,6 @@ void UserMenu::addNewProduct() throw (BadAuthException)
         return;
     }        
     
-    // we can dealloc container, categories are only printed
-    std::for_each(v.begin(), v.end(), deletePtr<Category>());
-    delete &v;
-    
     success = getNotEmptyLine("\nEnter category ID [0 to abort]: ", &cidStr);
     if (!success || cidStr == "0") {
         cerr << "\nOperation aborted.\n";
@@ -474,11 +470,10 @@ void UserMenu::addNewProduct() throw (BadAuthException)
     getNotEmptyLine("Price                         : ", &priceStr);
     getNotEmptyLine("Availability                  : ", &qtyStr);
     
-    price = atof(priceStr.c_str());
     qty = atoi(qtyStr.c_str());
     cid = atoi(cidStr.c_str());
     
-    if ((cid <= 0) || (price <= 0.0)) {
+    if ((cid <= 0) || !Money::parse(priceStr, price) || (price <= Money())) {
         cerr << "\nOperation aborted.\n";
     } else {
         Product *p = Product::factory(name, cid, price, descr, qty);
@@ -502,6 +497,7 @@ void UserMenu::changeProductDetail() throw (BadAuthException)
     Product *p;
     int pid, attr;
     string attribute;
+    Money price;
     
     // display the product catalog
     printCatalog();
@@ -516,7 +512,7 @@ void UserMenu::changeProductDetail() throw (BadAuthException)
     }
     
     // retrive the product from database
-    p = Product::productByID(pid);
+    p = Product::productByID(pid, true);
     if (!p) {
         cerr << "[ERR] Unable to find specified product. Abort.\n";
         wait();
@@ -524,6 +520,8 @@ void UserMenu::changeProductDetail() throw (BadAuthException)
     }
     cout << "\nREVIEW PRODUCT DETAIL\n " << *p << endl;
     
+    // observers learn about the changes once, if they're stored
+    NotificationScope scope;
     do {
         cout << "\nCHOOSE WHICH ATTRIBUTE YOU WANT TO EDIT:\n"
              << "[1] Name\n[2] Description\n[3] Price\n[0] End\n\n"
@@ -539,7 +537,11 @@ void UserMenu::changeProductDetail() throw (BadAuthException)
                         p->setValueForKey(KEY_PRD_DESCR, attribute);
                         break;
                     case 3:
-                        p->setValueForKey(KEY_PRD_PRICE, attribute);
+                        if (Money::parse(attribute, price) && 
+                            (price > Money()))
+                            p->setMoneyForKey(KEY_PRD_PRICE, price);
+                        else
+                            cout << "Invalid price, ignored.\n";
                         break;
                     default:
                         attr = 0;
@@ -549,10 +551,18 @@ void UserMenu::changeProductDetail() throw (BadAuthException)
         }        
     } while (attr != 0);
     
-    if (p->update())
+    if (p->update()) {
+        scope.commit();
         cout << "Operation successfully completed\n";
-    else
-        cerr << "Something went wrong. Operation aborted.\n";
+    } else {
+        scope.discard();
+        if (p->hasConflict())
+            cerr << "The product was changed by someone else in the "
+                 << "meanwhile.\nReview the new details and retry. "
+                 << "Operation aborted.\n";
+        else
+            cerr << "Something went wrong. Operation aborted.\n";
+    }
     
     wait();
 }
@@ -575,7 +585,7 @@ void UserMenu::disableUser() throw (BadAuthException)
     system(CLEAR_SCREEN_CMD);
     cout << "USER LOCK\n\n";
     
-    vector<User *> & uc = anAdmin->userList();
+    vector<User *> & uc = anAdmin->userList(_arena);
     int pid, i;
     
     for (i=0; i<(int)uc.size(); i++) {
@@ -601,12 +611,11 @@ void UserMenu::disableUser() throw (BadAuthException)
         
         cout << "\nOperation was " << (bValue?"":"NOT ") 
         << "succesfully completed\n";
+        if (anUser->hasConflict())
+            cerr << "The user was changed by someone else in the meanwhile.\n";
+        delete anUser;
     }
     
-    // dealloc container
-    std::for_each(uc.begin(), uc.end(), deletePtr<User>());
-    delete &uc;
-    
     wait();
 }
 
@@ -647,6 +656,49 @@ void UserMenu::deleteProduct() throw (BadAuthException)
     wait();
 }
 
+/**
+   @brief Add or remove units of a product
+ 
+   @throw    BadAuthException If called by client programmer without 
+            any logged user
+ 
+   @see AdminUser::adjustStock()
+ */
+void UserMenu::adjustStock() throw (BadAuthException)
+{
+    AdminUser *anAdmin = dynamic_cast<AdminUser *> (_currentUser);
+    
+    if (!_currentUser || !anAdmin)
+        throw BadAuthException();
+    
+    int pid, delta;
+    
+    system(CLEAR_SCREEN_CMD);
+    cout << "STOCK ADJUSTMENT\n\n";
+    
+    // Display product catalog
+    printCatalog();
+    
+    cout << "\nEnter product ID [0 to abort] :";
+    cin >> pid;
+    if (pid <= 0) {
+        cerr << "Operation aborted.\n";
+        wait();
+        return;
+    }
+    
+    cout << "Units to add (negative to remove) :";
+    cin >> delta;
+    if (delta == 0)
+        cerr << "Operation aborted.\n";
+    else if (anAdmin->adjustStock(pid, delta))
+        cout << "\nStock successfully adjusted.\n";
+    else
+        cerr << "\nNot enough units or unknown product. "
+                "Operation aborted.\n";
+    wait();
+}
+
 /**
    @brief Display a menu to the screen, according to authorization 
           level of current user.
@@ -11,6 +11,7 @@
 #include "common.h"
 #include "User.h"
 #include "Exceptions.h"
+#include "Arena.h"
 
 class UserMenu;
 
@@ -18,11 +19,17 @@ typedef void (UserMenu::*op)();
 
 /**
    @brief Display menus and handles user input
+ 
+   Objects an operation can't hold by value (the users listed by 
+   userList(), which are of different classes) are allocated from an 
+   arena, released in one step when the operation ends.
  */
 class UserMenu 
 {
 private:        
     User *_currentUser;
+    /** Objects fetched by the running operation */
+    Arena _arena;
     map<int, op> usr_operations;
     map<int, op> adm_operations;
     
@@ -42,6 +49,7 @@ private:
     void disableUser() throw (BadAuthException);
     void displayMonthlyTrend() throw (BadAuthException);
     void deleteProduct() throw (BadAuthException);
+    void adjustStock() throw (BadAuthException);
     
     void displayUnprivilegedMenu() throw (BadAuthException);
     void displayAdminMenu() throw (BadAuthException);
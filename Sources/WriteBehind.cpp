@@ -0,0 +1,951 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#include "WriteBehind.h"
+#include "Database.h"
+#include "SharedCache.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+
+#define SQL_WRITER_LAST     "SELECT last_seq FROM deferred_writes " \
+                            "WHERE writer = %0q"
+#define SQL_WRITER_FORGET   "DELETE FROM deferred_writes WHERE writer = %0q"
+
+/** Writes of one statement of a batch */
+struct WriteGroup {
+    char kind;
+    string entity;
+    string key;
+    /** Columns of a REPLACE, column of an increment */
+    vector<string> columns;
+    /** Records of a REPLACE */
+    vector< vector<string> > rows;
+    /** Primary keys of updates and increments, in order */
+    vector<string> ids;
+    /** Values set by updates, indexed by primary key then column */
+    map<string, map<string, string> > sets;
+    /** Increments, indexed by primary key */
+    map<string, long> deltas;
+};
+
+/**
+   @brief Returns the microseconds elapsed between two instants
+ */
+static ulonglong elapsedUsec(const struct timeval & t0,
+                             const struct timeval & t1)
+{
+    return (ulonglong) (t1.tv_sec - t0.tv_sec) * 1000000 +
+           t1.tv_usec - t0.tv_usec;
+}
+
+/**
+   @brief Default constructor
+ */
+WriteBehind::WriteBehind()
+{
+    LOG_CTOR();
+    _conn = NULL;
+    _running = _stopping = false;
+    _journal = -1;
+    _sync = false;
+    _lastSeq = 0;
+    _capacity = WRITE_BEHIND_CAPACITY;
+    _batchSize = WRITE_BEHIND_BATCH;
+    _interval = WRITE_BEHIND_INTERVAL;
+    _inFlight = 0;
+
+    _enqueued = _flushed = _batches = _statements = _failures = 0;
+    _stalls = _stallUsec = _flushUsec = _maxFlushUsec = 0;
+    _highWater = 0;
+
+    char host[64] = "localhost";
+    gethostname(host, sizeof(host) - 1);
+    stringstream writer;
+    writer << host << "." << getpid() << "." << time(NULL);
+    _writer = writer.str();
+    setJournalDir(WRITE_BEHIND_DIR);
+}
+
+/**
+   @brief Default destructor
+
+   The flusher is stopped: writes that couldn't be applied are left
+   in the journal.
+ */
+WriteBehind::~WriteBehind()
+{
+    LOG_DTOR();
+    stop();
+
+    if (_journal >= 0)
+        close(_journal);
+    delete _conn;
+}
+
+/**
+   @brief Queue the storage of a new record (REPLACE)
+
+   @param[in]    anEntity    The table
+   @param[in]    fields      Value of each column
+ */
+void WriteBehind::store(const string & anEntity,
+                        const map<string, string> & fields)
+{
+    Write w;
+    w.kind = 'R';
+    w.entity = anEntity;
+
+    map<string, string>::const_iterator it;
+    for (it = fields.begin(); it != fields.end(); it++) {
+        w.columns.push_back((*it).first);
+        w.values.push_back((*it).second);
+    }
+
+    enqueue(w);
+}
+
+/**
+   @brief Queue the update of an existing record
+
+   @param[in]    anEntity    The table
+   @param[in]    aKey        The primary key column
+   @param[in]    anID        The primary key value
+   @param[in]    fields      New value of the changed columns
+ */
+void WriteBehind::update(const string & anEntity, const string & aKey,
+                         const string & anID,
+                         const map<string, string> & fields)
+{
+    Write w;
+    w.kind = 'U';
+    w.entity = anEntity;
+    w.key = aKey;
+    w.id = anID;
+
+    map<string, string>::const_iterator it;
+    for (it = fields.begin(); it != fields.end(); it++) {
+        w.columns.push_back((*it).first);
+        w.values.push_back((*it).second);
+    }
+
+    enqueue(w);
+}
+
+/**
+   @brief Queue the increment of a numeric column
+
+   Increments of the same record in a batch are summed, so counters
+   don't lose updates even if written by several callers.
+
+   @param[in]    anEntity    The table
+   @param[in]    aKey        The primary key column
+   @param[in]    anID        The primary key value
+   @param[in]    aColumn     The column to increase
+   @param[in]    aDelta      Amount to add (may be negative)
+ */
+void WriteBehind::increment(const string & anEntity, const string & aKey,
+                            const string & anID, const string & aColumn,
+                            long aDelta)
+{
+    stringstream delta;
+    delta << aDelta;
+
+    Write w;
+    w.kind = 'A';
+    w.entity = anEntity;
+    w.key = aKey;
+    w.id = anID;
+    w.columns.push_back(aColumn);
+    w.values.push_back(delta.str());
+
+    enqueue(w);
+}
+
+/**
+   @brief Journal a write and put it in the queue
+
+   If the queue is full the caller waits for the flusher to make room;
+   without a flusher running, the queue is flushed synchronously.
+
+   @param[in]    aWrite  The write, numbered here
+ */
+void WriteBehind::enqueue(const Write & aWrite)
+{
+    Write w = aWrite;
+    bool mustFlush;
+
+    {
+        MutexLocker lock(_lock);
+
+        if (_running && _queue.size() >= _capacity) {
+            struct timeval t0, t1;
+
+            _stalls++;
+            gettimeofday(&t0, NULL);
+            while (_running && !_stopping && _queue.size() >= _capacity)
+                _notFull.wait(_lock);
+            gettimeofday(&t1, NULL);
+            _stallUsec += elapsedUsec(t0, t1);
+        }
+
+        // numbered in the order of the queue, which batches keep
+        w.seq = ++_lastSeq;
+        string record = journalRecord(w);
+
+        openJournal();
+        if (_journal >= 0) {
+            if (write(_journal, record.data(), record.size()) < 0) {
+                LOG(1, "Unable to write the journal\n");
+            } else if (_sync)
+                fdatasync(_journal);
+        }
+
+        _queue.push_back(w);
+        _enqueued++;
+        if (_queue.size() > _highWater)
+            _highWater = _queue.size();
+
+        if (_queue.size() >= _batchSize)
+            _notEmpty.signal();
+
+        mustFlush = (!_running && _queue.size() >= _capacity);
+    }
+
+    if (mustFlush)
+        flushBatch();
+}
+
+/**
+   @brief Apply the oldest queued writes
+
+   At most "batch size" writes are taken from the queue and applied in
+   a single transaction; if it fails they're put back in front of the
+   queue, to be retried later.
+
+   @return    True if successful (or nothing to do)
+ */
+bool WriteBehind::flushBatch()
+{
+    MutexLocker flushing(_flushLock);
+    deque<Write> batch;
+
+    {
+        MutexLocker lock(_lock);
+
+        size_t n = min(_queue.size(), _batchSize);
+        batch.assign(_queue.begin(), _queue.begin() + n);
+        _queue.erase(_queue.begin(), _queue.begin() + n);
+        _inFlight = n;
+        _notFull.broadcast();
+    }
+
+    if (batch.empty())
+        return true;
+
+    struct timeval t0, t1;
+    gettimeofday(&t0, NULL);
+    size_t statements = 0;
+    bool success = apply(batch, _writer, statements);
+    gettimeofday(&t1, NULL);
+
+    MutexLocker lock(_lock);
+    _inFlight = 0;
+
+    if (!success) {
+        _failures++;
+        _queue.insert(_queue.begin(), batch.begin(), batch.end());
+        return false;
+    }
+
+    ulonglong usec = elapsedUsec(t0, t1);
+    _flushUsec += usec;
+    if (usec > _maxFlushUsec)
+        _maxFlushUsec = usec;
+    _flushed += batch.size();
+    _statements += statements;
+    _batches++;
+
+    LOG(3, "Write-behind: %d write(s) applied in %llu usec\n",
+        (int) batch.size(), usec);
+
+    // everything is in the database, the journal can start over
+    if (_queue.empty()) {
+        if (_journal >= 0 && ftruncate(_journal, 0) < 0)
+            LOG(1, "Unable to truncate the journal\n");
+        _drained.broadcast();
+    }
+
+    return true;
+}
+
+/**
+   @brief Group a batch of writes into multi-row statements and run
+          them in a single transaction
+
+   The number of the last write of the batch is stored, in the same
+   transaction, as the last one applied for the writer.
+
+   @param[in]    batch       The writes, oldest first
+   @param[in]    aWriter     The process which made the writes
+   @param[out]   statements  Number of statements executed
+   @return    True if the transaction was committed
+ */
+bool WriteBehind::apply(const deque<Write> & batch, const string & aWriter,
+                        size_t & statements)
+{
+    vector<WriteGroup> groups;
+    map<string, size_t> index;
+
+    for (size_t i = 0; i < batch.size(); i++) {
+        const Write & w = batch[i];
+
+        // writes sharing the same statement
+        string gkey = string(1, w.kind) + "\t" + w.entity + "\t" + w.key;
+        if (w.kind == 'R' || w.kind == 'A')
+            gkey += "\t" + valueMerge(w.columns.begin(), w.columns.end(),
+                                      string(","));
+
+        map<string, size_t>::iterator it = index.find(gkey);
+        if (it == index.end()) {
+            WriteGroup g;
+            g.kind = w.kind;
+            g.entity = w.entity;
+            g.key = w.key;
+            if (w.kind == 'R' || w.kind == 'A')
+                g.columns = w.columns;
+
+            it = index.insert(make_pair(gkey, groups.size())).first;
+            groups.push_back(g);
+        }
+
+        WriteGroup & g = groups[(*it).second];
+        if (w.kind == 'R') {
+            g.rows.push_back(w.values);
+            continue;
+        }
+
+        if (g.sets.find(w.id) == g.sets.end() &&
+            g.deltas.find(w.id) == g.deltas.end())
+            g.ids.push_back(w.id);
+
+        if (w.kind == 'A')
+            g.deltas[w.id] += atol(w.values[0].c_str());
+        else
+            for (size_t c = 0; c < w.columns.size(); c++)
+                g.sets[w.id][w.columns[c]] = w.values[c];
+    }
+
+    if (!_conn || !_conn->isConnected()) {
+        delete _conn;
+        _conn = Database::instance().newConnection();
+        if (!_conn)
+            return false;
+    }
+
+    if (!_conn->begin()) {
+        LOG(1, "Write-behind failed: %s\n", _conn->error().c_str());
+        return false;
+    }
+
+    for (size_t i = 0; i < groups.size(); i++) {
+        WriteGroup & g = groups[i];
+        stringstream q;
+
+        if (g.kind == 'R') {
+            q << "REPLACE INTO " << g.entity << " ("
+              << valueMerge(g.columns.begin(), g.columns.end(),
+                            string(","))
+              << ") VALUES ";
+            for (size_t r = 0; r < g.rows.size(); r++) {
+                q << (r ? ",(" : "(");
+                for (size_t c = 0; c < g.rows[r].size(); c++)
+                    q << (c ? "," : "") << _conn->quote(g.rows[r][c]);
+                q << ")";
+            }
+        } else if (g.kind == 'A') {
+            const string & col = g.columns[0];
+
+            q << "UPDATE " << g.entity << " SET " << col << " = "
+              << col << " + CASE " << g.key;
+            for (size_t r = 0; r < g.ids.size(); r++)
+                q << " WHEN " << _conn->quote(g.ids[r]) << " THEN "
+                  << g.deltas[g.ids[r]];
+            q << " ELSE 0 END";
+        } else {
+            set<string> columns;
+            map<string, map<string, string> >::const_iterator rit;
+            for (rit = g.sets.begin(); rit != g.sets.end(); rit++) {
+                map<string, string>::const_iterator cit;
+                for (cit = (*rit).second.begin();
+                     cit != (*rit).second.end(); cit++)
+                    columns.insert((*cit).first);
+            }
+
+            q << "UPDATE " << g.entity << " SET ";
+            set<string>::const_iterator cit;
+            for (cit = columns.begin(); cit != columns.end(); cit++) {
+                q << (cit == columns.begin() ? "" : ", ") << *cit
+                  << " = CASE " << g.key;
+                for (size_t r = 0; r < g.ids.size(); r++) {
+                    map<string, string> & values = g.sets[g.ids[r]];
+                    map<string, string>::const_iterator v;
+                    v = values.find(*cit);
+                    if (v != values.end())
+                        q << " WHEN " << _conn->quote(g.ids[r]) << " THEN "
+                          << _conn->quote((*v).second);
+                }
+                q << " ELSE " << *cit << " END";
+            }
+        }
+
+        if (g.kind == 'U' || g.kind == 'A') {
+            q << " WHERE " << g.key << " IN (";
+            for (size_t r = 0; r < g.ids.size(); r++)
+                q << (r ? "," : "") << _conn->quote(g.ids[r]);
+            q << ")";
+        }
+
+        LOG(2, "SQL: %s\n", q.str().c_str());
+        if (!_conn->execute(q.str())) {
+            LOG(1, "Write-behind failed: %s\n", _conn->error().c_str());
+            _conn->rollback();
+            return false;
+        }
+        statements++;
+    }
+
+    // a replay of the journal skips the writes committed here
+    stringstream done;
+    done << "REPLACE INTO deferred_writes (writer, last_seq) VALUES ("
+         << _conn->quote(aWriter) << ", " << batch.back().seq << ")";
+    if (!_conn->execute(done.str())) {
+        LOG(1, "Write-behind failed: %s\n", _conn->error().c_str());
+        _conn->rollback();
+        return false;
+    }
+
+    if (!_conn->commit()) {
+        LOG(1, "Write-behind failed: %s\n", _conn->error().c_str());
+        _conn->rollback();
+        return false;
+    }
+
+    // cached reads of the written tables are now stale, and so are the
+    // copies of the written products shared with other processes
+    Database & db = Database::instance();
+    for (size_t i = 0; i < groups.size(); i++) {
+        const WriteGroup & g = groups[i];
+        db.tableDidChange(g.entity);
+        if (g.entity != "products")
+            continue;
+
+        for (size_t r = 0; r < g.ids.size(); r++)
+            SharedCache::instance().invalidate(atoi(g.ids[r].c_str()));
+
+        if (g.kind != 'R')
+            continue;
+        size_t c = find(g.columns.begin(), g.columns.end(), string("pid")) -
+                   g.columns.begin();
+        for (size_t r = 0; c < g.columns.size() && r < g.rows.size(); r++)
+            SharedCache::instance().invalidate(atoi(g.rows[r][c].c_str()));
+    }
+
+    return true;
+}
+
+/**
+   @brief Encode a write as a line of the journal
+
+   Fields are separated by tabs; backslashes, tabs and newlines inside
+   a field are escaped. The first field is the number of the write.
+
+   @param[in]    w   The write
+   @return    The journal line, newline included
+ */
+string WriteBehind::journalRecord(const Write & w) const
+{
+    stringstream seq;
+    seq << w.seq;
+
+    vector<string> fields;
+    fields.push_back(seq.str());
+    fields.push_back(string(1, w.kind));
+    fields.push_back(w.entity);
+    fields.push_back(w.key);
+    fields.push_back(w.id);
+    for (size_t i = 0; i < w.columns.size(); i++) {
+        fields.push_back(w.columns[i]);
+        fields.push_back(w.values[i]);
+    }
+
+    string line;
+    for (size_t i = 0; i < fields.size(); i++) {
+        if (i)
+            line += '\t';
+
+        const string & f = fields[i];
+        for (size_t c = 0; c < f.size(); c++) {
+            switch (f[c]) {
+                case '\\': line += "\\\\"; break;
+                case '\t': line += "\\t"; break;
+                case '\n': line += "\\n"; break;
+                default: line += f[c];
+            }
+        }
+    }
+
+    return line + '\n';
+}
+
+/**
+   @brief Decode a line of the journal
+
+   @param[in]    aLine   The line, without newline
+   @param[out]   w       The decoded write
+   @return    True if the line is a valid record
+ */
+bool WriteBehind::parseRecord(const string & aLine, Write & w) const
+{
+    vector<string> fields(1);
+
+    for (size_t c = 0; c < aLine.size(); c++) {
+        if (aLine[c] == '\t')
+            fields.push_back("");
+        else if (aLine[c] == '\\' && c + 1 < aLine.size()) {
+            char e = aLine[++c];
+            fields.back() += (e == 't') ? '\t' : (e == 'n') ? '\n' : e;
+        } else
+            fields.back() += aLine[c];
+    }
+
+    // a truncated last line has an even number of fields
+    if (fields.size() < 5 || fields.size() % 2 == 0 || 
+        fields[1].size() != 1)
+        return false;
+
+    w.seq = strtoull(fields[0].c_str(), NULL, 10);
+    w.kind = fields[1][0];
+    w.entity = fields[2];
+    w.key = fields[3];
+    w.id = fields[4];
+    w.columns.clear();
+    w.values.clear();
+    for (size_t i = 5; i < fields.size(); i += 2) {
+        w.columns.push_back(fields[i]);
+        w.values.push_back(fields[i+1]);
+    }
+
+    return (w.seq > 0 && string("RUA").find(w.kind) != string::npos &&
+            (w.kind != 'A' || w.columns.size() == 1));
+}
+
+/**
+   @brief Open the journal, if not already open (lock already held)
+
+   The journal stays locked until it's closed, so that replay() run by
+   another process leaves it alone.
+ */
+void WriteBehind::openJournal()
+{
+    if (_journal >= 0 || _journalPath.empty())
+        return;
+
+    _journal = open(_journalPath.c_str(), O_WRONLY | O_CREAT | O_APPEND,
+                    0600);
+    if (_journal >= 0 && flock(_journal, LOCK_EX | LOCK_NB) < 0) {
+        close(_journal);
+        _journal = -1;
+    }
+    if (_journal < 0)
+        cerr << "Unable to open journal " << _journalPath
+             << ": writes won't survive a crash\n";
+}
+
+/**
+   @brief Apply the writes left in the journals of ended processes
+
+   Journals still locked belong to running processes, which apply them
+   on their own. Call this method at startup, after the connection to
+   the database has been established and before any write is queued.
+
+   @return    Number of writes applied
+ */
+int WriteBehind::replay()
+{
+    string dir;
+    {
+        MutexLocker lock(_lock);
+        dir = _journalDir;
+    }
+
+    DIR *d = dir.empty() ? NULL : opendir(dir.c_str());
+    if (!d)
+        return 0;
+
+    string prefix = WRITE_BEHIND_PREFIX, suffix = WRITE_BEHIND_SUFFIX;
+    vector<string> names;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL) {
+        string name = entry->d_name;
+        if (name.size() > prefix.size() + suffix.size() &&
+            name.compare(0, prefix.size(), prefix) == 0 &&
+            name.compare(name.size() - suffix.size(), suffix.size(),
+                         suffix) == 0)
+            names.push_back(name);
+    }
+    closedir(d);
+
+    int count = 0;
+    for (size_t i = 0; i < names.size(); i++)
+        count += replayJournal(dir, names[i]);
+
+    return count;
+}
+
+/**
+   @brief Apply the writes of a journal not locked by its process
+
+   Writes already applied, according to "deferred_writes", are skipped.
+   Once all the others are applied the journal is removed; if a batch
+   fails the journal is kept, to be replayed again later.
+
+   @param[in]    aDir    The journal directory
+   @param[in]    aName   File name of the journal
+   @return    Number of writes applied
+ */
+int WriteBehind::replayJournal(const string & aDir, const string & aName)
+{
+    string writer = aName.substr(strlen(WRITE_BEHIND_PREFIX),
+                                 aName.size() - 
+                                 strlen(WRITE_BEHIND_PREFIX) - 
+                                 strlen(WRITE_BEHIND_SUFFIX));
+    string path = aDir + "/" + aName;
+    struct stat st;
+
+    // held by its process, or already replayed by someone else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return 0;
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0 || fstat(fd, &st) < 0 ||
+        st.st_nlink == 0) {
+        close(fd);
+        return 0;
+    }
+
+    Database &db = Database::instance();
+    ResultSet res;
+    if (!db.select(SQL_WRITER_LAST, res, SqlParams() << writer)) {
+        close(fd);
+        return 0;
+    }
+    ulonglong last = res.empty() ? 0 : strtoull(res[0][0].c_str(), NULL, 10);
+
+    ifstream in(path.c_str());
+    deque<Write> writes;
+    string line;
+    int skipped = 0;
+    while (getline(in, line)) {
+        // the process died while writing the last line
+        if (in.eof())
+            break;
+
+        Write w;
+        if (!parseRecord(line, w)) {
+            LOG(1, "Invalid journal record skipped: %s\n", line.c_str());
+            continue;
+        }
+        if (w.seq <= last)
+            skipped++;
+        else
+            writes.push_back(w);
+    }
+
+    LOG(1, "Replaying %d write(s) from %s, %d already applied\n",
+        (int) writes.size(), path.c_str(), skipped);
+
+    MutexLocker flushing(_flushLock);
+    int count = 0;
+    while (!writes.empty()) {
+        size_t n = min(writes.size(), _batchSize), statements = 0;
+        deque<Write> batch(writes.begin(), writes.begin() + n);
+
+        if (!apply(batch, writer, statements)) {
+            LOG(1, "Journal %s kept for a later replay\n", path.c_str());
+            close(fd);
+            return count;
+        }
+        writes.erase(writes.begin(), writes.begin() + n);
+        count += n;
+    }
+
+    // removed first: a journal must never outlive its numbers
+    unlink(path.c_str());
+    db.execute(SQL_WRITER_FORGET, SqlParams() << writer);
+    close(fd);
+
+    return count;
+}
+
+/**
+   @brief Start the background flusher
+
+   @return    True if the flusher is running
+ */
+bool WriteBehind::start()
+{
+    MutexLocker lock(_lock);
+
+    if (_running)
+        return true;
+
+    openJournal();
+    _stopping = false;
+    if (pthread_create(&_thread, NULL, &WriteBehind::run, this) != 0) {
+        cerr << "Unable to start the write-behind flusher\n";
+        return false;
+    }
+    _running = true;
+
+    return true;
+}
+
+/**
+   @brief Flush all queued writes and stop the background flusher
+
+   Once everything is in the database the journal of the process is
+   removed, and so is its last write number.
+ */
+void WriteBehind::stop()
+{
+    {
+        MutexLocker lock(_lock);
+
+        if (!_running)
+            return;
+
+        _stopping = true;
+        _notEmpty.signal();
+        _notFull.broadcast();
+    }
+
+    pthread_join(_thread, NULL);
+
+    MutexLocker lock(_lock);
+    _running = false;
+    if (!_queue.empty()) {
+        cerr << _queue.size() << " deferred write(s) kept in "
+             << _journalPath << endl;
+        return;
+    }
+
+    if (_journal >= 0) {
+        unlink(_journalPath.c_str());
+        close(_journal);
+        _journal = -1;
+        Database::instance().execute(SQL_WRITER_FORGET, 
+                                     SqlParams() << _writer);
+    }
+}
+
+/**
+   @brief Wait until all queued writes are in the database
+
+   @return    False if a batch failed in the meanwhile
+ */
+bool WriteBehind::drain()
+{
+    if (!_running) {
+        while (pending())
+            if (!flushBatch())
+                return false;
+
+        return true;
+    }
+
+    MutexLocker lock(_lock);
+    ulonglong failures = _failures;
+
+    while (!_queue.empty() || _inFlight) {
+        if (_failures != failures)
+            return false;
+
+        _notEmpty.signal();
+        _drained.timedWait(_lock, _interval);
+    }
+
+    return true;
+}
+
+/**
+   @brief Body of the flusher thread
+
+   @param[in]    arg The instance of WriteBehind
+ */
+void *WriteBehind::run(void *arg)
+{
+    WriteBehind *wb = (WriteBehind *) arg;
+    StorageBackend *backend = Database::instance().backend();
+
+    if (backend)
+        backend->threadStart();
+
+    for (;;) {
+        bool stopping;
+
+        {
+            MutexLocker lock(wb->_lock);
+
+            if (!wb->_stopping && wb->_queue.size() < wb->_batchSize)
+                wb->_notEmpty.timedWait(wb->_lock, wb->_interval);
+
+            stopping = wb->_stopping;
+            if (stopping && wb->_queue.empty())
+                break;
+        }
+
+        if (!wb->flushBatch()) {
+            // writes stay in the journal, next run will replay them
+            if (stopping)
+                break;
+            usleep(wb->_interval * 1000);
+        }
+    }
+
+    delete wb->_conn;
+    wb->_conn = NULL;
+    if (backend)
+        backend->threadEnd();
+
+    return NULL;
+}
+
+/**
+   @brief Change the directory of the journals
+
+   Call this method before replay() and before any write is queued: 
+   the journal of this process is created in the new directory.
+
+   @param[in]    aDir    Absolute path of an existing directory, empty
+                         to disable the journal
+   @param[in]    isSync  If true every write is synced to disk, so it
+                         survives a crash of the operating system too
+   @return    False if the directory is not absolute or not writable
+ */
+bool WriteBehind::setJournalDir(const string & aDir, bool isSync)
+{
+    if (!aDir.empty() && (aDir[0] != '/' || access(aDir.c_str(), W_OK))) {
+        LOG(1, "Invalid journal directory %s\n", aDir.c_str());
+        return false;
+    }
+
+    MutexLocker lock(_lock);
+
+    if (_journal >= 0)
+        close(_journal);
+    _journal = -1;
+    _journalDir = aDir;
+    _journalPath = aDir.empty() ? "" : aDir + "/" WRITE_BEHIND_PREFIX + 
+                                       _writer + WRITE_BEHIND_SUFFIX;
+    _sync = isSync;
+
+    return true;
+}
+
+/**
+   @brief Returns the path of the journal of this process
+
+   @return    The path, empty if the journal is disabled
+ */
+string WriteBehind::journalPath()
+{
+    MutexLocker lock(_lock);
+
+    return _journalPath;
+}
+
+/**
+   @brief Change how many writes can be queued before callers block
+
+   @param[in]    aValue  Number of writes
+ */
+void WriteBehind::setCapacity(size_t aValue)
+{
+    MutexLocker lock(_lock);
+
+    _capacity = aValue;
+    _notFull.broadcast();
+}
+
+/**
+   @brief Change how many writes are applied by a single transaction
+
+   @param[in]    aValue  Number of writes
+ */
+void WriteBehind::setBatchSize(size_t aValue)
+{
+    MutexLocker lock(_lock);
+
+    _batchSize = aValue;
+}
+
+/**
+   @brief Change how long a write can wait in the queue
+
+   @param[in]    aMsec   Milliseconds
+ */
+void WriteBehind::setInterval(long aMsec)
+{
+    MutexLocker lock(_lock);
+
+    _interval = aMsec;
+}
+
+/**
+   @brief Returns the number of writes not yet applied
+ */
+size_t WriteBehind::pending()
+{
+    MutexLocker lock(_lock);
+
+    return _queue.size() + _inFlight;
+}
+
+/**
+   @brief Returns how many times a caller blocked on a full queue
+ */
+ulonglong WriteBehind::stalls() const
+{
+    return _stalls;
+}
+
+/**
+   @brief Returns the average time taken to apply a batch
+ */
+double WriteBehind::averageFlushMsec() const
+{
+    return _batches ? (double) _flushUsec / _batches / 1000 : 0;
+}
+
+ostream& operator<<(ostream& aStream, WriteBehind& w) {
+    MutexLocker lock(w._lock);
+
+    return aStream << "Write-behind: " << w._queue.size() + w._inFlight
+           << " pending (high water " << w._highWater << "/"
+           << w._capacity << "), " << w._enqueued << " enqueued, "
+           << w._flushed << " flushed in " << w._batches << " batches ("
+           << w._statements << " statements), " << w._failures
+           << " failures, " << w._stalls << " stalls ("
+           << w._stallUsec / 1000 << " ms), flush latency "
+           << w.averageFlushMsec() << " ms avg, "
+           << w._maxFlushUsec / 1000.0 << " ms max\n";
+}
@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+#ifndef __WRITEBEHIND_H__
+#define __WRITEBEHIND_H__
+
+#include <deque>
+#include "common.h"
+#include "Storage.h"
+#include "Mutex.h"
+
+using namespace std;
+
+/** Maximum number of writes waiting to be flushed */
+#define WRITE_BEHIND_CAPACITY   1024
+/** Number of queued writes that wakes up the flusher */
+#define WRITE_BEHIND_BATCH      64
+/** Milliseconds a write can wait before being flushed */
+#define WRITE_BEHIND_INTERVAL   1000
+/** Directory of the journals of the writes not yet flushed */
+#define WRITE_BEHIND_DIR        "/var/tmp"
+/** Prefix and suffix of the name of a journal */
+#define WRITE_BEHIND_PREFIX     "ec++."
+#define WRITE_BEHIND_SUFFIX     ".journal"
+
+/**
+   @brief Deferred writes of non-critical data
+
+   The class WriteBehind takes writes off the caller's critical path:
+   a write is appended to an on-disk journal, put in a bounded queue
+   and the caller returns immediately. A background thread, with its
+   own connection to the database, wakes up when enough writes are
+   queued (or the oldest one waited too long) and groups them by
+   entity into multi-row statements:
+
+   - stored records become a single "REPLACE ... VALUES (..),(..)";
+   - updates of an entity become a single "UPDATE ... SET c = CASE pk
+     WHEN .. THEN .. ELSE c END WHERE pk IN (..)";
+   - increments of a column become "c = c + CASE pk WHEN .. END".
+
+   Writes of the same kind on the same entity keep their order; writes
+   on different entities may be applied in any order, so only data
+   that doesn't need to be read back at once (statistics, stock
+   adjustments, audit rows) should take this path.
+
+   When the queue is full, callers block until the flusher makes room
+   (back-pressure). Every process has its own journal, named after the
+   host, its pid and its start time and locked for as long as the 
+   process runs; it is truncated every time the queue is drained. 
+   After a crash, replay() applies the writes left in the journals no 
+   longer locked. Writes are numbered: the last number applied by each 
+   writer is stored in table "deferred_writes" by the transaction of 
+   the batch, so that replaying a journal never applies a write twice
+   (which matters for increments).
+
+   @see Inventory::restock()
+ */
+class WriteBehind : public Singleton<WriteBehind>
+{
+private:
+    /** A deferred write */
+    struct Write {
+        /** Number of the write, increasing within a writer */
+        ulonglong seq;
+        /** 'R' replace, 'U' update, 'A' add */
+        char kind;
+        string entity;
+        /** Primary key column and value (not used by 'R') */
+        string key;
+        string id;
+        vector<string> columns;
+        vector<string> values;
+    };
+
+    deque<Write> _queue;
+    /** Protects the queue, the journal and the counters */
+    Mutex _lock;
+    /** Serializes batches (flusher thread and synchronous flush) */
+    Mutex _flushLock;
+    Condition _notEmpty;
+    Condition _notFull;
+    Condition _drained;
+    StorageBackend *_conn;
+    pthread_t _thread;
+    bool _running;
+    bool _stopping;
+    int _journal;
+    string _journalDir;
+    string _journalPath;
+    bool _sync;
+    /** Name of this process in the journals and in "deferred_writes" */
+    string _writer;
+    ulonglong _lastSeq;
+    size_t _capacity;
+    size_t _batchSize;
+    long _interval;
+    /** Writes taken by the flusher and not yet applied */
+    size_t _inFlight;
+
+    ulonglong _enqueued;
+    ulonglong _flushed;
+    ulonglong _batches;
+    ulonglong _statements;
+    ulonglong _failures;
+    ulonglong _stalls;
+    ulonglong _stallUsec;
+    ulonglong _flushUsec;
+    ulonglong _maxFlushUsec;
+    size_t _highWater;
+
+    void enqueue(const Write & aWrite);
+    bool flushBatch();
+    bool apply(const deque<Write> & batch, const string & aWriter,
+               size_t & statements);
+    string journalRecord(const Write & w) const;
+    bool parseRecord(const string & aLine, Write & w) const;
+    void openJournal();
+    int replayJournal(const string & aDir, const string & aName);
+    static void *run(void *arg);
+
+protected:
+    friend class Singleton<WriteBehind>;
+    WriteBehind();
+    virtual ~WriteBehind();
+
+public:
+    void store(const string & anEntity, const map<string, string> & fields);
+    void update(const string & anEntity, const string & aKey,
+                const string & anID, const map<string, string> & fields);
+    void increment(const string & anEntity, const string & aKey,
+                   const string & anID, const string & aColumn,
+                   long aDelta);
+
+    int replay();
+    bool start();
+    void stop();
+    bool drain();
+
+    bool setJournalDir(const string & aDir, bool isSync = false);
+    string journalPath();
+    void setCapacity(size_t aValue);
+    void setBatchSize(size_t aValue);
+    void setInterval(long aMsec);
+
+    size_t pending();
+    ulonglong stalls() const;
+    double averageFlushMsec() const;
+
+    friend ostream& operator<<(ostream &, WriteBehind &);
+};
+
+#endif /* __WRITEBEHIND_H__ */
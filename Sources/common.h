@@ -14,6 +14,8 @@
 #include <map> 
 #include <set>
 #include <vector>
+#include <cassert>
+#include <unistd.h>
 
 // User-defined data types
 typedef std::set<std::string> StringSet;
@@ -6,11 +6,28 @@
  */
 
 #include "Database.h"
+#include "Inventory.h"
+#include "WriteBehind.h"
 #include "UserMenu.h"
 #include "CommandLine.h"
+#include "CatalogSnapshot.h"
+#include "SharedCache.h"
+#include "CatalogView.h"
+#include "Server.h"
+#include "Product.h"
+#include <signal.h>
+#include <string.h>
 
 int debugLevel = 0;
 
+/**
+   @brief Stop the server on SIGINT and SIGTERM
+ */
+static void stopServer(int)
+{
+    Server::instance().stop();
+}
+
 int main (int argc, char * const argv[]) 
 {
     // parse command line
@@ -26,16 +43,72 @@ int main (int argc, char * const argv[])
     db.setServer(cmd.dbServer());
     db.setUser(cmd.dbUser());
     db.setPassword(cmd.dbPasswd());
-    
+    if (cmd.embeddedDump())
+        db.setEmbedded(cmd.embeddedDump());
+
     // try to connect to database: halt the program if not
     if (!db.connect()) {
         cerr << "Unable to connect to database\n";
         return 2;
     }
+    
+    // export the catalog and exit, or map the snapshot (regenerating 
+    // it if stale)
+    CatalogSnapshot &snapshot = CatalogSnapshot::instance();
+    if (cmd.exportSnapshot())
+        return snapshot.exportTo(cmd.catalogSnapshot()) ? 0 : 3;
+    if (cmd.catalogSnapshot() && !snapshot.openFresh(cmd.catalogSnapshot()))
+        cerr << "Catalog snapshot not available, using the database\n";
+    
+    // share fetched products with the other sessions of this host
+    SharedCache &shared = SharedCache::instance();
+    if (cmd.sharedCache() && !shared.attach(cmd.sharedCache()))
+        cerr << "Shared cache not available, using the database\n";
+    
+    // apply deferred writes left by a crash, then start the flusher
+    WriteBehind &wb = WriteBehind::instance();
+    if (cmd.journalDir() && !wb.setJournalDir(cmd.journalDir())) {
+        cerr << "Invalid journal directory " << cmd.journalDir() << endl;
+        return 5;
+    }
+    wb.replay();
+    wb.start();
+    
+    // load stock of all products
+    Inventory &inv = Inventory::instance();
+    inv.reconcile();
+    
+    // listings are served by the materialized catalog view
+    CatalogView &view = CatalogView::instance();
+    if (!view.load())
+        cerr << "Catalog view not available, using the database\n";
 
-    // display main menu
-    UserMenu menu;
-    menu.mainMenu();
+    // serve sessions over a socket, or display main menu
+    Server &server = Server::instance();
+    if (cmd.listenAddress()) {
+        if (!server.listen(cmd.listenAddress())) {
+            cerr << "Unable to listen on " << cmd.listenAddress() << endl;
+            return 4;
+        }
+        
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = stopServer;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        
+        server.run(cmd.workers() ? cmd.workers() : SERVER_WORKERS);
+    } else {
+        UserMenu menu;
+        menu.mainMenu();
+    }
+    
+    // write back pending sales and deferred writes
+    inv.flush();
+    wb.stop();
+    if (debugLevel)
+        cout << db << wb << snapshot << shared << view << server
+             << Product::pool();
     
     return 0;
 }
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+/**
+   Microbenchmark of the notification path of Observable.
+
+   A property is set ITERATIONS times, as ManagedObject::setValueForKey()
+   does, on an object which is not observed, on one observed for another
+   key and on one observed for the property itself. The first case must
+   cost the same as setting the value without notifying anything: the
+   only extra work is a test of the dispatch table pointer.
+ */
+
+#include "common.h"
+#include "Observer.h"
+#include "Observable.h"
+#include <ctime>
+
+#define ITERATIONS  20000000
+
+int debugLevel = 0;
+
+class NullObserver : public Observer
+{
+private:
+    string _name;
+
+public:
+    NullObserver() : _name("NullObserver") {}
+    void willChangeValueForKey(const string &, Observable *) {}
+    void didChangeValueForKey(const string &, Observable *) {}
+    string & toString() { return _name; }
+};
+
+class BenchObservable : public Observable
+{
+private:
+    volatile int _value;
+
+public:
+    BenchObservable() : _value(0) {}
+
+    void setPlain(int aValue) {
+        _value = aValue;
+    }
+
+    void setNotifying(KeyID aKey, int aValue) {
+        willChangeValueForKey(aKey);
+        _value = aValue;
+        didChangeValueForKey(aKey);
+    }
+};
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *aCase, double aStart)
+{
+    printf("%-28s %6.2f ns/op\n", aCase,
+           (now() - aStart) * 1e9 / ITERATIONS);
+}
+
+int main()
+{
+    PropertyKeys &keys = PropertyKeys::instance();
+    KeyID price = keys.intern("price"), name = keys.intern("name");
+    NullObserver o;
+    double start;
+
+    BenchObservable plain, unobserved, other, observed;
+    other.addObserver(name, o);
+    observed.addObserver(price, o);
+
+    start = now();
+    for (int i = 0; i < ITERATIONS; i++)
+        plain.setPlain(i);
+    report("no notification", start);
+
+    start = now();
+    for (int i = 0; i < ITERATIONS; i++)
+        unobserved.setNotifying(price, i);
+    report("not observed", start);
+
+    start = now();
+    for (int i = 0; i < ITERATIONS; i++)
+        other.setNotifying(price, i);
+    report("observed, other key", start);
+
+    start = now();
+    for (int i = 0; i < ITERATIONS; i++)
+        observed.setNotifying(price, i);
+    report("observed", start);
+
+    return 0;
+}
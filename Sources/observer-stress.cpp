@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2010 Ferruccio Vitale <unixo@devzero.it>
+ * All rights reserved.
+ *
+ * $Id$
+ */
+
+/**
+   Stress test of Observable under concurrent use, meant to be built
+   with ThreadSanitizer ("make stress").
+
+   Notifier threads keep changing a few shared objects, while other
+   threads register and remove observers on the same objects, intern
+   new property names and open notification scopes. Some observers
+   remove themselves when notified. The test fails if a notification
+   reaches an observer for a key it never registered, if counts don't
+   add up, or if retired tables are never reclaimed; data races are
+   reported by ThreadSanitizer.
+ */
+
+#include "common.h"
+#include "Observer.h"
+#include "Observable.h"
+#include "NotificationScope.h"
+#include "Rcu.h"
+#include <pthread.h>
+
+#define OBJECTS         4
+#define OBSERVERS       8
+#define NOTIFIERS       4
+#define REGISTRARS      3
+#define ROUNDS          20000
+
+int debugLevel = 0;
+
+static KeyID keyA, keyB;
+static volatile int failures = 0;
+
+class StressObserver : public Observer
+{
+private:
+    string _name;
+
+public:
+    KeyID key;
+    /** If true the observer unregisters itself when notified */
+    bool once;
+    volatile long calls;
+
+    StressObserver() : _name("StressObserver"), once(false), calls(0) {}
+
+    void check(const string & aKey, Observable *anObject) {
+        if (aKey != PropertyKeys::instance().name(key))
+            __sync_fetch_and_add(&failures, 1);
+        __sync_fetch_and_add(&calls, 1);
+        if (once)
+            anObject->removeObserver(key, *this);
+    }
+
+    void willChangeValueForKey(const string & aKey, Observable *anObject) {
+        check(aKey, anObject);
+    }
+    void didChangeValueForKey(const string & aKey, Observable *anObject) {
+        check(aKey, anObject);
+    }
+    string & toString() { return _name; }
+};
+
+class StressObservable : public Observable
+{
+public:
+    void touch(KeyID aKey) {
+        willChangeValueForKey(aKey);
+        didChangeValueForKey(aKey);
+    }
+};
+
+static StressObservable objects[OBJECTS];
+static StressObserver observers[OBSERVERS];
+
+static void *notifier(void *anArg)
+{
+    long n = (long) anArg;
+
+    for (int i = 0; i < ROUNDS; i++) {
+        StressObservable & o = objects[(n + i) % OBJECTS];
+
+        if (i % 64 == 0) {
+            NotificationScope scope;
+            o.touch(keyA);
+            o.touch(keyB);
+            o.touch(keyA);
+        } else
+            o.touch((i & 1) ? keyA : keyB);
+        o.countObservers();
+    }
+
+    return NULL;
+}
+
+static void *registrar(void *anArg)
+{
+    unsigned int seed = (unsigned int) (long) anArg;
+
+    for (int i = 0; i < ROUNDS; i++) {
+        StressObservable & o = objects[rand_r(&seed) % OBJECTS];
+        StressObserver & s = observers[rand_r(&seed) % OBSERVERS];
+
+        if (rand_r(&seed) % 2)
+            o.addObserver(s.key, s);
+        else
+            o.removeObserver(s.key, s);
+        if (i % 1000 == 0)
+            o.removeAllObservers();
+    }
+
+    return NULL;
+}
+
+static void *interner(void *)
+{
+    for (int i = 0; i < ROUNDS / 10; i++) {
+        stringstream aKey;
+        aKey << "stress_" << i;
+
+        KeyID anID = PropertyKeys::instance().intern(aKey.str());
+        if (PropertyKeys::instance().name(anID) != aKey.str())
+            __sync_fetch_and_add(&failures, 1);
+    }
+
+    return NULL;
+}
+
+int main()
+{
+    PropertyKeys &keys = PropertyKeys::instance();
+    keyA = keys.intern("a");
+    keyB = keys.intern("b");
+
+    for (int i = 0; i < OBSERVERS; i++) {
+        observers[i].key = (i % 2) ? keyA : keyB;
+        observers[i].once = (i % 4 == 3);
+    }
+
+    vector<pthread_t> threads;
+    for (long i = 0; i < NOTIFIERS + REGISTRARS + 1; i++) {
+        pthread_t t;
+        void *(*body)(void *) = (i < NOTIFIERS) ? notifier :
+                                (i < NOTIFIERS + REGISTRARS) ? registrar :
+                                interner;
+        if (pthread_create(&t, NULL, body, (void *) i) != 0) {
+            cerr << "unable to start thread\n";
+            return 1;
+        }
+        threads.push_back(t);
+    }
+    for (size_t i = 0; i < threads.size(); i++)
+        pthread_join(threads[i], NULL);
+
+    long calls = 0;
+    for (int i = 0; i < OBSERVERS; i++)
+        calls += observers[i].calls;
+
+    for (int i = 0; i < OBJECTS; i++)
+        objects[i].removeAllObservers();
+    Rcu::synchronize();
+
+    cout << "notifications: " << calls << ", failures: " << failures
+         << ", retired tables left: " << Rcu::retired() << endl;
+
+    return (failures == 0 && Rcu::retired() == 0) ? 0 : 1;
+}
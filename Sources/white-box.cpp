@@ -29,6 +29,14 @@ void testObserver()
     master->removeObserver("attr", *slave1);
     master->setKey(str2);
     
+    // changes within a scope are notified once, at commit
+    {
+        NotificationScope scope;
+        master->setKey(str1);
+        master->setKey(str2);
+        cout << "[testObserver] committing scope\n";
+    }
+    
     delete master, delete slave1, delete slave2;
     
     cout << endl;
@@ -47,6 +55,599 @@ void testDataModel()
     delete usr1, delete usr2;
 }
 
+/**
+   @brief Check one amount read by Money::parse()
+ */
+static bool checkParse(const char *aText, bool isValid, long long aCents)
+{
+    Money m = Money::fromCents(-1);
+    bool valid = Money::parse(StringRef(aText), m);
+    bool ok = (valid == isValid) && (!valid || m.cents() == aCents);
+    
+    cout << "[testMoney] parse \"" << aText << "\" -> ";
+    if (valid)
+        cout << m.cents();
+    else
+        cout << "invalid";
+    cout << (ok ? "" : " FAILED") << endl;
+    
+    return ok;
+}
+
+/**
+   @brief Check the text of an amount
+ */
+static bool checkFormat(long long aCents, const char *aText)
+{
+    string text = Money::fromCents(aCents).str();
+    bool ok = (text == aText);
+    
+    cout << "[testMoney] format " << aCents << " -> " << text
+         << (ok ? "" : " FAILED") << endl;
+    
+    return ok;
+}
+
+/**
+   @brief Test parsing, rounding and formatting of amounts
+   @return    False if any check failed
+ */
+bool testMoney()
+{
+    cout << "MONEY TEST #3\n";
+    
+    bool ok = true;
+    ok &= checkParse("19.9", true, 1990);
+    ok &= checkParse("19.90", true, 1990);
+    ok &= checkParse("175", true, 17500);
+    ok &= checkParse(" +.5", true, 50);
+    ok &= checkParse("0.104", true, 10);
+    ok &= checkParse("0.105", true, 11);
+    ok &= checkParse("1.999", true, 200);
+    ok &= checkParse("-1.005", true, -101);
+    ok &= checkParse("12.5 EUR", true, 1250);
+    ok &= checkParse("1.5e2", true, 15000);
+    ok &= checkParse("999999999999999", true, 99999999999999900LL);
+    ok &= checkParse("1000000000000000", false, 0);
+    ok &= checkParse("-", false, 0);
+    ok &= checkParse("abc", false, 0);
+    
+    ok &= checkFormat(0, "0.00");
+    ok &= checkFormat(5, "0.05");
+    ok &= checkFormat(-5, "-0.05");
+    ok &= checkFormat(1990, "19.90");
+    ok &= checkFormat(-123456, "-1234.56");
+    
+    // rounding to whole units goes away from zero on halves
+    ok &= (Money::fromCents(149).rounded() == 1);
+    ok &= (Money::fromCents(150).rounded() == 2);
+    ok &= (Money::fromCents(-150).rounded() == -2);
+    ok &= (Money::fromFloat(0.1 * 3) == Money::fromCents(30));
+    
+    // ten dimes make exactly one unit, through both loops of sum()
+    Money dimes[10];
+    for (int i = 0; i < 10; i++)
+        dimes[i] = Money::fromCents(10);
+    ok &= (Money::sum(dimes, 10) == Money::fromCents(100));
+    
+    cout << "[testMoney] " << (ok ? "passed" : "FAILED") << endl << endl;
+    
+    return ok;
+}
+
+/**
+   @brief Returns the text of a number
+ */
+static string number(long aValue)
+{
+    stringstream value;
+    value << aValue;
+    
+    return value.str();
+}
+
+/**
+   @brief Fill a small vector with "0", "1", ... up to aCount - 1
+ */
+static void fillStrings(SmallVector<string, 2> & aVector, int aCount, 
+                        int aFirst = 0)
+{
+    aVector.clear();
+    for (int i = 0; i < aCount; i++)
+        aVector.push_back(number(aFirst + i));
+}
+
+/**
+   @brief Check the content of a vector filled by fillStrings()
+ */
+static bool checkStrings(const SmallVector<string, 2> & aVector, 
+                         int aCount, int aFirst = 0)
+{
+    if ((int) aVector.size() != aCount)
+        return false;
+    for (int i = 0; i < aCount; i++)
+        if (aVector[i] != number(aFirst + i))
+            return false;
+    
+    return true;
+}
+
+/**
+   @brief Swap two vectors of aCount1 and aCount2 elements
+ */
+static bool checkSwap(int aCount1, int aCount2)
+{
+    SmallVector<string, 2> a, b;
+    fillStrings(a, aCount1);
+    fillStrings(b, aCount2, 100);
+    a.swap(b);
+    
+    bool ok = checkStrings(a, aCount2, 100) && checkStrings(b, aCount1) &&
+              a.isInline() == (aCount2 <= 2) && 
+              b.isInline() == (aCount1 <= 2);
+    cout << "[testSmallVector] swap " << aCount1 << " <-> " << aCount2 
+         << (ok ? "" : " FAILED") << endl;
+    
+    return ok;
+}
+
+/**
+   @brief Returns a result list of aCount strings, built by a finder
+ */
+static ResultList<string> findStrings(int aCount)
+{
+    ResultList<string> res;
+    
+    res.reserve(aCount);
+    for (int i = 0; i < aCount; i++)
+        res.add(number(i));
+    
+    return res;
+}
+
+/**
+   @brief Test SmallVector and ResultList, inline and on the heap
+   @return    False if any check failed
+ */
+bool testSmallVector()
+{
+    cout << "SMALLVECTOR TEST #4\n";
+    
+    bool ok = true;
+    
+    // every combination of embedded and heap storage
+    ok &= checkSwap(1, 2);
+    ok &= checkSwap(10, 1);
+    ok &= checkSwap(2, 7);
+    ok &= checkSwap(10, 5);
+    ok &= checkSwap(0, 0);
+    
+    // the elements move to the heap on the third one
+    SmallVector<string, 2> v;
+    fillStrings(v, 2);
+    ok &= v.isInline();
+    v.insert(v.begin(), "x");
+    ok &= !v.isInline() && v.size() == 3 && v[0] == "x" && v[2] == "1";
+    v.erase(v.begin());
+    ok &= checkStrings(v, 2);
+    
+    SmallVector<string, 2> copy(v);
+    copy.push_back(copy[0]);
+    ok &= checkStrings(v, 2) && copy.size() == 3 && copy[2] == "0";
+    v = copy;
+    ok &= v.size() == 3 && v[2] == "0";
+    
+    ResultList<string> few = findStrings(3), many = findStrings(40);
+    ok &= few.isInline() && few.size() == 3 && few[2] == "2";
+    ok &= !many.isInline() && many.size() == 40 && many[39] == "39";
+    few.swap(many);
+    ok &= few.size() == 40 && many.size() == 3 && many[0] == "0";
+    
+    cout << "[testSmallVector] " << (ok ? "passed" : "FAILED") << endl 
+         << endl;
+    
+    return ok;
+}
+
+/**
+   @brief Test the lines, the total and the reservations of a basket
+   @return    False if any check failed
+ */
+bool testBasket()
+{
+    cout << "BASKET TEST #5\n";
+    
+    Inventory &inv = Inventory::instance();
+    inv.reconcile();
+    
+    Product *p8 = Product::productByID(8, true);
+    Product *p9 = Product::productByID(9, true);
+    Money price8 = p8->getPrice(), price9 = p9->getPrice();
+    int stock8 = inv.available(8);
+    bool ok = true;
+    
+    {
+        Basket b;
+        
+        // lines are sorted by product, a product added again is merged
+        ok &= b.addProduct(p9, 1) && b.addProduct(p8, 2) && 
+              b.addProduct(p9, 1);
+        ok &= (b.size() == 2 && (*b.begin()).pid == 8 && b.itemCount() == 4);
+        ok &= (b.total() == price8 * 2 + price9 * 2);
+        ok &= (inv.available(8) == stock8 - 2);
+        
+        // more pieces than in stock are refused, the line is unchanged
+        ok &= !b.addProduct(p8, stock8);
+        ok &= (b.itemCount() == 4 && inv.available(8) == stock8 - 2);
+        
+        // a new price changes the line and the total, not the others
+        ok &= b.reprice(9, price9 + Money::fromCents(50));
+        ok &= !b.reprice(9, price9 + Money::fromCents(50));
+        ok &= (b.total() == price8 * 2 + price9 * 2 + Money::fromCents(100));
+        
+        b.removeProduct(p8, 1);
+        ok &= (b.itemCount() == 3 && inv.available(8) == stock8 - 1);
+        b.removeProduct(p8, 5);
+        ok &= (b.size() == 1 && inv.available(8) == stock8);
+        
+        b.empty();
+        ok &= (b.size() == 0 && b.total() == Money() && b.itemCount() == 0);
+    }
+    
+    delete p8, delete p9;
+    
+    cout << "[testBasket] " << (ok ? "passed" : "FAILED") << endl << endl;
+    
+    return ok;
+}
+
+/**
+   @brief Read the columns checked by testWriteBehind() for a product
+ */
+static string productState(int aPid)
+{
+    ResultSet res;
+    SqlParams qp;
+    
+    qp << aPid;
+    if (!Database::instance().select("SELECT descr, availability, version "
+                                     "FROM products WHERE pid = %0", res, qp)
+        || res.empty())
+        return "?";
+    
+    return res[0]["descr"].str() + "|" + res[0]["availability"].str() + 
+           "|" + res[0]["version"].str();
+}
+
+/**
+   @brief Put back the columns changed by testWriteBehind()
+ */
+static void restoreProduct(int aPid, const string & aState)
+{
+    size_t a = aState.find('|'), b = aState.rfind('|');
+    SqlParams qp;
+    
+    qp << aState.substr(0, a) << aState.substr(a + 1, b - a - 1) 
+       << aState.substr(b + 1) << aPid;
+    Database::instance().execute("UPDATE products SET descr = %0q, "
+                                 "availability = %1, version = %2 "
+                                 "WHERE pid = %3", qp);
+}
+
+/**
+   @brief Write a journal as left by another process
+ */
+static void writeJournal(const string & aDir, const string & aWriter, 
+                         const string & aText)
+{
+    ofstream out((aDir + "/" WRITE_BEHIND_PREFIX + aWriter + 
+                  WRITE_BEHIND_SUFFIX).c_str());
+    out << aText;
+}
+
+/**
+   @brief Check if a journal left by another process is still there
+ */
+static bool hasJournal(const string & aDir, const string & aWriter)
+{
+    struct stat st;
+    
+    return stat((aDir + "/" WRITE_BEHIND_PREFIX + aWriter + 
+                 WRITE_BEHIND_SUFFIX).c_str(), &st) == 0;
+}
+
+/**
+   @brief Test the journal and the batches of WriteBehind
+ 
+   Writes are queued without a flusher: the journal they leave is kept, 
+   the batch is applied, then the journal is replayed as if left by 
+   other processes: still running (locked), crashed after the commit, 
+   crashed before it and crashed in the middle.
+ 
+   @return    False if any check failed
+ */
+bool testWriteBehind()
+{
+    cout << "WRITE-BEHIND TEST #6\n";
+    
+    char dir[] = "/tmp/white-box.XXXXXX";
+    WriteBehind &wb = WriteBehind::instance();
+    string before8 = productState(8), before9 = productState(9);
+    Database &db = Database::instance();
+    
+    bool ok = (mkdtemp(dir) != NULL && wb.setJournalDir(dir));
+    ok &= !wb.setJournalDir("white-box.journals");
+    string path = wb.journalPath();
+    
+    // values which need escaping in the journal
+    map<string, string> fields;
+    fields["descr"] = "tab\there\nnew line \\ backslash";
+    wb.update("products", "pid", "8", fields);
+    fields["descr"] = "plain";
+    wb.update("products", "pid", "9", fields);
+    
+    // one statement for the three increments
+    wb.increment("products", "pid", "8", "availability", 2);
+    wb.increment("products", "pid", "9", "availability", 3);
+    wb.increment("products", "pid", "8", "availability", 1);
+    
+    ifstream in(path.c_str());
+    stringstream journal;
+    journal << in.rdbuf();
+    in.close();
+    
+    string text = journal.str();
+    int lines = (int) count(text.begin(), text.end(), '\n');
+    cout << "[testWriteBehind] " << lines << " journal records\n";
+    ok &= (lines == 5);
+    
+    ok &= wb.drain();
+    stringstream stats;
+    stats << wb;
+    cout << "[testWriteBehind] " << stats.str();
+    ok &= (stats.str().find("in 1 batches (2 statements)") != string::npos);
+    
+    struct stat st;
+    ok &= (stat(path.c_str(), &st) == 0 && st.st_size == 0);
+    
+    string after8 = productState(8), after9 = productState(9);
+    int avail8 = atoi(before8.substr(before8.find('|') + 1).c_str());
+    int avail9 = atoi(before9.substr(before9.find('|') + 1).c_str());
+    stringstream expected8;
+    expected8 << "tab\there\nnew line \\ backslash|" << avail8 + 3 << "|" 
+              << before8.substr(before8.rfind('|') + 1);
+    ok &= (after8 == expected8.str());
+    ok &= (after9.substr(0, 6) == "plain|");
+    
+    // a running process keeps its journal locked
+    writeJournal(dir, "alive", text);
+    int alive = open((string(dir) + "/" WRITE_BEHIND_PREFIX "alive" 
+                      WRITE_BEHIND_SUFFIX).c_str(), O_RDONLY);
+    ok &= (alive >= 0 && flock(alive, LOCK_EX) == 0);
+    
+    // crashed after the commit: nothing is applied twice
+    writeJournal(dir, "committed", text);
+    db.execute("INSERT INTO deferred_writes VALUES ('committed', 5)");
+    int replayed = wb.replay();
+    ok &= (replayed == 0 && !hasJournal(dir, "committed") && 
+           hasJournal(dir, "alive"));
+    ok &= (productState(8) == after8 && productState(9) == after9);
+    
+    // crashed before the commit: the rows are back as before
+    restoreProduct(8, before8);
+    restoreProduct(9, before9);
+    writeJournal(dir, "crashed", text);
+    replayed = wb.replay();
+    cout << "[testWriteBehind] " << replayed << " records replayed\n";
+    ok &= (replayed == 5 && !hasJournal(dir, "crashed"));
+    ok &= (productState(8) == after8 && productState(9) == after9);
+    
+    // crashed after the first three writes, the last line half written
+    restoreProduct(8, before8);
+    restoreProduct(9, before9);
+    writeJournal(dir, "partial", text + "6\tA\tproducts\tpid\t8");
+    db.execute("INSERT INTO deferred_writes VALUES ('partial', 3)");
+    replayed = wb.replay();
+    stringstream expected9;
+    expected9 << before9.substr(0, before9.find('|') + 1) << avail9 + 3 
+              << before9.substr(before9.rfind('|'));
+    ok &= (replayed == 2 && !hasJournal(dir, "partial"));
+    ok &= (atoi(productState(8).substr(before8.find('|') + 1).c_str()) == 
+           avail8 + 1 && productState(9) == expected9.str());
+    
+    ResultSet res;
+    ok &= (db.select("SELECT writer FROM deferred_writes WHERE writer IN "
+                     "('committed', 'crashed', 'partial')", res) && 
+           res.empty());
+    
+    close(alive);
+    unlink((string(dir) + "/" WRITE_BEHIND_PREFIX "alive" 
+            WRITE_BEHIND_SUFFIX).c_str());
+    restoreProduct(8, before8);
+    restoreProduct(9, before9);
+    wb.setJournalDir(WRITE_BEHIND_DIR);
+    unlink(path.c_str());
+    rmdir(dir);
+    
+    cout << "[testWriteBehind] " << (ok ? "passed" : "FAILED") << endl 
+         << endl;
+    
+    return ok;
+}
+
+/**
+   @brief Availability of a product stored in the database
+ */
+static int storedStock(int aPid)
+{
+    ResultSet res;
+    SqlParams qp;
+    
+    qp << aPid;
+    if (!Database::instance().select("SELECT availability FROM products "
+                                     "WHERE pid = %0", res, qp) ||
+        res.empty())
+        return -1;
+    
+    return (int) res[0][0];
+}
+
+/** Product reserved by the threads of testInventory() */
+static int reservedPid;
+/** Units of that product stored in the database */
+static int reservedLimit;
+/** Threads still reserving */
+static volatile int reserving = 0;
+/** Set when a thread saw more units than stored */
+static volatile int exceeded = 0;
+
+/**
+   @brief Reserve and release one unit at a time, for testInventory()
+ */
+static void *reserveLoop(void *)
+{
+    Inventory &inv = Inventory::instance();
+    
+    for (int i = 0; i < 20000; i++) {
+        inv.release(inv.reserve(reservedPid, 1));
+        if (inv.available(reservedPid) > reservedLimit)
+            exceeded = 1;
+    }
+    __sync_fetch_and_sub(&reserving, 1);
+    
+    return NULL;
+}
+
+/**
+   @brief Test reservations, sales and reconciliation of the Inventory
+   @return    False if any check failed
+ */
+bool testInventory()
+{
+    cout << "INVENTORY TEST #7\n";
+    
+    Inventory &inv = Inventory::instance();
+    inv.reconcile();
+    
+    int pid = 8, stored = storedStock(pid);
+    bool ok = (inv.available(pid) == stored);
+    
+    // more units than available are refused, the stock is unchanged
+    unsigned long rid = inv.reserve(pid, 3);
+    ok &= (rid != 0 && inv.isValid(rid) && inv.available(pid) == stored - 3);
+    ok &= (inv.reserve(pid, stored) == 0 && inv.reserve(pid, 0) == 0);
+    ok &= (inv.available(pid) == stored - 3);
+    
+    // adjusting takes or gives back the difference only
+    ok &= inv.adjust(rid, 5) && (inv.available(pid) == stored - 5);
+    ok &= inv.adjust(rid, 1) && (inv.available(pid) == stored - 1);
+    ok &= !inv.adjust(rid, stored + 1) && (inv.available(pid) == stored - 1);
+    ok &= !inv.adjust(rid + 1000, 1);
+    
+    // reserved units are not counted again
+    inv.reconcile();
+    ok &= (inv.available(pid) == stored - 1);
+    
+    // an expired reservation gives its units back on the next reserve()
+    inv.setReservationTTL(0);
+    unsigned long expired = inv.reserve(pid, 2);
+    ok &= (expired != 0 && !inv.isValid(expired));
+    inv.setReservationTTL(INVENTORY_RESERVATION_TTL);
+    inv.release(inv.reserve(pid, 1));
+    ok &= (inv.available(pid) == stored - 1 && !inv.commit(expired));
+    
+    // a sale leaves the stock alone and is written back by flush()
+    ok &= inv.commit(rid) && !inv.commit(rid);
+    ok &= (inv.available(pid) == stored - 1 && storedStock(pid) == stored);
+    ok &= inv.flush() && (storedStock(pid) == stored - 1);
+    inv.reconcile();
+    ok &= (inv.available(pid) == stored - 1);
+    
+    // an order placed by the database only removes the reservation
+    rid = inv.reserve(pid, 1);
+    ok &= inv.commit(rid, true) && (inv.available(pid) == stored - 2);
+    
+    // give the units back
+    SqlParams qp;
+    qp << stored << pid;
+    Database::instance().execute("UPDATE products SET availability = %0 "
+                                 "WHERE pid = %1", qp);
+    inv.reconcile();
+    ok &= (inv.available(pid) == stored);
+    
+    // units taken by reservations in flight are not counted twice
+    pthread_t threads[4];
+    reservedPid = pid;
+    reservedLimit = stored;
+    reserving = 4;
+    for (int i = 0; i < 4; i++)
+        pthread_create(&threads[i], NULL, reserveLoop, NULL);
+    int rounds = 0;
+    for (; reserving > 0; rounds++)
+        inv.reconcile();
+    for (int i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+    cout << "[testInventory] " << rounds << " reconciliations during the "
+         << "reservations, " << (exceeded ? "too many" : "no extra") 
+         << " units seen\n";
+    ok &= (!exceeded && inv.available(pid) == stored);
+    
+    cout << "[testInventory] " << (ok ? "passed" : "FAILED") << endl << endl;
+    
+    return ok;
+}
+
+/**
+   @brief Test the optimistic locking of versioned entities
+ 
+   Two copies of the same product are changed: the update of the one 
+   read first must succeed, the other must fail with a conflict and 
+   leave the row as the first one wrote it.
+ 
+   @return    False if any check failed
+ */
+bool testOptimisticLocking()
+{
+    cout << "OPTIMISTIC LOCKING TEST #8\n";
+    
+    string before = productState(10);
+    int version = atoi(before.substr(before.rfind('|') + 1).c_str());
+    Product *p1 = Product::productByID(10, true);
+    Product *p2 = Product::productByID(10, true);
+    bool ok = (p1 && p2 && p1 != p2);
+    
+    if (ok) {
+        p1->setValueForKey("descr", "first copy");
+        ok &= p1->update() && !p1->hasConflict();
+        string written = productState(10);
+        stringstream expected;
+        expected << "first copy|" 
+                 << before.substr(before.find('|') + 1, 
+                                  before.rfind('|') - before.find('|')) 
+                 << version + 1;
+        ok &= (written == expected.str());
+        
+        p2->setValueForKey("descr", "second copy");
+        ok &= !p2->update() && p2->hasConflict();
+        ok &= (productState(10) == written);
+        
+        // fetched again, the change goes through
+        delete p2;
+        p2 = Product::productByID(10, true);
+        p2->setValueForKey("descr", "second copy");
+        ok &= p2->update() && !p2->hasConflict();
+        ok &= (productState(10).substr(0, 12) == "second copy|");
+    }
+    
+    delete p1, delete p2;
+    restoreProduct(10, before);
+    
+    cout << "[testOptimisticLocking] " << (ok ? "passed" : "FAILED") << endl 
+         << endl;
+    
+    return ok;
+}
+
 int main (int argc, char * const argv[]) 
 {
     CommandLine cmd(argc, argv);
@@ -58,6 +659,8 @@ int main (int argc, char * const argv[])
     db.setServer(cmd.dbServer());
     db.setUser(cmd.dbUser());
     db.setPassword(cmd.dbPasswd());
+    if (cmd.embeddedDump())
+        db.setEmbedded(cmd.embeddedDump());
     if (!db.connect()) {
         cerr << "Unable to connect to database\n";
         return 2;
@@ -66,6 +669,14 @@ int main (int argc, char * const argv[])
     // call unit tests
     testObserver();
     testDataModel();
+    bool passed = testMoney();
+    passed &= testSmallVector();
+    passed &= testBasket();
+    passed &= testWriteBehind();
+    passed &= testInventory();
+    passed &= testOptimisticLocking();
+    if (!passed)
+        return 3;
     
     return 0;
 }
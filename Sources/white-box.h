@@ -8,7 +8,19 @@
 #include "common.h"
 #include "Observer.h"
 #include "Observable.h"
+#include "NotificationScope.h"
 #include "User.h"
+#include "Money.h"
+#include "WriteBehind.h"
+#include "ResultList.h"
+#include "Basket.h"
+#include "Product.h"
+#include "Inventory.h"
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <fstream>
+#include <algorithm>
 
 class TestObserver : public Observer 
 {
@@ -18,12 +30,12 @@ private:
 public:
     TestObserver(string s) : _name(s) { };
     
-    virtual void willChangeValueForKey(string k, Observable *) { 
+    virtual void willChangeValueForKey(const string & k, Observable *) { 
         cout << "[TestObserver::willChangeValueForKey] key: '" << k 
              << "' observer: '" << _name << "'\n"; 
     };
     
-    virtual void didChangeValueForKey(string k, Observable *) {
+    virtual void didChangeValueForKey(const string & k, Observable *) {
         cout << "[TestObserver::didChangeValueForKey] key: '" << k 
              << "' observer: '" << _name << "'\n"; 
     };